@@ -31,6 +31,7 @@ DEALINGS IN THE SOFTWARE.
 #include "ble/BLE.h"
 #include "MicroBitConfig.h"
 #include "MicroBitSerial.h"
+#include "RingBuffer.h"
 
 #define MICROBIT_UART_S_DEFAULT_BUF_SIZE    20
 
@@ -45,14 +46,9 @@ DEALINGS IN THE SOFTWARE.
   */
 class MicroBitUARTService
 {
-    uint8_t* rxBuffer;
-
-    uint8_t* txBuffer;
-
-    uint8_t rxBufferHead;
-    uint8_t rxBufferTail;
-    uint8_t rxBufferSize;
+    RingBuffer<uint8_t> rxBuffer;
 
+    //the largest number of bytes sent in a single indication.
     uint8_t txBufferSize;
 
     uint32_t rxCharacteristicHandle;
@@ -71,20 +67,6 @@ class MicroBitUARTService
       */
     void onDataWritten(const GattWriteCallbackParams *params);
 
-    /**
-      * An internal method that copies values from a circular buffer to a linear buffer.
-      *
-      * @param circularBuff a pointer to the source circular buffer
-      * @param circularBuffSize the size of the circular buffer
-      * @param linearBuff a pointer to the destination linear buffer
-      * @param tailPosition the tail position in the circular buffer you want to copy from
-      * @param headPosition the head position in the circular buffer you want to copy to
-      *
-      * @note this method assumes that the linear buffer has the appropriate amount of
-      *       memory to contain the copy operation
-      */
-    void circularCopy(uint8_t *circularBuff, uint8_t circularBuffSize, uint8_t *linearBuff, uint16_t tailPosition, uint16_t headPosition);
-
     public:
 
     /**
@@ -294,6 +276,23 @@ class MicroBitUARTService
       * @return The currently buffered number of bytes in our txBuff.
       */
     int txBufferedSize();
+
+    /**
+      * Retrieves the traffic and timing statistics gathered by this service.
+      *
+      * @param statistics the structure to fill. bytesSent counts bytes acknowledged by the
+      *        connected device, and txLatencyMax the longest wait for an acknowledgement.
+      *
+      * @return MICROBIT_OK, or MICROBIT_NOT_SUPPORTED if MICROBIT_SERIAL_STATISTICS is not enabled.
+      */
+    int getStatistics(MicroBitSerialStatistics &statistics);
+
+    /**
+      * Resets all of the statistics gathered by this service to zero.
+      *
+      * @return MICROBIT_OK, or MICROBIT_NOT_SUPPORTED if MICROBIT_SERIAL_STATISTICS is not enabled.
+      */
+    int resetStatistics();
 };
 
 extern const uint8_t  UARTServiceBaseUUID[UUID::LENGTH_OF_LONG_UUID];
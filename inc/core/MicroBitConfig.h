@@ -359,6 +359,66 @@ extern uint32_t __etext;
 #define MICROBIT_DEFAULT_SERIAL_MODE            SYNC_SLEEP
 #endif
 
+// The default fill levels of the serial rx buffer, as a percentage of its capacity, at which RTS is
+// deasserted to pause the sender and reasserted to resume it, when hardware flow control is enabled.
+// The space above the high water mark must absorb any bytes the sender transmits before it reacts.
+#ifndef MICROBIT_SERIAL_FLOW_HIGH_WATER
+#define MICROBIT_SERIAL_FLOW_HIGH_WATER         75
+#endif
+
+#ifndef MICROBIT_SERIAL_FLOW_LOW_WATER
+#define MICROBIT_SERIAL_FLOW_LOW_WATER          25
+#endif
+
+// Enables the collection of traffic and timing statistics by MicroBitSerial and MicroBitUARTService.
+// This adds a small overhead to the handling of every character sent and received.
+// Set '1' to enable.
+#ifndef MICROBIT_SERIAL_STATISTICS
+#define MICROBIT_SERIAL_STATISTICS              0
+#endif
+
+//
+// Serial framing options
+//
+
+// The largest payload (in bytes) that can be carried in a single MicroBitSerialFramer frame.
+#ifndef MICROBIT_SERIAL_FRAME_MAX_SIZE
+#define MICROBIT_SERIAL_FRAME_MAX_SIZE          64
+#endif
+
+// The default number of frame buffers preallocated by MicroBitSerialFramer for reception.
+// Frames that arrive whilst all buffers are awaiting collection by the application are dropped.
+#ifndef MICROBIT_SERIAL_FRAME_POOL_SIZE
+#define MICROBIT_SERIAL_FRAME_POOL_SIZE         4
+#endif
+
+// The maximum number of virtual channels that can be open on a MicroBitSerialMux at once.
+#ifndef MICROBIT_SERIAL_MUX_CHANNELS
+#define MICROBIT_SERIAL_MUX_CHANNELS            4
+#endif
+
+// The default size (in bytes) of the rx and tx buffers of each MicroBitSerialMux channel.
+#ifndef MICROBIT_SERIAL_MUX_BUFFER_SIZE
+#define MICROBIT_SERIAL_MUX_BUFFER_SIZE         32
+#endif
+
+// The time (in milliseconds) a MicroBitSerialMux waits before retrying a frame that could not be sent,
+// because another fiber was using the serial port.
+#ifndef MICROBIT_SERIAL_MUX_RETRY_PERIOD
+#define MICROBIT_SERIAL_MUX_RETRY_PERIOD        5
+#endif
+
+//
+// Radio options
+//
+
+// The number of protocol handlers that can be registered with MicroBitRadio.
+// The built in services use up to seven: four always, and one each for the mesh, time synchronisation and TDMA
+// services once they are first used. Each entry costs 28 bytes of RAM.
+#ifndef MICROBIT_RADIO_MAX_PROTOCOLS
+#define MICROBIT_RADIO_MAX_PROTOCOLS            8
+#endif
+
 //
 // File System configuration defaults
 //
@@ -372,12 +432,57 @@ extern uint32_t __etext;
 #endif
 
 //
-// FileSystem writeback cache size, in bytes. Defines how many bytes will be stored
+// Default FileSystem writeback cache size, in bytes. Defines how many bytes will be stored
 // in RAM before being written back to FLASH. Set to zero to disable this feature.
-// Should be <= MBFS_BLOCK_SIZE.
+// Must be <= MBFS_BLOCK_SIZE. Allocated only for files opened with MB_WRITE, and
+// can be set for each file when it is opened.
 //
 #ifndef MBFS_CACHE_SIZE
-#define MBFS_CACHE_SIZE		16
+#define MBFS_CACHE_SIZE		64
+#endif
+
+//
+// Each open file keeps a map of every MBFS_BLOCK_MAP_INTERVAL'th block in the file,
+// up to MBFS_BLOCK_MAP_SIZE entries, so that seeking doesn't walk the whole chain of blocks.
+// Files of up to MBFS_BLOCK_MAP_SIZE * MBFS_BLOCK_MAP_INTERVAL blocks are fully mapped.
+//
+#ifndef MBFS_BLOCK_MAP_SIZE
+#define MBFS_BLOCK_MAP_SIZE		8
+#endif
+
+#ifndef MBFS_BLOCK_MAP_INTERVAL
+#define MBFS_BLOCK_MAP_INTERVAL		16
+#endif
+
+//
+// The wear table is written back to FLASH, during idle time, once MBFS_WEAR_SYNC_INTERVAL erases per page
+// of the file system have occurred since it was last written. Counts only increase, so each write erases
+// the page holding the wear table. Scaling the interval to the size of the file system means that page is
+// erased no more than 1/MBFS_WEAR_SYNC_INTERVAL times as often as the average page being levelled.
+// The trade-off is that up to this many erases per page may go uncounted if the device is reset,
+// so the counts of a device that is often reset under heavy use read low.
+//
+#ifndef MBFS_WEAR_SYNC_INTERVAL
+#define MBFS_WEAR_SYNC_INTERVAL		4
+#endif
+
+//
+// Up to MBFS_DIRECTORY_HASH_COUNT directories are indexed by an in-RAM hash table, so that
+// files can be found without searching the directory. Must be at least one.
+// Each table is sized to the directory, so that it is at most 3/4 full, from MBFS_DIRECTORY_HASH_SIZE
+// up to MBFS_DIRECTORY_HASH_MAX_SIZE entries (both powers of two). Directories too large to index
+// are searched instead.
+//
+#ifndef MBFS_DIRECTORY_HASH_COUNT
+#define MBFS_DIRECTORY_HASH_COUNT		2
+#endif
+
+#ifndef MBFS_DIRECTORY_HASH_SIZE
+#define MBFS_DIRECTORY_HASH_SIZE		32
+#endif
+
+#ifndef MBFS_DIRECTORY_HASH_MAX_SIZE
+#define MBFS_DIRECTORY_HASH_MAX_SIZE		256
 #endif
 
 //
@@ -111,6 +111,14 @@ void scheduler_init(EventModel &_messageBus);
   */
 int fiber_scheduler_running();
 
+/**
+  * Determines if the calling code is running on the idle fiber, for example from a component's idleTick(),
+  * or an event handler invoked by one. The idle fiber must never block.
+  *
+  * @return 1 if running on the idle fiber, 0 otherwise.
+  */
+int fiber_is_idle();
+
 /**
   * Exit point for all fibers.
   *
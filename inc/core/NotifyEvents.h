@@ -33,5 +33,6 @@ DEALINGS IN THE SOFTWARE.
 #define MICROBIT_DISPLAY_EVT_FREE           1
 #define MICROBIT_SERIAL_EVT_TX_EMPTY        2
 #define MICROBIT_UART_S_EVT_TX_EMPTY        3
+#define MICROBIT_RADIO_EVT_TX_DONE          4
 
 #endif
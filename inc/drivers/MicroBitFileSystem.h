@@ -2,18 +2,21 @@
 #define MICROBIT_FILE_SYSTEM_H
 
 #include "MicroBitConfig.h"
+#include "MicroBitComponent.h"
 #include "MicroBitFlash.h"
 
 
 // Configuration options.
 #define MBFS_FILENAME_LENGTH        16        
 #define MBFS_MAGIC                  "MICROBIT_FS_1_0"
+#define MBFS_GC_DIRECTORY_BLOCKS    4         // The number of directory blocks that can await recycling during idle time.
 
 // open() flags.
 #define MB_READ     0x01
 #define MB_WRITE    0x02
 #define MB_CREAT    0x04
 #define MB_APPEND   0x08
+#define MB_LOG      0x10
 
 // seek() flags.
 #define MB_SEEK_SET 0x01
@@ -22,6 +25,9 @@
 
 // Status flags
 #define MBFS_STATUS_INITIALISED           0x01
+#define MBFS_STATUS_GC_PENDING            0x02
+#define MBFS_STATUS_WEAR_PENDING          0x04
+#define MBFS_STATUS_IDLE                  0x08
 
 // FileTable codes
 #define MBFS_UNUSED                       0xFFFF
@@ -62,6 +68,18 @@ struct Directory
     DirectoryEntry entry[0];
 };
 
+//
+// A summary of how many times the physical pages of the file system have been erased.
+//
+struct WearStatistics
+{
+    uint16_t pages;                             // Number of physical pages in the file system.
+    uint16_t minimum;                           // Erase count of the least worn page.
+    uint16_t maximum;                           // Erase count of the most worn page.
+    uint16_t mean;                              // Mean erase count of all pages.
+    uint32_t total;                             // Total number of erases across all pages.
+};
+
 //
 // A FileDescriptor holds contextual information needed for each OPEN file.
 //
@@ -88,9 +106,31 @@ struct FileDescriptor
     // We maintain a chain of open file descriptors. Reference to the next FileDescriptor in the chain.
     FileDescriptor *next;
 
+    // The last block accessed, and its index in the file, so that sequential access doesn't walk the chain of blocks.
+    uint16_t block;
+    uint16_t blockIndex;
+
+    // Every MBFS_BLOCK_MAP_INTERVAL'th block in the file, as far as it has been walked.
+    uint16_t blockMap[MBFS_BLOCK_MAP_SIZE];
+    uint8_t blockMapLength;
+
     // Optional writeback cache, to minimise FLASH write operations at the expense of RAM.
+    // Holds cacheLength bytes of unwritten data, to be written at position cacheStart in the file.
+    uint8_t *cache;
+    uint16_t cacheSize;
     uint16_t cacheLength;
-    uint8_t cache[MBFS_CACHE_SIZE];
+    uint32_t cacheStart;
+};
+
+//
+// An in-RAM index of the valid entries in a directory, hashed by filename.
+// Collisions are resolved by linear probing, so empty slots are NULL.
+//
+struct DirectoryHash
+{
+    uint16_t directory;                                 // First block of the directory indexed, or zero if unused.
+    uint16_t size;                                      // Number of slots in the index, or zero if the directory is too large to index.
+    DirectoryEntry **entry;                             // Entries of the directory, indexed by the hash of their filename.
 };
 
 /**
@@ -105,14 +145,18 @@ struct FileDescriptor
   * - remove()
   *
   * Only a single instance shoud exist at any given time.
+  *
+  * Files opened with MB_LOG are log structured: all writes are appended to the end of the file, so always land in
+  * erased FLASH, and the directory is updated by adding a new entry rather than erasing the old one in place.
+  * Superseded directory entries, and the blocks of removed files, are recycled a page at a time during idle time.
+  *
+  * The number of times each physical page has been erased is kept in a wear table, stored after the file table, and
+  * new blocks and scratch pages are taken from the least worn pages available.
   */
-class MicroBitFileSystem
+class MicroBitFileSystem : MicroBitComponent
 {
     private:
 
-    // Status flags
-    uint32_t status;
-
     // The instance of MicroBitFlash - the interface used for all flash writes/erasures
     MicroBitFlash flash;
 
@@ -134,6 +178,26 @@ class MicroBitFileSystem
     // Chain of open files.
     FileDescriptor *openFiles;
 
+    // Directory blocks holding deleted entries, awaiting recycling during idle time.
+    uint16_t gcDirectory[MBFS_GC_DIRECTORY_BLOCKS];
+    uint8_t gcDirectoryCount;
+
+    // The next block to be checked for deleted blocks during idle time.
+    uint16_t gcBlock;
+
+    // Number of times each physical page has been erased. Persisted in the wear table, which follows the file table.
+    uint16_t *eraseCounts;
+
+    // Size of the wear table (blocks). Zero for file systems formatted without one.
+    uint16_t wearTableSize;
+
+    // Number of erases since the wear table was last updated.
+    uint16_t unsyncedErases;
+
+    // Filename indexes of recently searched directories, allocated on demand, and the next to be replaced.
+    DirectoryHash *directoryHash[MBFS_DIRECTORY_HASH_COUNT];
+    uint8_t directoryHashNext;
+
     /**
       * Initialize the flash storage system
       *
@@ -157,14 +221,14 @@ class MicroBitFileSystem
 
     /**
       * Allocate a free logical block.
-      * A round robin algorithm is used to even out the wear on the physical device.
+      * The block is chosen from the least worn page with space available, in round robin order, to even out the wear on the physical device.
       * @return NULL on error, page address on success
       */
     uint16_t getFreeBlock();
 
     /**
-    * Allocates a free physical block.
-    * A round robin algorithm is used to even out the wear on the physical device.
+    * Allocates a free physical page, for use as a scratch page. The page is not erased.
+    * The least worn page available is chosen, in round robin order, to even out the wear on the physical device.
     * @return NULL on error, page address on success
     */
     uint32_t* getFreePage();
@@ -185,6 +249,22 @@ class MicroBitFileSystem
     * @return A pointer to the DirectoryEntry for the given file, or NULL if no entry is found.
     */
     DirectoryEntry* getDirectoryEntry(char const * filename, const DirectoryEntry *directory = NULL);
+
+    /**
+    * Retrieve the filename index of the given directory, building it if necessary.
+    *
+    * @param directory The directory to index.
+    * @return The index of the directory, or NULL if it holds too many entries to be indexed, or no memory is available.
+    *         Directories too large to index are remembered, so they are not counted again until they change.
+    */
+    DirectoryHash* getDirectoryHash(const DirectoryEntry *directory);
+
+    /**
+    * Discard the filename index of the given directory, if there is one, as its entries have changed.
+    *
+    * @param directory The directory that has changed.
+    */
+    void invalidateDirectoryHash(const DirectoryEntry *directory);
     
     /**
     * Create a new DirectoryEntry with the given filename and flags.
@@ -201,9 +281,11 @@ class MicroBitFileSystem
     * Allocate a free DiretoryEntry in the given directory, extending and refreshing the directory block if necessary.
     *
     * @param directory The directory to add a DirectoryEntry to
+    * @param recycle If false, a block holding deleted entries is never erased to make room. The directory is extended instead,
+    *                and the block left to be recycled during idle time.
     * @return A pointer to the new DirectoryEntry for the given file, or NULL if it was not possible to allocated resources.
     */
-    DirectoryEntry* createDirectoryEntry(DirectoryEntry *directory);
+    DirectoryEntry* createDirectoryEntry(DirectoryEntry *directory, bool recycle = true);
 
     /**
     * Refresh the physical page associated with the given block.
@@ -224,6 +306,71 @@ class MicroBitFileSystem
     */
     int recycleFileTable();
 
+    /**
+    * Determine if a directory block has any unused entries.
+    *
+    * @param block A valid directory block.
+    * @return true if at least one entry in the block is unused.
+    */
+    bool hasFreeEntries(uint16_t block);
+
+    /**
+    * Determine if the physical page holding the given block of the file table has anything to recycle.
+    *
+    * @param block A block of the file table.
+    * @return true if the page holds any file table entries marked as DELETED, or is itself shared with a DELETED block.
+    */
+    bool hasDeletedEntries(uint16_t block);
+
+    /**
+    * Schedules the recycling of deleted blocks, and optionally a directory block, during idle time.
+    *
+    * @param directoryBlock A directory block holding deleted entries, or zero if there is none.
+    */
+    void scheduleGarbageCollection(uint16_t directoryBlock = 0);
+
+    /**
+    * Schedules background work to be performed during idle time.
+    *
+    * @param task One of MBFS_STATUS_GC_PENDING or MBFS_STATUS_WEAR_PENDING.
+    */
+    void scheduleIdleTask(uint32_t task);
+
+    /**
+    * Determine the number of logical blocks required to hold the wear table.
+    *
+    * @return The number of logical blocks required to hold the wear table.
+    */
+    uint16_t calculateWearTableSize();
+
+    /**
+    * Record the erasure of a physical page, scheduling an update of the wear table if enough erases have occurred.
+    *
+    * @param page The address of the page erased.
+    */
+    void pageErased(uint32_t *page);
+
+    /**
+    * Erase handler registered with MicroBitFlash. Passes the erasure on to the MicroBitFileSystem given as context.
+    */
+    static void eraseHandler(void *context, uint32_t *page);
+
+    /**
+    * Write the erase count of every page back to the wear table in FLASH.
+    *
+    * @return MICROBIT_OK on success, or MICROBIT_NOT_SUPPORTED if this file system has no wear table.
+    */
+    int writeWearTable();
+
+    /**
+    * Determine how many times the physical page holding the given block has been erased.
+    *
+    * @param block A valid block number.
+    *
+    * @return The erase count of the page.
+    */
+    uint16_t getBlockWear(uint16_t block);
+
     /**
     * Retrieve a memory pointer for the start of the physical memory page containing the given block.
     *
@@ -251,6 +398,19 @@ class MicroBitFileSystem
     */
     uint16_t getNextFileBlock(uint16_t block);
 
+    /**
+    * Determine the block of a file that holds the given position, starting from the nearest block
+    * recorded in the FileDescriptor rather than the start of the file.
+    *
+    * @param file The open file.
+    * @param position A position in the file, no greater than its length.
+    * @param blockStart Set to the position of the start of the block returned.
+    *
+    * @return The block holding the byte before the given position (or the first block, if the position is zero),
+    *         such that position - blockStart is in the range 0..MBFS_BLOCK_SIZE.
+    */
+    uint16_t getFileBlock(FileDescriptor *file, uint32_t position, uint32_t *blockStart);
+
     /**
     * Determine the logical block that contains the given address.
     *
@@ -305,11 +465,20 @@ class MicroBitFileSystem
       * Write a given buffer to the file provided.
       * 
       * @param file FileDescriptor of the file to write
+      * @param position The position in the file to write to, no greater than its length
       * @param buffer The start of the buffer to write
       * @param length The number of bytes to write
       * @return The number of bytes written.
       */
-    int writeBuffer(FileDescriptor *file, uint8_t* buffer, int length);
+    int writeBuffer(FileDescriptor *file, uint32_t position, uint8_t* buffer, int length);
+
+    /**
+      * Determine the length of a file, including any data held in its writeback cache.
+      *
+      * @param file The open file.
+      * @return The length of the file, in bytes.
+      */
+    uint32_t getFileLength(FileDescriptor *file);
 
 
     /**
@@ -331,21 +500,35 @@ class MicroBitFileSystem
       */
     MicroBitFileSystem(uint32_t flashStart = 0, int flashPages = 0);
 
+    /**
+      * Destructor.
+      */
+    ~MicroBitFileSystem();
+
     /**
       * Open a new file, and obtain a new file handle (int) to
       * read/write/seek the file. The flags are:
       *  - MB_READ : read from the file.
       *  - MB_WRITE : write to the file.
       *  - MB_CREAT : create a new file, if it doesn't already exist.
+      *  - MB_APPEND : start at the end of the file.
+      *  - MB_LOG : append every write to the end of the file, regardless of the seek position, so that
+      *             FLASH is never erased to update data already written. Suited to data logging.
       *
       * If a file is opened that doesn't exist, and MB_CREAT isn't passed,
       * an error is returned, otherwise the file is created.
       *
+      * Files opened with MB_WRITE are given a writeback cache of cacheSize bytes. Small, sequential writes
+      * are gathered in the cache, and only written to FLASH when the cache fills, a block boundary is reached,
+      * the file is written to elsewhere, or the file is flushed or closed.
+      *
       * @param filename name of the file to open, must contain only printable characters.
-      * @param flags One or more of MB_READ, MB_WRITE or MB_CREAT. 
+      * @param flags One or more of MB_READ, MB_WRITE, MB_CREAT, MB_APPEND or MB_LOG.
+      * @param cacheSize The size of the writeback cache, in the range 0..MBFS_BLOCK_SIZE bytes. Zero disables the cache.
+      *                  Defaults to MBFS_CACHE_SIZE.
       * @return return the file handle,MICROBIT_NOT_SUPPORTED if the file system has
       *         not been initialised MICROBIT_INVALID_PARAMETER if the filename is
-      *         too large, MICROBIT_NO_RESOURCES if the file system is full.
+      *         too large or the cacheSize is out of range, MICROBIT_NO_RESOURCES if the file system is full.
       *
       * @code
       * MicroBitFileSystem f();
@@ -354,7 +537,7 @@ class MicroBitFileSystem
       *    print("file open error");
       * @endcode
       */
-    int open(char const * filename, uint32_t flags);
+    int open(char const * filename, uint32_t flags, int cacheSize = MBFS_CACHE_SIZE);
 
     /**
      * Writes back all state associated with the given file to FLASH memory, 
@@ -363,7 +546,7 @@ class MicroBitFileSystem
      * @param fd file descriptor - obtained with open().
      * @return MICROBIT_OK on success, MICROBIT_NOT_SUPPORTED if the file system has not
      *         been initialised, MICROBIT_INVALID_PARAMETER if the given file handle
-     *         is invalid.
+     *         is invalid, or MICROBIT_NO_RESOURCES if the directory could not be updated.
      *
      * @code
      * MicroBitFileSystem f();
@@ -494,6 +677,38 @@ class MicroBitFileSystem
     * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if the path is invalid, or MICROBT_NO_RESOURCES if the FileSystem is full.
     */
     int createDirectory(char const *name);
+
+    /**
+      * Determine how many times a physical page of the file system has been erased.
+      *
+      * @param page The index of the page, from zero at the start of the file system.
+      * @return the erase count of the page, MICROBIT_NOT_SUPPORTED if the file system has not been
+      *         initialised, or MICROBIT_INVALID_PARAMETER if the page is out of range.
+      *
+      * @note Erase counts are written to FLASH periodically, so a few of the most recent erases may be lost on reset.
+      */
+    int getEraseCount(int page);
+
+    /**
+      * Summarise how evenly erases have been spread across the physical pages of the file system.
+      *
+      * @param statistics Set to the number of pages, and their minimum, maximum, mean and total erase counts.
+      * @return MICROBIT_OK on success, or MICROBIT_NOT_SUPPORTED if the file system has not been initialised.
+      *
+      * @code
+      * MicroBitFileSystem f;
+      * WearStatistics wear;
+      * f.getWearStatistics(wear);
+      * uBit.serial.printf("pages erased %d..%d times\r\n", wear.minimum, wear.maximum);
+      * @endcode
+      */
+    int getWearStatistics(WearStatistics &statistics);
+
+    /**
+      * A background, low priority callback that is triggered whenever the processor is idle.
+      * Here, we recycle a single page holding deleted data, or bring the wear table up to date.
+      */
+    virtual void idleTick();
 };
 
 #endif
@@ -5,10 +5,17 @@
 
 #define PAGE_SIZE 1024
 
+// A function to be called each time a page is erased, with the context given and the address of the page.
+typedef void (*MicroBitFlashEraseHandler)(void *context, uint32_t *page);
+
 class MicroBitFlash
 {
     private:
 
+    // Optional handler called each time a page is erased, and the context to pass to it.
+    MicroBitFlashEraseHandler eraseHandler;
+    void *eraseContext;
+
 
     /**
       * Write to flash memory, assuming that a write is valid
@@ -48,7 +55,8 @@ class MicroBitFlash
       * @param buffer location in memory to write from. 
       * @length number of bytes to burn
       * @param scratch_addr if specified, scratch page to use. Use default 
-      *                     otherwise.
+      *                     otherwise. It is only erased if it is needed, and
+      *                     not already blank.
       * @return non-zero on sucess, zero on error.
       * 
       * Example:
@@ -66,6 +74,20 @@ class MicroBitFlash
       * @param page_address address of first word of page.
       */
     void erase_page(uint32_t* page_address);
+
+    /**
+      * Check if an entire page is erased.
+      * @param page_address address of first word of page.
+      * @return true if every word of the page is erased.
+      */
+    bool is_erased(uint32_t* page_address);
+
+    /**
+      * Registers a function to be called each time a page is erased, e.g. to monitor wear.
+      * @param handler the function to call, or NULL to remove any existing handler.
+      * @param context a value passed to the handler on each call.
+      */
+    void setEraseHandler(MicroBitFlashEraseHandler handler, void *context = NULL);
 };
 
 #endif
@@ -27,13 +27,19 @@ DEALINGS IN THE SOFTWARE.
 #define MICROBIT_RADIO_H
 
 class MicroBitRadio;
+class MicroBitRadioSniffer;
 struct FrameBuffer;
 
 #include "mbed.h"
 #include "MicroBitConfig.h"
 #include "PacketBuffer.h"
+#include "RingBuffer.h"
 #include "MicroBitRadioDatagram.h"
 #include "MicroBitRadioEvent.h"
+#include "MicroBitRadioMesh.h"
+#include "MicroBitRadioTimeSync.h"
+#include "MicroBitRadioTdma.h"
+#include "MicroBitRadioNeighbours.h"
 
 /**
  * Provides a simple broadcast radio abstraction, built upon the raw nrf51822 RADIO module.
@@ -41,12 +47,13 @@ struct FrameBuffer;
  * The nrf51822 RADIO module supports a number of proprietary modes of operation in addition to the typical BLE usage.
  * This class uses one of these modes to enable simple, point to multipoint communication directly between micro:bits.
  *
- * TODO: The protocols implemented here do not currently perform any significant form of energy management,
- * which means that they will consume far more energy than their BLE equivalent. Later versions of the protocol
- * should look to address this through energy efficient broadcast techniques / sleep scheduling. In particular, the GLOSSY
- * approach to efficienct rebroadcast and network synchronisation would likely provide an effective future step.
+ * By default, the receiver is left on permanently, which means that it will consume far more energy than its BLE
+ * equivalent. setDutyCycle() provides simple low power listening, where the receiver wakes periodically and senders
+ * repeat each packet to cover the interval. More sophisticated sleep scheduling, such as the GLOSSY approach to
+ * efficienct rebroadcast and network synchronisation, would likely provide an effective future step.
  *
- * TODO: Meshing should also be considered - again a GLOSSY approach may be effective here, and highly complementary to
+ * Meshing is provided by MicroBitRadioMesh, which floods packets across multiple hops with randomised rebroadcast.
+ * A synchronous, GLOSSY style rebroadcast may still be a worthwhile refinement, and is highly complementary to
  * the master/slave arachitecture of BLE.
  *
  * TODO: This implementation only operates whilst the BLE stack is disabled. The nrf51822 provides a timeslot API to allow
@@ -60,6 +67,12 @@ struct FrameBuffer;
 
 // Status Flags
 #define MICROBIT_RADIO_STATUS_INITIALISED       0x0001
+#define MICROBIT_RADIO_STATUS_TX_PENDING        0x0002
+#define MICROBIT_RADIO_STATUS_TRANSMITTING      0x0004
+#define MICROBIT_RADIO_STATUS_SLEEPING          0x0008
+#define MICROBIT_RADIO_STATUS_TIMER             0x0010
+#define MICROBIT_RADIO_STATUS_TX_HELD           0x0020
+#define MICROBIT_RADIO_STATUS_TX_BACKOFF        0x0040
 
 // Default configuration values
 #define MICROBIT_RADIO_BASE_ADDRESS             0x75626974
@@ -69,13 +82,33 @@ struct FrameBuffer;
 #define MICROBIT_RADIO_MAX_PACKET_SIZE          32
 #define MICROBIT_RADIO_HEADER_SIZE              4
 #define MICROBIT_RADIO_MAXIMUM_RX_BUFFERS       4
+#define MICROBIT_RADIO_MAXIMUM_QUEUE_DEPTH      254
+#define MICROBIT_RADIO_TX_QUEUE_DEPTH           3
+#define MICROBIT_RADIO_MAX_GROUPS               8       // The number of groups that can be listened to at once. This is limited by the logical addresses of the RADIO hardware.
+
+// Clear channel assessment (CSMA) configuration
+#define MICROBIT_RADIO_CSMA_DEFAULT_THRESHOLD   -80     // The channel is considered busy if the signal strength is at least this, in dBm.
+#define MICROBIT_RADIO_CSMA_MAX_ATTEMPTS        8       // The most times the channel may be assessed before a packet is sent regardless.
+#define MICROBIT_RADIO_CSMA_MIN_WINDOW          4       // The initial range of the random backoff, in milliseconds. This doubles on each successive deferral.
+#define MICROBIT_RADIO_CSMA_MAX_WINDOW          128     // The largest range of the random backoff, in milliseconds.
 
 // Known Protocol Numbers
 #define MICROBIT_RADIO_PROTOCOL_DATAGRAM        1       // A simple, single frame datagram. a little like UDP but with smaller packets. :-)
 #define MICROBIT_RADIO_PROTOCOL_EVENTBUS        2       // Transparent propogation of events from one micro:bit to another.
+#define MICROBIT_RADIO_PROTOCOL_RELIABLE        3       // An acknowledged datagram, addressed to a single micro:bit.
+#define MICROBIT_RADIO_PROTOCOL_MESH            4       // A datagram flooded across multiple hops.
+#define MICROBIT_RADIO_PROTOCOL_FRAGMENT        5       // One part of a datagram too long to fit in a single frame.
+#define MICROBIT_RADIO_PROTOCOL_TIMESYNC        6       // A beacon carrying network time.
+#define MICROBIT_RADIO_PROTOCOL_TDMA            7       // A request for, or assignment of, a TDMA slot.
 
 // Events
 #define MICROBIT_RADIO_EVT_DATAGRAM             1       // Event to signal that a new datagram has been received.
+#define MICROBIT_RADIO_EVT_TX_COMPLETE          2       // Event to signal that a queued packet has been transmitted.
+#define MICROBIT_RADIO_EVT_DATAGRAM_ACKED       3       // Event to signal that a reliable datagram has been acknowledged by its destination.
+#define MICROBIT_RADIO_EVT_DATAGRAM_FAILED      4       // Event to signal that a reliable datagram was not acknowledged, despite retransmission.
+#define MICROBIT_RADIO_EVT_MESH                 5       // Event to signal that a new mesh packet has been received.
+#define MICROBIT_RADIO_EVT_TIMESYNC             6       // Event to signal that network time has been synchronised.
+#define MICROBIT_RADIO_EVT_TDMA_SLOT            7       // Event to signal that a TDMA slot has been assigned to this micro:bit.
 
 
 struct FrameBuffer
@@ -88,16 +121,135 @@ struct FrameBuffer
     uint8_t         payload[MICROBIT_RADIO_MAX_PACKET_SIZE];    // User / higher layer protocol data
     FrameBuffer     *next;                              // Linkage, to allow this and other protocols to queue packets pending processing.
     int             rssi;                               // Received signal strength of this frame.
+    uint32_t        timestamp;                          // The low 32 bits of the local time at which this frame was received, in microseconds.
 };
 
+/**
+  * A handler for packets of a given protocol, called from MicroBitRadio::idleTick() to recv() and process them.
+  */
+struct MicroBitRadioProtocol
+{
+    void            *object;                            // The object on which the handler is invoked, if it is a method.
+    uint32_t        method[4];                          // The handler, as either a pointer to a method or to a function.
+    void            (*invoke)(void *object, uint32_t *method);  // Calls the handler.
+    uint8_t         protocol;                           // The protocol number handled.
+};
+
+/**
+  * Counters describing the clear channel assessments made before transmission.
+  */
+struct MicroBitRadioCsmaStatistics
+{
+    uint32_t        assessments;    // The number of times the channel was checked before transmission.
+    uint32_t        deferrals;      // The number of times transmission was postponed because the channel was busy.
+    uint32_t        failures;       // The number of packets sent despite a busy channel, as the maximum number of attempts was reached.
+};
 
 class MicroBitRadio : MicroBitComponent
 {
-    uint8_t                 group;      // The radio group to which this micro:bit belongs.
-    uint8_t                 queueDepth; // The number of packets in the receiver queue.
+    uint8_t                 groups[MICROBIT_RADIO_MAX_GROUPS];  // The group listened to on each logical address. Address 0 holds our own group, which we send to.
+    uint8_t                 groupMask;  // Bit n is set if logical address n is in use.
+    MicroBitRadioProtocol   protocols[MICROBIT_RADIO_MAX_PROTOCOLS];    // Registered protocol handlers.
+    uint8_t                 protocolCount;  // The number of entries in protocols.
     int                     rssi;
-    FrameBuffer             *rxQueue;   // A linear list of incoming packets, queued awaiting processing.
-    FrameBuffer             *rxBuf;     // A pointer to the buffer being actively used by the RADIO hardware.
+    FrameBuffer             *rxRing;    // A ring of preallocated receive buffers. The RADIO hardware receives into rxRing[rxHead].
+    uint8_t                 rxRingSize; // The number of buffers in rxRing. This is one more than the receive queue depth.
+    volatile uint8_t        rxHead;     // The index of the buffer being actively used by the RADIO hardware.
+    volatile uint8_t        rxTail;     // The index of the oldest packet awaiting processing.
+    uint32_t                rxDropped;  // The number of valid packets discarded because the receive queue was full.
+    RingBuffer<FrameBuffer> txQueue;    // Packets awaiting transmission. The RADIO hardware transmits directly from the oldest.
+    MicroBitRadioSniffer    *sniffer;   // If not NULL, given a copy of every frame received.
+    uint16_t                txQueued;   // The number of packets ever added to txQueue.
+    volatile uint16_t       txCompleted;// The number of packets ever removed from txQueue, once transmitted or discarded.
+    uint32_t                txTrainEnd; // When duty cycling, the system time until which the packet being sent is repeated.
+    uint16_t                dutyInterval;// When duty cycling, the time between the start of each listening window, in milliseconds. Zero if not duty cycling.
+    uint16_t                dutyWindow; // When duty cycling, the length of each listening window, in milliseconds.
+    uint32_t                dutyWake;   // When duty cycling, the system time at which the receiver next turns on.
+    uint32_t                dutySleep;  // When duty cycling, the system time at which the receiver next turns off.
+    uint8_t                 csmaAttempts;// The most times the channel is assessed before each transmission. Zero if CSMA is disabled.
+    uint8_t                 csmaBackoff;// The number of times the packet at the head of the transmit queue has been deferred.
+    int8_t                  csmaThreshold;// The signal strength at which the channel is considered busy, in dBm.
+    uint32_t                csmaDeadline;// The system time at which a deferred transmission is next attempted.
+    MicroBitRadioCsmaStatistics csmaStatistics;
+    MicroBitRadioMesh       *meshService;       // The multi-hop flooding service, once first used.
+    MicroBitRadioTimeSync   *timesyncService;   // The network time service, once first used.
+    MicroBitRadioTdma       *tdmaService;       // The TDMA service, once first used.
+    MicroBitRadioNeighbours *neighbourTable;    // The neighbour table, once first used.
+
+    /**
+      * Allocates the ring of receive buffers, discarding any packets held in the previous one.
+      *
+      * @param depth the number of packets the receive queue can hold.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if the buffers could not be allocated.
+      */
+    int allocateRxRing(int depth);
+
+    /**
+      * Adds a copy of the given packet to the transmit queue, and wakes the transmitter if it is idle.
+      *
+      * @param buffer the packet to queue.
+      *
+      * @return the sequence number of the queued packet, which txCompleted will reach once it has been sent,
+      *         MICROBIT_INVALID_PARAMETER if the packet is invalid, MICROBIT_NOT_SUPPORTED if the radio is not
+      *         enabled, or MICROBIT_NO_RESOURCES if the transmit queue is full.
+      */
+    int queueTxBuf(FrameBuffer *buffer, uint8_t group);
+
+    /**
+      * Programs the RADIO hardware with the groups we listen to.
+      */
+    void configureAddresses();
+
+    /**
+      * Determines the logical address used to send to the given group.
+      *
+      * @param group the group of interest.
+      *
+      * @return the logical address, or 0 (our own group) if the group is not one we listen to.
+      */
+    int addressFor(uint8_t group);
+
+    /**
+      * Adds a protocol handler to the table, replacing any existing handler for the same protocol.
+      *
+      * @param handler the handler to add.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if MICROBIT_RADIO_MAX_PROTOCOLS handlers are already registered.
+      */
+    int addProtocol(MicroBitRadioProtocol &handler);
+
+    template <typename T> static void methodCall(void *object, uint32_t *method);
+    static void functionCall(void *object, uint32_t *method);
+
+    /**
+      * Turns the receiver off, so that RADIO_IRQHandler starts sending the transmit queue.
+      * If CSMA is enabled and the channel is busy, transmission is instead deferred for a random backoff.
+      *
+      * @note must be called with interrupts disabled, whilst the transmitter is idle.
+      */
+    void startTransmitter();
+
+    /**
+      * Determines if another micro:bit is transmitting, by checking for a packet being received,
+      * and sampling the signal strength on the channel.
+      *
+      * @return true if the channel is busy, false if it is clear or the receiver is not listening.
+      */
+    bool channelBusy();
+
+    /**
+      * Registers for periodic callbacks, if this has not already been done.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if a system timer slot could not be allocated.
+      */
+    int startTimer();
+
+    /**
+      * Turns the receiver back on at the start of a listening window, unless the transmitter is in use,
+      * in which case radioDisabled() will turn it on once transmission is complete.
+      */
+    void wake();
 
     public:
     MicroBitRadioDatagram   datagram;   // A simple datagram service.
@@ -143,12 +295,177 @@ class MicroBitRadio : MicroBitComponent
 
     /**
       * Attempt to queue a buffer received by the radio hardware, if sufficient space is available.
+      * This is O(1), and performs no memory allocation, so is safe to call from RADIO_IRQHandler.
       *
-      * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if a replacement receiver buffer
-      *         could not be allocated (either by policy or memory exhaustion).
+      * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if the receive queue is full, in which
+      *         case the packet is dropped and its buffer reused for the next packet.
       */
     int queueRxBuf();
 
+    /**
+      * Determines whether the RADIO hardware is being used to send queued packets.
+      *
+      * @return MICROBIT_RADIO_STATUS_TRANSMITTING if the transmitter is on, MICROBIT_RADIO_STATUS_TX_PENDING
+      *         if the receiver is being turned off in order to transmit, or zero otherwise.
+      */
+    int getTransmitStatus();
+
+    /**
+      * Called just before the RADIO hardware starts sending the packet at the head of the transmit queue,
+      * so that time critical fields can be filled in.
+      *
+      * @note should only be called from RADIO_IRQHandler...
+      */
+    void transmitStarting();
+
+    /**
+      * Passes the frame just received to the attached sniffer, if any, whether or not it is valid.
+      *
+      * @param valid true if the frame passed its CRC check.
+      *
+      * @note should only be called from RADIO_IRQHandler, before the frame is queued.
+      */
+    void frameReceived(bool valid);
+
+    /**
+      * Releases the packet at the head of the transmit queue once the RADIO hardware has sent it,
+      * and either starts sending the next one or turns the transmitter off.
+      *
+      * @note should only be called from RADIO_IRQHandler...
+      */
+    void packetTransmitted();
+
+    /**
+      * Turns the RADIO hardware back on once it has been disabled; as a transmitter if
+      * any packets are queued for transmission, otherwise as a receiver.
+      *
+      * @note should only be called from RADIO_IRQHandler...
+      */
+    void radioDisabled();
+
+    /**
+      * Puts the receiver to sleep once a packet has been received whilst duty cycling, as the sender
+      * will continue repeating it for up to a full interval.
+      *
+      * @return true if the receiver is being turned off, false if we're not duty cycling.
+      *
+      * @note should only be called from RADIO_IRQHandler...
+      */
+    bool dutyCycleReceived();
+
+    /**
+      * Enables or disables duty cycled, low power listening.
+      *
+      * When enabled, the receiver is only turned on for a short window once every interval, and otherwise left off,
+      * which substantially reduces the energy used by an idle micro:bit. To make sure they are heard, each packet sent is
+      * repeated back to back for a full interval and window. Once a receiver has caught a packet, it sleeps until the
+      * repeats must have finished, so that they are not received as duplicates.
+      *
+      * All micro:bits in a group must use the same settings.
+      *
+      * @param interval the time between the start of each listening window, in milliseconds, or zero to leave the receiver on
+      *        permanently (the default).
+      *
+      * @param window the time for which the receiver listens, in milliseconds. This must be less than interval, and should be
+      *        at least one system timer period, as the schedule is driven by the system timer.
+      *
+      * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if the parameters are out of range, MICROBIT_NO_RESOURCES
+      *         if no system timer slot is available, or MICROBIT_NOT_SUPPORTED if the BLE stack is running.
+      *
+      * @note Packets take up to interval + window to send, and protocols that wait for a reply (such as reliable datagrams)
+      *       will need correspondingly longer timeouts.
+      */
+    int setDutyCycle(int interval, int window = 0);
+
+    /**
+      * Enables or disables clear channel assessment (CSMA) before transmission.
+      *
+      * When enabled, the channel is checked before the transmitter is turned on. If a packet is being received, or the
+      * signal strength is at or above the threshold, transmission is deferred for a random time, drawn from a window
+      * that doubles after each deferral. Once the channel has been found busy attempts times, the packet is sent regardless.
+      * Packets that follow back to back, whilst the transmitter is already on, are not deferred.
+      *
+      * @param attempts the most times the channel is assessed before each transmission, in the range
+      *        1..MICROBIT_RADIO_CSMA_MAX_ATTEMPTS, or zero to transmit immediately (the default).
+      *
+      * @param threshold the signal strength at which the channel is considered busy, in dBm (e.g. -80).
+      *
+      * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if the parameters are out of range,
+      *         or MICROBIT_NO_RESOURCES if no system timer slot is available.
+      */
+    int setCsma(int attempts, int threshold = MICROBIT_RADIO_CSMA_DEFAULT_THRESHOLD);
+
+    /**
+      * Copies the clear channel assessment counters accumulated since the last call to resetCsmaStatistics().
+      *
+      * @param stats the structure to fill in.
+      *
+      * @return MICROBIT_OK.
+      */
+    int getCsmaStatistics(MicroBitRadioCsmaStatistics &stats);
+
+    /**
+      * Resets all clear channel assessment counters to zero.
+      *
+      * @return MICROBIT_OK.
+      */
+    int resetCsmaStatistics();
+
+    /**
+      * Holds packets in the transmit queue rather than sending them, or releases them for transmission.
+      * This is used to confine transmission to a time slot, and has no effect on reception.
+      *
+      * @param hold true to hold packets, false to send them as normal.
+      *
+      * @return MICROBIT_OK.
+      *
+      * @note A packet already being sent is completed, but no further packets are started whilst held.
+      *       Fibers blocked in send() remain blocked until their packet has been released and sent.
+      */
+    int setTransmitHold(bool hold);
+
+    /**
+      * Attaches a sniffer, which is given a copy of every frame received, including those that fail their CRC check.
+      *
+      * @param s the sniffer to attach, or NULL to detach the current one.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_NOT_SUPPORTED if a different sniffer is already attached.
+      *
+      * @note This is called by MicroBitRadioSniffer::start() and stop().
+      */
+    int setSniffer(MicroBitRadioSniffer *s);
+
+    /**
+      * Periodic callback from MicroBit system timer.
+      *
+      * Retries transmissions deferred by CSMA once their backoff has expired. When duty cycling, also turns the receiver
+      * on at the start of each listening window, and off again at the end.
+      */
+    virtual void systemTick();
+
+    /**
+      * Changes the number of received packets that can be held awaiting processing. The buffers for
+      * these packets are allocated up front, so that no memory allocation takes place on reception.
+      *
+      * @param depth the number of packets to hold, in the range 1..MICROBIT_RADIO_MAXIMUM_QUEUE_DEPTH.
+      *        The default is MICROBIT_RADIO_MAXIMUM_RX_BUFFERS.
+      *
+      * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if depth is out of range,
+      *         MICROBIT_NO_RESOURCES if the buffers could not be allocated, or MICROBIT_NOT_SUPPORTED
+      *         if the BLE stack is running.
+      *
+      * @note Any packets awaiting processing are discarded. If the radio is enabled, it is briefly
+      *       disabled whilst the buffers are replaced.
+      */
+    int setQueueDepth(int depth);
+
+    /**
+      * Determines the number of valid packets that have been discarded because the receive queue was full.
+      *
+      * @return the number of packets dropped since the radio was created.
+      */
+    int getDroppedPackets();
+
     /**
       * Sets the RSSI for the most recent packet.
       * The value is measured in -dbm. The higher the value, the stronger the signal.
@@ -184,14 +501,75 @@ class MicroBitRadio : MicroBitComponent
     int disable();
 
     /**
-      * Sets the radio to listen to packets sent with the given group id.
+      * Sets the radio to listen to packets sent with the given group id. This is also the group to which packets are sent.
       *
-      * @param group The group to join. A micro:bit can only listen to one group ID at any time.
+      * @param group The group to join. Further groups may be listened to with addGroup().
       *
       * @return MICROBIT_OK on success, or MICROBIT_NOT_SUPPORTED if the BLE stack is running.
       */
     int setGroup(uint8_t group);
 
+    /**
+      * Listens to packets sent with the given group id, in addition to our own group.
+      * The group each packet was received on is recorded in FrameBuffer::group.
+      *
+      * @param group The group to listen to.
+      *
+      * @return MICROBIT_OK on success, MICROBIT_NOT_SUPPORTED if the BLE stack is running, or MICROBIT_NO_RESOURCES
+      *         if MICROBIT_RADIO_MAX_GROUPS groups are already being listened to.
+      */
+    int addGroup(uint8_t group);
+
+    /**
+      * Stops listening to packets sent with the given group id, previously passed to addGroup().
+      *
+      * @param group The group to stop listening to.
+      *
+      * @return MICROBIT_OK on success, MICROBIT_NOT_SUPPORTED if the BLE stack is running, or MICROBIT_INVALID_PARAMETER
+      *         if the group was not added with addGroup().
+      */
+    int removeGroup(uint8_t group);
+
+    /**
+      * Registers a method to handle received packets of the given protocol, replacing any existing handler.
+      * The handler is called from idleTick(), and should take the packet from the receive queue with recv().
+      *
+      * @param protocol The protocol number.
+      *
+      * @param object The object on which the handler is invoked.
+      *
+      * @param handler The method to invoke.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if MICROBIT_RADIO_MAX_PROTOCOLS handlers are already registered.
+      *
+      * @code
+      * uBit.radio.registerProtocol(42, &myProtocol, &MyProtocol::packetReceived);
+      * @endcode
+      */
+    template <typename T> int registerProtocol(uint8_t protocol, T* object, void (T::*handler)());
+
+    /**
+      * Registers a function to handle received packets of the given protocol, replacing any existing handler.
+      * The handler is called from idleTick(), and should take the packet from the receive queue with recv().
+      *
+      * @param protocol The protocol number.
+      *
+      * @param handler The function to invoke.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if MICROBIT_RADIO_MAX_PROTOCOLS handlers are already registered.
+      */
+    int registerProtocol(uint8_t protocol, void (*handler)());
+
+    /**
+      * Removes the handler registered for the given protocol. Packets of that protocol are then announced with
+      * a MICROBIT_ID_RADIO_DATA_READY event instead.
+      *
+      * @param protocol The protocol number.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if no handler is registered for the protocol.
+      */
+    int unregisterProtocol(uint8_t protocol);
+
     /**
       * A background, low priority callback that is triggered whenever the processor is idle.
       * Here, we empty our queue of received packets, and pass them onto higher level protocol handlers.
@@ -210,22 +588,136 @@ class MicroBitRadio : MicroBitComponent
       * If a data packet is available, then it will be returned immediately to
       * the caller. This call will also dequeue the buffer.
       *
-      * @return The buffer containing the the packet. If no data is available, NULL is returned.
+      * @return The buffer containing the the packet. If no data is available, or the buffer
+      *         could not be allocated, NULL is returned.
       *
       * @note Once recv() has been called, it is the callers responsibility to
-      *       delete the buffer when appropriate.
+      *       delete the buffer when appropriate. The packet is copied out of the receive
+      *       queue into a new buffer here, outside of interrupt context.
       */
     FrameBuffer* recv();
 
     /**
       * Transmits the given buffer onto the broadcast radio.
       * The call will wait until the transmission of the packet has completed before returning.
+      * The calling fiber sleeps whilst it waits, so other fibers continue to run.
       *
       * @param data The packet contents to transmit.
       *
-      * @return MICROBIT_OK on success, or MICROBIT_NOT_SUPPORTED if the BLE stack is running.
+      * @return MICROBIT_OK on success, MICROBIT_NOT_SUPPORTED if the BLE stack is running or the radio
+      *         is not enabled, or MICROBIT_INVALID_PARAMETER if the packet is too long.
+      *
+      * @note If called from interrupt context, the packet is queued as for sendAsync(), and this
+      *       call returns without waiting for it to be sent.
       */
     int send(FrameBuffer *buffer);
+
+    /**
+      * Queues the given buffer for transmission onto the broadcast radio, and returns immediately.
+      * Queued packets are sent back to back by the RADIO interrupt handler, which then returns the
+      * radio to receive mode. A MICROBIT_RADIO_EVT_TX_COMPLETE event is raised as each packet is sent.
+      *
+      * @param data The packet contents to transmit. This is copied, so may be reused as soon as this call returns.
+      *
+      * @return MICROBIT_OK on success, MICROBIT_NOT_SUPPORTED if the BLE stack is running or the radio
+      *         is not enabled, MICROBIT_INVALID_PARAMETER if the packet is too long, or MICROBIT_NO_RESOURCES
+      *         if MICROBIT_RADIO_TX_QUEUE_DEPTH packets are already awaiting transmission.
+      */
+    int sendAsync(FrameBuffer *buffer);
+
+    /**
+      * Queues the given buffer for transmission to the given group, and returns immediately.
+      * This allows a micro:bit listening to several groups to bridge between them.
+      *
+      * @param data The packet contents to transmit. This is copied, so may be reused as soon as this call returns.
+      *
+      * @param group The group to send to. This must be our own group, or one added with addGroup().
+      *
+      * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if the packet is too long or we are not listening
+      *         to the group, or an error code as described for sendAsync().
+      */
+    int sendToGroup(FrameBuffer *buffer, uint8_t group);
+
+    /**
+      * Provides the multi-hop flooding service, creating it on first use.
+      *
+      * @return the mesh service.
+      *
+      * @note Mesh packets received before this is first called are discarded, rather than delivered or rebroadcast.
+      *       A micro:bit intended to relay mesh traffic should call this once at startup.
+      */
+    MicroBitRadioMesh& mesh();
+
+    /**
+      * Provides the network wide time base, creating it on first use.
+      *
+      * @return the time synchronisation service.
+      *
+      * @note Time beacons received before this is first called are discarded.
+      */
+    MicroBitRadioTimeSync& timesync();
+
+    /**
+      * Provides collision free transmission in assigned time slots, creating it on first use.
+      *
+      * @return the TDMA service.
+      *
+      * @note TDMA control packets received before this is first called are discarded.
+      */
+    MicroBitRadioTdma& tdma();
+
+    /**
+      * Provides link quality statistics for each micro:bit heard directly, creating the table on first use.
+      *
+      * @return the neighbour table.
+      *
+      * @note The table is created when it is first requested, or when a frame carrying the serial number of its sender
+      *       (e.g. a reliable datagram, or a mesh packet) is first received.
+      */
+    MicroBitRadioNeighbours& neighbours();
 };
 
+/**
+  * Registers a method to handle received packets of the given protocol, replacing any existing handler.
+  * The handler is called from idleTick(), and should take the packet from the receive queue with recv().
+  *
+  * @param protocol The protocol number.
+  *
+  * @param object The object on which the handler is invoked.
+  *
+  * @param handler The method to invoke.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if MICROBIT_RADIO_MAX_PROTOCOLS handlers are already registered.
+  */
+template <typename T>
+int MicroBitRadio::registerProtocol(uint8_t protocol, T* object, void (T::*handler)())
+{
+    MicroBitRadioProtocol p;
+
+    p.protocol = protocol;
+    p.object = object;
+    memclr(p.method, sizeof(p.method));
+    memcpy(p.method, &handler, sizeof(handler));
+    p.invoke = &MicroBitRadio::methodCall<T>;
+
+    return addProtocol(p);
+}
+
+/**
+  * A template used to create a static method capable of invoking a protocol handler method.
+  *
+  * @param object The object the method should be invoked on.
+  *
+  * @param method The method to invoke.
+  */
+template <typename T>
+void MicroBitRadio::methodCall(void *object, uint32_t *method)
+{
+    T* o = (T*)object;
+    void (T::*m)();
+
+    memcpy(&m, method, sizeof(m));
+    (o->*m)();
+}
+
 #endif
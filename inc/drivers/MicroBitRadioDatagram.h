@@ -28,9 +28,81 @@ DEALINGS IN THE SOFTWARE.
 
 #include "mbed.h"
 #include "MicroBitConfig.h"
+#include "MicroBitComponent.h"
 #include "MicroBitRadio.h"
+#include "PacketBuffer.h"
 #include "ManagedString.h"
 
+// Reliable datagram layout. Each frame starts with a header, at these offsets into the payload.
+#define MICROBIT_RADIO_RELIABLE_TYPE            0       // MICROBIT_RADIO_RELIABLE_DATA or MICROBIT_RADIO_RELIABLE_ACK.
+#define MICROBIT_RADIO_RELIABLE_SEQUENCE        1       // The sequence number of the datagram sent, or being acknowledged.
+#define MICROBIT_RADIO_RELIABLE_DESTINATION     2       // The serial number of the micro:bit the frame is addressed to.
+#define MICROBIT_RADIO_RELIABLE_SOURCE          6       // The serial number of the micro:bit that sent the frame.
+#define MICROBIT_RADIO_RELIABLE_HEADER_SIZE     10
+#define MICROBIT_RADIO_RELIABLE_MAX_SIZE        (MICROBIT_RADIO_MAX_PACKET_SIZE - MICROBIT_RADIO_RELIABLE_HEADER_SIZE)
+
+// Reliable datagram frame types
+#define MICROBIT_RADIO_RELIABLE_DATA            1
+#define MICROBIT_RADIO_RELIABLE_ACK             2
+
+// Reliable datagram configuration
+#define MICROBIT_RADIO_RELIABLE_TIMEOUT         12      // The time to wait for the first acknowledgement, in milliseconds. Doubled on each retransmission.
+#define MICROBIT_RADIO_RELIABLE_RETRIES         5       // The number of retransmissions made before a datagram is reported as failed.
+#define MICROBIT_RADIO_RELIABLE_HISTORY         4       // The number of senders whose last sequence number is remembered, to suppress duplicates.
+
+// Fragmented datagram layout. Each fragment starts with a header, at these offsets into the payload.
+#define MICROBIT_RADIO_FRAGMENT_ID              0       // Identifies the datagram the fragment belongs to, amongst those from the same source.
+#define MICROBIT_RADIO_FRAGMENT_INDEX           1       // The position of the fragment in the datagram, from zero.
+#define MICROBIT_RADIO_FRAGMENT_COUNT           2       // The number of fragments in the datagram.
+#define MICROBIT_RADIO_FRAGMENT_SOURCE          3       // The serial number of the micro:bit that sent the datagram.
+#define MICROBIT_RADIO_FRAGMENT_HEADER_SIZE     7
+#define MICROBIT_RADIO_FRAGMENT_PAYLOAD_SIZE    (MICROBIT_RADIO_MAX_PACKET_SIZE - MICROBIT_RADIO_FRAGMENT_HEADER_SIZE)
+
+// Fragmented datagram configuration
+#define MICROBIT_RADIO_FRAGMENT_MAX_SIZE        256     // The longest datagram that can be sent, in bytes.
+#define MICROBIT_RADIO_FRAGMENT_MAX_COUNT       ((MICROBIT_RADIO_FRAGMENT_MAX_SIZE + MICROBIT_RADIO_FRAGMENT_PAYLOAD_SIZE - 1) / MICROBIT_RADIO_FRAGMENT_PAYLOAD_SIZE)
+#define MICROBIT_RADIO_FRAGMENT_BUFFERS         2       // The number of fragmented datagrams that can be reassembled at once.
+#define MICROBIT_RADIO_FRAGMENT_TIMEOUT         500     // The time after which an incomplete datagram is discarded if no more fragments arrive, in milliseconds.
+
+// Receive queue overflow policies
+#define MICROBIT_RADIO_DATAGRAM_DROP_NEWEST     0       // When the queue is full, newly received datagrams are discarded.
+#define MICROBIT_RADIO_DATAGRAM_DROP_OLDEST     1       // When the queue is full, the oldest queued datagram is discarded to make room.
+
+// Status Flags
+#define MICROBIT_RADIO_DATAGRAM_STATUS_PENDING  0x02    // A reliable datagram is awaiting acknowledgement.
+
+/**
+  * A received datagram, queued awaiting user reception.
+  */
+struct DatagramEntry
+{
+    PacketBuffer    packet;     // The payload of the datagram.
+    DatagramEntry   *next;      // Linkage, to the next datagram in the queue.
+};
+
+/**
+  * A fragmented datagram being reassembled.
+  */
+struct FragmentBuffer
+{
+    uint32_t        source;     // The serial number of the sender.
+    uint8_t         *data;      // Storage for the reassembled datagram, or NULL if this buffer is not in use.
+    uint32_t        received;   // Bit n is set once fragment n has been received.
+    uint32_t        deadline;   // The system time after which the datagram is discarded if still incomplete.
+    uint16_t        length;     // The length of the datagram, once its last fragment has been received.
+    uint8_t         id;         // The id of the datagram.
+    uint8_t         count;      // The number of fragments in the datagram.
+};
+
+/**
+  * The last reliable datagram received from a given micro:bit, used to discard retransmissions we've already seen.
+  */
+struct ReliableHistory
+{
+    uint32_t        source;     // The serial number of the sender.
+    uint8_t         sequence;   // The sequence number of the last datagram received from it.
+};
+
 /**
   * Provides a simple broadcast radio abstraction, built upon the raw nrf51822 RADIO module.
   *
@@ -42,10 +114,91 @@ DEALINGS IN THE SOFTWARE.
   * teaching aid to demonstrate how simple communications operates, and to provide a sandpit through which learning can take place.
   * For serious applications, BLE should be considered a substantially more secure alternative.
   */
-class MicroBitRadioDatagram
+class MicroBitRadioDatagram : MicroBitComponent
 {
     MicroBitRadio   &radio;     // The underlying radio module used to send and receive data.
-    FrameBuffer     *rxQueue;   // A linear list of incoming packets, queued awaiting processing.
+    DatagramEntry   *rxQueue;   // A linear list of incoming packets, queued awaiting processing.
+    DatagramEntry   *rxQueueTail;   // The last packet in rxQueue, to which new packets are appended.
+    uint8_t         rxQueueDepth;   // The number of packets in rxQueue.
+    uint8_t         rxQueueLimit;   // The most packets rxQueue may hold.
+    uint8_t         rxPolicy;       // The overflow policy applied when rxQueue is full.
+    uint32_t        rxDropped;      // The number of datagrams discarded because rxQueue was full.
+    FrameBuffer     *txFrame;   // The reliable datagram awaiting acknowledgement, if any.
+    uint8_t         txSequence; // The sequence number of txFrame.
+    uint8_t         txRetries;  // The number of times txFrame has been retransmitted.
+    uint16_t        txTimeout;  // The time to wait for the next acknowledgement of txFrame, in milliseconds.
+    uint32_t        txDeadline; // The system time at which txFrame will next be retransmitted.
+    uint8_t         historyIndex;                                   // The next entry in history to be replaced.
+    ReliableHistory history[MICROBIT_RADIO_RELIABLE_HISTORY];       // The last datagram received from recent senders.
+    uint8_t         txMessageId;                                    // The id of the last fragmented datagram sent.
+    FragmentBuffer  fragments[MICROBIT_RADIO_FRAGMENT_BUFFERS];     // Fragmented datagrams being reassembled.
+
+    /**
+      * Adds the given packet to the queue awaiting user reception, and raises a MICROBIT_RADIO_EVT_DATAGRAM event.
+      * If the queue is full, either this packet or the oldest queued is discarded, according to the overflow policy.
+      *
+      * @param packet The packet to queue.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if the packet was discarded.
+      */
+    int queuePacket(PacketBuffer packet);
+
+    /**
+      * Removes the oldest packet from the queue awaiting user reception.
+      *
+      * @return the queue entry, which the caller must delete, or NULL if the queue is empty.
+      */
+    DatagramEntry* dequeue();
+
+    /**
+      * Transmits the given buffer as a sequence of fragments.
+      *
+      * @param buffer The packet contents to transmit.
+      *
+      * @param len The number of bytes to transmit, in the range 1..MICROBIT_RADIO_FRAGMENT_MAX_SIZE.
+      *
+      * @return MICROBIT_OK on success, or an error code as described for MicroBitRadio::send().
+      */
+    int sendFragmented(uint8_t *buffer, int len);
+
+    /**
+      * Finds the buffer in which the given datagram is being reassembled, or allocates one if it is new.
+      * Any incomplete datagrams that have timed out are discarded along the way.
+      *
+      * @param source the serial number of the sender.
+      *
+      * @param id the id of the datagram.
+      *
+      * @param count the number of fragments in the datagram.
+      *
+      * @return the buffer, or NULL if all buffers are in use, or memory could not be allocated.
+      */
+    FragmentBuffer* fragmentBufferFor(uint32_t source, uint8_t id, uint8_t count);
+
+    /**
+      * Transmits a reliable datagram header, without any data.
+      *
+      * @param type the frame type.
+      *
+      * @param sequence the sequence number.
+      *
+      * @param destination the serial number of the micro:bit to send the frame to.
+      *
+      * @param group the group to send the frame to, which should be the one the destination's last frame was received on.
+      *
+      * @return MICROBIT_OK on success, or an error code as described for MicroBitRadio::sendToGroup().
+      */
+    int sendControl(uint8_t type, uint8_t sequence, uint32_t destination, uint8_t group);
+
+    /**
+      * Looks up the last reliable datagram received from the given micro:bit.
+      *
+      * @param source the serial number of the sender.
+      *
+      * @return the history entry for source, or if there is none, the least recently added entry, which should
+      *         be replaced once a datagram from source has been accepted.
+      */
+    ReliableHistory* historyFor(uint32_t source);
 
     public:
 
@@ -87,14 +240,15 @@ class MicroBitRadioDatagram
       * Transmits the given buffer onto the broadcast radio.
       *
       * This is a synchronous call that will wait until the transmission of the packet
-      * has completed before returning.
+      * has completed before returning. Packets longer than MICROBIT_RADIO_MAX_PACKET_SIZE
+      * are split across several frames, and reassembled by the receiver.
       *
       * @param buffer The packet contents to transmit.
       *
       * @param len The number of bytes to transmit.
       *
       * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if the buffer is invalid,
-      *         or the number of bytes to transmit is greater than `MICROBIT_RADIO_MAX_PACKET_SIZE + MICROBIT_RADIO_HEADER_SIZE`.
+      *         or the number of bytes to transmit is greater than `MICROBIT_RADIO_FRAGMENT_MAX_SIZE`.
       */
     int send(uint8_t *buffer, int len);
 
@@ -102,12 +256,13 @@ class MicroBitRadioDatagram
       * Transmits the given string onto the broadcast radio.
       *
       * This is a synchronous call that will wait until the transmission of the packet
-      * has completed before returning.
+      * has completed before returning. Packets longer than MICROBIT_RADIO_MAX_PACKET_SIZE
+      * are split across several frames, and reassembled by the receiver.
       *
       * @param data The packet contents to transmit.
       *
       * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if the buffer is invalid,
-      *         or the number of bytes to transmit is greater than `MICROBIT_RADIO_MAX_PACKET_SIZE + MICROBIT_RADIO_HEADER_SIZE`.
+      *         or the number of bytes to transmit is greater than `MICROBIT_RADIO_FRAGMENT_MAX_SIZE`.
       */
     int send(PacketBuffer data);
 
@@ -115,21 +270,145 @@ class MicroBitRadioDatagram
       * Transmits the given string onto the broadcast radio.
       *
       * This is a synchronous call that will wait until the transmission of the packet
-      * has completed before returning.
+      * has completed before returning. Packets longer than MICROBIT_RADIO_MAX_PACKET_SIZE
+      * are split across several frames, and reassembled by the receiver.
       *
       * @param data The packet contents to transmit.
       *
       * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if the buffer is invalid,
-      *         or the number of bytes to transmit is greater than `MICROBIT_RADIO_MAX_PACKET_SIZE + MICROBIT_RADIO_HEADER_SIZE`.
+      *         or the number of bytes to transmit is greater than `MICROBIT_RADIO_FRAGMENT_MAX_SIZE`.
       */
     int send(ManagedString data);
 
+    /**
+      * Transmits the given buffer to a single micro:bit, which acknowledges it.
+      *
+      * If no acknowledgement is received within MICROBIT_RADIO_RELIABLE_TIMEOUT milliseconds, the datagram is
+      * retransmitted, doubling the timeout each time, up to MICROBIT_RADIO_RELIABLE_RETRIES times. The outcome is
+      * reported with either a MICROBIT_RADIO_EVT_DATAGRAM_ACKED or a MICROBIT_RADIO_EVT_DATAGRAM_FAILED event.
+      *
+      * The receiver discards any retransmissions it has already seen, and queues the datagram for recv() as for any other.
+      *
+      * @param destination the serial number of the micro:bit to send to, as returned by microbit_serial_number() on that device.
+      *
+      * @param buffer The packet contents to transmit.
+      *
+      * @param len The number of bytes to transmit.
+      *
+      * @return MICROBIT_OK once the datagram has first been sent, MICROBIT_BUSY if a previous reliable datagram is yet to
+      *         be acknowledged, MICROBIT_NO_RESOURCES if memory could not be allocated, or MICROBIT_INVALID_PARAMETER
+      *         if the buffer is invalid, or the number of bytes to transmit is greater than `MICROBIT_RADIO_RELIABLE_MAX_SIZE`.
+      */
+    int sendReliable(uint32_t destination, uint8_t *buffer, int len);
+
+    /**
+      * Transmits the given buffer to a single micro:bit, which acknowledges it.
+      *
+      * @param destination the serial number of the micro:bit to send to.
+      *
+      * @param data The packet contents to transmit.
+      *
+      * @return MICROBIT_OK once the datagram has first been sent, or an error code as described for
+      *         sendReliable(uint32_t, uint8_t *, int).
+      */
+    int sendReliable(uint32_t destination, PacketBuffer data);
+
+    /**
+      * Transmits the given string to a single micro:bit, which acknowledges it.
+      *
+      * @param destination the serial number of the micro:bit to send to.
+      *
+      * @param data The packet contents to transmit.
+      *
+      * @return MICROBIT_OK once the datagram has first been sent, or an error code as described for
+      *         sendReliable(uint32_t, uint8_t *, int).
+      */
+    int sendReliable(uint32_t destination, ManagedString data);
+
+    /**
+      * Determines if a reliable datagram is still awaiting acknowledgement.
+      *
+      * @return true if sendReliable() would currently return MICROBIT_BUSY.
+      */
+    bool isReliablePending();
+
+    /**
+      * Changes the number of received datagrams that can be held awaiting collection by recv().
+      *
+      * @param depth the number of datagrams to hold, in the range 1..MICROBIT_RADIO_MAXIMUM_QUEUE_DEPTH.
+      *        The default is MICROBIT_RADIO_MAXIMUM_RX_BUFFERS.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if depth is out of range.
+      *
+      * @note If the queue already holds more datagrams than the new depth, the excess are discarded according
+      *       to the overflow policy, and counted as dropped.
+      */
+    int setQueueDepth(int depth);
+
+    /**
+      * Selects which datagram is discarded when one is received whilst the queue is full.
+      *
+      * @param policy MICROBIT_RADIO_DATAGRAM_DROP_NEWEST (the default) to discard the datagram just received, or
+      *        MICROBIT_RADIO_DATAGRAM_DROP_OLDEST to discard the oldest queued datagram to make room for it.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if the policy is not recognised.
+      *
+      * @note Reliable datagrams are only acknowledged once queued, so under MICROBIT_RADIO_DATAGRAM_DROP_NEWEST
+      *       the sender will retransmit them, whereas under MICROBIT_RADIO_DATAGRAM_DROP_OLDEST they are always
+      *       accepted, but may be discarded before they are collected.
+      */
+    int setOverflowPolicy(int policy);
+
+    /**
+      * Determines the number of datagrams awaiting collection by recv().
+      *
+      * @return the number of datagrams queued.
+      */
+    int dataReady();
+
+    /**
+      * Determines the number of received datagrams that have been discarded because the queue was full.
+      *
+      * @return the number of datagrams dropped since the last call to resetDroppedPackets().
+      */
+    int getDroppedPackets();
+
+    /**
+      * Resets the count of dropped datagrams to zero.
+      *
+      * @return MICROBIT_OK.
+      */
+    int resetDroppedPackets();
+
     /**
       * Protocol handler callback. This is called when the radio receives a packet marked as a datagram.
       *
       * This function process this packet, and queues it for user reception.
       */
     void packetReceived();
+
+    /**
+      * Protocol handler callback. This is called when the radio receives a packet marked as a reliable datagram.
+      *
+      * Datagrams addressed to this micro:bit are acknowledged, and queued for user reception unless they are
+      * duplicates. Acknowledgements of our own pending datagram complete its delivery.
+      */
+    void reliablePacketReceived();
+
+    /**
+      * Protocol handler callback. This is called when the radio receives a fragment of a datagram.
+      *
+      * Fragments may arrive in any order. Once all the fragments of a datagram have arrived, it is
+      * queued for user reception.
+      */
+    void fragmentReceived();
+
+    /**
+      * Periodic callback from MicroBit system timer.
+      *
+      * Retransmits any reliable datagram that has not been acknowledged in time.
+      */
+    virtual void systemTick();
 };
 
 #endif
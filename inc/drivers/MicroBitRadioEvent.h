@@ -48,6 +48,7 @@ class MicroBitRadioEvent
 {
     bool            suppressForwarding;     // A private flag used to prevent event forwarding loops.
     MicroBitRadio   &radio;                 // A reference to the underlying radio module to use.
+    uint32_t        dropped;                // The number of events not forwarded, as the transmit queue was full.
 
     public:
 
@@ -138,6 +139,12 @@ class MicroBitRadioEvent
       * a radio packet and transmitted to any other micro:bits in the same group.
       */
     void eventReceived(MicroBitEvent e);
+
+    /**
+      * @return the number of events that could not be forwarded, because they were raised in interrupt context,
+      *         or on the idle fiber, whilst the radio transmit queue was full.
+      */
+    int getDroppedEvents();
 };
 
 #endif
@@ -0,0 +1,295 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 British Broadcasting Corporation.
+This software is provided by Lancaster University by arrangement with the BBC.
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef MICROBIT_RADIO_MESH_H
+#define MICROBIT_RADIO_MESH_H
+
+#include "mbed.h"
+#include "MicroBitConfig.h"
+#include "MicroBitComponent.h"
+#include "MicroBitRadio.h"
+#include "PacketBuffer.h"
+#include "ManagedString.h"
+
+// Mesh packet layout. Each packet starts with a header, at these offsets into the payload.
+#define MICROBIT_RADIO_MESH_TTL                 0       // The number of further times the packet may be rebroadcast, including this one.
+#define MICROBIT_RADIO_MESH_HOPS                1       // The number of times the packet has been rebroadcast so far.
+#define MICROBIT_RADIO_MESH_SEQUENCE            2       // The sequence number assigned to the packet by its origin (16 bit).
+#define MICROBIT_RADIO_MESH_ORIGIN              4       // The serial number of the micro:bit that first sent the packet.
+#define MICROBIT_RADIO_MESH_HEADER_SIZE         8
+#define MICROBIT_RADIO_MESH_MAX_SIZE            (MICROBIT_RADIO_MAX_PACKET_SIZE - MICROBIT_RADIO_MESH_HEADER_SIZE)
+
+// Mesh configuration
+#define MICROBIT_RADIO_MESH_DEFAULT_TTL         4       // The number of hops a packet travels, unless specified when it is sent.
+#define MICROBIT_RADIO_MESH_MAX_TTL             15
+#define MICROBIT_RADIO_MESH_JITTER              24      // The maximum random delay before a packet is rebroadcast, in milliseconds.
+#define MICROBIT_RADIO_MESH_SUPPRESSION         2       // A rebroadcast is cancelled if this many neighbours are heard rebroadcasting the packet first.
+#define MICROBIT_RADIO_MESH_ORIGINS             8       // The number of origins whose recent sequence numbers are remembered, to suppress duplicates.
+#define MICROBIT_RADIO_MESH_WINDOW              16      // The number of recent sequence numbers remembered for each origin.
+#define MICROBIT_RADIO_MESH_FORWARD_SLOTS       4       // The number of packets that can be awaiting rebroadcast at once.
+#define MICROBIT_RADIO_MESH_STATS_HOPS          8       // The number of hop count buckets kept in the statistics.
+
+// Forwarding slot states
+#define MICROBIT_RADIO_MESH_SLOT_FREE           0
+#define MICROBIT_RADIO_MESH_SLOT_PENDING        1
+
+// Receive queue overflow policies
+#define MICROBIT_RADIO_MESH_DROP_NEWEST         0       // When the queue is full, newly received packets are discarded.
+#define MICROBIT_RADIO_MESH_DROP_OLDEST         1       // When the queue is full, the oldest queued packet is discarded to make room.
+
+/**
+  * The recent packets seen from a given origin, used to discard duplicates.
+  */
+struct MeshOrigin
+{
+    uint32_t        origin;     // The serial number of the origin.
+    uint16_t        sequence;   // The highest sequence number seen from the origin.
+    uint16_t        window;     // Bit n is set if sequence - n has been seen.
+};
+
+// A packet awaiting rebroadcast. Defined in MicroBitRadioMesh.cpp, as FrameBuffer is incomplete here.
+struct MeshForward;
+
+/**
+  * Counters describing the traffic handled by the mesh.
+  */
+struct MicroBitRadioMeshStatistics
+{
+    uint32_t        sent;                                   // Packets originated by this micro:bit.
+    uint32_t        received;                               // Distinct packets delivered to this micro:bit.
+    uint32_t        duplicates;                             // Copies of packets already seen, which were discarded.
+    uint32_t        forwarded;                              // Packets rebroadcast on behalf of other micro:bits.
+    uint32_t        suppressed;                             // Rebroadcasts cancelled because enough neighbours had already made them.
+    uint32_t        dropped;                                // Packets not delivered or rebroadcast due to lack of space.
+    uint32_t        hops[MICROBIT_RADIO_MESH_STATS_HOPS];   // Packets received, by the number of hops travelled. The last entry includes all longer paths.
+};
+
+/**
+  * Provides a simple multi-hop broadcast over the radio, so that packets reach micro:bits beyond the range of the sender.
+  *
+  * Every micro:bit that receives a mesh packet for the first time delivers it, and, if its time to live has not expired,
+  * rebroadcasts it after a short random delay. The delay decorrelates neighbouring rebroadcasts, and if enough neighbours
+  * are heard rebroadcasting the same packet first, ours is cancelled, bounding the airtime used in dense networks.
+  * Duplicates are recognised by the serial number of the origin and a per-origin sequence number.
+  *
+  * This is similar in spirit to GLOSSY flooding, though rebroadcasts are randomised rather than synchronous, as the
+  * nrf51822 RADIO module is driven here without precise timing.
+  *
+  * @note This API does not contain any form of encryption, authentication or authorisation. Its purpose is solely for use as a
+  * teaching aid to demonstrate how simple communications operates, and to provide a sandpit through which learning can take place.
+  * For serious applications, BLE should be considered a substantially more secure alternative.
+  */
+class MicroBitRadioMesh : MicroBitComponent
+{
+    MicroBitRadio               &radio;         // The underlying radio module used to send and receive data.
+    FrameBuffer                 *rxQueue;       // A linear list of incoming packets, queued awaiting processing.
+    FrameBuffer                 *rxQueueTail;   // The last packet in rxQueue, to which new packets are appended.
+    uint8_t                     rxQueueDepth;   // The number of packets in rxQueue.
+    uint8_t                     rxPolicy;       // The overflow policy applied when rxQueue is full.
+    MeshForward                 *forward;       // Packets awaiting rebroadcast. Allocated on first use.
+    uint16_t                    txSequence;     // The sequence number of the last packet we originated.
+    uint8_t                     originIndex;    // The next entry in origins to be replaced.
+    MeshOrigin                  origins[MICROBIT_RADIO_MESH_ORIGINS];  // Recent packets seen from each origin.
+    MicroBitRadioMeshStatistics statistics;
+
+    /**
+      * Allocates the forwarding slots, and registers for periodic callbacks, if this has not already been done.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if memory or a system timer slot could not be allocated.
+      */
+    int init();
+
+    /**
+      * Determines if a packet has already been seen, and records it if not.
+      *
+      * @param origin the serial number of the micro:bit that first sent the packet.
+      *
+      * @param sequence the sequence number of the packet.
+      *
+      * @return true if the packet has been seen before (or is too old to tell), false otherwise.
+      */
+    bool isDuplicate(uint32_t origin, uint16_t sequence);
+
+    /**
+      * Notes that a neighbour has rebroadcast a packet we are waiting to rebroadcast,
+      * and cancels our rebroadcast if enough neighbours have done so.
+      *
+      * @param origin the serial number of the micro:bit that first sent the packet.
+      *
+      * @param sequence the sequence number of the packet.
+      */
+    void duplicateHeard(uint32_t origin, uint16_t sequence);
+
+    /**
+      * Schedules a received packet for rebroadcast after a random delay.
+      *
+      * @param packet the packet, as received.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if all forwarding slots are in use.
+      */
+    int scheduleForward(FrameBuffer *packet);
+
+    /**
+      * Adds the given packet to the queue awaiting user reception.
+      * If the queue is full, either this packet or the oldest queued is discarded, according to the overflow policy.
+      *
+      * @param packet The packet to queue.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if the packet was discarded.
+      */
+    int queuePacket(FrameBuffer *packet);
+
+    /**
+      * Removes the oldest packet from the queue awaiting user reception.
+      *
+      * @return the packet, which the caller must delete, or NULL if the queue is empty.
+      */
+    FrameBuffer* dequeue();
+
+    public:
+
+    /**
+      * Constructor.
+      *
+      * Creates an instance of a MicroBitRadioMesh which offers the ability to broadcast
+      * simple text or binary messages to micro:bits beyond the range of the radio.
+      *
+      * @param r The underlying radio module used to send and receive data.
+      *
+      * @note No memory is allocated, and packets are not rebroadcast, until this micro:bit first sends a mesh packet
+      *       or receives one.
+      */
+    MicroBitRadioMesh(MicroBitRadio &r);
+
+    /**
+      * Retrieves packet payload data into the given buffer.
+      *
+      * @param buf A pointer to a valid memory location where the received data is to be stored
+      *
+      * @param len The maximum amount of data that can safely be stored in 'buf'
+      *
+      * @param origin If not NULL, set to the serial number of the micro:bit that sent the packet.
+      *
+      * @return The length of the data stored, or MICROBIT_INVALID_PARAMETER if no data is available, or the memory regions provided are invalid.
+      */
+    int recv(uint8_t *buf, int len, uint32_t *origin = NULL);
+
+    /**
+      * Retrieves packet payload data.
+      *
+      * @return the data received, or an empty PacketBuffer if no data is available.
+      */
+    PacketBuffer recv();
+
+    /**
+      * Transmits the given buffer to all micro:bits within the given number of hops.
+      *
+      * This is a synchronous call that will wait until the first transmission of the packet
+      * has completed before returning.
+      *
+      * @param buffer The packet contents to transmit.
+      *
+      * @param len The number of bytes to transmit.
+      *
+      * @param ttl The number of hops the packet may travel, in the range 1..MICROBIT_RADIO_MESH_MAX_TTL.
+      *
+      * @return MICROBIT_OK on success, MICROBIT_NO_RESOURCES if memory could not be allocated, or MICROBIT_INVALID_PARAMETER
+      *         if the buffer or ttl is invalid, or the number of bytes to transmit is greater than `MICROBIT_RADIO_MESH_MAX_SIZE`.
+      */
+    int send(uint8_t *buffer, int len, int ttl = MICROBIT_RADIO_MESH_DEFAULT_TTL);
+
+    /**
+      * Transmits the given buffer to all micro:bits within the given number of hops.
+      *
+      * @param data The packet contents to transmit.
+      *
+      * @param ttl The number of hops the packet may travel, in the range 1..MICROBIT_RADIO_MESH_MAX_TTL.
+      *
+      * @return MICROBIT_OK on success, or an error code as described for send(uint8_t *, int, int).
+      */
+    int send(PacketBuffer data, int ttl = MICROBIT_RADIO_MESH_DEFAULT_TTL);
+
+    /**
+      * Transmits the given string to all micro:bits within the given number of hops.
+      *
+      * @param data The packet contents to transmit.
+      *
+      * @param ttl The number of hops the packet may travel, in the range 1..MICROBIT_RADIO_MESH_MAX_TTL.
+      *
+      * @return MICROBIT_OK on success, or an error code as described for send(uint8_t *, int, int).
+      */
+    int send(ManagedString data, int ttl = MICROBIT_RADIO_MESH_DEFAULT_TTL);
+
+    /**
+      * Selects which packet is discarded when one is received whilst the queue is full.
+      *
+      * @param policy MICROBIT_RADIO_MESH_DROP_NEWEST (the default) to discard the packet just received, or
+      *        MICROBIT_RADIO_MESH_DROP_OLDEST to discard the oldest queued packet to make room for it.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if the policy is not recognised.
+      *
+      * @note Packets discarded from the queue are still rebroadcast, and are counted as dropped in the statistics.
+      */
+    int setOverflowPolicy(int policy);
+
+    /**
+      * Determines the number of packets awaiting collection by recv().
+      *
+      * @return the number of packets queued.
+      */
+    int dataReady();
+
+    /**
+      * Copies the mesh traffic counters accumulated since the last call to resetStatistics().
+      *
+      * @param stats the structure to fill in.
+      *
+      * @return MICROBIT_OK.
+      */
+    int getStatistics(MicroBitRadioMeshStatistics &stats);
+
+    /**
+      * Resets all mesh traffic counters to zero.
+      *
+      * @return MICROBIT_OK.
+      */
+    int resetStatistics();
+
+    /**
+      * Protocol handler callback. This is called when the radio receives a packet marked as a mesh packet.
+      *
+      * New packets are queued for user reception, and scheduled for rebroadcast.
+      */
+    void packetReceived();
+
+    /**
+      * Periodic callback from MicroBit system timer.
+      *
+      * Rebroadcasts any packets whose random delay has expired.
+      */
+    virtual void systemTick();
+};
+
+#endif
@@ -0,0 +1,165 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 British Broadcasting Corporation.
+This software is provided by Lancaster University by arrangement with the BBC.
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef MICROBIT_RADIO_NEIGHBOURS_H
+#define MICROBIT_RADIO_NEIGHBOURS_H
+
+#include "mbed.h"
+#include "MicroBitConfig.h"
+
+// Neighbour table configuration
+#define MICROBIT_RADIO_NEIGHBOURS               8       // The number of neighbours tracked. The least recently heard is replaced when a new one appears.
+#define MICROBIT_RADIO_NEIGHBOUR_RSSI_SHIFT     3       // The signal strength is smoothed with a weight of 1/2^n given to each new frame.
+#define MICROBIT_RADIO_NEIGHBOUR_PRR_SHIFT      4       // The reception ratio is smoothed with a weight of 1/2^n given to each packet sent.
+#define MICROBIT_RADIO_NEIGHBOUR_PRR_SCALE      1024    // The reception ratio of a neighbour from which every packet is received.
+#define MICROBIT_RADIO_NEIGHBOUR_ETX_SCALE      100     // The ETX of a perfect link.
+#define MICROBIT_RADIO_NEIGHBOUR_MAX_GAP        32      // A larger jump in sequence numbers is assumed to be a restart by the neighbour, rather than lost packets.
+
+struct FrameBuffer;
+
+/**
+  * What we know about a micro:bit heard directly over the radio.
+  */
+struct MicroBitRadioNeighbour
+{
+    uint32_t        id;             // The serial number of the neighbour.
+    uint32_t        lastSeen;       // The system time at which a frame was last heard from the neighbour, in milliseconds.
+    uint32_t        frames;         // The number of frames heard from the neighbour.
+    int             rssi;           // The smoothed signal strength of frames from the neighbour, in dBm.
+    uint16_t        prr;            // The smoothed packet reception ratio, out of MICROBIT_RADIO_NEIGHBOUR_PRR_SCALE.
+    uint16_t        etx;            // The expected number of transmissions to deliver a packet and its acknowledgement, out of MICROBIT_RADIO_NEIGHBOUR_ETX_SCALE.
+    int16_t         rssiAverage;    // The smoothed signal strength, with MICROBIT_RADIO_NEIGHBOUR_RSSI_SHIFT fractional bits.
+    uint16_t        sequence;       // The last sequence number heard from the neighbour.
+    uint8_t         protocol;       // The protocol whose sequence numbers are tracked, or zero if none have been heard.
+};
+
+/**
+  * Keeps statistics on the quality of the link from each micro:bit heard directly over the radio.
+  *
+  * Protocols whose frames carry the serial number of their sender report each frame heard. The signal strength of
+  * each neighbour is smoothed with an exponentially weighted moving average. Where frames also carry a sequence number,
+  * gaps in the sequence reveal lost packets, from which a smoothed packet reception ratio (PRR) is estimated, and from
+  * that, the expected transmission count (ETX) of the link. Links are assumed to be symmetric, as we cannot hear how well
+  * a neighbour receives us, so ETX is taken as 1 / PRR^2.
+  *
+  * The table is bounded in size, and the least recently heard neighbour is replaced when a new one appears.
+  *
+  * The table is only updated by protocol handlers, which MicroBitRadio::idleTick() calls in fiber context, never from
+  * the radio interrupt. As fibers are not preempted, entries can be read without disabling interrupts.
+  */
+class MicroBitRadioNeighbours
+{
+    MicroBitRadioNeighbour      table[MICROBIT_RADIO_NEIGHBOURS];   // The neighbours heard recently.
+    uint8_t                     size;                               // The number of entries in use.
+
+    /**
+      * Looks up a neighbour in the table, adding it if necessary.
+      *
+      * @param id the serial number of the neighbour.
+      *
+      * @return the entry for the neighbour.
+      */
+    MicroBitRadioNeighbour* entryFor(uint32_t id);
+
+    /**
+      * Updates the smoothed reception ratio, and ETX, of a neighbour.
+      *
+      * @param n the neighbour.
+      *
+      * @param lost the number of packets lost since the last one received.
+      */
+    void updateReception(MicroBitRadioNeighbour *n, int lost);
+
+    public:
+
+    /**
+      * Constructor.
+      *
+      * Creates an empty neighbour table.
+      */
+    MicroBitRadioNeighbours();
+
+    /**
+      * Records a frame heard from a neighbour.
+      *
+      * @param packet the frame, as received.
+      *
+      * @param id the serial number of the micro:bit that sent the frame.
+      *
+      * @note This is called by protocols whose frames carry the serial number of their sender.
+      */
+    void frameHeard(FrameBuffer *packet, uint32_t id);
+
+    /**
+      * Records a frame heard from a neighbour, which carries a sequence number.
+      *
+      * @param packet the frame, as received.
+      *
+      * @param id the serial number of the micro:bit that sent the frame.
+      *
+      * @param sequence the sequence number of the frame. Retransmissions should repeat the sequence number.
+      *
+      * @param mask the range of sequence numbers, less one (e.g. 0xFF for an 8 bit sequence number).
+      *
+      * @note This is called by protocols whose frames carry the serial number of their sender. Sequence gaps are only
+      *       counted between frames of the same protocol, so a neighbour that alternates between protocols with sequence
+      *       numbers has its reception ratio estimated from whichever it uses for the longest runs.
+      */
+    void frameHeard(FrameBuffer *packet, uint32_t id, uint16_t sequence, uint16_t mask);
+
+    /**
+      * Retrieves what we know about the given neighbour.
+      *
+      * @param id the serial number of the neighbour.
+      *
+      * @param neighbour set to the neighbour's entry in the table.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if the neighbour is not in the table.
+      */
+    int get(uint32_t id, MicroBitRadioNeighbour &neighbour);
+
+    /**
+      * Retrieves the whole neighbour table, in no particular order.
+      *
+      * @param neighbours the array into which to copy the table.
+      *
+      * @param len the number of entries that can be stored in neighbours.
+      *
+      * @return the number of entries copied, or MICROBIT_INVALID_PARAMETER if the array is invalid.
+      */
+    int list(MicroBitRadioNeighbour *neighbours, int len);
+
+    /**
+      * @return the number of neighbours in the table.
+      */
+    int count();
+
+    /**
+      * Removes all neighbours from the table.
+      */
+    void clear();
+};
+
+#endif
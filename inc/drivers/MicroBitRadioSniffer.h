@@ -0,0 +1,151 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 British Broadcasting Corporation.
+This software is provided by Lancaster University by arrangement with the BBC.
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef MICROBIT_RADIO_SNIFFER_H
+#define MICROBIT_RADIO_SNIFFER_H
+
+#include "mbed.h"
+#include "MicroBitConfig.h"
+#include "MicroBitComponent.h"
+#include "MicroBitRadio.h"
+#include "MicroBitSerial.h"
+#include "MicroBitSerialFramer.h"
+#include "RingBuffer.h"
+
+// Capture record layout. Each record starts with a header, at these offsets, followed by the frame as sent over the air.
+#define MICROBIT_RADIO_SNIFFER_TIMESTAMP        0       // The low 32 bits of the local time at which the frame was received, in microseconds.
+#define MICROBIT_RADIO_SNIFFER_RSSI             4       // The signal strength of the frame, in dBm (signed).
+#define MICROBIT_RADIO_SNIFFER_FLAGS            5       // A combination of MICROBIT_RADIO_SNIFFER_FLAG_* values.
+#define MICROBIT_RADIO_SNIFFER_FREQUENCY        6       // The frequency band the frame was received on.
+#define MICROBIT_RADIO_SNIFFER_GROUP            7       // The group the frame was addressed to.
+#define MICROBIT_RADIO_SNIFFER_HEADER_SIZE      8
+#define MICROBIT_RADIO_SNIFFER_MAX_FRAME        (MICROBIT_RADIO_MAX_PACKET_SIZE + MICROBIT_RADIO_HEADER_SIZE)
+#define MICROBIT_RADIO_SNIFFER_MAX_RECORD       (MICROBIT_RADIO_SNIFFER_HEADER_SIZE + MICROBIT_RADIO_SNIFFER_MAX_FRAME)
+
+// Capture record flags
+#define MICROBIT_RADIO_SNIFFER_FLAG_CRC_OK      0x01    // The frame passed its CRC check. Otherwise, its contents (including its length) may be corrupt.
+
+// Sniffer configuration
+#define MICROBIT_RADIO_SNIFFER_BUFFER_SIZE      512     // The space for records awaiting transmission over serial, in bytes.
+
+// The serial tx buffer space needed to send the largest record: every byte (and the CRC) escaped, plus both frame delimiters.
+#define MICROBIT_RADIO_SNIFFER_TX_BUFFER_SIZE   (2 * (MICROBIT_RADIO_SNIFFER_MAX_RECORD + MICROBIT_SERIAL_FRAME_CRC_SIZE) + 2)
+
+/**
+  * Captures every frame received by the radio, including those that fail their CRC check, and streams them over serial.
+  *
+  * Frames are recorded in RADIO_IRQHandler, with their time of reception and signal strength, by a single copy into a
+  * ring buffer. They are sent from idleTick(), one record per frame, using the framing of MicroBitSerialFramer (SLIP,
+  * with a CRC-16-CCITT). A host tool need only decode each frame and write its record out as a pcap packet, unwrapping
+  * the 32 bit timestamp, for the capture to be inspected with standard tools (e.g. using a user DLT).
+  *
+  * Capture is passive; every frame received is still processed as normal. Only frames addressed to a group the radio
+  * is listening to can be heard, so MicroBitRadio::addGroup() should be used to widen the capture.
+  * Records are dropped if they are captured faster than they can be sent over serial.
+  *
+  * Each record is queued for transmission whole, so the serial tx buffer is grown to at least
+  * MICROBIT_RADIO_SNIFFER_TX_BUFFER_SIZE bytes when capture starts.
+  */
+class MicroBitRadioSniffer : MicroBitComponent
+{
+    MicroBitRadio               &radio;         // The radio whose frames are captured.
+    MicroBitSerialFramer        framer;         // Frames records for transmission over serial.
+    MicroBitSerial              &serial;        // The serial port records are streamed over.
+    RingBuffer<uint8_t>         records;        // Records awaiting transmission, each preceded by its length.
+    uint32_t                    captured;       // The number of frames captured.
+    uint32_t                    dropped;        // The number of frames not captured, due to lack of space.
+
+    public:
+
+    /**
+      * Constructor.
+      *
+      * Creates an instance of a MicroBitRadioSniffer, which captures frames received by the given radio.
+      *
+      * @param r The radio whose frames are captured.
+      *
+      * @param s The serial port to stream captured frames over.
+      *
+      * @code
+      * MicroBitRadioSniffer sniffer(uBit.radio, uBit.serial);
+      * @endcode
+      *
+      * @note No memory is allocated, and nothing is captured, until start() is called.
+      */
+    MicroBitRadioSniffer(MicroBitRadio &r, MicroBitSerial &s);
+
+    /**
+      * Destructor.
+      */
+    ~MicroBitRadioSniffer();
+
+    /**
+      * Begins capturing frames received by the radio, and streaming them over serial.
+      * The serial tx buffer is grown to hold MICROBIT_RADIO_SNIFFER_TX_BUFFER_SIZE bytes, if it is smaller.
+      *
+      * @return MICROBIT_OK on success, MICROBIT_NO_RESOURCES if a buffer could not be allocated,
+      *         MICROBIT_SERIAL_IN_USE if the serial tx buffer needs to grow but another fiber is transmitting, or
+      *         MICROBIT_NOT_SUPPORTED if another sniffer is attached to the radio.
+      */
+    int start();
+
+    /**
+      * Stops capturing frames, and discards any that have not yet been sent.
+      *
+      * @return MICROBIT_OK.
+      */
+    int stop();
+
+    /**
+      * @return the number of frames captured since start() was called.
+      */
+    int getCapturedFrames();
+
+    /**
+      * @return the number of frames not captured since start() was called, due to lack of space.
+      */
+    int getDroppedFrames();
+
+    /**
+      * Records a frame received by the radio.
+      *
+      * @param packet the frame, as received.
+      *
+      * @param group the group the frame was addressed to.
+      *
+      * @param valid true if the frame passed its CRC check.
+      *
+      * @note should only be called from RADIO_IRQHandler, whilst the frame is still in the receive buffer.
+      */
+    void frameCaptured(FrameBuffer *packet, uint8_t group, bool valid);
+
+    /**
+      * A background, low priority callback that is triggered whenever the processor is idle.
+      * Here, we send as many records over serial as there is space for.
+      */
+    virtual void idleTick();
+};
+
+#endif
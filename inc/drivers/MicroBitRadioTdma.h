@@ -0,0 +1,182 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 British Broadcasting Corporation.
+This software is provided by Lancaster University by arrangement with the BBC.
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef MICROBIT_RADIO_TDMA_H
+#define MICROBIT_RADIO_TDMA_H
+
+#include "mbed.h"
+#include "MicroBitConfig.h"
+#include "MicroBitComponent.h"
+#include "MicroBitRadio.h"
+
+// Slot management packet layout, as offsets into the payload.
+#define MICROBIT_RADIO_TDMA_TYPE                0       // MICROBIT_RADIO_TDMA_REQUEST or MICROBIT_RADIO_TDMA_ASSIGN.
+#define MICROBIT_RADIO_TDMA_NODE                1       // The serial number of the micro:bit requesting, or being assigned, a slot.
+#define MICROBIT_RADIO_TDMA_SLOT                5       // The slot assigned.
+#define MICROBIT_RADIO_TDMA_SIZE                6
+
+// Slot management packet types
+#define MICROBIT_RADIO_TDMA_REQUEST             1
+#define MICROBIT_RADIO_TDMA_ASSIGN              2
+
+// TDMA configuration
+#define MICROBIT_RADIO_TDMA_DEFAULT_SLOTS       16      // The number of slots in each frame, including the coordinator's.
+#define MICROBIT_RADIO_TDMA_MAX_SLOTS           64
+#define MICROBIT_RADIO_TDMA_DEFAULT_SLOT_LENGTH 30      // The length of each slot, in milliseconds.
+#define MICROBIT_RADIO_TDMA_MIN_SLOT_LENGTH     20      // Slots must span several system timer periods, as slot boundaries are only checked once per period.
+#define MICROBIT_RADIO_TDMA_MAX_SLOT_LENGTH     1000
+#define MICROBIT_RADIO_TDMA_GUARD               2       // Time left unused at the end of each slot, to absorb synchronisation error and the last packet sent, in milliseconds.
+#define MICROBIT_RADIO_TDMA_REQUEST_INTERVAL    500     // The minimum time between requests for a slot, in milliseconds. A random delay of up to the same again is added.
+
+// Status Flags
+#define MICROBIT_RADIO_TDMA_STATUS_COORDINATOR  0x02
+#define MICROBIT_RADIO_TDMA_STATUS_JOINED       0x04
+#define MICROBIT_RADIO_TDMA_STATUS_ASSIGNED     0x08
+#define MICROBIT_RADIO_TDMA_STATUS_OPEN         0x10
+
+/**
+  * Provides collision free transmission, by giving each micro:bit in a group its own time slot.
+  *
+  * Time is divided into frames of a fixed number of slots, using the network time provided by MicroBitRadio::timesync.
+  * One micro:bit is the coordinator; it is also the time reference, owns slot 0, and assigns the other slots on request.
+  * Other micro:bits join, and once synchronised, request a slot during slot 0. Thereafter, the transmit queue of the radio
+  * is only released during their own slot, so all packets sent (by any protocol) wait for it.
+  *
+  * Slot boundaries are checked by the system timer, so slots should be several timer periods long. All micro:bits in a
+  * group must use the same number and length of slots.
+  *
+  * @note TDMA cannot be combined with duty cycled listening (MicroBitRadio::setDutyCycle()), as a packet sent whilst
+  *       duty cycling is repeated for longer than a slot.
+  */
+class MicroBitRadioTdma : MicroBitComponent
+{
+    MicroBitRadio               &radio;         // The underlying radio module used to send and receive data.
+    uint32_t                    *assigned;      // When coordinating, the serial number of the micro:bit assigned each slot, or zero.
+    uint32_t                    requestDeadline;// The system time at which we next request a slot, in milliseconds.
+    uint16_t                    slotLength;     // The length of each slot, in milliseconds.
+    uint8_t                     slotCount;      // The number of slots in each frame.
+    uint8_t                     slot;           // Our slot, once assigned.
+
+    /**
+      * Registers for periodic callbacks, if this has not already been done.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if a system timer slot could not be allocated.
+      */
+    int init();
+
+    /**
+      * Determines if the given slot is open for transmission at the given network time.
+      *
+      * @param s the slot of interest.
+      *
+      * @param time the network time, in milliseconds.
+      *
+      * @return true if the slot has begun, and will not end before the next system timer period (plus a guard time).
+      */
+    bool isOpen(int s, uint64_t time);
+
+    /**
+      * Sends a slot management packet.
+      *
+      * @param type MICROBIT_RADIO_TDMA_REQUEST or MICROBIT_RADIO_TDMA_ASSIGN.
+      *
+      * @param node the serial number of the micro:bit requesting, or being assigned, a slot.
+      *
+      * @param s the slot assigned, if any.
+      *
+      * @return MICROBIT_OK on success, or an error code as described for MicroBitRadio::sendAsync().
+      */
+    int sendControl(uint8_t type, uint32_t node, uint8_t s);
+
+    public:
+
+    /**
+      * Constructor.
+      *
+      * Creates an instance of a MicroBitRadioTdma, which offers collision free transmission by time division.
+      *
+      * @param r The underlying radio module used to send and receive data.
+      *
+      * @note Transmission is unaffected until start() or join() is called.
+      */
+    MicroBitRadioTdma(MicroBitRadio &r);
+
+    /**
+      * Makes this micro:bit the TDMA coordinator (and time reference) for its group.
+      *
+      * @param slots the number of slots in each frame, in the range 2..MICROBIT_RADIO_TDMA_MAX_SLOTS.
+      *
+      * @param length the length of each slot in milliseconds, in the range
+      *        MICROBIT_RADIO_TDMA_MIN_SLOT_LENGTH..MICROBIT_RADIO_TDMA_MAX_SLOT_LENGTH.
+      *
+      * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if the parameters are out of range, or
+      *         MICROBIT_NO_RESOURCES if memory or a system timer slot could not be allocated.
+      */
+    int start(int slots = MICROBIT_RADIO_TDMA_DEFAULT_SLOTS, int length = MICROBIT_RADIO_TDMA_DEFAULT_SLOT_LENGTH);
+
+    /**
+      * Joins the TDMA schedule run by the coordinator of our group. A slot is requested once this micro:bit
+      * is synchronised, and a MICROBIT_RADIO_EVT_TDMA_SLOT event raised when it is assigned.
+      *
+      * @param slots the number of slots in each frame, as given to start() on the coordinator.
+      *
+      * @param length the length of each slot in milliseconds, as given to start() on the coordinator.
+      *
+      * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if the parameters are out of range, or
+      *         MICROBIT_NO_RESOURCES if a system timer slot could not be allocated.
+      *
+      * @note Until a slot is assigned, packets are only sent during the coordinator's slot, and not at all
+      *       until this micro:bit is synchronised.
+      */
+    int join(int slots = MICROBIT_RADIO_TDMA_DEFAULT_SLOTS, int length = MICROBIT_RADIO_TDMA_DEFAULT_SLOT_LENGTH);
+
+    /**
+      * Stops coordinating, or leaves the TDMA schedule, and returns to sending packets as soon as they are queued.
+      *
+      * @return MICROBIT_OK.
+      */
+    int stop();
+
+    /**
+      * Determines the slot in which this micro:bit transmits.
+      *
+      * @return the slot number, or MICROBIT_NO_DATA if no slot has been assigned.
+      */
+    int getSlot();
+
+    /**
+      * Protocol handler callback. This is called when the radio receives a slot management packet.
+      */
+    void packetReceived();
+
+    /**
+      * Periodic callback from MicroBit system timer.
+      *
+      * Releases the transmit queue of the radio at the start of our slot, and holds it again at the end.
+      */
+    virtual void systemTick();
+};
+
+#endif
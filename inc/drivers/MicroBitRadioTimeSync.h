@@ -0,0 +1,230 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 British Broadcasting Corporation.
+This software is provided by Lancaster University by arrangement with the BBC.
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef MICROBIT_RADIO_TIME_SYNC_H
+#define MICROBIT_RADIO_TIME_SYNC_H
+
+#include "mbed.h"
+#include "MicroBitConfig.h"
+#include "MicroBitComponent.h"
+#include "MicroBitRadio.h"
+
+// Beacon layout, as offsets into the payload.
+#define MICROBIT_RADIO_TIMESYNC_ROOT            0       // The serial number of the reference micro:bit.
+#define MICROBIT_RADIO_TIMESYNC_SEQUENCE        4       // The sequence number assigned to the beacon by the reference (16 bit).
+#define MICROBIT_RADIO_TIMESYNC_HOPS            6       // The number of hops between the sender and the reference.
+#define MICROBIT_RADIO_TIMESYNC_TIME            7       // The network time at which the beacon was sent, in microseconds (64 bit).
+#define MICROBIT_RADIO_TIMESYNC_SIZE            15
+
+// Time synchronisation configuration
+#define MICROBIT_RADIO_TIMESYNC_PERIOD          1000    // The time between beacons sent by the reference, in milliseconds.
+#define MICROBIT_RADIO_TIMESYNC_JITTER          40      // The maximum random delay before a beacon is rebroadcast, in milliseconds.
+#define MICROBIT_RADIO_TIMESYNC_MAX_HOPS        4       // Beacons are not rebroadcast beyond this many hops from the reference.
+#define MICROBIT_RADIO_TIMESYNC_SAMPLES         8       // The number of recent beacons used to estimate offset and drift.
+#define MICROBIT_RADIO_TIMESYNC_MIN_SAMPLES     3       // The number of beacons needed before the network time is considered valid.
+#define MICROBIT_RADIO_TIMESYNC_TIMEOUT         5       // Synchronisation is lost if no beacon is heard for this many periods.
+#define MICROBIT_RADIO_TIMESYNC_DELAY_US        220     // The time from a beacon being stamped by its sender to it being stamped by a receiver; mostly its time on air at 1Mbit/s.
+#define MICROBIT_RADIO_TIMESYNC_DRIFT_PPM       5       // Allowance for error in the estimated drift, used to widen the error bound as time passes since the last beacon.
+#define MICROBIT_RADIO_TIMESYNC_RESOLUTION_US   2       // Allowance for timestamp quantisation, included in the error bound.
+
+// Status Flags
+#define MICROBIT_RADIO_TIMESYNC_STATUS_REFERENCE    0x02
+#define MICROBIT_RADIO_TIMESYNC_STATUS_SYNCHRONISED 0x04
+#define MICROBIT_RADIO_TIMESYNC_STATUS_FORWARD      0x08
+
+/**
+  * A single observation of the offset between network time and our local time.
+  */
+struct TimeSyncSample
+{
+    uint64_t        local;      // The local time at which the beacon was received, in microseconds.
+    int64_t         offset;     // The network time minus the local time at that point, in microseconds.
+};
+
+/**
+  * Provides a network wide time base, shared by all micro:bits in a group.
+  *
+  * One micro:bit is made the reference, and periodically broadcasts a beacon carrying its own time. Beacons are
+  * timestamped by the radio interrupt handler as they are sent and received, so their delivery is subject only to
+  * a constant delay, which is compensated for. Each receiver keeps a table of recent (local time, offset) samples,
+  * and fits a line through them to estimate both the offset and the relative drift of its clock.
+  *
+  * Once synchronised, receivers rebroadcast each new beacon, stamped with their own estimate of network time, so that
+  * micro:bits several hops from the reference are synchronised too. This is a simplified form of the Flooding Time
+  * Synchronisation Protocol (FTSP).
+  *
+  * @note This API does not contain any form of encryption, authentication or authorisation. Its purpose is solely for use as a
+  * teaching aid to demonstrate how simple communications operates, and to provide a sandpit through which learning can take place.
+  * For serious applications, BLE should be considered a substantially more secure alternative.
+  */
+class MicroBitRadioTimeSync : MicroBitComponent
+{
+    MicroBitRadio               &radio;         // The underlying radio module used to send and receive data.
+    uint32_t                    root;           // The serial number of the reference we are synchronised to.
+    uint16_t                    sequence;       // The sequence number of the last beacon sent or accepted.
+    uint8_t                     hops;           // The number of hops between this micro:bit and the reference.
+    uint8_t                     sampleCount;    // The number of valid entries in samples.
+    uint8_t                     sampleIndex;    // The next entry in samples to be replaced.
+    TimeSyncSample              samples[MICROBIT_RADIO_TIMESYNC_SAMPLES];
+    uint64_t                    localAverage;   // The mean local time of the samples.
+    int64_t                     offsetAverage;  // The mean offset of the samples.
+    float                       skew;           // The estimated drift of network time relative to local time.
+    uint32_t                    residual;       // The largest difference between a sample and the fitted line, in microseconds.
+    uint32_t                    lastBeacon;     // The system time at which the last beacon was accepted, in milliseconds.
+    uint32_t                    txDeadline;     // The system time at which the next beacon is due to be sent, in milliseconds.
+    volatile int64_t            txOffset;       // The offset added to local time when stamping outgoing beacons.
+
+    /**
+      * Registers for periodic callbacks, if this has not already been done.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if a system timer slot could not be allocated.
+      */
+    int init();
+
+    /**
+      * Discards all samples, and marks this micro:bit as unsynchronised.
+      */
+    void reset();
+
+    /**
+      * Adds a sample to the table, and refits the estimate of offset and drift.
+      *
+      * @param local the local time at which the beacon was received, in microseconds.
+      *
+      * @param offset the network time minus the local time at that point, in microseconds.
+      */
+    void addSample(uint64_t local, int64_t offset);
+
+    /**
+      * Estimates the offset between network time and local time.
+      *
+      * @param local the local time of interest, in microseconds.
+      *
+      * @return the network time minus the local time, in microseconds.
+      */
+    int64_t estimateOffset(uint64_t local);
+
+    /**
+      * Queues a beacon for transmission. It is stamped with the network time just before it is sent.
+      */
+    void sendBeacon();
+
+    public:
+
+    static MicroBitRadioTimeSync *instance;     // The time base used by network_time_us(), once created by MicroBitRadio::timesync().
+
+    /**
+      * Constructor.
+      *
+      * Creates an instance of a MicroBitRadioTimeSync, which estimates a time base shared by all micro:bits in a group.
+      *
+      * @param r The underlying radio module used to send and receive data.
+      *
+      * @note No beacons are sent until setReference() is called, and none are rebroadcast until one is received.
+      */
+    MicroBitRadioTimeSync(MicroBitRadio &r);
+
+    /**
+      * Makes this micro:bit the reference for network time, or stops it being one.
+      *
+      * The reference broadcasts a beacon every MICROBIT_RADIO_TIMESYNC_PERIOD milliseconds, and its local time is
+      * the network time. Only one micro:bit in a group should be the reference.
+      *
+      * @param reference true to become the reference, false to stop.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if a system timer slot could not be allocated.
+      */
+    int setReference(bool reference);
+
+    /**
+      * Determines if this micro:bit is the reference for network time.
+      *
+      * @return true if this micro:bit is the reference, false otherwise.
+      */
+    bool isReference();
+
+    /**
+      * Determines if this micro:bit has a valid estimate of network time.
+      *
+      * @return true if this micro:bit is the reference, or has heard enough recent beacons, false otherwise.
+      */
+    bool isSynchronised();
+
+    /**
+      * Determines the current network time.
+      *
+      * @return the network time in microseconds, or the local time (as given by system_timer_current_time_us())
+      *         if this micro:bit is not synchronised.
+      */
+    uint64_t getTime();
+
+    /**
+      * Determines how far the network time given by getTime() may be from that of the reference.
+      *
+      * The bound combines the disagreement between recent beacons and the estimated drift, a further allowance
+      * for drift since the last beacon, and the resolution of the timestamps at each hop from the reference.
+      *
+      * @return the error bound in microseconds, zero if this micro:bit is the reference, or MICROBIT_NO_DATA if it
+      *         is not synchronised.
+      */
+    int getErrorBound();
+
+    /**
+      * Stamps a beacon with the current network time, just before the RADIO hardware sends it.
+      *
+      * @param frame the beacon, in the transmit queue.
+      *
+      * @note should only be called from RADIO_IRQHandler...
+      */
+    void transmitStarting(FrameBuffer *frame);
+
+    /**
+      * Protocol handler callback. This is called when the radio receives a time synchronisation beacon.
+      */
+    void packetReceived();
+
+    /**
+      * Periodic callback from MicroBit system timer.
+      *
+      * Sends the beacons due from the reference, and rebroadcasts those received once their random delay has expired.
+      */
+    virtual void systemTick();
+};
+
+/**
+  * Determines the current network time, as estimated by MicroBitRadio::timesync.
+  *
+  * @return the network time in microseconds, or the local time if the radio has not been synchronised.
+  */
+uint64_t network_time_us();
+
+/**
+  * Determines how far the network time given by network_time_us() may be from that of the reference.
+  *
+  * @return the error bound in microseconds, or MICROBIT_NO_DATA if the radio has not been synchronised.
+  */
+int network_time_error_us();
+
+#endif
@@ -28,6 +28,9 @@ DEALINGS IN THE SOFTWARE.
 
 #include "mbed.h"
 #include "ManagedString.h"
+#include "RingBuffer.h"
+
+class MicroBitSerialFramer;
 
 #define MICROBIT_SERIAL_DEFAULT_BAUD_RATE   115200
 #define MICROBIT_SERIAL_DEFAULT_BUFFER_SIZE 20
@@ -35,11 +38,16 @@ DEALINGS IN THE SOFTWARE.
 #define MICROBIT_SERIAL_EVT_DELIM_MATCH     1
 #define MICROBIT_SERIAL_EVT_HEAD_MATCH      2
 #define MICROBIT_SERIAL_EVT_RX_FULL         3
+#define MICROBIT_SERIAL_EVT_FRAME_READY     4
 
 #define MICROBIT_SERIAL_RX_IN_USE           1
 #define MICROBIT_SERIAL_TX_IN_USE           2
 #define MICROBIT_SERIAL_RX_BUFF_INIT        4
 #define MICROBIT_SERIAL_TX_BUFF_INIT        8
+#define MICROBIT_SERIAL_RX_VIEW             16
+
+// The number of words in a delimeter lookup table (one bit for each possible byte value).
+#define MICROBIT_SERIAL_DELIMETER_MAP_SIZE  8
 
 
 enum MicroBitSerialMode
@@ -49,6 +57,92 @@ enum MicroBitSerialMode
 	SYNC_SLEEP
 };
 
+/**
+  * A read only view of bytes held in the receive buffer of a MicroBitSerial instance,
+  * as returned by MicroBitSerial::peek() and MicroBitSerial::peekUntil().
+  *
+  * As the buffer is circular, the bytes may be split into two contiguous segments. The
+  * second segment is only used when the bytes wrap around the end of the buffer.
+  */
+struct MicroBitSerialView
+{
+    uint8_t *first;
+    int firstLength;
+    uint8_t *second;
+    int secondLength;
+
+    /**
+      * @return the total number of bytes in the view.
+      */
+    int length()
+    {
+        return firstLength + secondLength;
+    }
+
+    /**
+      * @return the byte at the given position in the view.
+      *
+      * @note the caller must ensure index is less than length().
+      */
+    uint8_t operator[] (int index)
+    {
+        return index < firstLength ? first[index] : second[index - firstLength];
+    }
+
+    /**
+      * Copies up to len bytes from the start of the view into a user buffer.
+      *
+      * @return the number of bytes copied.
+      */
+    int copy(uint8_t *buffer, int len)
+    {
+        int n = min(len, firstLength);
+
+        memcpy(buffer, first, n);
+
+        if(len > n)
+        {
+            int m = min(len - n, secondLength);
+
+            memcpy(buffer + n, second, m);
+            n += m;
+        }
+
+        return n;
+    }
+};
+
+/**
+  * Counters describing the traffic handled by a serial port, as returned by
+  * MicroBitSerial::getStatistics() and MicroBitUARTService::getStatistics().
+  *
+  * All times are in microseconds.
+  */
+struct MicroBitSerialStatistics
+{
+    //the number of characters stored in the rx buffer (or passed to a framing layer).
+    uint32_t bytesReceived;
+
+    //the number of characters transmitted.
+    uint32_t bytesSent;
+
+    //the number of characters discarded because the rx buffer was full. An RX_FULL event is raised for each.
+    uint32_t rxDropped;
+
+    //the number of characters lost by the UART hardware before they could be read.
+    uint32_t rxOverruns;
+
+    //the total, and longest single, time spent handling received and transmitted characters.
+    uint32_t interruptTime;
+    uint32_t interruptTimeMax;
+
+    //the total time spent spinning in SYNC_SPINWAIT calls.
+    uint32_t spinWaitTime;
+
+    //the longest time taken for a transmission to be acknowledged (MicroBitUARTService only).
+    uint32_t txLatencyMax;
+};
+
 /**
   * Class definition for MicroBitSerial.
   *
@@ -63,22 +157,41 @@ class MicroBitSerial : public RawSerial
     //holds the state of the baudrate for all MicroBitSerial instances.
     static int baudrate;
 
-    //delimeters used for matching on receive.
-    ManagedString delimeters;
+    //delimeters used for matching on receive, as a bitmap indexed by character.
+    uint32_t delimeterMap[MICROBIT_SERIAL_DELIMETER_MAP_SIZE];
+
+    //the position up to which the last unsuccessful readUntil() scanned, or -1 if there is none,
+    //and the delimeters it was looking for.
+    int rxBuffScanIndex;
+    ManagedString rxBuffScanDelimeters;
 
     //a variable used when a user calls the eventAfter() method.
     int rxBuffHeadMatch;
 
-    uint8_t *rxBuff;
-    uint8_t rxBuffSize;
-    volatile uint16_t rxBuffHead;
-    uint16_t rxBuffTail;
+    //the requested sizes of our buffers, applied when they are next allocated.
+    uint16_t rxBuffSize;
+    uint16_t txBuffSize;
+
+    RingBuffer<uint8_t> rxBuff;
+    RingBuffer<uint8_t> txBuff;
+
+    //a framing layer that takes all received data in place of rxBuff, if attached.
+    MicroBitSerialFramer *framer;
+
+    //the pins used for hardware flow control, or NULL if flow control is not in use.
+    DigitalOut *rtsPin;
+    InterruptIn *ctsPin;
 
+    //the requested rx buffer water marks for flow control (zero selects the default),
+    //and the levels in effect for the current rx buffer.
+    uint16_t rxHighWater;
+    uint16_t rxLowWater;
+    int rxHighWaterMark;
+    int rxLowWaterMark;
 
-    uint8_t *txBuff;
-    uint8_t txBuffSize;
-    uint16_t txBuffHead;
-    volatile uint16_t txBuffTail;
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+    MicroBitSerialStatistics statistics;
+#endif
 
     /**
       * An internal interrupt callback for MicroBitSerial configured for when a
@@ -96,6 +209,38 @@ class MicroBitSerial : public RawSerial
       */
     void dataWritten();
 
+    /**
+      * An internal interrupt callback for MicroBitSerial, configured when the CTS input
+      * is asserted. Resumes any transmission paused whilst CTS was deasserted.
+      */
+    void ctsAsserted();
+
+    /**
+      * Calculates the rx buffer levels at which flow control pauses and resumes the sender,
+      * for the current rx buffer.
+      */
+    void updateWaterMarks();
+
+    /**
+      * Reasserts RTS to resume the sender, if flow control is in use and the rx buffer
+      * has drained to its low water mark. Called whenever characters are removed from rxBuff.
+      */
+    void rxBufferDrained();
+
+    /**
+      * Records the time spent handling an interrupt, if statistics are enabled.
+      *
+      * @param start the time at which handling began, as returned by us_ticker_read().
+      */
+    void interruptComplete(uint32_t start);
+
+    /**
+      * Records the time spent spinning in a SYNC_SPINWAIT call, if statistics are enabled.
+      *
+      * @param start the time at which spinning began, as returned by us_ticker_read().
+      */
+    void spinWaitComplete(uint32_t start);
+
     /**
       * An internal method to configure an interrupt on tx buffer and also
       * a best effort copy operation to move bytes from a user buffer to our txBuff
@@ -178,22 +323,29 @@ class MicroBitSerial : public RawSerial
     int getChar(MicroBitSerialMode mode);
 
     /**
-      * An internal method that copies values from a circular buffer to a linear buffer.
+      * Waits until the rxBuff holds at least the given number of characters.
       *
-      * @param circularBuff a pointer to the source circular buffer
+      * @param len the number of characters wanted. This is limited to the capacity of the rxBuff.
       *
-      * @param circularBuffSize the size of the circular buffer
+      * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. ASYNC returns
+      *        immediately, SYNC_SPINWAIT spins (locks up the processor) and SYNC_SLEEP puts the
+      *        calling fiber to sleep until the characters have been received.
+      */
+    void waitForData(int len, MicroBitSerialMode mode);
+
+    /**
+      * Searches the rxBuff for a character that matches one of the delimeters.
       *
-      * @param linearBuff a pointer to the destination linear buffer
+      * @param delimeters a ManagedString containing a sequence of delimeter characters.
       *
-      * @param tailPosition the tail position in the circular buffer you want to copy from
+      * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP, which
+      *        determines how to wait for a match if none is buffered. See readUntil().
       *
-      * @param headPosition the head position in the circular buffer you want to copy to
+      * @return the index in the rxBuff of the matching character, or -1 if no match was found.
       *
-      * @note this method assumes that the linear buffer has the appropriate amount of
-      *       memory to contain the copy operation
+      * @note the caller must hold the lock for reception.
       */
-    void circularCopy(uint8_t *circularBuff, uint8_t circularBuffSize, uint8_t *linearBuff, uint16_t tailPosition, uint16_t headPosition);
+    int findDelimeter(ManagedString delimeters, MicroBitSerialMode mode);
 
     public:
 
@@ -217,8 +369,11 @@ class MicroBitSerial : public RawSerial
       *       -https://github.com/mbedmicro/mbed/blob/master/libraries/mbed/api/RawSerial.h
       *
       *       Buffers aren't allocated until the first send or receive respectively.
+      *
+      *       Buffers are rounded up to a power of two in size, so at least the number
+      *       of bytes requested can be held.
       */
-    MicroBitSerial(PinName tx, PinName rx, uint8_t rxBufferSize = MICROBIT_SERIAL_DEFAULT_BUFFER_SIZE, uint8_t txBufferSize = MICROBIT_SERIAL_DEFAULT_BUFFER_SIZE);
+    MicroBitSerial(PinName tx, PinName rx, uint16_t rxBufferSize = MICROBIT_SERIAL_DEFAULT_BUFFER_SIZE, uint16_t txBufferSize = MICROBIT_SERIAL_DEFAULT_BUFFER_SIZE);
 
     /**
       * Sends a single character over the serial line.
@@ -410,6 +565,85 @@ class MicroBitSerial : public RawSerial
       */
     ManagedString readUntil(ManagedString delimeters, MicroBitSerialMode mode = MICROBIT_DEFAULT_SERIAL_MODE);
 
+    /**
+      * Provides direct access to characters in the rxBuff, without copying or removing them.
+      *
+      * @param view set to describe the characters available. As the rxBuff is circular, these
+      *        may be split into two segments.
+      *
+      * @param size the number of characters wanted. This is limited to the capacity of the rxBuff.
+      *
+      * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. Each mode
+      *        gives a different behaviour:
+      *
+      *            ASYNC - The view covers however many characters are available, up to size.
+      *
+      *            SYNC_SPINWAIT - If the desired number of characters are not available, this method
+      *                            will spin (lock up the processor) until they have been received.
+      *
+      *            SYNC_SLEEP - If the desired number of characters are not available, the calling
+      *                         fiber sleeps until they have been received.
+      *
+      *         Defaults to SYNC_SLEEP.
+      *
+      * @return the number of characters in the view, MICROBIT_NO_DATA if there are no characters
+      *         available and the mode given is ASYNC, MICROBIT_INVALID_PARAMETER if size is not positive,
+      *         MICROBIT_SERIAL_IN_USE if another fiber is using the instance for reception, or
+      *         MICROBIT_NO_RESOURCES if buffer allocation did not complete successfully.
+      *
+      * @note When a view is returned, this instance remains locked for reception until consume() is
+      *       called, which also releases the characters in the view.
+      */
+    int peek(MicroBitSerialView &view, int size, MicroBitSerialMode mode = MICROBIT_DEFAULT_SERIAL_MODE);
+
+    /**
+      * Provides direct access to the characters in the rxBuff up to and including the first
+      * that matches one of the delimeters, without copying or removing them.
+      *
+      * @param delimeters a ManagedString containing a sequence of delimeter characters e.g. ManagedString("\r\n")
+      *
+      * @param view set to describe the characters up to and including the delimeter. As the rxBuff
+      *        is circular, these may be split into two segments.
+      *
+      * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. Each mode
+      *        gives a different behaviour:
+      *
+      *            ASYNC - If none of the delimeters matches a character already in the rxBuff,
+      *                    MICROBIT_NO_DATA is returned.
+      *
+      *            SYNC_SPINWAIT - If none of the delimeters matches a character already in the rxBuff,
+      *                            this method will spin (lock up the processor) until a received
+      *                            character matches one of the delimeters.
+      *
+      *            SYNC_SLEEP - If none of the delimeters matches a character already in the rxBuff,
+      *                         the calling fiber sleeps until a character matching one of the
+      *                         delimeters is seen.
+      *
+      *         Defaults to SYNC_SLEEP.
+      *
+      * @return the number of characters in the view, including the delimeter, MICROBIT_NO_DATA if no
+      *         delimeter was found, MICROBIT_SERIAL_IN_USE if another fiber is using the instance for
+      *         reception, or MICROBIT_NO_RESOURCES if buffer allocation did not complete successfully.
+      *
+      * @note When a view is returned, this instance remains locked for reception until consume() is
+      *       called, which also releases the characters in the view. consume(view.length()) discards
+      *       the delimeter along with the characters before it.
+      */
+    int peekUntil(ManagedString delimeters, MicroBitSerialView &view, MicroBitSerialMode mode = MICROBIT_DEFAULT_SERIAL_MODE);
+
+    /**
+      * Removes characters from the start of the view returned by the last call to peek() or
+      * peekUntil(), and releases the lock for reception held since that call. The view is no
+      * longer valid once this method has been called.
+      *
+      * @param len the number of characters to remove. Zero releases the lock without removing
+      *        any characters.
+      *
+      * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if there is no view outstanding
+      *         or len is greater than the number of characters buffered.
+      */
+    int consume(int len);
+
     /**
       * A wrapper around the inherited method "baud" so we can trap the baud rate
       * as it changes and restore it if redirect() is called.
@@ -502,22 +736,26 @@ class MicroBitSerial : public RawSerial
     /**
       * Reconfigures the size of our rxBuff
       *
-      * @param size the new size for our rxBuff
+      * @param size the new size for our rxBuff. This is rounded up to a power of two, so
+      *        at least size bytes can be held. Must be no greater than MICROBIT_RING_BUFFER_MAXIMUM_SIZE.
       *
       * @return MICROBIT_SERIAL_IN_USE if another fiber is currently using this instance
-      *         for reception, otherwise MICROBIT_OK.
+      *         for reception, MICROBIT_INVALID_PARAMETER if size is out of range,
+      *         otherwise MICROBIT_OK.
       */
-    int setRxBufferSize(uint8_t size);
+    int setRxBufferSize(uint16_t size);
 
     /**
       * Reconfigures the size of our txBuff
       *
-      * @param size the new size for our txBuff
+      * @param size the new size for our txBuff. This is rounded up to a power of two, so
+      *        at least size bytes can be held. Must be no greater than MICROBIT_RING_BUFFER_MAXIMUM_SIZE.
       *
       * @return MICROBIT_SERIAL_IN_USE if another fiber is currently using this instance
-      *         for transmission, otherwise MICROBIT_OK.
+      *         for transmission, MICROBIT_INVALID_PARAMETER if size is out of range,
+      *         otherwise MICROBIT_OK.
       */
-    int setTxBufferSize(uint8_t size);
+    int setTxBufferSize(uint16_t size);
 
     /**
       * The size of our rx buffer in bytes.
@@ -585,6 +823,57 @@ class MicroBitSerial : public RawSerial
       */
     int txInUse();
 
+    /**
+      * Configures hardware flow control. RTS is deasserted to pause the sender when the rx buffer
+      * fills to its high water mark, and reasserted once it has drained to its low water mark.
+      * Transmission is paused whilst the other device deasserts CTS. Both signals are active low.
+      *
+      * @param rts the pin used to signal that we are ready to receive, or NC if not used.
+      *
+      * @param cts the pin on which the other device signals that it is ready to receive, or NC if not used.
+      *
+      * @param highWater the number of buffered characters at which RTS is deasserted. Zero selects
+      *        MICROBIT_SERIAL_FLOW_HIGH_WATER percent of the capacity of the rx buffer.
+      *
+      * @param lowWater the number of buffered characters at or below which RTS is reasserted. Zero selects
+      *        MICROBIT_SERIAL_FLOW_LOW_WATER percent of the capacity of the rx buffer.
+      *
+      * @return MICROBIT_SERIAL_IN_USE if another fiber is currently using this instance, MICROBIT_INVALID_PARAMETER
+      *         if lowWater is not less than highWater, otherwise MICROBIT_OK.
+      *
+      * @note Passing NC for both pins disables flow control. Whilst RTS is in use, blocking reads wait for
+      *       no more characters than the high water mark, so a readUntil() with no delimeter below the
+      *       high water mark cannot complete.
+      */
+    int setFlowControl(PinName rts, PinName cts, uint16_t highWater = 0, uint16_t lowWater = 0);
+
+    /**
+      * Retrieves the traffic and timing statistics gathered by this instance.
+      *
+      * @param statistics the structure to fill.
+      *
+      * @return MICROBIT_OK, or MICROBIT_NOT_SUPPORTED if MICROBIT_SERIAL_STATISTICS is not enabled.
+      */
+    int getStatistics(MicroBitSerialStatistics &statistics);
+
+    /**
+      * Resets all of the statistics gathered by this instance to zero.
+      *
+      * @return MICROBIT_OK, or MICROBIT_NOT_SUPPORTED if MICROBIT_SERIAL_STATISTICS is not enabled.
+      */
+    int resetStatistics();
+
+    /**
+      * Attaches a framing layer to this serial instance. Whilst attached, the framing layer is passed
+      * every received byte in place of the rx buffer, and holds this instance's lock for reception.
+      *
+      * @param framer the framing layer to attach, or NULL to detach the current one.
+      *
+      * @return MICROBIT_SERIAL_IN_USE if another fiber is currently using this instance
+      *         for reception, otherwise MICROBIT_OK.
+      */
+    int setFramer(MicroBitSerialFramer *framer);
+
     /**
       * Detaches a previously configured interrupt
       *
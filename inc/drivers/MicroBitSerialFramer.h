@@ -0,0 +1,220 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 British Broadcasting Corporation.
+This software is provided by Lancaster University by arrangement with the BBC.
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef MICROBIT_SERIAL_FRAMER_H
+#define MICROBIT_SERIAL_FRAMER_H
+
+#include "mbed.h"
+#include "MicroBitConfig.h"
+#include "MicroBitSerial.h"
+#include "PacketBuffer.h"
+#include "RingBuffer.h"
+
+// SLIP (RFC 1055) control characters.
+#define MICROBIT_SERIAL_FRAME_END               0xC0
+#define MICROBIT_SERIAL_FRAME_ESC               0xDB
+#define MICROBIT_SERIAL_FRAME_ESC_END           0xDC
+#define MICROBIT_SERIAL_FRAME_ESC_ESC           0xDD
+
+// Size of the CRC appended to each frame, in bytes.
+#define MICROBIT_SERIAL_FRAME_CRC_SIZE          2
+
+// Receiver status flags
+#define MICROBIT_SERIAL_FRAME_STATUS_ESCAPED    0x01
+#define MICROBIT_SERIAL_FRAME_STATUS_DROPPING   0x02
+#define MICROBIT_SERIAL_FRAME_STATUS_ERROR      0x04
+
+/**
+  * A single received frame, as stored in the receive pool.
+  */
+struct SerialFrame
+{
+    uint16_t        length;                                                                 // The length of the payload, excluding the CRC.
+    uint8_t         data[MICROBIT_SERIAL_FRAME_MAX_SIZE + MICROBIT_SERIAL_FRAME_CRC_SIZE];  // The payload, followed by its CRC whilst being received.
+};
+
+/**
+  * Class definition for MicroBitSerialFramer.
+  *
+  * Provides a simple, reliable framing layer over a MicroBitSerial instance, so that applications can exchange
+  * whole binary messages rather than streams of bytes.
+  *
+  * Each frame is SLIP encoded (RFC 1055), and carries a CRC-16-CCITT checksum of its payload. Incoming data is decoded
+  * a byte at a time in the serial receive interrupt, directly into a pool of preallocated frame buffers. Frames that fail
+  * their CRC check are silently discarded, and a single MICROBIT_SERIAL_EVT_FRAME_READY event is raised for each valid frame,
+  * so no fiber is woken until a complete frame is available.
+  */
+class MicroBitSerialFramer
+{
+    MicroBitSerial          &serial;        // The serial port we send and receive frames over.
+    SerialFrame             *pool;          // Preallocated storage for received frames.
+    RingBuffer<uint8_t>     freeFrames;     // Indexes of pool entries available for reception.
+    RingBuffer<uint8_t>     readyFrames;    // Indexes of pool entries holding complete frames, oldest first.
+    SerialFrame             *rxFrame;       // The frame currently being received, if any.
+    uint16_t                rxLength;       // The number of bytes received into rxFrame.
+    uint16_t                rxCrc;          // The running CRC of the bytes received into rxFrame.
+    uint8_t                 rxStatus;       // Decoder state flags.
+    uint32_t                crcErrors;      // The number of frames discarded due to a CRC (or encoding) error.
+    uint32_t                droppedFrames;  // The number of frames discarded due to lack of space.
+
+    /**
+      * Takes a buffer from the free pool for the next incoming frame, and resets the decoder.
+      */
+    void nextFrame();
+
+    /**
+      * Frees the receive pool, and any frames held in it.
+      */
+    void freePool();
+
+    public:
+
+    /**
+      * Constructor.
+      * Create an instance of MicroBitSerialFramer.
+      *
+      * @param serial the serial port to send and receive frames over.
+      *
+      * @code
+      * MicroBitSerialFramer framer(uBit.serial);
+      * @endcode
+      *
+      * @note No memory is allocated, and received data is not intercepted, until enable() is called.
+      */
+    MicroBitSerialFramer(MicroBitSerial &serial);
+
+    /**
+      * Destructor.
+      */
+    ~MicroBitSerialFramer();
+
+    /**
+      * Allocates the receive pool, and attaches this framing layer to the serial port.
+      * From this point on, all data received by the serial port is decoded as frames, and is no
+      * longer available through the MicroBitSerial read methods.
+      *
+      * @param poolSize the number of frames that can be held awaiting collection by the application.
+      *
+      * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if poolSize is out of range,
+      *         MICROBIT_NO_RESOURCES if the pool could not be allocated, or MICROBIT_SERIAL_IN_USE if
+      *         the serial port is in use by another fiber for reception.
+      */
+    int enable(int poolSize = MICROBIT_SERIAL_FRAME_POOL_SIZE);
+
+    /**
+      * Detaches this framing layer from the serial port, and frees the receive pool.
+      * Any frames awaiting collection are discarded.
+      *
+      * @return MICROBIT_OK.
+      */
+    int disable();
+
+    /**
+      * Sends a frame over the serial port.
+      *
+      * @param buffer the payload of the frame.
+      *
+      * @param len the length of the payload, in the range 1..MICROBIT_SERIAL_FRAME_MAX_SIZE.
+      *
+      * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. See MicroBitSerial::send().
+      *
+      * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if the buffer is invalid, MICROBIT_SERIAL_IN_USE
+      *         if another fiber is using the serial port for transmission, or MICROBIT_NO_RESOURCES if, in ASYNC mode,
+      *         the frame did not fit in the serial tx buffer.
+      *
+      * @note A frame that is only partially queued in ASYNC mode will be discarded by the receiver.
+      */
+    int send(uint8_t *buffer, int len, MicroBitSerialMode mode = MICROBIT_DEFAULT_SERIAL_MODE);
+
+    /**
+      * Sends a frame over the serial port.
+      *
+      * @param data the payload of the frame.
+      *
+      * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. See MicroBitSerial::send().
+      *
+      * @return MICROBIT_OK on success, or an error code as described for send(uint8_t *, int, MicroBitSerialMode).
+      */
+    int send(PacketBuffer data, MicroBitSerialMode mode = MICROBIT_DEFAULT_SERIAL_MODE);
+
+    /**
+      * Retrieves the payload of the oldest received frame into the given buffer.
+      *
+      * @param buf a pointer to a valid memory location where the payload is to be stored.
+      *
+      * @param len the maximum amount of data that can safely be stored in buf. Any remaining
+      *        payload is discarded.
+      *
+      * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. Each mode
+      *        gives a different behaviour:
+      *
+      *            ASYNC - If no frame is available, MICROBIT_NO_DATA is returned immediately.
+      *
+      *            SYNC_SPINWAIT - If no frame is available, this method will spin
+      *                            (lock up the processor) until a frame is received.
+      *
+      *            SYNC_SLEEP - If no frame is available, the calling fiber sleeps
+      *                         until a frame is received.
+      *
+      * @return The length of the data stored, MICROBIT_INVALID_PARAMETER if the buffer is invalid,
+      *         MICROBIT_NOT_SUPPORTED if the framer is not enabled, or MICROBIT_NO_DATA.
+      */
+    int recv(uint8_t *buf, int len, MicroBitSerialMode mode = MICROBIT_DEFAULT_SERIAL_MODE);
+
+    /**
+      * Retrieves the payload of the oldest received frame.
+      *
+      * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. See recv(uint8_t *, int, MicroBitSerialMode).
+      *
+      * @return the payload received, or an empty PacketBuffer if no frame is available.
+      */
+    PacketBuffer recv(MicroBitSerialMode mode = MICROBIT_DEFAULT_SERIAL_MODE);
+
+    /**
+      * Determines the number of complete frames awaiting collection.
+      *
+      * @return The number of frames ready to be read.
+      */
+    int dataReady();
+
+    /**
+      * @return the number of received frames discarded because they failed their CRC check, or were badly encoded.
+      */
+    int getCrcErrors();
+
+    /**
+      * @return the number of received frames discarded because they were too long, or no buffer was available to store them.
+      */
+    int getDroppedFrames();
+
+    /**
+      * Decodes a single received byte. Called by MicroBitSerial in interrupt context.
+      *
+      * @param c the byte received.
+      */
+    void dataReceived(uint8_t c);
+};
+
+#endif
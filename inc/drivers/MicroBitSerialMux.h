@@ -0,0 +1,268 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 British Broadcasting Corporation.
+This software is provided by Lancaster University by arrangement with the BBC.
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef MICROBIT_SERIAL_MUX_H
+#define MICROBIT_SERIAL_MUX_H
+
+#include "mbed.h"
+#include "MicroBitConfig.h"
+#include "MicroBitSerialFramer.h"
+#include "MicroBitEvent.h"
+#include "ManagedString.h"
+#include "RingBuffer.h"
+
+// Event raised on MICROBIT_ID_SERIAL_MUX each time a frame is taken from a channel's tx buffer.
+// Data received on a channel raises an event with the channel's id as its value.
+#define MICROBIT_SERIAL_MUX_EVT_TX_SPACE        0xFFFF
+
+// Channel status flags
+#define MICROBIT_SERIAL_MUX_CHANNEL_TX_IN_USE   0x01
+
+// MicroBitSerialMux status flags
+#define MICROBIT_SERIAL_MUX_TRANSMITTING        0x01
+#define MICROBIT_SERIAL_MUX_LISTENING           0x02
+
+/**
+  * The state of a single virtual channel.
+  */
+struct SerialChannel
+{
+    uint8_t                 id;             // The channel identifier carried in each frame, or zero if this slot is unused.
+    uint8_t                 priority;       // The transmit priority of the channel. Lower values are sent first.
+    uint8_t                 status;         // Channel status flags.
+    RingBuffer<uint8_t>     rxBuffer;       // Data received on this channel, awaiting collection.
+    RingBuffer<uint8_t>     txBuffer;       // Data queued for transmission on this channel.
+    uint32_t                rxDropped;      // The number of received bytes discarded because rxBuffer was full.
+    uint32_t                txDropped;      // The number of queued bytes discarded because the serial port could not send them.
+};
+
+/**
+  * Class definition for MicroBitSerialMux.
+  *
+  * Carries several independent byte streams (e.g. logging, telemetry and commands) over a single serial port.
+  *
+  * Each channel has its own transmit and receive buffers. Queued data is sent by a background fiber as frames of
+  * at most MICROBIT_SERIAL_FRAME_MAX_SIZE - 1 bytes, using a MicroBitSerialFramer. The first byte of each frame identifies
+  * its channel. Before each frame, the channel with the lowest priority value that has data waiting is chosen, so a
+  * high priority channel never waits behind more than one frame of lower priority data. Channels of equal priority
+  * take turns.
+  *
+  * Received frames are routed into the rx buffer of the channel they belong to.
+  */
+class MicroBitSerialMux
+{
+    MicroBitSerialFramer    &framer;                                // The framing layer we send and receive over.
+    SerialChannel           channels[MICROBIT_SERIAL_MUX_CHANNELS]; // The state of each channel.
+    uint8_t                 lastChannel;                            // The index of the channel most recently sent.
+    uint8_t                 status;                                 // Status flags.
+
+    /**
+      * Looks up an open channel.
+      *
+      * @param id the channel identifier.
+      *
+      * @return the channel, or NULL if it is not open.
+      */
+    SerialChannel *getChannel(uint8_t id);
+
+    /**
+      * Chooses the channel to send the next frame from.
+      *
+      * @return the highest priority channel with data queued, or NULL if there is none.
+      */
+    SerialChannel *nextChannel();
+
+    /**
+      * Sends frames from the channel tx buffers until all are empty.
+      * Runs in its own fiber, started when data is queued.
+      */
+    void transmit();
+
+    /**
+      * Entry point for the fiber that runs transmit().
+      */
+    static void transmitTask(void *mux);
+
+    /**
+      * Routes received frames to their channels. Invoked when the framer raises
+      * MICROBIT_SERIAL_EVT_FRAME_READY.
+      */
+    void frameReceived(MicroBitEvent);
+
+    public:
+
+    /**
+      * Constructor.
+      * Create an instance of MicroBitSerialMux.
+      *
+      * @param framer the framing layer to carry channels over. It must be enabled before data can be received.
+      *
+      * @code
+      * MicroBitSerialFramer framer(uBit.serial);
+      * MicroBitSerialMux mux(framer);
+      *
+      * framer.enable();
+      * mux.openChannel(1, 0);  // commands, highest priority
+      * mux.openChannel(2, 1);  // telemetry
+      * mux.openChannel(3, 2);  // logging
+      * @endcode
+      *
+      * @note Once a channel is open, this instance collects all frames received by the framer.
+      */
+    MicroBitSerialMux(MicroBitSerialFramer &framer);
+
+    /**
+      * Destructor. Closes all channels.
+      */
+    ~MicroBitSerialMux();
+
+    /**
+      * Opens a channel.
+      *
+      * @param id the channel identifier, in the range 1..255. Both ends of the link must use the same identifiers.
+      *
+      * @param priority the transmit priority of the channel. Lower values are sent first.
+      *
+      * @param rxBufferSize the number of received bytes the channel can hold awaiting collection.
+      *
+      * @param txBufferSize the number of bytes the channel can hold awaiting transmission.
+      *
+      * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if id is zero or already open, or
+      *         MICROBIT_NO_RESOURCES if MICROBIT_SERIAL_MUX_CHANNELS are already open or the buffers could not be allocated.
+      */
+    int openChannel(uint8_t id, uint8_t priority, uint16_t rxBufferSize = MICROBIT_SERIAL_MUX_BUFFER_SIZE, uint16_t txBufferSize = MICROBIT_SERIAL_MUX_BUFFER_SIZE);
+
+    /**
+      * Closes a channel, discarding any data buffered on it.
+      *
+      * @param id the channel identifier.
+      *
+      * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if the channel is not open, or
+      *         MICROBIT_SERIAL_IN_USE if a fiber is sending on the channel.
+      */
+    int closeChannel(uint8_t id);
+
+    /**
+      * Queues data for transmission on a channel.
+      *
+      * @param id the channel identifier.
+      *
+      * @param buffer the data to send.
+      *
+      * @param len the number of bytes to send.
+      *
+      * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. Each mode
+      *        gives a different behaviour:
+      *
+      *            ASYNC - Copies as many bytes as will fit into the channel's tx buffer, and returns immediately.
+      *
+      *            SYNC_SPINWAIT - Not supported, as data is sent by a background fiber.
+      *
+      *            SYNC_SLEEP - The calling fiber sleeps until all of the data has been queued.
+      *
+      *         Defaults to SYNC_SLEEP.
+      *
+      * @return the number of bytes queued, MICROBIT_INVALID_PARAMETER if the channel is not open, the buffer is invalid
+      *         or the mode is SYNC_SPINWAIT, or MICROBIT_SERIAL_IN_USE if another fiber is sending on the channel.
+      */
+    int send(uint8_t id, const uint8_t *buffer, int len, MicroBitSerialMode mode = MICROBIT_DEFAULT_SERIAL_MODE);
+
+    /**
+      * Queues a string for transmission on a channel.
+      *
+      * @param id the channel identifier.
+      *
+      * @param s the string to send.
+      *
+      * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. See send(uint8_t, const uint8_t *, int, MicroBitSerialMode).
+      *
+      * @return the number of bytes queued, or an error code as described for send(uint8_t, const uint8_t *, int, MicroBitSerialMode).
+      */
+    int send(uint8_t id, ManagedString s, MicroBitSerialMode mode = MICROBIT_DEFAULT_SERIAL_MODE);
+
+    /**
+      * Reads data received on a channel.
+      *
+      * @param id the channel identifier.
+      *
+      * @param buffer a pointer to a user allocated buffer.
+      *
+      * @param len the maximum number of bytes to read.
+      *
+      * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. Each mode
+      *        gives a different behaviour:
+      *
+      *            ASYNC - Reads whatever data is available, up to len bytes. Returns MICROBIT_NO_DATA if there is none.
+      *
+      *            SYNC_SPINWAIT - Not supported, as data is received by a background fiber.
+      *
+      *            SYNC_SLEEP - If no data is available, the calling fiber sleeps until some is received.
+      *                         Whatever data is then available is read, up to len bytes.
+      *
+      *         Defaults to SYNC_SLEEP.
+      *
+      * @return the number of bytes read, MICROBIT_NO_DATA, or MICROBIT_INVALID_PARAMETER if the channel is
+      *         not open, the buffer is invalid or the mode is SYNC_SPINWAIT.
+      */
+    int recv(uint8_t id, uint8_t *buffer, int len, MicroBitSerialMode mode = MICROBIT_DEFAULT_SERIAL_MODE);
+
+    /**
+      * Determines the number of bytes received on a channel and awaiting collection.
+      *
+      * @param id the channel identifier.
+      *
+      * @return the number of bytes buffered, or MICROBIT_INVALID_PARAMETER if the channel is not open.
+      */
+    int rxBufferedSize(uint8_t id);
+
+    /**
+      * Determines the number of bytes queued on a channel and awaiting transmission.
+      *
+      * @param id the channel identifier.
+      *
+      * @return the number of bytes buffered, or MICROBIT_INVALID_PARAMETER if the channel is not open.
+      */
+    int txBufferedSize(uint8_t id);
+
+    /**
+      * Determines the number of bytes received on a channel that were discarded because its rx buffer was full.
+      *
+      * @param id the channel identifier.
+      *
+      * @return the number of bytes dropped, or MICROBIT_INVALID_PARAMETER if the channel is not open.
+      */
+    int getDroppedBytes(uint8_t id);
+
+    /**
+      * Determines the number of bytes queued on a channel that were discarded because the serial port could not send them.
+      *
+      * @param id the channel identifier.
+      *
+      * @return the number of bytes dropped, or MICROBIT_INVALID_PARAMETER if the channel is not open.
+      */
+    int getDroppedTxBytes(uint8_t id);
+};
+
+#endif
@@ -0,0 +1,469 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 British Broadcasting Corporation.
+This software is provided by Lancaster University by arrangement with the BBC.
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef MICROBIT_RING_BUFFER_H
+#define MICROBIT_RING_BUFFER_H
+
+#include "MicroBitConfig.h"
+#include "MicroBitCompat.h"
+#include "ErrorNo.h"
+
+// The largest number of elements a RingBuffer can hold.
+#define MICROBIT_RING_BUFFER_MAXIMUM_SIZE   32767
+
+/**
+  * Class definition for a generic circular buffer.
+  *
+  * The underlying storage is always a power of two in length, so that indices can be
+  * wrapped with a mask rather than a division. One slot is always kept free, so that a full
+  * buffer can be distinguished from an empty one.
+  *
+  * The buffer is safe for a single producer and a single consumer without locking (e.g. an
+  * interrupt handler adding data and a fiber removing it), as the head is only ever updated by
+  * the producer and the tail only ever updated by the consumer.
+  *
+  * @note T must be a plain data type, as elements are moved with memcpy.
+  */
+template <class T>
+class RingBuffer
+{
+    T *buffer;
+    uint16_t mask;
+    volatile uint16_t head;
+    volatile uint16_t tail;
+
+public:
+
+    /**
+      * Constructor.
+      * Creates an empty RingBuffer. No memory is allocated until allocate() is called.
+      */
+    RingBuffer();
+
+    /**
+      * Destructor. Frees any allocated storage.
+      */
+    ~RingBuffer();
+
+    /**
+      * Allocates storage for the buffer, discarding any previously buffered data.
+      *
+      * @param size the minimum number of elements the buffer must be able to hold. The storage
+      *        allocated is rounded up to the next power of two strictly greater than size.
+      *
+      * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if size is out of range, or
+      *         MICROBIT_NO_RESOURCES if the storage could not be allocated.
+      */
+    int allocate(int size);
+
+    /**
+      * Frees any storage held by this buffer.
+      */
+    void release();
+
+    /**
+      * Copies up to len elements into the buffer.
+      *
+      * @param data the elements to add.
+      *
+      * @param len the number of elements available in data.
+      *
+      * @return the number of elements copied, which is limited by the free space available.
+      */
+    int write(const T *data, int len);
+
+    /**
+      * Copies up to len elements out of the buffer, without removing them.
+      *
+      * @param data the destination for the elements.
+      *
+      * @param len the maximum number of elements to copy.
+      *
+      * @return the number of elements copied.
+      */
+    int copy(T *data, int len);
+
+    /**
+      * Copies up to len elements out of the buffer, removing them.
+      *
+      * @param data the destination for the elements.
+      *
+      * @param len the maximum number of elements to read.
+      *
+      * @return the number of elements read.
+      */
+    int read(T *data, int len);
+
+    /**
+      * Provides direct access to up to len elements at the tail of the buffer, without copying
+      * or removing them. As the storage is circular, the elements may be split into two
+      * contiguous segments; the second is only used when they wrap around the end of storage.
+      *
+      * @param len the maximum number of elements to access.
+      *
+      * @param first set to the start of the first segment.
+      *
+      * @param firstLength set to the number of elements in the first segment.
+      *
+      * @param second set to the start of the second segment.
+      *
+      * @param secondLength set to the number of elements in the second segment.
+      *
+      * @return the total number of elements accessible through the two segments.
+      *
+      * @note the segments remain valid until the elements are removed, e.g. with skip().
+      */
+    int segments(int len, T **first, int *firstLength, T **second, int *secondLength);
+
+    /**
+      * Adds a single element to the buffer.
+      *
+      * @param value the element to add.
+      *
+      * @return true if the element was added, false if the buffer is full.
+      */
+    bool push(T value)
+    {
+        uint16_t next = (head + 1) & mask;
+
+        if (next == tail)
+            return false;
+
+        buffer[head] = value;
+        head = next;
+
+        return true;
+    }
+
+    /**
+      * Removes the element at the tail of the buffer.
+      *
+      * @return the element removed.
+      *
+      * @note the caller must ensure the buffer is not empty.
+      */
+    T pop()
+    {
+        T value = buffer[tail];
+        tail = (tail + 1) & mask;
+
+        return value;
+    }
+
+    /**
+      * Returns the element at the tail of the buffer without removing it.
+      *
+      * @note the caller must ensure the buffer is not empty.
+      */
+    T peek()
+    {
+        return buffer[tail];
+    }
+
+    /**
+      * Returns the element stored at the given absolute index.
+      *
+      * @param index a position in the buffer, as returned by getHead(), getTail() or wrap().
+      */
+    T at(int index)
+    {
+        return buffer[index & mask];
+    }
+
+    /**
+      * Wraps the given index into the range of valid buffer positions.
+      */
+    uint16_t wrap(int index)
+    {
+        return index & mask;
+    }
+
+    /**
+      * Discards len elements from the tail of the buffer.
+      *
+      * @note the caller must ensure at least len elements are buffered.
+      */
+    void skip(int len)
+    {
+        tail = (tail + len) & mask;
+    }
+
+    /**
+      * Discards all buffered elements.
+      */
+    void clear()
+    {
+        tail = head;
+    }
+
+    /**
+      * @return the absolute index at which the next element will be stored.
+      */
+    uint16_t getHead()
+    {
+        return head;
+    }
+
+    /**
+      * @return the absolute index of the oldest buffered element.
+      */
+    uint16_t getTail()
+    {
+        return tail;
+    }
+
+    /**
+      * @return the number of elements currently buffered.
+      */
+    int count()
+    {
+        return (head - tail) & mask;
+    }
+
+    /**
+      * @return the number of elements that can be added before the buffer is full.
+      */
+    int space()
+    {
+        return mask - count();
+    }
+
+    /**
+      * @return the maximum number of elements the buffer can hold.
+      */
+    int capacity()
+    {
+        return mask;
+    }
+
+    /**
+      * @return the size of the underlying storage, in elements.
+      */
+    int size()
+    {
+        return buffer == NULL ? 0 : mask + 1;
+    }
+
+    /**
+      * @return true if no elements are buffered.
+      */
+    bool isEmpty()
+    {
+        return head == tail;
+    }
+
+    /**
+      * @return true if no more elements can be added.
+      */
+    bool isFull()
+    {
+        return ((head + 1) & mask) == tail;
+    }
+
+    /**
+      * @return true if storage has been allocated for this buffer.
+      */
+    bool isAllocated()
+    {
+        return buffer != NULL;
+    }
+};
+
+/**
+  * Constructor.
+  * Creates an empty RingBuffer. No memory is allocated until allocate() is called.
+  */
+template<typename T>
+RingBuffer<T>::RingBuffer()
+{
+    buffer = NULL;
+    mask = 0;
+    head = 0;
+    tail = 0;
+}
+
+/**
+  * Destructor. Frees any allocated storage.
+  */
+template<typename T>
+RingBuffer<T>::~RingBuffer()
+{
+    release();
+}
+
+/**
+  * Allocates storage for the buffer, discarding any previously buffered data.
+  *
+  * @param size the minimum number of elements the buffer must be able to hold. The storage
+  *        allocated is rounded up to the next power of two strictly greater than size.
+  *
+  * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if size is out of range, or
+  *         MICROBIT_NO_RESOURCES if the storage could not be allocated.
+  */
+template<typename T>
+int RingBuffer<T>::allocate(int size)
+{
+    if (size <= 0 || size > MICROBIT_RING_BUFFER_MAXIMUM_SIZE)
+        return MICROBIT_INVALID_PARAMETER;
+
+    // + 1 for the slot that is always kept free.
+    int length = 1;
+
+    while (length < size + 1)
+        length <<= 1;
+
+    release();
+
+    if ((buffer = (T *)malloc(length * sizeof(T))) == NULL)
+        return MICROBIT_NO_RESOURCES;
+
+    mask = length - 1;
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Frees any storage held by this buffer.
+  */
+template<typename T>
+void RingBuffer<T>::release()
+{
+    T *b = buffer;
+
+    // Leave the buffer in a permanently empty (and full) state before freeing the memory,
+    // so that a concurrent producer or consumer can never touch it.
+    mask = 0;
+    head = 0;
+    tail = 0;
+    buffer = NULL;
+
+    if (b)
+        free(b);
+}
+
+/**
+  * Copies up to len elements into the buffer.
+  *
+  * @param data the elements to add.
+  *
+  * @param len the number of elements available in data.
+  *
+  * @return the number of elements copied, which is limited by the free space available.
+  */
+template<typename T>
+int RingBuffer<T>::write(const T *data, int len)
+{
+    int n = min(len, space());
+
+    if (n <= 0)
+        return 0;
+
+    // Copy in at most two contiguous segments: up to the end of storage, then from the start.
+    int first = min(n, (int)(mask + 1 - head));
+
+    memcpy(&buffer[head], data, first * sizeof(T));
+    memcpy(buffer, data + first, (n - first) * sizeof(T));
+
+    head = (head + n) & mask;
+
+    return n;
+}
+
+/**
+  * Copies up to len elements out of the buffer, without removing them.
+  *
+  * @param data the destination for the elements.
+  *
+  * @param len the maximum number of elements to copy.
+  *
+  * @return the number of elements copied.
+  */
+template<typename T>
+int RingBuffer<T>::copy(T *data, int len)
+{
+    int n = min(len, count());
+
+    if (n <= 0)
+        return 0;
+
+    int first = min(n, (int)(mask + 1 - tail));
+
+    memcpy(data, &buffer[tail], first * sizeof(T));
+    memcpy(data + first, buffer, (n - first) * sizeof(T));
+
+    return n;
+}
+
+/**
+  * Copies up to len elements out of the buffer, removing them.
+  *
+  * @param data the destination for the elements.
+  *
+  * @param len the maximum number of elements to read.
+  *
+  * @return the number of elements read.
+  */
+template<typename T>
+int RingBuffer<T>::read(T *data, int len)
+{
+    int n = copy(data, len);
+
+    skip(n);
+
+    return n;
+}
+
+/**
+  * Provides direct access to up to len elements at the tail of the buffer, without copying
+  * or removing them. As the storage is circular, the elements may be split into two
+  * contiguous segments; the second is only used when they wrap around the end of storage.
+  *
+  * @param len the maximum number of elements to access.
+  *
+  * @param first set to the start of the first segment.
+  *
+  * @param firstLength set to the number of elements in the first segment.
+  *
+  * @param second set to the start of the second segment.
+  *
+  * @param secondLength set to the number of elements in the second segment.
+  *
+  * @return the total number of elements accessible through the two segments.
+  *
+  * @note the segments remain valid until the elements are removed, e.g. with skip().
+  */
+template<typename T>
+int RingBuffer<T>::segments(int len, T **first, int *firstLength, T **second, int *secondLength)
+{
+    int n = max(0, min(len, count()));
+
+    *first = &buffer[tail];
+    *firstLength = min(n, (int)(mask + 1 - tail));
+    *second = buffer;
+    *secondLength = n - *firstLength;
+
+    return n;
+}
+#endif
@@ -37,8 +37,14 @@ DEALINGS IN THE SOFTWARE.
 #include "ErrorNo.h"
 #include "NotifyEvents.h"
 
-static uint8_t txBufferHead = 0;
-static uint8_t txBufferTail = 0;
+static RingBuffer<uint8_t> txBuffer;
+
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+static MicroBitSerialStatistics statistics;
+
+//the time at which the last indication was sent.
+static uint32_t txIndicationTime = 0;
+#endif
 
 static GattCharacteristic* txCharacteristic = NULL;
 
@@ -49,7 +55,12 @@ void on_confirmation(uint16_t handle)
 {
     if(handle == txCharacteristic->getValueAttribute().getHandle())
     {
-        txBufferTail = txBufferHead;
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+        statistics.bytesSent += txBuffer.count();
+        statistics.txLatencyMax = max(statistics.txLatencyMax, us_ticker_read() - txIndicationTime);
+#endif
+
+        txBuffer.clear();
         MicroBitEvent(MICROBIT_ID_NOTIFY, MICROBIT_UART_S_EVT_TX_EMPTY);
     }
 }
@@ -64,23 +75,18 @@ void on_confirmation(uint16_t handle)
  */
 MicroBitUARTService::MicroBitUARTService(BLEDevice &_ble, uint8_t rxBufferSize, uint8_t txBufferSize) : ble(_ble)
 {
-    rxBufferSize += 1;
-    txBufferSize += 1;
-
-    txBuffer = (uint8_t *)malloc(txBufferSize);
-    rxBuffer = (uint8_t *)malloc(rxBufferSize);
+    rxBuffer.allocate(rxBufferSize);
+    txBuffer.allocate(txBufferSize);
+    this->txBufferSize = txBufferSize;
 
-    rxBufferHead = 0;
-    rxBufferTail = 0;
-    this->rxBufferSize = rxBufferSize;
+    rxBuffHeadMatch = -1;
 
-    txBufferHead = 0;
-    txBufferTail = 0;
-    this->txBufferSize = txBufferSize;
+    // The characteristic values live in the BLE stack, so only need an initial value here.
+    uint8_t initialValue = 0;
 
-    GattCharacteristic rxCharacteristic(UARTServiceRXCharacteristicUUID, rxBuffer, 1, rxBufferSize, GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE | GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE_WITHOUT_RESPONSE);
+    GattCharacteristic rxCharacteristic(UARTServiceRXCharacteristicUUID, &initialValue, 1, rxBufferSize + 1, GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE | GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_WRITE_WITHOUT_RESPONSE);
 
-    txCharacteristic = new GattCharacteristic(UARTServiceTXCharacteristicUUID, txBuffer, 1, txBufferSize, GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_INDICATE);
+    txCharacteristic = new GattCharacteristic(UARTServiceTXCharacteristicUUID, &initialValue, 1, txBufferSize + 1, GattCharacteristic::BLE_GATT_CHAR_PROPERTIES_INDICATE);
 
     GattCharacteristic *charTable[] = {txCharacteristic, &rxCharacteristic};
 
@@ -100,15 +106,21 @@ MicroBitUARTService::MicroBitUARTService(BLEDevice &_ble, uint8_t rxBufferSize,
 void MicroBitUARTService::onDataWritten(const GattWriteCallbackParams *params) {
     if (params->handle == this->rxCharacteristicHandle)
     {
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+        uint32_t start = us_ticker_read();
+#endif
+
         uint16_t bytesWritten = params->len;
 
         for(int byteIterator = 0; byteIterator <  bytesWritten; byteIterator++)
         {
-            int newHead = (rxBufferHead + 1) % rxBufferSize;
+            char c = params->data[byteIterator];
 
-            if(newHead != rxBufferTail)
+            if(rxBuffer.push(c))
             {
-                char c = params->data[byteIterator];
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+                statistics.bytesReceived++;
+#endif
 
                 int delimeterOffset = 0;
                 int delimLength = this->delimeters.length();
@@ -123,43 +135,27 @@ void MicroBitUARTService::onDataWritten(const GattWriteCallbackParams *params) {
                     delimeterOffset++;
                 }
 
-                rxBuffer[rxBufferHead] = c;
-
-                rxBufferHead = newHead;
-
-                if(rxBufferHead == rxBuffHeadMatch)
+                if(rxBuffer.getHead() == rxBuffHeadMatch)
                 {
                     rxBuffHeadMatch = -1;
                     MicroBitEvent(MICROBIT_ID_BLE_UART, MICROBIT_UART_S_EVT_HEAD_MATCH);
                 }
             }
             else
+            {
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+                statistics.rxDropped++;
+#endif
                 MicroBitEvent(MICROBIT_ID_BLE_UART, MICROBIT_UART_S_EVT_RX_FULL);
+            }
         }
-    }
-}
-
-/**
-  * An internal method that copies values from a circular buffer to a linear buffer.
-  *
-  * @param circularBuff a pointer to the source circular buffer
-  * @param circularBuffSize the size of the circular buffer
-  * @param linearBuff a pointer to the destination linear buffer
-  * @param tailPosition the tail position in the circular buffer you want to copy from
-  * @param headPosition the head position in the circular buffer you want to copy to
-  *
-  * @note this method assumes that the linear buffer has the appropriate amount of
-  *       memory to contain the copy operation
-  */
-void MicroBitUARTService::circularCopy(uint8_t *circularBuff, uint8_t circularBuffSize, uint8_t *linearBuff, uint16_t tailPosition, uint16_t headPosition)
-{
-    int toBuffIndex = 0;
 
-    while(tailPosition != headPosition)
-    {
-        linearBuff[toBuffIndex++] = circularBuff[tailPosition];
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+        uint32_t duration = us_ticker_read() - start;
 
-        tailPosition = (tailPosition + 1) % circularBuffSize;
+        statistics.interruptTime += duration;
+        statistics.interruptTimeMax = max(statistics.interruptTimeMax, duration);
+#endif
     }
 }
 
@@ -195,11 +191,7 @@ int MicroBitUARTService::getc(MicroBitSerialMode mode)
             eventAfter(1, mode);
     }
 
-    char c = rxBuffer[rxBufferTail];
-
-    rxBufferTail = (rxBufferTail + 1) % rxBufferSize;
-
-    return c;
+    return rxBuffer.pop();
 }
 
 /**
@@ -263,19 +255,7 @@ int MicroBitUARTService::send(const uint8_t *buf, int length, MicroBitSerialMode
 
     while(bytesWritten < length && ble.getGapState().connected && updatesEnabled)
     {
-        for(int bufferIterator = bytesWritten; bufferIterator < length; bufferIterator++)
-        {
-            int nextHead = (txBufferHead + 1) % txBufferSize;
-
-            if(nextHead != txBufferTail)
-            {
-                txBuffer[txBufferHead] = buf[bufferIterator];
-
-                txBufferHead = nextHead;
-
-                bytesWritten++;
-            }
-        }
+        bytesWritten += txBuffer.write(buf + bytesWritten, min(length - bytesWritten, txBufferSize - txBufferedSize()));
 
         int size = txBufferedSize();
 
@@ -283,12 +263,16 @@ int MicroBitUARTService::send(const uint8_t *buf, int length, MicroBitSerialMode
 
         memclr(&temp, size);
 
-        circularCopy(txBuffer, txBufferSize, temp, txBufferTail, txBufferHead);
+        txBuffer.copy(temp, size);
 
 
         if(mode == SYNC_SLEEP)
             fiber_wake_on_event(MICROBIT_ID_NOTIFY, MICROBIT_UART_S_EVT_TX_EMPTY);
 
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+        txIndicationTime = us_ticker_read();
+#endif
+
         ble.gattServer().write(txCharacteristic->getValueAttribute().getHandle(), temp, size);
 
         if(mode == SYNC_SLEEP)
@@ -433,22 +417,21 @@ ManagedString MicroBitUARTService::readUntil(ManagedString delimeters, MicroBitS
     if(mode == SYNC_SPINWAIT)
         return MICROBIT_INVALID_PARAMETER;
 
-    int localTail = rxBufferTail;
-    int preservedTail = rxBufferTail;
+    int localTail = rxBuffer.getTail();
 
     int foundIndex = -1;
 
     //ASYNC mode just iterates through our stored characters checking for any matches.
-    while(localTail != rxBufferHead && foundIndex  == -1)
+    while(localTail != rxBuffer.getHead() && foundIndex  == -1)
     {
         //we use localTail to prevent modification of the actual tail.
-        char c = rxBuffer[localTail];
+        char c = rxBuffer.at(localTail);
 
         for(int delimeterIterator = 0; delimeterIterator < delimeters.length(); delimeterIterator++)
             if(delimeters.charAt(delimeterIterator) == c)
                 foundIndex = localTail;
 
-        localTail = (localTail + 1) % rxBufferSize;
+        localTail = rxBuffer.wrap(localTail + 1);
     }
 
     //if our mode is SYNC_SLEEP, we set up an event to be fired when we see a
@@ -457,7 +440,7 @@ ManagedString MicroBitUARTService::readUntil(ManagedString delimeters, MicroBitS
     {
         eventOn(delimeters, mode);
 
-        foundIndex = rxBufferHead - 1;
+        foundIndex = rxBuffer.wrap(rxBuffer.getHead() - 1);
 
         this->delimeters = ManagedString();
     }
@@ -465,16 +448,16 @@ ManagedString MicroBitUARTService::readUntil(ManagedString delimeters, MicroBitS
     if(foundIndex >= 0)
     {
         //calculate our local buffer size
-        int localBuffSize = (preservedTail > foundIndex) ? (rxBufferSize - preservedTail) + foundIndex : foundIndex - preservedTail;
+        int localBuffSize = rxBuffer.wrap(foundIndex - rxBuffer.getTail());
 
         uint8_t localBuff[localBuffSize + 1];
 
         memclr(&localBuff, localBuffSize + 1);
 
-        circularCopy(rxBuffer, rxBufferSize, localBuff, preservedTail, foundIndex);
+        rxBuffer.read(localBuff, localBuffSize);
 
         //plus one for the character we listened for...
-        rxBufferTail = (rxBufferTail + localBuffSize + 1) % rxBufferSize;
+        rxBuffer.skip(1);
 
         return ManagedString((char *)localBuff, localBuffSize);
     }
@@ -537,7 +520,7 @@ int MicroBitUARTService::eventAfter(int len, MicroBitSerialMode mode)
         return MICROBIT_INVALID_PARAMETER;
 
     //configure our head match...
-    this->rxBuffHeadMatch = (rxBufferHead + len) % rxBufferSize;
+    this->rxBuffHeadMatch = rxBuffer.wrap(rxBuffer.getHead() + len);
 
     //block!
     if(mode == SYNC_SLEEP)
@@ -556,7 +539,7 @@ int MicroBitUARTService::eventAfter(int len, MicroBitSerialMode mode)
   */
 int MicroBitUARTService::isReadable()
 {
-    return (rxBufferTail != rxBufferHead) ? 1 : 0;
+    return rxBuffer.isEmpty() ? 0 : 1;
 }
 
 /**
@@ -564,10 +547,7 @@ int MicroBitUARTService::isReadable()
   */
 int MicroBitUARTService::rxBufferedSize()
 {
-    if(rxBufferTail > rxBufferHead)
-        return (rxBufferSize - rxBufferTail) + rxBufferHead;
-
-    return rxBufferHead - rxBufferTail;
+    return rxBuffer.count();
 }
 
 /**
@@ -575,8 +555,42 @@ int MicroBitUARTService::rxBufferedSize()
   */
 int MicroBitUARTService::txBufferedSize()
 {
-    if(txBufferTail > txBufferHead)
-        return (txBufferSize - txBufferTail) + txBufferHead;
+    return txBuffer.count();
+}
+
+/**
+  * Retrieves the traffic and timing statistics gathered by this service.
+  *
+  * @param statistics the structure to fill. bytesSent counts bytes acknowledged by the
+  *        connected device, and txLatencyMax the longest wait for an acknowledgement.
+  *
+  * @return MICROBIT_OK, or MICROBIT_NOT_SUPPORTED if MICROBIT_SERIAL_STATISTICS is not enabled.
+  */
+int MicroBitUARTService::getStatistics(MicroBitSerialStatistics &statistics)
+{
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+    statistics = ::statistics;
+
+    return MICROBIT_OK;
+#else
+    (void)statistics;
+
+    return MICROBIT_NOT_SUPPORTED;
+#endif
+}
+
+/**
+  * Resets all of the statistics gathered by this service to zero.
+  *
+  * @return MICROBIT_OK, or MICROBIT_NOT_SUPPORTED if MICROBIT_SERIAL_STATISTICS is not enabled.
+  */
+int MicroBitUARTService::resetStatistics()
+{
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+    memclr(&::statistics, sizeof(::statistics));
 
-    return txBufferHead - txBufferTail;
+    return MICROBIT_OK;
+#else
+    return MICROBIT_NOT_SUPPORTED;
+#endif
 }
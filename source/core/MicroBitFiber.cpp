@@ -231,6 +231,20 @@ int fiber_scheduler_running()
 	return 0;
 }
 
+/**
+  * Determines if the calling code is running on the idle fiber, for example from a component's idleTick(),
+  * or an event handler invoked by one. The idle fiber must never block.
+  *
+  * @return 1 if running on the idle fiber, 0 otherwise.
+  */
+int fiber_is_idle()
+{
+	if (idleFiber != NULL && currentFiber == idleFiber)
+		return 1;
+
+	return 0;
+}
+
 /**
   * The timer callback, called from interrupt context once every SYSTEM_TICK_PERIOD_MS milliseconds.
   * This function checks to determine if any fibers blocked on the sleep queue need to be woken up
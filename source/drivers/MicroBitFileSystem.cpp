@@ -3,36 +3,54 @@
 #include "MicroBitFlash.h"
 #include "MicroBitStorage.h"        
 #include "MicroBitCompat.h"
+#include "MicroBitFiber.h"
 #include "ErrorNo.h"
 
 static uint32_t *defaultScratchPage = (uint32_t *)DEFAULT_SCRATCH_PAGE;
 
 MicroBitFileSystem* MicroBitFileSystem::defaultFileSystem = NULL;
 
+/**
+  * Calculates the slot in a DirectoryHash of the given size at which to start searching for the given filename.
+  */
+static uint16_t hashFilename(char const *name, uint16_t size)
+{
+    uint16_t hash = 5381;
+
+    for (int i = 0; i < MBFS_FILENAME_LENGTH && name[i]; i++)
+        hash = hash * 33 + (uint8_t)name[i];
+
+    return hash & (size - 1);
+}
+
 /**
   * Allocate a free logical block.
-  * This is chosen at random from the blocks available, to even out the wear on the physical device.
+  * The block is chosen from the least worn page with space available, in round robin order, to even out the wear on the physical device.
   * @return a valid, unused block address on success, or zero if no space is available.
   */
 uint16_t MicroBitFileSystem::getFreeBlock()
 {
-    // Walk the File Table and allocate the first free block - starting immediately after the last block allocated,
-    // and wrapping around the filesystem space if we reach the end.
+    // Walk the File Table and allocate the free block on the least worn page - starting immediately after the last block allocated,
+    // and wrapping around the filesystem space if we reach the end. The first block found is taken from pages of equal wear.
     uint16_t block;
+    uint16_t freeBlock = 0;
     uint16_t deletedBlock = 0;
 
-    for (block = (lastBlockAllocated + 1) % fileSystemSize; block != lastBlockAllocated; block++)
+    for (block = (lastBlockAllocated + 1) % fileSystemSize; block != lastBlockAllocated; block = (block + 1) % fileSystemSize)
     {
-        if (fileSystemTable[block] == MBFS_UNUSED)
-        {
-            lastBlockAllocated = block;
-            return block;
-        }
+        if (fileSystemTable[block] == MBFS_UNUSED && (freeBlock == 0 || getBlockWear(block) < getBlockWear(freeBlock)))
+            freeBlock = block;
 
         if (fileSystemTable[block] == MBFS_DELETED)
             deletedBlock = block;
     }
 
+    if (freeBlock)
+    {
+        lastBlockAllocated = freeBlock;
+        return freeBlock;
+    }
+
     // if no UNUSED blocks are available, try to recycle one marked as DELETED.
     block = deletedBlock;
 
@@ -51,8 +69,8 @@ uint16_t MicroBitFileSystem::getFreeBlock()
 }
 
 /**
-  * Allocates a free physical page of memory.
-  * This is chosen using a round robin algorithm, to even out the wear on the physical device.
+  * Allocates a free physical page of memory, for use as a scratch page. The page is not erased.
+  * The least worn page available is chosen, in round robin order, to even out the wear on the physical device.
   * @return NULL on error, page address on success
   */
 uint32_t* MicroBitFileSystem::getFreePage()
@@ -63,53 +81,41 @@ uint32_t* MicroBitFileSystem::getFreePage()
     // get a handle on the next physical page.
     uint16_t currentPage = getBlockNumber(getPage(lastBlockAllocated));
     uint16_t page = (currentPage + blocksPerPage) % fileSystemSize;
-    uint16_t recyclablePage = 0;
+    uint16_t freePage = 0;
 
-    // Walk around the file table, looking for a free page.
+    // Walk around the file table, looking for the least worn page holding no valid data.
     while (page != currentPage)
     {
         bool empty = true;
-        bool deleted = false;
         uint16_t next;
 
         for (int i = 0; i < blocksPerPage; i++)
         {
             next = getNextFileBlock(page + i);
             
-            if (next == MBFS_DELETED)
-                deleted = true;
-            
-            else if (next != MBFS_UNUSED)
+            if (next != MBFS_DELETED && next != MBFS_UNUSED)
             {
                 empty = false;
                 break;
             }
         }
 
-        // See if we found one...
-        if (empty)
-        {
-            lastBlockAllocated = page;
-            return getBlock(page);
-        }
-
-        // make note of the first unused but un-erased page we find (if any).
-        if (deleted && !recyclablePage)
-            recyclablePage = page;
+        if (empty && (freePage == 0 || getBlockWear(page) < getBlockWear(freePage)))
+            freePage = page;
 
         page = (page + blocksPerPage) % fileSystemSize;
     }
 
-    // No empty pages are available, but we may be able to recycle one.
-    if (recyclablePage)
+    // See if we found one...
+    // n.b. the page may hold deleted data, or have been used as a scratch page before. It is left to the user of the page to
+    // erase it, if and when it is needed, as MicroBitFlash::flash_write() only uses the scratch page if an erase is required.
+    if (freePage)
     {
-        uint32_t *address = getBlock(recyclablePage);
-        flash.erase_page(address);
-        return address;
+        lastBlockAllocated = freePage;
+        return getBlock(freePage);
     }
 
     // Nothing available at all. Use the default.
-    flash.erase_page(defaultScratchPage);
     return defaultScratchPage;
 }
 
@@ -127,6 +133,29 @@ MicroBitFileSystem::MicroBitFileSystem(uint32_t flashStart, int flashPages)
         MicroBitFileSystem::defaultFileSystem = this;
 }
 
+/**
+  * Destructor.
+  */
+MicroBitFileSystem::~MicroBitFileSystem()
+{
+    if (status & MBFS_STATUS_IDLE)
+        fiber_remove_idle_component(this);
+
+    flash.setEraseHandler(NULL);
+    delete[] eraseCounts;
+
+    for (int i = 0; i < MBFS_DIRECTORY_HASH_COUNT; i++)
+    {
+        if (directoryHash[i])
+            delete[] directoryHash[i]->entry;
+
+        delete directoryHash[i];
+    }
+
+    if (MicroBitFileSystem::defaultFileSystem == this)
+        MicroBitFileSystem::defaultFileSystem = NULL;
+}
+
 /**
   * Initialize the flash storage system
   *
@@ -154,6 +183,15 @@ int MicroBitFileSystem::init(uint32_t flashStart, int flashPages)
     lastBlockAllocated = 0;
     rootDirectory = NULL;
     openFiles = NULL;
+    gcDirectoryCount = 0;
+    gcBlock = 0;
+    eraseCounts = NULL;
+    wearTableSize = 0;
+    unsyncedErases = 0;
+    directoryHashNext = 0;
+
+    for (int i = 0; i < MBFS_DIRECTORY_HASH_COUNT; i++)
+        directoryHash[i] = NULL;
 
     // If we have a zero length, then dynamically determine our geometry.
     if (flashStart == 0)
@@ -180,10 +218,25 @@ int MicroBitFileSystem::init(uint32_t flashStart, int flashPages)
         // Bring up a freshly formatted file system here.
         fileSystemSize = flashPages * (PAGE_SIZE / MBFS_BLOCK_SIZE);
         fileSystemTableSize = calculateFileTableSize();
+        wearTableSize = calculateWearTableSize();
 
         format();
     }
 
+    // Load the erase count of each page from the wear table (if there is one), and keep them up to date from here on.
+    // Entries never written since the file system was formatted are still erased.
+    int pages = fileSystemSize / (PAGE_SIZE / MBFS_BLOCK_SIZE);
+    uint16_t *wearTable = (uint16_t *)getBlock(fileSystemTableSize);
+
+    eraseCounts = new uint16_t[pages];
+    if (eraseCounts == NULL)
+        return MICROBIT_NO_RESOURCES;
+
+    for (int i = 0; i < pages; i++)
+        eraseCounts[i] = (wearTableSize && wearTable[i] != MBFS_UNUSED) ? wearTable[i] : 0;
+
+    flash.setEraseHandler(MicroBitFileSystem::eraseHandler, this);
+
     // indicate that we have a valid FileSystem
     status = MBFS_STATUS_INITIALISED;
     return MICROBIT_OK;
@@ -213,6 +266,11 @@ int MicroBitFileSystem::load()
     rootDirectory = root;
     fileSystemSize = root->length;
     fileSystemTableSize = calculateFileTableSize();
+    wearTableSize = calculateWearTableSize();
+
+    // File systems formatted without a wear table have their root directory immediately after the file table.
+    if (rootOffset < fileSystemTableSize + wearTableSize)
+        wearTableSize = 0;
 
     return MICROBIT_OK;
 }
@@ -225,27 +283,29 @@ int MicroBitFileSystem::load()
   */
 int MicroBitFileSystem::format()
 {
-    uint16_t value = fileSystemTableSize;
+    uint16_t rootOffset = fileSystemTableSize + wearTableSize;
+    uint16_t value = rootOffset;
 
-    // Mark the FileTable blocks themselves as used.
-    for (uint16_t block = 0; block < fileSystemTableSize; block++)
+    // Mark the FileTable and wear table blocks themselves as used.
+    // The wear table is left erased, as no pages have been erased since the file system was formatted.
+    for (uint16_t block = 0; block < rootOffset; block++)
         flash.flash_write(&fileSystemTable[block], &value, 2);
 
     // Create a root directory
     value = MBFS_EOF;
-    flash.flash_write(&fileSystemTable[fileSystemTableSize], &value, 2);
+    flash.flash_write(&fileSystemTable[rootOffset], &value, 2);
     
     // Store a MAGIC value in the first root directory entry. 
     // This will let us identify a valid File System later.
     DirectoryEntry magic;
 
     strcpy(magic.file_name, MBFS_MAGIC);
-    magic.first_block = fileSystemTableSize;
+    magic.first_block = rootOffset;
     magic.flags = MBFS_DIRECTORY_ENTRY_VALID;
     magic.length = fileSystemSize;
 
     // Cache the root directory entry for later use.
-    rootDirectory = (DirectoryEntry *)getBlock(fileSystemTableSize);
+    rootDirectory = (DirectoryEntry *)getBlock(rootOffset);
     flash.flash_write(rootDirectory, &magic, sizeof(DirectoryEntry));
 
     return MICROBIT_OK;
@@ -276,6 +336,18 @@ DirectoryEntry* MicroBitFileSystem::getDirectoryEntry(char const * filename, con
     if (directory == NULL)
         directory = rootDirectory;
 
+    // If the directory is indexed, look up the file there instead of searching every entry.
+    DirectoryHash *hash = getDirectoryHash(directory);
+
+    if (hash)
+    {
+        for (uint16_t i = hashFilename(file, hash->size); hash->entry[i]; i = (i + 1) & (hash->size - 1))
+            if (hash->entry[i]->flags & MBFS_DIRECTORY_ENTRY_VALID && strcmp(hash->entry[i]->file_name, file) == 0)
+                return hash->entry[i];
+
+        return NULL;
+    }
+
     block = directory->first_block;
     dir = (Directory *) getBlock(block);
     dirent = &dir->entry[0];
@@ -304,6 +376,113 @@ DirectoryEntry* MicroBitFileSystem::getDirectoryEntry(char const * filename, con
     return NULL;
 }
 
+/**
+  * Retrieve the filename index of the given directory, building it if necessary.
+  *
+  * @param directory The directory to index.
+  * @return The index of the directory, or NULL if it holds too many entries to be indexed, or no memory is available.
+  *         Directories too large to index are remembered, so they are not counted again until they change.
+  */
+DirectoryHash* MicroBitFileSystem::getDirectoryHash(const DirectoryEntry *directory)
+{
+    DirectoryHash *hash;
+    DirectoryEntry *dirent;
+    uint16_t block;
+    uint16_t size = MBFS_DIRECTORY_HASH_SIZE;
+    int count = 0;
+
+    for (int i = 0; i < MBFS_DIRECTORY_HASH_COUNT; i++)
+        if (directoryHash[i] && directoryHash[i]->directory == directory->first_block)
+            return directoryHash[i]->size ? directoryHash[i] : NULL;
+
+    // Count the valid entries in the directory, so that the index can be sized to keep it sparse (and lookups short).
+    // Unused entries are erased, so they have an invalid filename.
+    for (block = directory->first_block; block != MBFS_EOF; block = getNextFileBlock(block))
+    {
+        dirent = (DirectoryEntry *)getBlock(block);
+
+        for (uint16_t entry = 0; entry < MBFS_BLOCK_SIZE / sizeof(DirectoryEntry); entry++, dirent++)
+            if ((dirent->flags & MBFS_DIRECTORY_ENTRY_VALID) && (uint8_t)dirent->file_name[0] != 0xFF)
+                count++;
+    }
+
+    while (count > size * 3 / 4 && size < MBFS_DIRECTORY_HASH_MAX_SIZE)
+        size <<= 1;
+
+    // Build a new index, replacing the least recently built one.
+    if (directoryHash[directoryHashNext] == NULL)
+    {
+        directoryHash[directoryHashNext] = new DirectoryHash;
+        if (directoryHash[directoryHashNext] == NULL)
+            return NULL;
+
+        directoryHash[directoryHashNext]->size = 0;
+        directoryHash[directoryHashNext]->entry = NULL;
+    }
+
+    hash = directoryHash[directoryHashNext];
+    hash->directory = directory->first_block;
+    directoryHashNext = (directoryHashNext + 1) % MBFS_DIRECTORY_HASH_COUNT;
+
+    // Reallocate the slots if the directory needs a different number. If the directory is too large to index,
+    // release them and remember that, so that it is searched directly until it changes.
+    if (hash->size != size || count > size * 3 / 4)
+    {
+        delete[] hash->entry;
+        hash->entry = NULL;
+        hash->size = 0;
+    }
+
+    if (count > size * 3 / 4)
+        return NULL;
+
+    if (hash->entry == NULL)
+    {
+        hash->entry = new DirectoryEntry*[size];
+        if (hash->entry == NULL)
+        {
+            hash->directory = 0;
+            return NULL;
+        }
+
+        hash->size = size;
+    }
+
+    memset(hash->entry, 0, size * sizeof(DirectoryEntry *));
+
+    // Add every valid entry to the index, in directory order, so that the first of any duplicates is found first.
+    for (block = directory->first_block; block != MBFS_EOF; block = getNextFileBlock(block))
+    {
+        dirent = (DirectoryEntry *)getBlock(block);
+
+        for (uint16_t entry = 0; entry < MBFS_BLOCK_SIZE / sizeof(DirectoryEntry); entry++, dirent++)
+        {
+            if (!(dirent->flags & MBFS_DIRECTORY_ENTRY_VALID) || (uint8_t)dirent->file_name[0] == 0xFF)
+                continue;
+
+            uint16_t i = hashFilename(dirent->file_name, size);
+            while (hash->entry[i])
+                i = (i + 1) & (size - 1);
+
+            hash->entry[i] = dirent;
+        }
+    }
+
+    return hash;
+}
+
+/**
+  * Discard the filename index of the given directory, if there is one, as its entries have changed.
+  *
+  * @param directory The directory that has changed.
+  */
+void MicroBitFileSystem::invalidateDirectoryHash(const DirectoryEntry *directory)
+{
+    for (int i = 0; i < MBFS_DIRECTORY_HASH_COUNT; i++)
+        if (directoryHash[i] && directoryHash[i]->directory == directory->first_block)
+            directoryHash[i]->directory = 0;
+}
+
 /**
   * Determine the number of logical blocks required to hold the file table.
   *
@@ -318,6 +497,87 @@ uint16_t MicroBitFileSystem::calculateFileTableSize()
     return size;
 }
 
+/**
+  * Determine the number of logical blocks required to hold the wear table.
+  *
+  * @return The number of logical blocks required to hold the wear table.
+  */
+uint16_t MicroBitFileSystem::calculateWearTableSize()
+{
+    uint16_t pages = fileSystemSize / (PAGE_SIZE / MBFS_BLOCK_SIZE);
+    uint16_t size = (pages * 2) / MBFS_BLOCK_SIZE;
+    if ((pages * 2) % MBFS_BLOCK_SIZE)
+        size++;
+
+    return size;
+}
+
+/**
+  * Determine how many times the physical page holding the given block has been erased.
+  *
+  * @param block A valid block number.
+  *
+  * @return The erase count of the page.
+  */
+uint16_t MicroBitFileSystem::getBlockWear(uint16_t block)
+{
+    return eraseCounts[block / (PAGE_SIZE / MBFS_BLOCK_SIZE)];
+}
+
+/**
+  * Erase handler registered with MicroBitFlash. Passes the erasure on to the MicroBitFileSystem given as context.
+  */
+void MicroBitFileSystem::eraseHandler(void *context, uint32_t *page)
+{
+    ((MicroBitFileSystem *)context)->pageErased(page);
+}
+
+/**
+  * Record the erasure of a physical page, scheduling an update of the wear table if enough erases have occurred.
+  *
+  * @param page The address of the page erased.
+  */
+void MicroBitFileSystem::pageErased(uint32_t *page)
+{
+    uint32_t pages = fileSystemSize / (PAGE_SIZE / MBFS_BLOCK_SIZE);
+    uint32_t index = ((uint32_t)page - (uint32_t)fileSystemTable) / PAGE_SIZE;
+
+    // Ignore pages outside the file system, such as the default scratch page.
+    if ((uint32_t)page < (uint32_t)fileSystemTable || index >= pages)
+        return;
+
+    // Saturate below MBFS_UNUSED, which denotes an entry in the wear table that has never been written.
+    if (eraseCounts[index] < MBFS_UNUSED - 1)
+        eraseCounts[index]++;
+
+    // Writing the wear table erases the page holding it, so only do so once every page could have been erased
+    // several times over. Otherwise that page would wear faster than those it is levelling.
+    if (wearTableSize && ++unsyncedErases >= pages * MBFS_WEAR_SYNC_INTERVAL)
+        scheduleIdleTask(MBFS_STATUS_WEAR_PENDING);
+}
+
+/**
+  * Write the erase count of every page back to the wear table in FLASH.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_NOT_SUPPORTED if this file system has no wear table.
+  */
+int MicroBitFileSystem::writeWearTable()
+{
+    int length = (fileSystemSize / (PAGE_SIZE / MBFS_BLOCK_SIZE)) * 2;
+    uint8_t *counts = (uint8_t *)eraseCounts;
+
+    if (wearTableSize == 0)
+        return MICROBIT_NOT_SUPPORTED;
+
+    // Write a block at a time, so that each write stays within a single page.
+    for (uint16_t i = 0; i < wearTableSize; i++)
+        flash.flash_write(getBlock(fileSystemTableSize + i), counts + i * MBFS_BLOCK_SIZE, min(length - i * MBFS_BLOCK_SIZE, MBFS_BLOCK_SIZE), getFreePage());
+
+    unsyncedErases = 0;
+
+    return MICROBIT_OK;
+}
+
 /**
   * Retrieve a memory pointer for the start of the physical memory page containing the given block.
   *
@@ -355,6 +615,50 @@ uint16_t MicroBitFileSystem::getNextFileBlock(uint16_t block)
     return fileSystemTable[block];
 }
 
+/**
+  * Determine the block of a file that holds the given position, starting from the nearest block
+  * recorded in the FileDescriptor rather than the start of the file.
+  *
+  * @param file The open file.
+  * @param position A position in the file, no greater than its length.
+  * @param blockStart Set to the position of the start of the block returned.
+  *
+  * @return The block holding the byte before the given position (or the first block, if the position is zero),
+  *         such that position - blockStart is in the range 0..MBFS_BLOCK_SIZE.
+  */
+uint16_t MicroBitFileSystem::getFileBlock(FileDescriptor *file, uint32_t position, uint32_t *blockStart)
+{
+    uint16_t index = position ? (position - 1) / MBFS_BLOCK_SIZE : 0;
+    uint16_t map = min(index / MBFS_BLOCK_MAP_INTERVAL, file->blockMapLength - 1);
+
+    // Start from the nearest known block at or before the one we want.
+    uint16_t i = map * MBFS_BLOCK_MAP_INTERVAL;
+    uint16_t block = file->blockMap[map];
+
+    if (file->blockIndex <= index && file->blockIndex > i)
+    {
+        i = file->blockIndex;
+        block = file->block;
+    }
+
+    // Walk the file table the rest of the way, filling in the map as we go.
+    while (i < index)
+    {
+        block = getNextFileBlock(block);
+        i++;
+
+        if (i == file->blockMapLength * MBFS_BLOCK_MAP_INTERVAL && file->blockMapLength < MBFS_BLOCK_MAP_SIZE)
+            file->blockMap[file->blockMapLength++] = block;
+    }
+
+    file->block = block;
+    file->blockIndex = index;
+
+    *blockStart = (uint32_t)index * MBFS_BLOCK_SIZE;
+
+    return block;
+}
+
 /**
   * Determine the logical block that contains the given address.
   *
@@ -445,6 +749,10 @@ int MicroBitFileSystem::recycleBlock(uint16_t block, int type)
     uint8_t *write = (uint8_t *)scratch;
     uint16_t b = getBlockNumber(page);
 
+    // We build the new page directly in the scratch page, so it must be blank.
+    if (!flash.is_erased(scratch))
+        flash.erase_page(scratch);
+
     for (int i = 0; i < PAGE_SIZE / MBFS_BLOCK_SIZE; i++)
     {
         // If we have an unused or deleted block, there's nothing to do - allow the block to be recycled.
@@ -467,9 +775,9 @@ int MicroBitFileSystem::recycleBlock(uint16_t block, int type)
             }
         }
 
-        // All blocks before the root directory are the FileTable. 
+        // All blocks before the wear table are the FileTable. 
         // Recycle any entries marked as DELETED to UNUSED.
-        else if (getBlock(b) < (uint32_t *)rootDirectory)
+        else if (b < fileSystemTableSize)
         {
             uint16_t *tableIn = (uint16_t *)getBlock(b);
             uint16_t *tableOut = (uint16_t *)write;
@@ -524,20 +832,170 @@ int MicroBitFileSystem::recycleFileTable()
     }
 
     // now, recycle the FileSystemTable itself, upcycling entries marked as DELETED to UNUSED as we go.
-    for (uint16_t block = 0; getPage(block) < (uint32_t *)rootDirectory; block += PAGE_SIZE / MBFS_BLOCK_SIZE)
+    for (uint16_t block = 0; block < fileSystemTableSize; block += PAGE_SIZE / MBFS_BLOCK_SIZE)
         recycleBlock(block);
 
     return MICROBIT_OK;
 }
 
+/**
+  * Determine if a directory block has any unused entries.
+  *
+  * @param block A valid directory block.
+  * @return true if at least one entry in the block is unused.
+  */
+bool MicroBitFileSystem::hasFreeEntries(uint16_t block)
+{
+    DirectoryEntry *dirent = (DirectoryEntry *)getBlock(block);
+
+    for (uint16_t entry = 0; entry < MBFS_BLOCK_SIZE / sizeof(DirectoryEntry); entry++)
+        if (dirent[entry].flags & MBFS_DIRECTORY_ENTRY_FREE)
+            return true;
+
+    return false;
+}
+
+/**
+  * Determine if the physical page holding the given block of the file table has anything to recycle.
+  *
+  * @param block A block of the file table.
+  * @return true if the page holds any file table entries marked as DELETED, or is itself shared with a DELETED block.
+  */
+bool MicroBitFileSystem::hasDeletedEntries(uint16_t block)
+{
+    uint16_t first = getBlockNumber(getPage(block));
+
+    for (uint16_t b = first; b < first + PAGE_SIZE / MBFS_BLOCK_SIZE; b++)
+    {
+        if (fileSystemTable[b] == MBFS_DELETED)
+            return true;
+
+        if (b >= fileSystemTableSize)
+            continue;
+
+        uint16_t *entry = (uint16_t *)getBlock(b);
+
+        for (int i = 0; i < MBFS_BLOCK_SIZE / 2; i++)
+            if (entry[i] == MBFS_DELETED)
+                return true;
+    }
+
+    return false;
+}
+
+/**
+  * Schedules the recycling of deleted blocks, and optionally a directory block, during idle time.
+  *
+  * @param directoryBlock A directory block holding deleted entries, or zero if there is none.
+  */
+void MicroBitFileSystem::scheduleGarbageCollection(uint16_t directoryBlock)
+{
+    if (directoryBlock)
+    {
+        bool queued = false;
+
+        for (int i = 0; i < gcDirectoryCount; i++)
+            if (gcDirectory[i] == directoryBlock)
+                queued = true;
+
+        // If too many blocks are waiting, there's nothing for it but to recycle this one now.
+        if (!queued)
+        {
+            if (gcDirectoryCount < MBFS_GC_DIRECTORY_BLOCKS)
+                gcDirectory[gcDirectoryCount++] = directoryBlock;
+            else
+                recycleBlock(directoryBlock, MBFS_BLOCK_TYPE_DIRECTORY);
+        }
+    }
+
+    // Start the search for deleted blocks afresh, as there may now be some on pages already checked.
+    gcBlock = 0;
+
+    scheduleIdleTask(MBFS_STATUS_GC_PENDING);
+}
+
+/**
+  * Schedules background work to be performed during idle time.
+  *
+  * @param task One of MBFS_STATUS_GC_PENDING or MBFS_STATUS_WEAR_PENDING.
+  */
+void MicroBitFileSystem::scheduleIdleTask(uint32_t task)
+{
+    status |= task;
+
+    if (!(status & MBFS_STATUS_IDLE) && fiber_add_idle_component(this) == MICROBIT_OK)
+        status |= MBFS_STATUS_IDLE;
+}
+
+/**
+  * A background, low priority callback that is triggered whenever the processor is idle.
+  * Here, we recycle a single page holding deleted data, or bring the wear table up to date.
+  */
+void MicroBitFileSystem::idleTick()
+{
+    int blocksPerPage = PAGE_SIZE / MBFS_BLOCK_SIZE;
+
+    if (status & MBFS_STATUS_GC_PENDING)
+    {
+        // Firstly, free up space in directories, so that log structured files can be updated without extending them.
+        if (gcDirectoryCount > 0)
+        {
+            recycleBlock(gcDirectory[--gcDirectoryCount], MBFS_BLOCK_TYPE_DIRECTORY);
+            return;
+        }
+
+        // Next, erase the deleted blocks, a page at a time. Pages holding the file table are left until last,
+        // as recycling those marks every deleted block as UNUSED, and so available without an erase.
+        while (gcBlock < fileSystemSize)
+        {
+            uint16_t page = gcBlock;
+            gcBlock += blocksPerPage;
+
+            if (getPage(page) <= getPage(fileSystemTableSize - 1))
+                continue;
+
+            for (int i = 0; i < blocksPerPage; i++)
+            {
+                if (fileSystemTable[page + i] == MBFS_DELETED)
+                {
+                    recycleBlock(page);
+                    return;
+                }
+            }
+        }
+
+        // Finally, recycle the pages of the file table that hold DELETED entries (along with any deleted blocks that share them).
+        for (uint16_t block = 0; block < fileSystemTableSize; block += blocksPerPage)
+            if (hasDeletedEntries(block))
+                recycleBlock(block);
+
+        status &= ~MBFS_STATUS_GC_PENDING;
+        return;
+    }
+
+    // Record the erases made since the wear table was last written, including those made by garbage collection.
+    if (status & MBFS_STATUS_WEAR_PENDING)
+    {
+        status &= ~MBFS_STATUS_WEAR_PENDING;
+        writeWearTable();
+    }
+
+    if (!(status & (MBFS_STATUS_GC_PENDING | MBFS_STATUS_WEAR_PENDING)))
+    {
+        fiber_remove_idle_component(this);
+        status &= ~MBFS_STATUS_IDLE;
+    }
+}
 
 /**
   * Allocate a free DiretoryEntry in the given directory, extending and refreshing the directory block if necessary.
   *
   * @param directory The directory to add a DirectoryEntry to
+  * @param recycle If false, a block holding deleted entries is never erased to make room. The directory is extended instead,
+  *                and the block left to be recycled during idle time.
   * @return A pointer to the new DirectoryEntry for the given file, or NULL if it was not possible to allocated resources.
   */
-DirectoryEntry* MicroBitFileSystem::createDirectoryEntry(DirectoryEntry *directory)
+DirectoryEntry* MicroBitFileSystem::createDirectoryEntry(DirectoryEntry *directory, bool recycle)
 {
     Directory *dir;
     uint16_t block;
@@ -545,6 +1003,9 @@ DirectoryEntry* MicroBitFileSystem::createDirectoryEntry(DirectoryEntry *directo
     DirectoryEntry *empty = NULL;
     DirectoryEntry *invalid = NULL;
 
+    // The caller is about to add an entry to this directory, so its index will be out of date.
+    invalidateDirectoryHash(directory);
+
     // Try to find an unused entry in the directory.
     block = directory->first_block;
     dir = (Directory *)getBlock(block);
@@ -591,7 +1052,7 @@ DirectoryEntry* MicroBitFileSystem::createDirectoryEntry(DirectoryEntry *directo
 
     // if not possible, try to re-use a second-hand block that has been freed. This will result in an erase operation of the block,
     // but will not consume any more resources.
-    else if (invalid)
+    else if (invalid && recycle)
     {
         dirent = invalid;
         uint16_t b = getBlockNumber(dirent);
@@ -603,9 +1064,21 @@ DirectoryEntry* MicroBitFileSystem::createDirectoryEntry(DirectoryEntry *directo
     {
         // Allocate a new logical block
         uint16_t newBlock = getFreeBlock();
+
+        // If we're out of space, fall back to erasing a second-hand block after all.
+        if (newBlock == 0 && invalid)
+        {
+            recycleBlock(getBlockNumber(invalid), MBFS_BLOCK_TYPE_DIRECTORY);
+            return invalid;
+        }
+
         if (newBlock == 0)
             return NULL;
 
+        // Leave the second-hand block to be recycled once we're idle.
+        if (invalid)
+            scheduleGarbageCollection(getBlockNumber(invalid));
+
         // Append this to the directory
         uint16_t lastBlock = directory->first_block;
         while (getNextFileBlock(lastBlock) != MBFS_EOF)
@@ -755,15 +1228,24 @@ int MicroBitFileSystem::createDirectory(char const *name)
   *  - MB_READ : read from the file.
   *  - MB_WRITE : write to the file.
   *  - MB_CREAT : create a new file, if it doesn't already exist.
+  *  - MB_APPEND : start at the end of the file.
+  *  - MB_LOG : append every write to the end of the file, regardless of the seek position, so that
+  *             FLASH is never erased to update data already written. Suited to data logging.
   *
   * If a file is opened that doesn't exist, and MB_CREAT isn't passed,
   * an error is returned, otherwise the file is created.
   *
+  * Files opened with MB_WRITE are given a writeback cache of cacheSize bytes. Small, sequential writes
+  * are gathered in the cache, and only written to FLASH when the cache fills, a block boundary is reached,
+  * the file is written to elsewhere, or the file is flushed or closed.
+  *
   * @param filename name of the file to open, must contain only printable characters.
-  * @param flags One or more of MB_READ, MB_WRITE or MB_CREAT. 
+  * @param flags One or more of MB_READ, MB_WRITE, MB_CREAT, MB_APPEND or MB_LOG.
+  * @param cacheSize The size of the writeback cache, in the range 0..MBFS_BLOCK_SIZE bytes. Zero disables the cache.
+  *                  Defaults to MBFS_CACHE_SIZE.
   * @return return the file handle,MICROBIT_NOT_SUPPORTED if the file system has
   *         not been initialised MICROBIT_INVALID_PARAMETER if the filename is
-  *         too large, MICROBIT_NO_RESOURCES if the file system is full.
+  *         too large or the cacheSize is out of range, MICROBIT_NO_RESOURCES if the file system is full.
   *
   * @code
   * MicroBitFileSystem f();
@@ -772,7 +1254,7 @@ int MicroBitFileSystem::createDirectory(char const *name)
   *    print("file open error");
   * @endcode
   */
-int MicroBitFileSystem::open(char const * filename, uint32_t flags)
+int MicroBitFileSystem::open(char const * filename, uint32_t flags, int cacheSize)
 {
     FileDescriptor *file;               // File Descriptor of this file.
     DirectoryEntry* directory;          // Directory holding this file.
@@ -783,8 +1265,8 @@ int MicroBitFileSystem::open(char const * filename, uint32_t flags)
     if ((status & MBFS_STATUS_INITIALISED) == 0)
         return MICROBIT_NOT_SUPPORTED;
 
-    // Reject invalid filenames.
-    if(!isValidFilename(filename))
+    // Reject invalid filenames, and caches that could span more than one block.
+    if(!isValidFilename(filename) || cacheSize < 0 || cacheSize > MBFS_BLOCK_SIZE)
         return MICROBIT_INVALID_PARAMETER;
 
     // Determine the directory for this file.
@@ -839,7 +1321,31 @@ int MicroBitFileSystem::open(char const * filename, uint32_t flags)
     file->seek = (flags & MB_APPEND) ? file->length : 0;
     file->dirent = dirent;
     file->directory = directory;
+
+    // Only files we can write to need a writeback cache.
+    file->cache = NULL;
+    file->cacheSize = 0;
     file->cacheLength = 0;
+    file->cacheStart = 0;
+
+    if ((flags & MB_WRITE) && cacheSize > 0)
+    {
+        file->cache = new uint8_t[cacheSize];
+
+        if (file->cache == NULL)
+        {
+            delete file;
+            return MICROBIT_NO_RESOURCES;
+        }
+
+        file->cacheSize = cacheSize;
+    }
+
+    // The only block we know of so far is the first.
+    file->block = dirent->first_block;
+    file->blockIndex = 0;
+    file->blockMap[0] = dirent->first_block;
+    file->blockMapLength = 1;
 
     // Add the file descriptor to the chain of open files.
     file->next = openFiles;
@@ -857,7 +1363,7 @@ int MicroBitFileSystem::open(char const * filename, uint32_t flags)
   * @param fd file descriptor - obtained with open().
   * @return MICROBIT_OK on success, MICROBIT_NOT_SUPPORTED if the file system has not
   *         been initialised, MICROBIT_INVALID_PARAMETER if the given file handle
-  *         is invalid.
+  *         is invalid, or MICROBIT_NO_RESOURCES if the directory could not be updated.
   *
   * @code
   * MicroBitFileSystem f();
@@ -897,15 +1403,26 @@ int MicroBitFileSystem::flush(int fd)
         }
 
         // Otherwise, replace the dirent with a freshly allocated one, and mark the other as INVALID.
+        // Log structured files avoid erasing the directory to do so, and leave the old entry to be recycled when idle.
         else
         {
             DirectoryEntry *newDirent;
             uint16_t value = MBFS_DELETED;
+            bool log = (file->flags & MB_LOG) != 0;
+
+            // create a new directory entry with the updated data, then invalidate the old one.
+            newDirent = createDirectoryEntry(file->directory, !log);
+            if (newDirent == NULL)
+                return MICROBIT_NO_RESOURCES;
 
-            // invalidate the old directory entry and create a new one with the updated data.
-            flash.flash_write(&file->dirent->flags, &value, 2);
-            newDirent = createDirectoryEntry(file->directory);
             flash.flash_write(newDirent, &d, sizeof(DirectoryEntry));
+            flash.flash_write(&file->dirent->flags, &value, 2);
+
+            // Only recycle the old entry's block once it is full. Until then, the directory still has room to grow without an erase.
+            if (log && !hasFreeEntries(getBlockNumber(file->dirent)))
+                scheduleGarbageCollection(getBlockNumber(file->dirent));
+
+            file->dirent = newDirent;
         }
     }
 
@@ -945,7 +1462,10 @@ int MicroBitFileSystem::close(int fd)
 
     // Remove the file descriptor from the list of open files, and free it.
     // n.b. we know this is safe, as flush() validates this.
-    delete getFileDescriptor(fd, true);
+    FileDescriptor *file = getFileDescriptor(fd, true);
+
+    delete[] file->cache;
+    delete file;
 
     return MICROBIT_OK;
 }
@@ -987,22 +1507,20 @@ int MicroBitFileSystem::seek(int fd, int offset, uint8_t flags)
 
     if (file == NULL)
         return MICROBIT_INVALID_PARAMETER;
-    
-    // Flush any data in the writeback cache.
-    writeBack(file);
 
+    // n.b. any data in the writeback cache is left there. It is written back by the next write elsewhere in the file.
     position = file->seek;
 
     if(flags == MB_SEEK_SET)
         position = offset;
     
     if(flags == MB_SEEK_END)
-        position = file->length + offset;
+        position = getFileLength(file) + offset;
     
     if (flags == MB_SEEK_CUR)
         position = file->seek + offset;
     
-    if (position < 0 || (uint32_t)position > file->length)
+    if (position < 0 || (uint32_t)position > getFileLength(file))
         return MICROBIT_INVALID_PARAMETER;
 
     file->seek = position;
@@ -1041,7 +1559,9 @@ int MicroBitFileSystem::read(int fd, uint8_t* buffer, int size)
 
     uint32_t offset;
     uint32_t position = 0;
+    uint32_t start, end;
     int bytesCopied = 0;
+    int flashLength;
     int segmentLength;
 
     // Protect against accidental re-initialisation
@@ -1054,32 +1574,27 @@ int MicroBitFileSystem::read(int fd, uint8_t* buffer, int size)
     if (file == NULL || buffer == NULL || size == 0)
         return MICROBIT_INVALID_PARAMETER;
 
-    // Flush any data in the writeback cache before we change the seek pointer.
-    writeBack(file);
-
     // Validate the read length.
-    size = min(size, file->length - file->seek);
+    size = min(size, getFileLength(file) - file->seek);
 
-    // Find the read position.
-    block = file->dirent->first_block; 
+    // Only the part of the file already written back is read from FLASH. Any data in the writeback cache
+    // is copied over it afterwards, so the cache needn't be flushed first.
+    flashLength = file->seek < file->length ? min(size, file->length - file->seek) : 0;
 
-    // Walk the file table until we reach the start block
-    while (file->seek - position > MBFS_BLOCK_SIZE)
-    {
-        block = getNextFileBlock(block);
-        position += MBFS_BLOCK_SIZE;
-    }
+    // Find the read position.
+    if (flashLength > 0)
+        block = getFileBlock(file, file->seek, &position);
 
     // Once we have the correct start block, handle the byte offset.
     offset = file->seek - position;
 
     // Now, start copying bytes into the requested buffer.
     writePointer = buffer;
-    while (bytesCopied < size)
+    while (bytesCopied < flashLength)
     {
         // First, determine if we need to write a partial block.
         readPointer = (uint8_t *)getBlock(block) + offset;
-        segmentLength = min(size - bytesCopied, MBFS_BLOCK_SIZE - offset);
+        segmentLength = min(flashLength - bytesCopied, MBFS_BLOCK_SIZE - offset);
 
         if(segmentLength > 0)
             memcpy(writePointer, readPointer, segmentLength);
@@ -1095,9 +1610,19 @@ int MicroBitFileSystem::read(int fd, uint8_t* buffer, int size)
         }
     }
 
-    file->seek += bytesCopied;
+    // Overlay any cached data that overlaps the region read.
+    if (file->cacheLength)
+    {
+        start = max(file->seek, file->cacheStart);
+        end = min(file->seek + size, file->cacheStart + file->cacheLength);
 
-    return bytesCopied;
+        if (start < end)
+            memcpy(buffer + (start - file->seek), file->cache + (start - file->cacheStart), end - start);
+    }
+
+    file->seek += size;
+
+    return size;
 }
 
 /**
@@ -1111,44 +1636,58 @@ int MicroBitFileSystem::writeBack(FileDescriptor *file)
 {
     if (file->cacheLength)
     {
-        int r = writeBuffer(file, file->cache, file->cacheLength);
+        int r = writeBuffer(file, file->cacheStart, file->cache, file->cacheLength);
         file->cacheLength = 0;
+
+        // If the file system is full, some cached data may have been lost. Ensure we don't seek beyond the end of the file.
+        if (file->seek > file->length)
+            file->seek = file->length;
+
         return r;
     }
 
     return 0;
 }
 
+/**
+  * Determine the length of a file, including any data held in its writeback cache.
+  *
+  * @param file The open file.
+  * @return The length of the file, in bytes.
+  */
+uint32_t MicroBitFileSystem::getFileLength(FileDescriptor *file)
+{
+    if (file->cacheLength)
+        return max(file->length, file->cacheStart + file->cacheLength);
+
+    return file->length;
+}
+
 /**
   * Write a given buffer to the file provided.
   *
   * @param file FileDescriptor of the file to write
+  * @param position The position in the file to write to, no greater than its length
   * @param buffer The start of the buffer to write
   * @param length The number of bytes to write
+  * @return The number of bytes written.
   */
-int MicroBitFileSystem::writeBuffer(FileDescriptor *file, uint8_t *buffer, int size)
+int MicroBitFileSystem::writeBuffer(FileDescriptor *file, uint32_t position, uint8_t *buffer, int size)
 {
     uint16_t block, newBlock;
     uint8_t *readPointer;
     uint8_t *writePointer;
 
     uint32_t offset;
-    uint32_t position = 0;
+    uint32_t blockStart = 0;
     int bytesCopied = 0;
     int segmentLength;
 
-    // Find the read position.
-    block = file->dirent->first_block;
-
-    // Walk the file table until we reach the start block
-    while (file->seek - position > MBFS_BLOCK_SIZE)
-    {
-        block = getNextFileBlock(block);
-        position += MBFS_BLOCK_SIZE;
-    }
+    // Find the write position.
+    block = getFileBlock(file, position, &blockStart);
 
     // Once we have the correct start block, handle the byte offset.
-    offset = file->seek - position;
+    offset = position - blockStart;
     writePointer = (uint8_t *)getBlock(block) + offset;
 
     // Now, start copying bytes from the requested buffer.
@@ -1159,7 +1698,7 @@ int MicroBitFileSystem::writeBuffer(FileDescriptor *file, uint8_t *buffer, int s
         segmentLength = min(size - bytesCopied, MBFS_BLOCK_SIZE - offset);
 
         if (segmentLength != 0)
-            flash.flash_write(writePointer, readPointer, segmentLength, file->seek + bytesCopied < file->length ? getFreePage() : NULL);
+            flash.flash_write(writePointer, readPointer, segmentLength, position + bytesCopied < file->length ? getFreePage() : NULL);
 
         offset += segmentLength;
         bytesCopied += segmentLength;
@@ -1181,9 +1720,8 @@ int MicroBitFileSystem::writeBuffer(FileDescriptor *file, uint8_t *buffer, int s
         }
     }
 
-    // update the filelength metadata and seek position such that multiple writes are sequential.
-    file->length = max(file->length, file->seek + bytesCopied);
-    file->seek += bytesCopied;
+    // update the filelength metadata.
+    file->length = max(file->length, position + bytesCopied);
 
     return bytesCopied;
 }
@@ -1240,6 +1778,7 @@ int MicroBitFileSystem::write(int fd, uint8_t* buffer, int size)
     FileDescriptor *file;
     int bytesCopied = 0;
     int segmentSize;
+    int limit;
 
     // Protect against accidental re-initialisation
     if ((status & MBFS_STATUS_INITIALISED) == 0)
@@ -1251,32 +1790,48 @@ int MicroBitFileSystem::write(int fd, uint8_t* buffer, int size)
     if (file == NULL || buffer == NULL || size == 0)
         return MICROBIT_INVALID_PARAMETER;
 
+    // Log structured files are only ever appended to, so data always lands in erased FLASH.
+    if (file->flags & MB_LOG)
+        file->seek = getFileLength(file);
+
     // Determine how to handle the write. If the buffer size is less than our cache size, 
     // write the data via the cache. Otherwise, a direct write through is likely more efficient.
     // This may take a few iterations if the cache is already quite full.
-    if (size < MBFS_CACHE_SIZE)
+    if (size < file->cacheSize)
     {
         while (bytesCopied < size)
         {
-            segmentSize = min(size, MBFS_CACHE_SIZE - file->cacheLength);
-            memcpy(&file->cache[file->cacheLength], buffer, segmentSize);
+            // Cached data must be contiguous, so write back anything cached for elsewhere in the file.
+            if (file->cacheLength && file->seek != file->cacheStart + file->cacheLength)
+                writeBack(file);
+
+            if (file->cacheLength == 0)
+                file->cacheStart = file->seek;
+
+            // Never let the cache span a block boundary, so that each write back updates a single block.
+            limit = min(file->cacheSize, MBFS_BLOCK_SIZE - file->cacheStart % MBFS_BLOCK_SIZE);
+
+            segmentSize = min(size - bytesCopied, limit - file->cacheLength);
+            memcpy(&file->cache[file->cacheLength], buffer + bytesCopied, segmentSize);
 
             file->cacheLength += segmentSize;
+            file->seek += segmentSize;
             bytesCopied += segmentSize;
-            
-            if (file->cacheLength == MBFS_CACHE_SIZE)
-                writeBack(file);
-
 
+            if (file->cacheLength == limit)
+                writeBack(file);
         }
 
         return bytesCopied;
     }
 
-    // If we have a relatively large block, then write it directly (
+    // If we have a relatively large block, then write it directly.
     writeBack(file);
 
-    return writeBuffer(file, buffer, size);
+    bytesCopied = writeBuffer(file, file->seek, buffer, size);
+    file->seek += bytesCopied;
+
+    return bytesCopied;
 }
 
 /**
@@ -1318,10 +1873,74 @@ int MicroBitFileSystem::remove(char const * filename)
     // Mark the directory entry of this file as invalid.
     value = MBFS_DIRECTORY_ENTRY_DELETED;
     flash.flash_write(&file->dirent->flags, &value, 2);
+    invalidateDirectoryHash(file->directory);
+
+    // Reclaim the space once we're idle, rather than when it's next needed.
+    scheduleGarbageCollection();
 
     // release file metadata
+    delete[] file->cache;
     delete file;
 
     return MICROBIT_OK;
 }
 
+/**
+  * Determine how many times a physical page of the file system has been erased.
+  *
+  * @param page The index of the page, from zero at the start of the file system.
+  * @return the erase count of the page, MICROBIT_NOT_SUPPORTED if the file system has not been
+  *         initialised, or MICROBIT_INVALID_PARAMETER if the page is out of range.
+  *
+  * @note Erase counts are written to FLASH periodically, so a few of the most recent erases may be lost on reset.
+  */
+int MicroBitFileSystem::getEraseCount(int page)
+{
+    // Protect against accidental re-initialisation
+    if ((status & MBFS_STATUS_INITIALISED) == 0)
+        return MICROBIT_NOT_SUPPORTED;
+
+    if (page < 0 || page >= fileSystemSize / (PAGE_SIZE / MBFS_BLOCK_SIZE))
+        return MICROBIT_INVALID_PARAMETER;
+
+    return eraseCounts[page];
+}
+
+/**
+  * Summarise how evenly erases have been spread across the physical pages of the file system.
+  *
+  * @param statistics Set to the number of pages, and their minimum, maximum, mean and total erase counts.
+  * @return MICROBIT_OK on success, or MICROBIT_NOT_SUPPORTED if the file system has not been initialised.
+  *
+  * @code
+  * MicroBitFileSystem f;
+  * WearStatistics wear;
+  * f.getWearStatistics(wear);
+  * uBit.serial.printf("pages erased %d..%d times\r\n", wear.minimum, wear.maximum);
+  * @endcode
+  */
+int MicroBitFileSystem::getWearStatistics(WearStatistics &statistics)
+{
+    // Protect against accidental re-initialisation
+    if ((status & MBFS_STATUS_INITIALISED) == 0)
+        return MICROBIT_NOT_SUPPORTED;
+
+    statistics.pages = fileSystemSize / (PAGE_SIZE / MBFS_BLOCK_SIZE);
+    statistics.minimum = MBFS_UNUSED;
+    statistics.maximum = 0;
+    statistics.total = 0;
+
+    for (int i = 0; i < statistics.pages; i++)
+    {
+        statistics.minimum = min(statistics.minimum, eraseCounts[i]);
+        statistics.maximum = max(statistics.maximum, eraseCounts[i]);
+        statistics.total += eraseCounts[i];
+    }
+
+    statistics.mean = statistics.pages ? statistics.total / statistics.pages : 0;
+
+    if (statistics.pages == 0)
+        statistics.minimum = 0;
+
+    return MICROBIT_OK;
+}
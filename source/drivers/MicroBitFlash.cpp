@@ -12,6 +12,8 @@
   */
 MicroBitFlash::MicroBitFlash() 
 {
+    eraseHandler = NULL;
+    eraseContext = NULL;
 }
 
 /**
@@ -55,6 +57,34 @@ void MicroBitFlash::erase_page(uint32_t* pg_addr)
     // Turn off flash erase enable and wait until the NVMC is ready:
     NRF_NVMC->CONFIG = (NVMC_CONFIG_WEN_Ren << NVMC_CONFIG_WEN_Pos);
     while (NRF_NVMC->READY == NVMC_READY_READY_Busy) { }
+
+    if (eraseHandler)
+        eraseHandler(eraseContext, pg_addr);
+}
+
+/**
+  * Check if an entire page is erased.
+  * @param page_address address of first word of page.
+  * @return true if every word of the page is erased.
+  */
+bool MicroBitFlash::is_erased(uint32_t* pg_addr)
+{
+    for (int i = 0; i < PAGE_SIZE / 4; i++)
+        if (pg_addr[i] != 0xFFFFFFFF)
+            return false;
+
+    return true;
+}
+
+/**
+  * Registers a function to be called each time a page is erased, e.g. to monitor wear.
+  * @param handler the function to call, or NULL to remove any existing handler.
+  * @param context a value passed to the handler on each call.
+  */
+void MicroBitFlash::setEraseHandler(MicroBitFlashEraseHandler handler, void *context)
+{
+    eraseHandler = handler;
+    eraseContext = context;
 }
  
 /**
@@ -127,6 +157,10 @@ int MicroBitFlash::flash_write(void* address, void* from_buffer,
         if (!scratch_addr)
             return MICROBIT_INVALID_PARAMETER;
 
+        // Only erase the scratch page now we know it's needed, and only if it holds anything.
+        if (!this->is_erased((uint32_t*)scratch_addr))
+            this->erase_page((uint32_t*)scratch_addr);
+
         this->flash_burn((uint32_t*)scratch_addr, pgAddr, PAGE_SIZE/4);
         this->erase_page(pgAddr);
         writeFrom = (uint8_t*)scratch_addr;
@@ -25,11 +25,14 @@ DEALINGS IN THE SOFTWARE.
 
 #include "MicroBitConfig.h"
 #include "MicroBitRadio.h"
+#include "MicroBitRadioSniffer.h"
 #include "MicroBitComponent.h"
 #include "EventModel.h"
 #include "MicroBitDevice.h"
 #include "ErrorNo.h"
 #include "MicroBitFiber.h"
+#include "MicroBitSystemTimer.h"
+#include "NotifyEvents.h"
 #include "MicroBitBLEManager.h"
 
 /**
@@ -38,12 +41,13 @@ DEALINGS IN THE SOFTWARE.
   * The nrf51822 RADIO module supports a number of proprietary modes of operation in addition to the typical BLE usage.
   * This class uses one of these modes to enable simple, point to multipoint communication directly between micro:bits.
   *
-  * TODO: The protocols implemented here do not currently perform any significant form of energy management,
-  * which means that they will consume far more energy than their BLE equivalent. Later versions of the protocol
-  * should look to address this through energy efficient broadcast techniques / sleep scheduling. In particular, the GLOSSY
-  * approach to efficient rebroadcast and network synchronisation would likely provide an effective future step.
+  * By default, the receiver is left on permanently, which means that it will consume far more energy than its BLE
+  * equivalent. setDutyCycle() provides simple low power listening, where the receiver wakes periodically and senders
+  * repeat each packet to cover the interval. More sophisticated sleep scheduling, such as the GLOSSY approach to
+  * efficient rebroadcast and network synchronisation, would likely provide an effective future step.
   *
-  * TODO: Meshing should also be considered - again a GLOSSY approach may be effective here, and highly complementary to
+  * Meshing is provided by MicroBitRadioMesh, which floods packets across multiple hops with randomised rebroadcast.
+  * A synchronous, GLOSSY style rebroadcast may still be a worthwhile refinement, and is highly complementary to
   * the master/slave arachitecture of BLE.
   *
   * TODO: This implementation may only operated whilst the BLE stack is disabled. The nrf51822 provides a timeslot API to allow
@@ -63,35 +67,73 @@ extern "C" void RADIO_IRQHandler(void)
     {
         NRF_RADIO->EVENTS_READY = 0;
 
-        // Start listening and wait for the END event
+        if(MicroBitRadio::instance->getTransmitStatus() & MICROBIT_RADIO_STATUS_TRANSMITTING)
+            MicroBitRadio::instance->transmitStarting();
+
+        // Start listening (or sending) and wait for the END event
         NRF_RADIO->TASKS_START = 1;
     }
 
     if(NRF_RADIO->EVENTS_END)
     {
         NRF_RADIO->EVENTS_END = 0;
-        if(NRF_RADIO->CRCSTATUS == 1)
-        {
-            int sample = (int)NRF_RADIO->RSSISAMPLE;
 
-            // Associate this packet's rssi value with the data just
-            // transferred by DMA receive
-            MicroBitRadio::instance->setRSSI(-sample);
+        int txStatus = MicroBitRadio::instance->getTransmitStatus();
 
-            // Now move on to the next buffer, if possible.
-            // The queued packet will get the rssi value set above.
-            MicroBitRadio::instance->queueRxBuf();
+        // The radio raises ADDRESS when it sends a packet as well as when it receives one.
+        // Either way, the packet is complete, so we mustn't mistake it for one in progress.
+        NRF_RADIO->EVENTS_ADDRESS = 0;
 
-            // Set the new buffer for DMA
-            NRF_RADIO->PACKETPTR = (uint32_t) MicroBitRadio::instance->getRxBuf();
+        if(txStatus & MICROBIT_RADIO_STATUS_TRANSMITTING)
+        {
+            // A queued packet has been sent. Move on to the next one, or back to receiving.
+            MicroBitRadio::instance->packetTransmitted();
         }
         else
         {
-            MicroBitRadio::instance->setRSSI(0);
+            bool sleeping = false;
+
+            // Let any sniffer see the packet, before we decide what to do with it.
+            MicroBitRadio::instance->frameReceived(NRF_RADIO->CRCSTATUS == 1);
+
+            if(NRF_RADIO->CRCSTATUS == 1)
+            {
+                int sample = (int)NRF_RADIO->RSSISAMPLE;
+
+                // Associate this packet's rssi value with the data just
+                // transferred by DMA receive
+                MicroBitRadio::instance->setRSSI(-sample);
+
+                // Now move on to the next buffer, if possible.
+                // The queued packet will get the rssi value set above.
+                MicroBitRadio::instance->queueRxBuf();
+
+                // Set the new buffer for DMA
+                NRF_RADIO->PACKETPTR = (uint32_t) MicroBitRadio::instance->getRxBuf();
+
+                // If we're duty cycling, the sender will be repeating this packet. Sleep until it has finished.
+                sleeping = MicroBitRadio::instance->dutyCycleReceived();
+            }
+            else
+            {
+                MicroBitRadio::instance->setRSSI(0);
+            }
+
+            // Start listening and wait for the END event, unless we're turning the receiver off to transmit or sleep.
+            if(!(txStatus & MICROBIT_RADIO_STATUS_TX_PENDING) && !sleeping)
+                NRF_RADIO->TASKS_START = 1;
         }
+    }
 
-        // Start listening and wait for the END event
-        NRF_RADIO->TASKS_START = 1;
+    if(NRF_RADIO->EVENTS_DISABLED)
+    {
+        NRF_RADIO->EVENTS_DISABLED = 0;
+
+        // Any packet part way through being received has been abandoned.
+        NRF_RADIO->EVENTS_ADDRESS = 0;
+
+        // Turn the radio back on, as a transmitter or a receiver as appropriate.
+        MicroBitRadio::instance->radioDisabled();
     }
 }
 
@@ -107,11 +149,41 @@ MicroBitRadio::MicroBitRadio(uint16_t id) : datagram(*this), event (*this)
 {
     this->id = id;
     this->status = 0;
-	this->group = MICROBIT_RADIO_DEFAULT_GROUP;
-	this->queueDepth = 0;
+    this->groupMask = 1;
+    this->protocolCount = 0;
     this->rssi = 0;
-    this->rxQueue = NULL;
-    this->rxBuf = NULL;
+    this->rxRing = NULL;
+    this->rxRingSize = 0;
+    this->rxHead = 0;
+    this->rxTail = 0;
+    this->rxDropped = 0;
+    this->sniffer = NULL;
+    this->txQueued = 0;
+    this->txCompleted = 0;
+    this->txTrainEnd = 0;
+    this->dutyInterval = 0;
+    this->dutyWindow = 0;
+    this->dutyWake = 0;
+    this->dutySleep = 0;
+
+    memset(groups, 0, sizeof(groups));
+    groups[0] = MICROBIT_RADIO_DEFAULT_GROUP;
+    this->csmaAttempts = 0;
+    this->csmaBackoff = 0;
+    this->csmaThreshold = MICROBIT_RADIO_CSMA_DEFAULT_THRESHOLD;
+    this->csmaDeadline = 0;
+    this->meshService = NULL;
+    this->timesyncService = NULL;
+    this->tdmaService = NULL;
+    this->neighbourTable = NULL;
+
+    memset(&csmaStatistics, 0, sizeof(csmaStatistics));
+
+    // Register the built in protocols. The optional services register theirs when they are first used.
+    registerProtocol(MICROBIT_RADIO_PROTOCOL_DATAGRAM, &datagram, &MicroBitRadioDatagram::packetReceived);
+    registerProtocol(MICROBIT_RADIO_PROTOCOL_EVENTBUS, &event, &MicroBitRadioEvent::packetReceived);
+    registerProtocol(MICROBIT_RADIO_PROTOCOL_RELIABLE, &datagram, &MicroBitRadioDatagram::reliablePacketReceived);
+    registerProtocol(MICROBIT_RADIO_PROTOCOL_FRAGMENT, &datagram, &MicroBitRadioDatagram::fragmentReceived);
 
     instance = this;
 }
@@ -125,92 +197,671 @@ MicroBitRadio::MicroBitRadio(uint16_t id) : datagram(*this), event (*this)
   */
 int MicroBitRadio::setTransmitPower(int power)
 {
-    if (power < 0 || power >= MICROBIT_BLE_POWER_LEVELS)
+    if (power < 0 || power >= MICROBIT_BLE_POWER_LEVELS)
+        return MICROBIT_INVALID_PARAMETER;
+
+    NRF_RADIO->TXPOWER = (uint32_t)MICROBIT_BLE_POWER_LEVEL[power];
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Change the transmission and reception band of the radio to the given channel
+  *
+  * @param band a frequency band in the range 0 - 100. Each step is 1MHz wide, based at 2400MHz.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if the value is out of range,
+  *         or MICROBIT_NOT_SUPPORTED if the BLE stack is running.
+  */
+int MicroBitRadio::setFrequencyBand(int band)
+{
+    if (ble_running())
+        return MICROBIT_NOT_SUPPORTED;
+
+    if (band < 0 || band > 100)
+        return MICROBIT_INVALID_PARAMETER;
+
+    NRF_RADIO->FREQUENCY = (uint32_t)band;
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Retrieve a pointer to the currently allocated receive buffer. This is the area of memory
+  * actively being used by the radio hardware to store incoming data.
+  *
+  * @return a pointer to the current receive buffer, or NULL if no buffers have been allocated.
+  */
+FrameBuffer* MicroBitRadio::getRxBuf()
+{
+    if (rxRing == NULL)
+        return NULL;
+
+    return &rxRing[rxHead];
+}
+
+/**
+  * Allocates the ring of receive buffers, discarding any packets held in the previous one.
+  *
+  * @param depth the number of packets the receive queue can hold.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if the buffers could not be allocated.
+  */
+int MicroBitRadio::allocateRxRing(int depth)
+{
+    // One buffer more than the queue depth, as the RADIO hardware always owns the buffer at rxHead.
+    FrameBuffer *ring = new FrameBuffer[depth + 1];
+
+    if (ring == NULL)
+        return MICROBIT_NO_RESOURCES;
+
+    if (rxRing != NULL)
+        delete[] rxRing;
+
+    rxRing = ring;
+    rxRingSize = depth + 1;
+    rxHead = 0;
+    rxTail = 0;
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Attempt to queue a buffer received by the radio hardware, if sufficient space is available.
+  * This is O(1), and performs no memory allocation, so is safe to call from RADIO_IRQHandler.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if the receive queue is full, in which
+  *         case the packet is dropped and its buffer reused for the next packet.
+  */
+int MicroBitRadio::queueRxBuf()
+{
+    if (rxRing == NULL)
+        return MICROBIT_INVALID_PARAMETER;
+
+    uint8_t next = rxHead + 1 == rxRingSize ? 0 : rxHead + 1;
+
+    if (next == rxTail)
+    {
+        rxDropped++;
+        return MICROBIT_NO_RESOURCES;
+    }
+
+    // Store the received RSSI value, time of reception, and the group it was received on in the frame
+    rxRing[rxHead].group = groups[NRF_RADIO->RXMATCH & (MICROBIT_RADIO_MAX_GROUPS - 1)];
+    rxRing[rxHead].rssi = getRSSI();
+    rxRing[rxHead].timestamp = (uint32_t)system_timer_current_time_us();
+
+    // Hand the buffer on to higher layer protocols/apps, and move the receiver hardware on to the next one.
+    rxHead = next;
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Changes the number of received packets that can be held awaiting processing. The buffers for
+  * these packets are allocated up front, so that no memory allocation takes place on reception.
+  *
+  * @param depth the number of packets to hold, in the range 1..MICROBIT_RADIO_MAXIMUM_QUEUE_DEPTH.
+  *        The default is MICROBIT_RADIO_MAXIMUM_RX_BUFFERS.
+  *
+  * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if depth is out of range,
+  *         MICROBIT_NO_RESOURCES if the buffers could not be allocated, or MICROBIT_NOT_SUPPORTED
+  *         if the BLE stack is running.
+  *
+  * @note Any packets awaiting processing are discarded. If the radio is enabled, it is briefly
+  *       disabled whilst the buffers are replaced.
+  */
+int MicroBitRadio::setQueueDepth(int depth)
+{
+    if (ble_running())
+        return MICROBIT_NOT_SUPPORTED;
+
+    if (depth < 1 || depth > MICROBIT_RADIO_MAXIMUM_QUEUE_DEPTH)
+        return MICROBIT_INVALID_PARAMETER;
+
+    // Stop the RADIO hardware from writing into the buffers we're about to free.
+    bool enabled = status & MICROBIT_RADIO_STATUS_INITIALISED;
+
+    if (enabled)
+        disable();
+
+    int result = allocateRxRing(depth);
+
+    if (enabled)
+        enable();
+
+    return result;
+}
+
+/**
+  * Determines the number of valid packets that have been discarded because the receive queue was full.
+  *
+  * @return the number of packets dropped since the radio was created.
+  */
+int MicroBitRadio::getDroppedPackets()
+{
+    return rxDropped;
+}
+
+/**
+  * Adds a copy of the given packet to the transmit queue, and wakes the transmitter if it is idle.
+  *
+  * @param buffer the packet to queue.
+  *
+  * @param group the group to send the packet to.
+  *
+  * @return the sequence number of the queued packet, which txCompleted will reach once it has been sent,
+  *         MICROBIT_INVALID_PARAMETER if the packet is invalid, MICROBIT_NOT_SUPPORTED if the radio is not
+  *         enabled, or MICROBIT_NO_RESOURCES if the transmit queue is full.
+  */
+int MicroBitRadio::queueTxBuf(FrameBuffer *buffer, uint8_t group)
+{
+    if (ble_running() || !(status & MICROBIT_RADIO_STATUS_INITIALISED))
+        return MICROBIT_NOT_SUPPORTED;
+
+    if (buffer == NULL)
+        return MICROBIT_INVALID_PARAMETER;
+
+    if (buffer->length > MICROBIT_RADIO_MAX_PACKET_SIZE + MICROBIT_RADIO_HEADER_SIZE - 1)
+        return MICROBIT_INVALID_PARAMETER;
+
+    // Note the group in the packet, so that the RADIO interrupt handler can select the address to send it to.
+    buffer->group = group;
+
+    // We may be called from both fibers and interrupt handlers, so protect the producer side of the queue.
+    __disable_irq();
+
+    if (!txQueue.push(*buffer))
+    {
+        __enable_irq();
+        return MICROBIT_NO_RESOURCES;
+    }
+
+    int sequence = ++txQueued;
+
+    // If the transmitter is idle, and we're not being held back, start sending.
+    if (!(status & (MICROBIT_RADIO_STATUS_TX_PENDING | MICROBIT_RADIO_STATUS_TRANSMITTING | MICROBIT_RADIO_STATUS_TX_HELD | MICROBIT_RADIO_STATUS_TX_BACKOFF)))
+        startTransmitter();
+
+    __enable_irq();
+
+    return sequence;
+}
+
+/**
+  * Turns the receiver off, so that RADIO_IRQHandler starts sending the transmit queue.
+  * If CSMA is enabled and the channel is busy, transmission is instead deferred for a random backoff.
+  *
+  * @note must be called with interrupts disabled, whilst the transmitter is idle.
+  */
+void MicroBitRadio::startTransmitter()
+{
+    if (csmaAttempts && channelBusy())
+    {
+        if (++csmaBackoff < csmaAttempts)
+        {
+            // Back off for a random time, from a window that doubles each time we find the channel busy.
+            int window = min(MICROBIT_RADIO_CSMA_MIN_WINDOW << (csmaBackoff - 1), MICROBIT_RADIO_CSMA_MAX_WINDOW);
+
+            csmaDeadline = (uint32_t)system_timer_current_time() + 1 + microbit_random(window);
+            csmaStatistics.deferrals++;
+            status |= MICROBIT_RADIO_STATUS_TX_BACKOFF;
+
+            return;
+        }
+
+        csmaStatistics.failures++;
+    }
+
+    csmaBackoff = 0;
+    status |= MICROBIT_RADIO_STATUS_TX_PENDING;
+
+    // If we're sleeping, the receiver may already be off, in which case we can start sending right away.
+    if ((status & MICROBIT_RADIO_STATUS_SLEEPING) && NRF_RADIO->STATE == RADIO_STATE_STATE_Disabled)
+    {
+        NRF_RADIO->EVENTS_DISABLED = 0;
+        radioDisabled();
+    }
+    else
+    {
+        NRF_RADIO->TASKS_DISABLE = 1;
+    }
+}
+
+/**
+  * Holds packets in the transmit queue rather than sending them, or releases them for transmission.
+  * This is used to confine transmission to a time slot, and has no effect on reception.
+  *
+  * @param hold true to hold packets, false to send them as normal.
+  *
+  * @return MICROBIT_OK.
+  *
+  * @note A packet already being sent is completed, but no further packets are started whilst held.
+  *       Fibers blocked in send() remain blocked until their packet has been released and sent.
+  */
+int MicroBitRadio::setTransmitHold(bool hold)
+{
+    __disable_irq();
+
+    if (hold)
+    {
+        status |= MICROBIT_RADIO_STATUS_TX_HELD;
+    }
+    else
+    {
+        status &= ~MICROBIT_RADIO_STATUS_TX_HELD;
+
+        if ((status & MICROBIT_RADIO_STATUS_INITIALISED) && !txQueue.isEmpty() &&
+            !(status & (MICROBIT_RADIO_STATUS_TX_PENDING | MICROBIT_RADIO_STATUS_TRANSMITTING | MICROBIT_RADIO_STATUS_TX_BACKOFF)))
+            startTransmitter();
+    }
+
+    __enable_irq();
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Determines whether the RADIO hardware is being used to send queued packets.
+  *
+  * @return MICROBIT_RADIO_STATUS_TRANSMITTING if the transmitter is on, MICROBIT_RADIO_STATUS_TX_PENDING
+  *         if the receiver is being turned off in order to transmit, or zero otherwise.
+  */
+int MicroBitRadio::getTransmitStatus()
+{
+    return status & (MICROBIT_RADIO_STATUS_TX_PENDING | MICROBIT_RADIO_STATUS_TRANSMITTING);
+}
+
+/**
+  * Passes the frame just received to the attached sniffer, if any, whether or not it is valid.
+  *
+  * @param valid true if the frame passed its CRC check.
+  *
+  * @note should only be called from RADIO_IRQHandler, before the frame is queued.
+  */
+void MicroBitRadio::frameReceived(bool valid)
+{
+    if (sniffer != NULL && rxRing != NULL)
+        sniffer->frameCaptured(&rxRing[rxHead], groups[NRF_RADIO->RXMATCH & (MICROBIT_RADIO_MAX_GROUPS - 1)], valid);
+}
+
+/**
+  * Attaches a sniffer, which is given a copy of every frame received, including those that fail their CRC check.
+  *
+  * @param s the sniffer to attach, or NULL to detach the current one.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_NOT_SUPPORTED if a different sniffer is already attached.
+  *
+  * @note This is called by MicroBitRadioSniffer::start() and stop().
+  */
+int MicroBitRadio::setSniffer(MicroBitRadioSniffer *s)
+{
+    if (s != NULL && sniffer != NULL && sniffer != s)
+        return MICROBIT_NOT_SUPPORTED;
+
+    sniffer = s;
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Called just before the RADIO hardware starts sending the packet at the head of the transmit queue,
+  * so that time critical fields can be filled in.
+  *
+  * @note should only be called from RADIO_IRQHandler...
+  */
+void MicroBitRadio::transmitStarting()
+{
+    FrameBuffer *first, *second;
+    int firstLength, secondLength;
+
+    if (txQueue.segments(1, &first, &firstLength, &second, &secondLength) == 0)
+        return;
+
+    if (first->protocol == MICROBIT_RADIO_PROTOCOL_TIMESYNC && timesyncService != NULL)
+        timesyncService->transmitStarting(first);
+}
+
+/**
+  * Releases the packet at the head of the transmit queue once the RADIO hardware has sent it,
+  * and either starts sending the next one or turns the transmitter off.
+  *
+  * @note should only be called from RADIO_IRQHandler...
+  */
+void MicroBitRadio::packetTransmitted()
+{
+    // When duty cycling, repeat each packet until every receiver in range must have woken up to hear it.
+    if (dutyInterval && (int32_t)((uint32_t)system_timer_current_time() - txTrainEnd) < 0)
+    {
+        transmitStarting();
+        NRF_RADIO->TASKS_START = 1;
+        return;
+    }
+
+    txQueue.skip(1);
+    txCompleted++;
+
+    MicroBitEvent(id, MICROBIT_RADIO_EVT_TX_COMPLETE);
+    MicroBitEvent(MICROBIT_ID_NOTIFY, MICROBIT_RADIO_EVT_TX_DONE);
+
+    if (txQueue.isEmpty() || (status & MICROBIT_RADIO_STATUS_TX_HELD))
+    {
+        // Nothing left to send (for now). RADIO_IRQHandler will return us to receive mode once the transmitter is off.
+        NRF_RADIO->TASKS_DISABLE = 1;
+    }
+    else
+    {
+        // The transmitter is still ramped up, so we can send the next packet back to back.
+        FrameBuffer *first, *second;
+        int firstLength, secondLength;
+
+        txQueue.segments(1, &first, &firstLength, &second, &secondLength);
+
+        txTrainEnd = (uint32_t)system_timer_current_time() + dutyInterval + dutyWindow;
+
+        NRF_RADIO->TXADDRESS = addressFor(first->group);
+        NRF_RADIO->PACKETPTR = (uint32_t) first;
+        transmitStarting();
+        NRF_RADIO->TASKS_START = 1;
+    }
+}
+
+/**
+  * Turns the RADIO hardware back on once it has been disabled; as a transmitter if
+  * any packets are queued for transmission, otherwise as a receiver.
+  *
+  * @note should only be called from RADIO_IRQHandler...
+  */
+void MicroBitRadio::radioDisabled()
+{
+    if (!(status & MICROBIT_RADIO_STATUS_INITIALISED))
+        return;
+
+    status &= ~MICROBIT_RADIO_STATUS_TX_PENDING;
+
+    if (txQueue.isEmpty() || (status & MICROBIT_RADIO_STATUS_TX_HELD))
+    {
+        status &= ~MICROBIT_RADIO_STATUS_TRANSMITTING;
+
+        // If we're duty cycling, and it's not time to listen, leave the radio off.
+        if (status & MICROBIT_RADIO_STATUS_SLEEPING)
+            return;
+
+        // Start listening for the next packet. RADIO_IRQHandler starts reception once the receiver is ready.
+        NRF_RADIO->PACKETPTR = (uint32_t) getRxBuf();
+        NRF_RADIO->TASKS_RXEN = 1;
+    }
+    else
+    {
+        FrameBuffer *first, *second;
+        int firstLength, secondLength;
+
+        txQueue.segments(1, &first, &firstLength, &second, &secondLength);
+
+        status |= MICROBIT_RADIO_STATUS_TRANSMITTING;
+
+        txTrainEnd = (uint32_t)system_timer_current_time() + dutyInterval + dutyWindow;
+
+        // Turn on the transmitter. RADIO_IRQHandler starts transmission once it is ready.
+        NRF_RADIO->TXADDRESS = addressFor(first->group);
+        NRF_RADIO->PACKETPTR = (uint32_t) first;
+        NRF_RADIO->TASKS_TXEN = 1;
+    }
+}
+
+/**
+  * Turns the receiver back on at the start of a listening window, unless the transmitter is in use,
+  * in which case radioDisabled() will turn it on once transmission is complete.
+  */
+void MicroBitRadio::wake()
+{
+    uint32_t now = (uint32_t)system_timer_current_time();
+
+    status &= ~MICROBIT_RADIO_STATUS_SLEEPING;
+
+    dutySleep = now + dutyWindow;
+    dutyWake = now + dutyInterval;
+
+    if (!(status & (MICROBIT_RADIO_STATUS_TX_PENDING | MICROBIT_RADIO_STATUS_TRANSMITTING)) && NRF_RADIO->STATE == RADIO_STATE_STATE_Disabled)
+    {
+        NRF_RADIO->PACKETPTR = (uint32_t) getRxBuf();
+        NRF_RADIO->TASKS_RXEN = 1;
+    }
+}
+
+/**
+  * Enables or disables duty cycled, low power listening.
+  *
+  * When enabled, the receiver is only turned on for a short window once every interval, and otherwise left off,
+  * which substantially reduces the energy used by an idle micro:bit. To make sure they are heard, each packet sent is
+  * repeated back to back for a full interval and window. Once a receiver has caught a packet, it sleeps until the
+  * repeats must have finished, so that they are not received as duplicates.
+  *
+  * All micro:bits in a group must use the same settings.
+  *
+  * @param interval the time between the start of each listening window, in milliseconds, or zero to leave the receiver on
+  *        permanently (the default).
+  *
+  * @param window the time for which the receiver listens, in milliseconds. This must be less than interval, and should be
+  *        at least one system timer period, as the schedule is driven by the system timer.
+  *
+  * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if the parameters are out of range, MICROBIT_NO_RESOURCES
+  *         if no system timer slot is available, or MICROBIT_NOT_SUPPORTED if the BLE stack is running.
+  *
+  * @note Packets take up to interval + window to send, and protocols that wait for a reply (such as reliable datagrams)
+  *       will need correspondingly longer timeouts.
+  */
+int MicroBitRadio::setDutyCycle(int interval, int window)
+{
+    if (ble_running())
+        return MICROBIT_NOT_SUPPORTED;
+
+    if (interval < 0 || interval > 0xFFFF || (interval > 0 && (window <= 0 || window >= interval)))
+        return MICROBIT_INVALID_PARAMETER;
+
+    // Register for periodic callbacks, to drive the listening schedule.
+    if (interval && startTimer() != MICROBIT_OK)
+        return MICROBIT_NO_RESOURCES;
+
+    __disable_irq();
+
+    dutyInterval = interval;
+    dutyWindow = interval ? window : 0;
+
+    // Start with a listening window. If duty cycling is being disabled, this turns the receiver back on for good.
+    if (status & MICROBIT_RADIO_STATUS_INITIALISED)
+        wake();
+
+    __enable_irq();
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Puts the receiver to sleep once a packet has been received whilst duty cycling, as the sender
+  * will continue repeating it for up to a full interval.
+  *
+  * @return true if the receiver is being turned off, false if we're not duty cycling.
+  *
+  * @note should only be called from RADIO_IRQHandler...
+  */
+bool MicroBitRadio::dutyCycleReceived()
+{
+    if (dutyInterval == 0 || (status & (MICROBIT_RADIO_STATUS_TX_PENDING | MICROBIT_RADIO_STATUS_TRANSMITTING)))
+        return false;
+
+    status |= MICROBIT_RADIO_STATUS_SLEEPING;
+    dutyWake = (uint32_t)system_timer_current_time() + dutyInterval + dutyWindow;
+
+    NRF_RADIO->TASKS_DISABLE = 1;
+
+    return true;
+}
+
+/**
+  * Determines if another micro:bit is transmitting, by checking for a packet being received,
+  * and sampling the signal strength on the channel.
+  *
+  * @return true if the channel is busy, false if it is clear or the receiver is not listening.
+  */
+bool MicroBitRadio::channelBusy()
+{
+    // We can only assess the channel whilst the receiver is on.
+    if (NRF_RADIO->STATE != RADIO_STATE_STATE_Rx)
+        return false;
+
+    csmaStatistics.assessments++;
+
+    // A packet is part way through being received.
+    if (NRF_RADIO->EVENTS_ADDRESS)
+        return true;
+
+    // Otherwise, sample the signal strength. This takes around 8us.
+    NRF_RADIO->EVENTS_RSSIEND = 0;
+    NRF_RADIO->TASKS_RSSISTART = 1;
+
+    while (NRF_RADIO->EVENTS_RSSIEND == 0);
+
+    NRF_RADIO->EVENTS_RSSIEND = 0;
+
+    return -(int)NRF_RADIO->RSSISAMPLE >= csmaThreshold;
+}
+
+/**
+  * Registers for periodic callbacks, if this has not already been done.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if a system timer slot could not be allocated.
+  */
+int MicroBitRadio::startTimer()
+{
+    if (status & MICROBIT_RADIO_STATUS_TIMER)
+        return MICROBIT_OK;
+
+    if (system_timer_add_component(this) != MICROBIT_OK)
+        return MICROBIT_NO_RESOURCES;
+
+    status |= MICROBIT_RADIO_STATUS_TIMER;
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Enables or disables clear channel assessment (CSMA) before transmission.
+  *
+  * When enabled, the channel is checked before the transmitter is turned on. If a packet is being received, or the
+  * signal strength is at or above the threshold, transmission is deferred for a random time, drawn from a window
+  * that doubles after each deferral. Once the channel has been found busy attempts times, the packet is sent regardless.
+  * Packets that follow back to back, whilst the transmitter is already on, are not deferred.
+  *
+  * @param attempts the most times the channel is assessed before each transmission, in the range
+  *        1..MICROBIT_RADIO_CSMA_MAX_ATTEMPTS, or zero to transmit immediately (the default).
+  *
+  * @param threshold the signal strength at which the channel is considered busy, in dBm (e.g. -80).
+  *
+  * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if the parameters are out of range,
+  *         or MICROBIT_NO_RESOURCES if no system timer slot is available.
+  */
+int MicroBitRadio::setCsma(int attempts, int threshold)
+{
+    if (attempts < 0 || attempts > MICROBIT_RADIO_CSMA_MAX_ATTEMPTS || threshold < -128 || threshold > 0)
         return MICROBIT_INVALID_PARAMETER;
 
-    NRF_RADIO->TXPOWER = (uint32_t)MICROBIT_BLE_POWER_LEVEL[power];
+    // Register for periodic callbacks, to retry deferred transmissions.
+    if (attempts && startTimer() != MICROBIT_OK)
+        return MICROBIT_NO_RESOURCES;
+
+    __disable_irq();
+
+    csmaAttempts = attempts;
+    csmaThreshold = threshold;
+
+    // If CSMA is being disabled, send anything we've deferred right away.
+    if (attempts == 0 && (status & MICROBIT_RADIO_STATUS_TX_BACKOFF))
+        csmaDeadline = (uint32_t)system_timer_current_time();
+
+    __enable_irq();
 
     return MICROBIT_OK;
 }
 
 /**
-  * Change the transmission and reception band of the radio to the given channel
+  * Copies the clear channel assessment counters accumulated since the last call to resetCsmaStatistics().
   *
-  * @param band a frequency band in the range 0 - 100. Each step is 1MHz wide, based at 2400MHz.
+  * @param stats the structure to fill in.
   *
-  * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if the value is out of range,
-  *         or MICROBIT_NOT_SUPPORTED if the BLE stack is running.
+  * @return MICROBIT_OK.
   */
-int MicroBitRadio::setFrequencyBand(int band)
+int MicroBitRadio::getCsmaStatistics(MicroBitRadioCsmaStatistics &stats)
 {
-    if (ble_running())
-        return MICROBIT_NOT_SUPPORTED;
-
-    if (band < 0 || band > 100)
-        return MICROBIT_INVALID_PARAMETER;
-
-    NRF_RADIO->FREQUENCY = (uint32_t)band;
+    __disable_irq();
+    memcpy(&stats, &csmaStatistics, sizeof(MicroBitRadioCsmaStatistics));
+    __enable_irq();
 
     return MICROBIT_OK;
 }
 
 /**
-  * Retrieve a pointer to the currently allocated receive buffer. This is the area of memory
-  * actively being used by the radio hardware to store incoming data.
+  * Resets all clear channel assessment counters to zero.
   *
-  * @return a pointer to the current receive buffer.
+  * @return MICROBIT_OK.
   */
-FrameBuffer* MicroBitRadio::getRxBuf()
+int MicroBitRadio::resetCsmaStatistics()
 {
-    return rxBuf;
+    __disable_irq();
+    memset(&csmaStatistics, 0, sizeof(MicroBitRadioCsmaStatistics));
+    __enable_irq();
+
+    return MICROBIT_OK;
 }
 
 /**
-  * Attempt to queue a buffer received by the radio hardware, if sufficient space is available.
+  * Periodic callback from MicroBit system timer.
   *
-  * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if a replacement receiver buffer
-  *         could not be allocated (either by policy or memory exhaustion).
+  * Retries transmissions deferred by CSMA once their backoff has expired. When duty cycling, also turns the receiver
+  * on at the start of each listening window, and off again at the end.
   */
-int MicroBitRadio::queueRxBuf()
+void MicroBitRadio::systemTick()
 {
-    if (rxBuf == NULL)
-        return MICROBIT_INVALID_PARAMETER;
+    if (!(status & MICROBIT_RADIO_STATUS_INITIALISED))
+        return;
 
-    if (queueDepth >= MICROBIT_RADIO_MAXIMUM_RX_BUFFERS)
-        return MICROBIT_NO_RESOURCES;
+    uint32_t now = (uint32_t)system_timer_current_time();
 
-    // Store the received RSSI value in the frame
-    rxBuf->rssi = getRSSI();
+    // Protect our status from RADIO_IRQHandler.
+    __disable_irq();
 
-    // Ensure that a replacement buffer is available before queuing.
-    FrameBuffer *newRxBuf = new FrameBuffer();
+    if ((status & MICROBIT_RADIO_STATUS_TX_BACKOFF) && (int32_t)(now - csmaDeadline) >= 0)
+    {
+        status &= ~MICROBIT_RADIO_STATUS_TX_BACKOFF;
 
-    if (newRxBuf == NULL)
-        return MICROBIT_NO_RESOURCES;
+        if (!txQueue.isEmpty() && !(status & (MICROBIT_RADIO_STATUS_TX_PENDING | MICROBIT_RADIO_STATUS_TRANSMITTING | MICROBIT_RADIO_STATUS_TX_HELD)))
+            startTransmitter();
+    }
 
-    // We add to the tail of the queue to preserve causal ordering.
-    rxBuf->next = NULL;
+    if (dutyInterval == 0)
+    {
+        __enable_irq();
+        return;
+    }
 
-    if (rxQueue == NULL)
+    if (status & MICROBIT_RADIO_STATUS_SLEEPING)
     {
-        rxQueue = rxBuf;
+        if ((int32_t)(now - dutyWake) >= 0)
+            wake();
     }
-    else
+    else if ((int32_t)(now - dutySleep) >= 0)
     {
-        FrameBuffer *p = rxQueue;
-        while (p->next != NULL)
-            p = p->next;
+        // Stay awake whilst we're transmitting, or part way through receiving a packet.
+        bool receiving = NRF_RADIO->STATE == RADIO_STATE_STATE_Rx && NRF_RADIO->EVENTS_ADDRESS;
 
-        p->next = rxBuf;
+        if (!(status & (MICROBIT_RADIO_STATUS_TX_PENDING | MICROBIT_RADIO_STATUS_TRANSMITTING)) && !receiving)
+        {
+            status |= MICROBIT_RADIO_STATUS_SLEEPING;
+            NRF_RADIO->TASKS_DISABLE = 1;
+        }
     }
 
-    // Increase our received packet count
-    queueDepth++;
-
-    // Allocate a new buffer for the receiver hardware to use. the old on will be passed on to higher layer protocols/apps.
-    rxBuf = newRxBuf;
-
-    return MICROBIT_OK;
+    __enable_irq();
 }
 
 /**
@@ -263,10 +914,10 @@ int MicroBitRadio::enable()
         return MICROBIT_NOT_SUPPORTED;
 
     // If this is the first time we've been enable, allocate out receive buffers.
-    if (rxBuf == NULL)
-        rxBuf = new FrameBuffer();
+    if (rxRing == NULL && allocateRxRing(MICROBIT_RADIO_MAXIMUM_RX_BUFFERS) != MICROBIT_OK)
+        return MICROBIT_NO_RESOURCES;
 
-    if (rxBuf == NULL)
+    if (!txQueue.isAllocated() && txQueue.allocate(MICROBIT_RADIO_TX_QUEUE_DEPTH) != MICROBIT_OK)
         return MICROBIT_NO_RESOURCES;
 
     // Enable the High Frequency clock on the processor. This is a pre-requisite for
@@ -290,13 +941,15 @@ int MicroBitRadio::enable()
     // address matching for us, and only generate an interrupt when a packet matching our group is received.
     NRF_RADIO->BASE0 = MICROBIT_RADIO_BASE_ADDRESS;
 
-    // Join the default group. This will configure the remaining byte in the RADIO hardware module.
-    setGroup(this->group);
+    NRF_RADIO->BASE1 = MICROBIT_RADIO_BASE_ADDRESS;
+
+    // The RADIO hardware module supports the use of multiple addresses. We use one per group we listen to,
+    // each with the same base address, but with the group in the prefix. Logical address 0 is our own group.
+    // This will configure the remaining byte of each address in the RADIO hardware module.
+    configureAddresses();
 
-    // The RADIO hardware module supports the use of multiple addresses, but as we're running anonymously, we only need one.
-    // Configure the RADIO module to use the default address (address 0) for both send and receive operations.
+    // We send to our own group, unless asked otherwise.
     NRF_RADIO->TXADDRESS = 0;
-    NRF_RADIO->RXADDRESSES = 1;
 
     // Packet layout configuration. The nrf51822 has a highly capable and flexible RADIO module that, in addition to transmission
     // and reception of data, also contains a LENGTH field, two optional additional 1 byte fields (S0 and S1) and a CRC calculation.
@@ -318,29 +971,35 @@ int MicroBitRadio::enable()
     NRF_RADIO->DATAWHITEIV = 0x18;
 
     // Set up the RADIO module to read and write from our internal buffer.
-    NRF_RADIO->PACKETPTR = (uint32_t)rxBuf;
+    NRF_RADIO->PACKETPTR = (uint32_t)getRxBuf();
+
+    NRF_RADIO->SHORTS |= RADIO_SHORTS_ADDRESS_RSSISTART_Msk;
 
-    // Configure the hardware to issue an interrupt whenever a task is complete (e.g. send/receive).
-    NRF_RADIO->INTENSET = 0x00000008;
+    // Record that our RADIO is configured before the interrupt handler can run.
+    status |= MICROBIT_RADIO_STATUS_INITIALISED;
+
+    // Configure the hardware to issue an interrupt whenever a task is complete (e.g. send/receive),
+    // and whenever the transceiver is ready or has been turned off, so that it never needs to be polled.
+    NRF_RADIO->EVENTS_READY = 0;
+    NRF_RADIO->EVENTS_END = 0;
+    NRF_RADIO->EVENTS_DISABLED = 0;
+    NRF_RADIO->EVENTS_ADDRESS = 0;
+    NRF_RADIO->INTENSET = RADIO_INTENSET_READY_Msk | RADIO_INTENSET_END_Msk | RADIO_INTENSET_DISABLED_Msk;
     NVIC_ClearPendingIRQ(RADIO_IRQn);
     NVIC_EnableIRQ(RADIO_IRQn);
 
-    NRF_RADIO->SHORTS |= RADIO_SHORTS_ADDRESS_RSSISTART_Msk;
+    // Start listening for the next packet. RADIO_IRQHandler starts reception once the receiver is ready.
+    // If we're duty cycling, this is the start of our first listening window.
+    uint32_t now = (uint32_t)system_timer_current_time();
 
-    // Start listening for the next packet
-    NRF_RADIO->EVENTS_READY = 0;
-    NRF_RADIO->TASKS_RXEN = 1;
-    while(NRF_RADIO->EVENTS_READY == 0);
+    dutySleep = now + dutyWindow;
+    dutyWake = now + dutyInterval;
 
-    NRF_RADIO->EVENTS_END = 0;
-    NRF_RADIO->TASKS_START = 1;
+    NRF_RADIO->TASKS_RXEN = 1;
 
     // register ourselves for a callback event, in order to empty the receive queue.
     fiber_add_idle_component(this);
 
-    // Done. Record that our RADIO is configured.
-    status |= MICROBIT_RADIO_STATUS_INITIALISED;
-
     return MICROBIT_OK;
 }
 
@@ -368,8 +1027,15 @@ int MicroBitRadio::disable()
     // deregister ourselves from the callback event used to empty the receive queue.
     fiber_remove_idle_component(this);
 
+    // Discard any packets awaiting transmission, and release any fibers waiting for them to be sent.
+    txQueue.clear();
+    txCompleted = txQueued;
+
     // record that the radio is now disabled
-    status &= ~MICROBIT_RADIO_STATUS_INITIALISED;
+    status &= ~(MICROBIT_RADIO_STATUS_INITIALISED | MICROBIT_RADIO_STATUS_TX_PENDING | MICROBIT_RADIO_STATUS_TRANSMITTING | MICROBIT_RADIO_STATUS_SLEEPING | MICROBIT_RADIO_STATUS_TX_BACKOFF);
+    csmaBackoff = 0;
+
+    MicroBitEvent(MICROBIT_ID_NOTIFY, MICROBIT_RADIO_EVT_TX_DONE);
 
     return MICROBIT_OK;
 }
@@ -387,46 +1053,235 @@ int MicroBitRadio::setGroup(uint8_t group)
         return MICROBIT_NOT_SUPPORTED;
 
     // Record our group id locally
-    this->group = group;
+    groups[0] = group;
 
     // Also append it to the address of this device, to allow the RADIO module to filter for us.
-    NRF_RADIO->PREFIX0 = (uint32_t)group;
+    configureAddresses();
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Listens to packets sent with the given group id, in addition to our own group.
+  * The group each packet was received on is recorded in FrameBuffer::group.
+  *
+  * @param group The group to listen to.
+  *
+  * @return MICROBIT_OK on success, MICROBIT_NOT_SUPPORTED if the BLE stack is running, or MICROBIT_NO_RESOURCES
+  *         if MICROBIT_RADIO_MAX_GROUPS groups are already being listened to.
+  */
+int MicroBitRadio::addGroup(uint8_t group)
+{
+    if (ble_running())
+        return MICROBIT_NOT_SUPPORTED;
+
+    int address = -1;
+
+    for (int i = 0; i < MICROBIT_RADIO_MAX_GROUPS; i++)
+    {
+        // Nothing to do if we're already listening.
+        if ((groupMask & (1 << i)) && groups[i] == group)
+            return MICROBIT_OK;
+
+        if (!(groupMask & (1 << i)) && address < 0)
+            address = i;
+    }
+
+    if (address < 0)
+        return MICROBIT_NO_RESOURCES;
+
+    groups[address] = group;
+    groupMask |= 1 << address;
+
+    configureAddresses();
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Stops listening to packets sent with the given group id, previously passed to addGroup().
+  *
+  * @param group The group to stop listening to.
+  *
+  * @return MICROBIT_OK on success, MICROBIT_NOT_SUPPORTED if the BLE stack is running, or MICROBIT_INVALID_PARAMETER
+  *         if the group was not added with addGroup().
+  */
+int MicroBitRadio::removeGroup(uint8_t group)
+{
+    if (ble_running())
+        return MICROBIT_NOT_SUPPORTED;
+
+    // Our own group, on address 0, can only be changed with setGroup().
+    for (int i = 1; i < MICROBIT_RADIO_MAX_GROUPS; i++)
+    {
+        if ((groupMask & (1 << i)) && groups[i] == group)
+        {
+            groupMask &= ~(1 << i);
+            configureAddresses();
+
+            return MICROBIT_OK;
+        }
+    }
+
+    return MICROBIT_INVALID_PARAMETER;
+}
+
+/**
+  * Programs the RADIO hardware with the groups we listen to.
+  */
+void MicroBitRadio::configureAddresses()
+{
+    uint32_t prefix0 = 0;
+    uint32_t prefix1 = 0;
+
+    // Logical addresses 0..3 take their prefix from PREFIX0, and 4..7 from PREFIX1, a byte each.
+    for (int i = 0; i < 4; i++)
+    {
+        prefix0 |= (uint32_t)groups[i] << (i * 8);
+        prefix1 |= (uint32_t)groups[i + 4] << (i * 8);
+    }
+
+    NRF_RADIO->PREFIX0 = prefix0;
+    NRF_RADIO->PREFIX1 = prefix1;
+    NRF_RADIO->RXADDRESSES = groupMask;
+}
+
+/**
+  * Determines the logical address used to send to the given group.
+  *
+  * @param group the group of interest.
+  *
+  * @return the logical address, or 0 (our own group) if the group is not one we listen to.
+  */
+int MicroBitRadio::addressFor(uint8_t group)
+{
+    for (int i = 0; i < MICROBIT_RADIO_MAX_GROUPS; i++)
+        if ((groupMask & (1 << i)) && groups[i] == group)
+            return i;
+
+    return 0;
+}
+
+/**
+  * Adds a protocol handler to the table, replacing any existing handler for the same protocol.
+  *
+  * @param handler the handler to add.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if MICROBIT_RADIO_MAX_PROTOCOLS handlers are already registered.
+  */
+int MicroBitRadio::addProtocol(MicroBitRadioProtocol &handler)
+{
+    int i;
+
+    for (i = 0; i < protocolCount; i++)
+        if (protocols[i].protocol == handler.protocol)
+            break;
+
+    if (i == MICROBIT_RADIO_MAX_PROTOCOLS)
+        return MICROBIT_NO_RESOURCES;
+
+    if (i == protocolCount)
+        protocolCount++;
+
+    protocols[i] = handler;
 
     return MICROBIT_OK;
 }
 
+/**
+  * A static method capable of invoking a protocol handler function.
+  *
+  * @param object Unused.
+  *
+  * @param method The function to invoke.
+  */
+void MicroBitRadio::functionCall(void *, uint32_t *method)
+{
+    void (*f)();
+
+    memcpy(&f, method, sizeof(f));
+    f();
+}
+
+/**
+  * Registers a function to handle received packets of the given protocol, replacing any existing handler.
+  * The handler is called from idleTick(), and should take the packet from the receive queue with recv().
+  *
+  * @param protocol The protocol number.
+  *
+  * @param handler The function to invoke.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if MICROBIT_RADIO_MAX_PROTOCOLS handlers are already registered.
+  */
+int MicroBitRadio::registerProtocol(uint8_t protocol, void (*handler)())
+{
+    MicroBitRadioProtocol p;
+
+    if (handler == NULL)
+        return MICROBIT_INVALID_PARAMETER;
+
+    p.protocol = protocol;
+    p.object = NULL;
+    memclr(p.method, sizeof(p.method));
+    memcpy(p.method, &handler, sizeof(handler));
+    p.invoke = &MicroBitRadio::functionCall;
+
+    return addProtocol(p);
+}
+
+/**
+  * Removes the handler registered for the given protocol. Packets of that protocol are then announced with
+  * a MICROBIT_ID_RADIO_DATA_READY event instead.
+  *
+  * @param protocol The protocol number.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if no handler is registered for the protocol.
+  */
+int MicroBitRadio::unregisterProtocol(uint8_t protocol)
+{
+    for (int i = 0; i < protocolCount; i++)
+    {
+        if (protocols[i].protocol == protocol)
+        {
+            // Keep the table dense, by moving the last entry into the gap.
+            protocols[i] = protocols[--protocolCount];
+            return MICROBIT_OK;
+        }
+    }
+
+    return MICROBIT_INVALID_PARAMETER;
+}
+
 /**
   * A background, low priority callback that is triggered whenever the processor is idle.
   * Here, we empty our queue of received packets, and pass them onto higher level protocol handlers.
   */
 void MicroBitRadio::idleTick()
 {
-    // Walk the list of packets and process each one.
-    while(rxQueue)
+    // Walk the queue of packets and process each one.
+    while(dataReady())
     {
-        FrameBuffer *p = rxQueue;
+        uint8_t t = rxTail;
+        uint8_t protocol = rxRing[t].protocol;
+        int i;
 
-        switch (p->protocol)
+        for (i = 0; i < protocolCount; i++)
         {
-            case MICROBIT_RADIO_PROTOCOL_DATAGRAM:
-                datagram.packetReceived();
-                break;
-
-            case MICROBIT_RADIO_PROTOCOL_EVENTBUS:
-                event.packetReceived();
+            if (protocols[i].protocol == protocol)
+            {
+                protocols[i].invoke(protocols[i].object, protocols[i].method);
                 break;
-
-            default:
-                MicroBitEvent(MICROBIT_ID_RADIO_DATA_READY, p->protocol);
+            }
         }
 
+        // Let the application know about packets that no handler is registered for.
+        if (i == protocolCount)
+            MicroBitEvent(MICROBIT_ID_RADIO_DATA_READY, protocol);
+
         // If the packet was processed, it will have been recv'd, and taken from the queue.
-        // If this was a packet for an unknown protocol, it will still be there, so simply free it.
-        if (p == rxQueue)
-        {
-            recv();
-            delete p;
-        }
+        // If this was a packet for an unknown protocol, it will still be there, so simply drop it.
+        if (t == rxTail)
+            rxTail = t + 1 == rxRingSize ? 0 : t + 1;
     }
 }
 
@@ -437,7 +1292,9 @@ void MicroBitRadio::idleTick()
   */
 int MicroBitRadio::dataReady()
 {
-    return queueDepth;
+    int n = rxHead - rxTail;
+
+    return n < 0 ? n + rxRingSize : n;
 }
 
 /**
@@ -445,89 +1302,206 @@ int MicroBitRadio::dataReady()
   * If a data packet is available, then it will be returned immediately to
   * the caller. This call will also dequeue the buffer.
   *
-  * @return The buffer containing the the packet. If no data is available, NULL is returned.
+  * @return The buffer containing the the packet. If no data is available, or the buffer
+  *         could not be allocated, NULL is returned.
   *
   * @note Once recv() has been called, it is the callers responsibility to
-  *       delete the buffer when appropriate.
+  *       delete the buffer when appropriate. The packet is copied out of the receive
+  *       queue into a new buffer here, outside of interrupt context.
   */
 FrameBuffer* MicroBitRadio::recv()
 {
-    FrameBuffer *p = rxQueue;
+    if (!dataReady())
+        return NULL;
+
+    FrameBuffer *p = new FrameBuffer();
 
     if (p)
     {
-         // Protect shared resource from ISR activity
-        NVIC_DisableIRQ(RADIO_IRQn); 
-
-        rxQueue = rxQueue->next;
-        queueDepth--;
-
-        // Allow ISR access to shared resource
-        NVIC_EnableIRQ(RADIO_IRQn);
+        *p = rxRing[rxTail];
+        p->next = NULL;
     }
 
+    // The RADIO_IRQHandler only ever moves rxHead, so the slot can be released without disabling interrupts.
+    rxTail = rxTail + 1 == rxRingSize ? 0 : rxTail + 1;
+
     return p;
 }
 
 /**
   * Transmits the given buffer onto the broadcast radio.
   * The call will wait until the transmission of the packet has completed before returning.
+  * The calling fiber sleeps whilst it waits, so other fibers continue to run.
   *
   * @param data The packet contents to transmit.
   *
-  * @return MICROBIT_OK on success, or MICROBIT_NOT_SUPPORTED if the BLE stack is running.
+  * @return MICROBIT_OK on success, MICROBIT_NOT_SUPPORTED if the BLE stack is running or the radio
+  *         is not enabled, or MICROBIT_INVALID_PARAMETER if the packet is too long.
+  *
+  * @note If called from interrupt context, the packet is queued as for sendAsync(), and this
+  *       call returns without waiting for it to be sent.
   */
 int MicroBitRadio::send(FrameBuffer *buffer)
 {
-    if (ble_running())
-        return MICROBIT_NOT_SUPPORTED;
+    int sequence;
 
-    if (buffer == NULL)
-        return MICROBIT_INVALID_PARAMETER;
+    // Wait for space in the transmit queue.
+    while ((sequence = queueTxBuf(buffer, groups[0])) == MICROBIT_NO_RESOURCES)
+    {
+        if (inInterruptContext())
+            return MICROBIT_NO_RESOURCES;
 
-    if (buffer->length > MICROBIT_RADIO_MAX_PACKET_SIZE + MICROBIT_RADIO_HEADER_SIZE - 1)
-        return MICROBIT_INVALID_PARAMETER;
+        if (!fiber_scheduler_running())
+            continue;
 
-    // Firstly, disable the Radio interrupt. We want to wait until the trasmission completes.
-    NVIC_DisableIRQ(RADIO_IRQn);
+        __disable_irq();
 
-    // Turn off the transceiver.
-    NRF_RADIO->EVENTS_DISABLED = 0;
-    NRF_RADIO->TASKS_DISABLE = 1;
-    while(NRF_RADIO->EVENTS_DISABLED == 0);
+        if (txQueue.isFull())
+            fiber_wake_on_event(MICROBIT_ID_NOTIFY, MICROBIT_RADIO_EVT_TX_DONE);
 
-    // Configure the radio to send the buffer provided.
-    NRF_RADIO->PACKETPTR = (uint32_t) buffer;
+        __enable_irq();
 
-    // Turn on the transmitter, and wait for it to signal that it's ready to use.
-    NRF_RADIO->EVENTS_READY = 0;
-    NRF_RADIO->TASKS_TXEN = 1;
-    while (NRF_RADIO->EVENTS_READY == 0);
+        schedule();
+    }
 
-    // Start transmission and wait for end of packet.
-    NRF_RADIO->TASKS_START = 1;
-    NRF_RADIO->EVENTS_END = 0;
-    while(NRF_RADIO->EVENTS_END == 0);
+    if (sequence < 0)
+        return sequence;
 
-    // Return the radio to using the default receive buffer
-    NRF_RADIO->PACKETPTR = (uint32_t) rxBuf;
+    // We cannot wait for RADIO_IRQHandler from within another interrupt handler.
+    if (inInterruptContext())
+        return MICROBIT_OK;
 
-    // Turn off the transmitter.
-    NRF_RADIO->EVENTS_DISABLED = 0;
-    NRF_RADIO->TASKS_DISABLE = 1;
-    while(NRF_RADIO->EVENTS_DISABLED == 0);
+    // Wait until our packet has been sent. The check and the wait must be atomic, else the
+    // event signalling completion could be raised in between, and we would never be woken.
+    while ((int16_t)(txCompleted - (uint16_t)sequence) < 0)
+    {
+        if (!fiber_scheduler_running())
+            continue;
 
-    // Start listening for the next packet
-    NRF_RADIO->EVENTS_READY = 0;
-    NRF_RADIO->TASKS_RXEN = 1;
-    while(NRF_RADIO->EVENTS_READY == 0);
+        __disable_irq();
 
-    NRF_RADIO->EVENTS_END = 0;
-    NRF_RADIO->TASKS_START = 1;
+        if ((int16_t)(txCompleted - (uint16_t)sequence) >= 0)
+        {
+            __enable_irq();
+            break;
+        }
 
-    // Re-enable the Radio interrupt.
-    NVIC_ClearPendingIRQ(RADIO_IRQn);
-    NVIC_EnableIRQ(RADIO_IRQn);
+        fiber_wake_on_event(MICROBIT_ID_NOTIFY, MICROBIT_RADIO_EVT_TX_DONE);
+
+        __enable_irq();
+
+        schedule();
+    }
 
     return MICROBIT_OK;
 }
+
+/**
+  * Queues the given buffer for transmission onto the broadcast radio, and returns immediately.
+  * Queued packets are sent back to back by the RADIO interrupt handler, which then returns the
+  * radio to receive mode. A MICROBIT_RADIO_EVT_TX_COMPLETE event is raised as each packet is sent.
+  *
+  * @param data The packet contents to transmit. This is copied, so may be reused as soon as this call returns.
+  *
+  * @return MICROBIT_OK on success, MICROBIT_NOT_SUPPORTED if the BLE stack is running or the radio
+  *         is not enabled, MICROBIT_INVALID_PARAMETER if the packet is too long, or MICROBIT_NO_RESOURCES
+  *         if MICROBIT_RADIO_TX_QUEUE_DEPTH packets are already awaiting transmission.
+  */
+int MicroBitRadio::sendAsync(FrameBuffer *buffer)
+{
+    int result = queueTxBuf(buffer, groups[0]);
+
+    return result < 0 ? result : MICROBIT_OK;
+}
+
+/**
+  * Queues the given buffer for transmission to the given group, and returns immediately.
+  * This allows a micro:bit listening to several groups to bridge between them.
+  *
+  * @param data The packet contents to transmit. This is copied, so may be reused as soon as this call returns.
+  *
+  * @param group The group to send to. This must be our own group, or one added with addGroup().
+  *
+  * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if the packet is too long or we are not listening
+  *         to the group, or an error code as described for sendAsync().
+  */
+int MicroBitRadio::sendToGroup(FrameBuffer *buffer, uint8_t group)
+{
+    if (group != groups[0] && addressFor(group) == 0)
+        return MICROBIT_INVALID_PARAMETER;
+
+    int result = queueTxBuf(buffer, group);
+
+    return result < 0 ? result : MICROBIT_OK;
+}
+
+/**
+  * Provides the multi-hop flooding service, creating it on first use.
+  *
+  * @return the mesh service.
+  *
+  * @note Mesh packets received before this is first called are discarded, rather than delivered or rebroadcast.
+  *       A micro:bit intended to relay mesh traffic should call this once at startup.
+  */
+MicroBitRadioMesh& MicroBitRadio::mesh()
+{
+    if (meshService == NULL)
+    {
+        meshService = new MicroBitRadioMesh(*this);
+        registerProtocol(MICROBIT_RADIO_PROTOCOL_MESH, meshService, &MicroBitRadioMesh::packetReceived);
+    }
+
+    return *meshService;
+}
+
+/**
+  * Provides the network wide time base, creating it on first use.
+  *
+  * @return the time synchronisation service.
+  *
+  * @note Time beacons received before this is first called are discarded.
+  */
+MicroBitRadioTimeSync& MicroBitRadio::timesync()
+{
+    if (timesyncService == NULL)
+    {
+        timesyncService = new MicroBitRadioTimeSync(*this);
+        registerProtocol(MICROBIT_RADIO_PROTOCOL_TIMESYNC, timesyncService, &MicroBitRadioTimeSync::packetReceived);
+    }
+
+    return *timesyncService;
+}
+
+/**
+  * Provides collision free transmission in assigned time slots, creating it on first use.
+  *
+  * @return the TDMA service.
+  *
+  * @note TDMA control packets received before this is first called are discarded.
+  */
+MicroBitRadioTdma& MicroBitRadio::tdma()
+{
+    if (tdmaService == NULL)
+    {
+        tdmaService = new MicroBitRadioTdma(*this);
+        registerProtocol(MICROBIT_RADIO_PROTOCOL_TDMA, tdmaService, &MicroBitRadioTdma::packetReceived);
+    }
+
+    return *tdmaService;
+}
+
+/**
+  * Provides link quality statistics for each micro:bit heard directly, creating the table on first use.
+  *
+  * @return the neighbour table.
+  *
+  * @note The table is created when it is first requested, or when a frame carrying the serial number of its sender
+  *       (e.g. a reliable datagram, or a mesh packet) is first received.
+  */
+MicroBitRadioNeighbours& MicroBitRadio::neighbours()
+{
+    if (neighbourTable == NULL)
+        neighbourTable = new MicroBitRadioNeighbours();
+
+    return *neighbourTable;
+}
@@ -25,6 +25,8 @@ DEALINGS IN THE SOFTWARE.
 
 #include "MicroBitConfig.h"
 #include "MicroBitRadio.h"
+#include "MicroBitDevice.h"
+#include "MicroBitSystemTimer.h"
 
 /**
   * Provides a simple broadcast radio abstraction, built upon the raw nrf51822 RADIO module.
@@ -49,6 +51,21 @@ DEALINGS IN THE SOFTWARE.
 MicroBitRadioDatagram::MicroBitRadioDatagram(MicroBitRadio &r) : radio(r)
 {
     this->rxQueue = NULL;
+    this->rxQueueTail = NULL;
+    this->rxQueueDepth = 0;
+    this->rxQueueLimit = MICROBIT_RADIO_MAXIMUM_RX_BUFFERS;
+    this->rxPolicy = MICROBIT_RADIO_DATAGRAM_DROP_NEWEST;
+    this->rxDropped = 0;
+    this->txFrame = NULL;
+    this->txSequence = 0;
+    this->txRetries = 0;
+    this->txTimeout = 0;
+    this->txDeadline = 0;
+    this->historyIndex = 0;
+    this->txMessageId = 0;
+
+    memset(history, 0, sizeof(history));
+    memset(fragments, 0, sizeof(fragments));
 }
 
 /**
@@ -69,13 +86,12 @@ int MicroBitRadioDatagram::recv(uint8_t *buf, int len)
         return MICROBIT_INVALID_PARAMETER;
 
     // Take the first buffer from the queue.
-    FrameBuffer *p = rxQueue;
-    rxQueue = rxQueue->next;
+    DatagramEntry *p = dequeue();
 
-    int l = min(len, p->length - (MICROBIT_RADIO_HEADER_SIZE - 1));
+    int l = min(len, p->packet.length());
 
     // Fill in the buffer provided, if possible.
-    memcpy(buf, p->payload, l);
+    memcpy(buf, p->packet.getBytes(), l);
 
     delete p;
     return l;
@@ -94,10 +110,9 @@ PacketBuffer MicroBitRadioDatagram::recv()
     if (rxQueue == NULL)
         return PacketBuffer::EmptyPacket;
 
-    FrameBuffer *p = rxQueue;
-    rxQueue = rxQueue->next;
+    DatagramEntry *p = dequeue();
 
-    PacketBuffer packet(p->payload, p->length - (MICROBIT_RADIO_HEADER_SIZE - 1), p->rssi);
+    PacketBuffer packet = p->packet;
 
     delete p;
     return packet;
@@ -107,20 +122,24 @@ PacketBuffer MicroBitRadioDatagram::recv()
   * Transmits the given buffer onto the broadcast radio.
   *
   * This is a synchronous call that will wait until the transmission of the packet
-  * has completed before returning.
+  * has completed before returning. Packets longer than MICROBIT_RADIO_MAX_PACKET_SIZE
+  * are split across several frames, and reassembled by the receiver.
   *
   * @param buffer The packet contents to transmit.
   *
   * @param len The number of bytes to transmit.
   *
   * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if the buffer is invalid,
-  *         or the number of bytes to transmit is greater than `MICROBIT_RADIO_MAX_PACKET_SIZE + MICROBIT_RADIO_HEADER_SIZE`.
+  *         or the number of bytes to transmit is greater than `MICROBIT_RADIO_FRAGMENT_MAX_SIZE`.
   */
 int MicroBitRadioDatagram::send(uint8_t *buffer, int len)
 {
-    if (buffer == NULL || len < 0 || len > MICROBIT_RADIO_MAX_PACKET_SIZE + MICROBIT_RADIO_HEADER_SIZE - 1)
+    if (buffer == NULL || len < 0 || len > MICROBIT_RADIO_FRAGMENT_MAX_SIZE)
         return MICROBIT_INVALID_PARAMETER;
 
+    if (len > MICROBIT_RADIO_MAX_PACKET_SIZE)
+        return sendFragmented(buffer, len);
+
     FrameBuffer buf;
 
     buf.length = len + MICROBIT_RADIO_HEADER_SIZE - 1;
@@ -136,12 +155,13 @@ int MicroBitRadioDatagram::send(uint8_t *buffer, int len)
   * Transmits the given string onto the broadcast radio.
   *
   * This is a synchronous call that will wait until the transmission of the packet
-  * has completed before returning.
+  * has completed before returning. Packets longer than MICROBIT_RADIO_MAX_PACKET_SIZE
+  * are split across several frames, and reassembled by the receiver.
   *
   * @param data The packet contents to transmit.
   *
   * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if the buffer is invalid,
-  *         or the number of bytes to transmit is greater than `MICROBIT_RADIO_MAX_PACKET_SIZE + MICROBIT_RADIO_HEADER_SIZE`.
+  *         or the number of bytes to transmit is greater than `MICROBIT_RADIO_FRAGMENT_MAX_SIZE`.
   */
 int MicroBitRadioDatagram::send(PacketBuffer data)
 {
@@ -152,18 +172,398 @@ int MicroBitRadioDatagram::send(PacketBuffer data)
   * Transmits the given string onto the broadcast radio.
   *
   * This is a synchronous call that will wait until the transmission of the packet
-  * has completed before returning.
+  * has completed before returning. Packets longer than MICROBIT_RADIO_MAX_PACKET_SIZE
+  * are split across several frames, and reassembled by the receiver.
   *
   * @param data The packet contents to transmit.
   *
   * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if the buffer is invalid,
-  *         or the number of bytes to transmit is greater than `MICROBIT_RADIO_MAX_PACKET_SIZE + MICROBIT_RADIO_HEADER_SIZE`.
+  *         or the number of bytes to transmit is greater than `MICROBIT_RADIO_FRAGMENT_MAX_SIZE`.
   */
 int MicroBitRadioDatagram::send(ManagedString data)
 {
     return send((uint8_t *)data.toCharArray(), data.length());
 }
 
+/**
+  * Transmits the given buffer as a sequence of fragments.
+  *
+  * @param buffer The packet contents to transmit.
+  *
+  * @param len The number of bytes to transmit, in the range 1..MICROBIT_RADIO_FRAGMENT_MAX_SIZE.
+  *
+  * @return MICROBIT_OK on success, or an error code as described for MicroBitRadio::send().
+  */
+int MicroBitRadioDatagram::sendFragmented(uint8_t *buffer, int len)
+{
+    FrameBuffer buf;
+    uint32_t source = microbit_serial_number();
+    uint8_t count = (len + MICROBIT_RADIO_FRAGMENT_PAYLOAD_SIZE - 1) / MICROBIT_RADIO_FRAGMENT_PAYLOAD_SIZE;
+
+    txMessageId++;
+
+    buf.version = 1;
+    buf.group = 0;
+    buf.protocol = MICROBIT_RADIO_PROTOCOL_FRAGMENT;
+    buf.payload[MICROBIT_RADIO_FRAGMENT_ID] = txMessageId;
+    buf.payload[MICROBIT_RADIO_FRAGMENT_COUNT] = count;
+    memcpy(&buf.payload[MICROBIT_RADIO_FRAGMENT_SOURCE], &source, sizeof(uint32_t));
+
+    for (int i = 0; i < count; i++)
+    {
+        int offset = i * MICROBIT_RADIO_FRAGMENT_PAYLOAD_SIZE;
+        int l = min(len - offset, MICROBIT_RADIO_FRAGMENT_PAYLOAD_SIZE);
+
+        buf.length = MICROBIT_RADIO_FRAGMENT_HEADER_SIZE + l + MICROBIT_RADIO_HEADER_SIZE - 1;
+        buf.payload[MICROBIT_RADIO_FRAGMENT_INDEX] = i;
+        memcpy(&buf.payload[MICROBIT_RADIO_FRAGMENT_HEADER_SIZE], buffer + offset, l);
+
+        int result = radio.send(&buf);
+
+        if (result != MICROBIT_OK)
+            return result;
+    }
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Transmits the given buffer to a single micro:bit, which acknowledges it.
+  *
+  * If no acknowledgement is received within MICROBIT_RADIO_RELIABLE_TIMEOUT milliseconds, the datagram is
+  * retransmitted, doubling the timeout each time, up to MICROBIT_RADIO_RELIABLE_RETRIES times. The outcome is
+  * reported with either a MICROBIT_RADIO_EVT_DATAGRAM_ACKED or a MICROBIT_RADIO_EVT_DATAGRAM_FAILED event.
+  *
+  * The receiver discards any retransmissions it has already seen, and queues the datagram for recv() as for any other.
+  *
+  * @param destination the serial number of the micro:bit to send to, as returned by microbit_serial_number() on that device.
+  *
+  * @param buffer The packet contents to transmit.
+  *
+  * @param len The number of bytes to transmit.
+  *
+  * @return MICROBIT_OK once the datagram has first been sent, MICROBIT_BUSY if a previous reliable datagram is yet to
+  *         be acknowledged, MICROBIT_NO_RESOURCES if memory could not be allocated, or MICROBIT_INVALID_PARAMETER
+  *         if the buffer is invalid, or the number of bytes to transmit is greater than `MICROBIT_RADIO_RELIABLE_MAX_SIZE`.
+  */
+int MicroBitRadioDatagram::sendReliable(uint32_t destination, uint8_t *buffer, int len)
+{
+    if (buffer == NULL || len < 0 || len > MICROBIT_RADIO_RELIABLE_MAX_SIZE)
+        return MICROBIT_INVALID_PARAMETER;
+
+    if (status & MICROBIT_RADIO_DATAGRAM_STATUS_PENDING)
+        return MICROBIT_BUSY;
+
+    // If this is our first reliable datagram, allocate a buffer to hold it until it's acknowledged.
+    // Start from a random sequence number, so that a receiver doesn't mistake us for our previous incarnation after a reset.
+    if (txFrame == NULL)
+    {
+        txFrame = new FrameBuffer();
+
+        if (txFrame == NULL)
+            return MICROBIT_NO_RESOURCES;
+
+        txSequence = microbit_random(256);
+    }
+
+    // Register for periodic callbacks, to drive retransmission.
+    if (!(status & MICROBIT_COMPONENT_RUNNING))
+    {
+        if (system_timer_add_component(this) != MICROBIT_OK)
+            return MICROBIT_NO_RESOURCES;
+
+        status |= MICROBIT_COMPONENT_RUNNING;
+    }
+
+    uint32_t source = microbit_serial_number();
+
+    txSequence++;
+
+    txFrame->length = len + MICROBIT_RADIO_RELIABLE_HEADER_SIZE + MICROBIT_RADIO_HEADER_SIZE - 1;
+    txFrame->version = 1;
+    txFrame->group = 0;
+    txFrame->protocol = MICROBIT_RADIO_PROTOCOL_RELIABLE;
+    txFrame->payload[MICROBIT_RADIO_RELIABLE_TYPE] = MICROBIT_RADIO_RELIABLE_DATA;
+    txFrame->payload[MICROBIT_RADIO_RELIABLE_SEQUENCE] = txSequence;
+    memcpy(&txFrame->payload[MICROBIT_RADIO_RELIABLE_DESTINATION], &destination, sizeof(uint32_t));
+    memcpy(&txFrame->payload[MICROBIT_RADIO_RELIABLE_SOURCE], &source, sizeof(uint32_t));
+    memcpy(&txFrame->payload[MICROBIT_RADIO_RELIABLE_HEADER_SIZE], buffer, len);
+
+    txRetries = 0;
+    txTimeout = MICROBIT_RADIO_RELIABLE_TIMEOUT;
+    txDeadline = (uint32_t)system_timer_current_time() + txTimeout;
+
+    // From here on, systemTick() may retransmit the frame.
+    status |= MICROBIT_RADIO_DATAGRAM_STATUS_PENDING;
+
+    int result = radio.send(txFrame);
+
+    if (result != MICROBIT_OK)
+    {
+        __disable_irq();
+        status &= ~MICROBIT_RADIO_DATAGRAM_STATUS_PENDING;
+        __enable_irq();
+    }
+
+    return result;
+}
+
+/**
+  * Transmits the given buffer to a single micro:bit, which acknowledges it.
+  *
+  * @param destination the serial number of the micro:bit to send to.
+  *
+  * @param data The packet contents to transmit.
+  *
+  * @return MICROBIT_OK once the datagram has first been sent, or an error code as described for
+  *         sendReliable(uint32_t, uint8_t *, int).
+  */
+int MicroBitRadioDatagram::sendReliable(uint32_t destination, PacketBuffer data)
+{
+    return sendReliable(destination, (uint8_t *)data.getBytes(), data.length());
+}
+
+/**
+  * Transmits the given string to a single micro:bit, which acknowledges it.
+  *
+  * @param destination the serial number of the micro:bit to send to.
+  *
+  * @param data The packet contents to transmit.
+  *
+  * @return MICROBIT_OK once the datagram has first been sent, or an error code as described for
+  *         sendReliable(uint32_t, uint8_t *, int).
+  */
+int MicroBitRadioDatagram::sendReliable(uint32_t destination, ManagedString data)
+{
+    return sendReliable(destination, (uint8_t *)data.toCharArray(), data.length());
+}
+
+/**
+  * Determines if a reliable datagram is still awaiting acknowledgement.
+  *
+  * @return true if sendReliable() would currently return MICROBIT_BUSY.
+  */
+bool MicroBitRadioDatagram::isReliablePending()
+{
+    return status & MICROBIT_RADIO_DATAGRAM_STATUS_PENDING;
+}
+
+/**
+  * Transmits a reliable datagram header, without any data.
+  *
+  * @param type the frame type.
+  *
+  * @param sequence the sequence number.
+  *
+  * @param destination the serial number of the micro:bit to send the frame to.
+  *
+  * @param group the group to send the frame to, which should be the one the destination's last frame was received on.
+  *
+  * @return MICROBIT_OK on success, or an error code as described for MicroBitRadio::sendToGroup().
+  */
+int MicroBitRadioDatagram::sendControl(uint8_t type, uint8_t sequence, uint32_t destination, uint8_t group)
+{
+    FrameBuffer buf;
+    uint32_t source = microbit_serial_number();
+
+    buf.length = MICROBIT_RADIO_RELIABLE_HEADER_SIZE + MICROBIT_RADIO_HEADER_SIZE - 1;
+    buf.version = 1;
+    buf.group = 0;
+    buf.protocol = MICROBIT_RADIO_PROTOCOL_RELIABLE;
+    buf.payload[MICROBIT_RADIO_RELIABLE_TYPE] = type;
+    buf.payload[MICROBIT_RADIO_RELIABLE_SEQUENCE] = sequence;
+    memcpy(&buf.payload[MICROBIT_RADIO_RELIABLE_DESTINATION], &destination, sizeof(uint32_t));
+    memcpy(&buf.payload[MICROBIT_RADIO_RELIABLE_SOURCE], &source, sizeof(uint32_t));
+
+    // We're called from the idle thread, so don't wait for the frame to be sent.
+    return radio.sendToGroup(&buf, group);
+}
+
+/**
+  * Looks up the last reliable datagram received from the given micro:bit.
+  *
+  * @param source the serial number of the sender.
+  *
+  * @return the history entry for source, or if there is none, the least recently added entry, which should
+  *         be replaced once a datagram from source has been accepted.
+  */
+ReliableHistory* MicroBitRadioDatagram::historyFor(uint32_t source)
+{
+    for (int i = 0; i < MICROBIT_RADIO_RELIABLE_HISTORY; i++)
+        if (history[i].source == source)
+            return &history[i];
+
+    return &history[historyIndex];
+}
+
+/**
+  * Adds the given packet to the queue awaiting user reception, and raises a MICROBIT_RADIO_EVT_DATAGRAM event.
+  * If the queue is full, either this packet or the oldest queued is discarded, according to the overflow policy.
+  *
+  * @param packet The packet to queue.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if the packet was discarded.
+  */
+int MicroBitRadioDatagram::queuePacket(PacketBuffer packet)
+{
+    if (rxQueueDepth >= rxQueueLimit && rxPolicy == MICROBIT_RADIO_DATAGRAM_DROP_NEWEST)
+    {
+        rxDropped++;
+        return MICROBIT_NO_RESOURCES;
+    }
+
+    // Allocate the new entry before making room for it, so that a failure doesn't lose the oldest datagram too.
+    DatagramEntry *entry = new DatagramEntry();
+
+    if (entry == NULL)
+        return MICROBIT_NO_RESOURCES;
+
+    entry->packet = packet;
+
+    if (rxQueueDepth >= rxQueueLimit)
+    {
+        rxDropped++;
+        delete dequeue();
+    }
+
+    // We add to the tail of the queue to preserve causal ordering.
+    entry->next = NULL;
+
+    if (rxQueueTail == NULL)
+        rxQueue = entry;
+    else
+        rxQueueTail->next = entry;
+
+    rxQueueTail = entry;
+    rxQueueDepth++;
+
+    MicroBitEvent(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_DATAGRAM);
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Removes the oldest packet from the queue awaiting user reception.
+  *
+  * @return the queue entry, which the caller must delete, or NULL if the queue is empty.
+  */
+DatagramEntry* MicroBitRadioDatagram::dequeue()
+{
+    DatagramEntry *p = rxQueue;
+
+    if (p == NULL)
+        return NULL;
+
+    rxQueue = p->next;
+    rxQueueDepth--;
+
+    if (rxQueue == NULL)
+        rxQueueTail = NULL;
+
+    return p;
+}
+
+/**
+  * Changes the number of received datagrams that can be held awaiting collection by recv().
+  *
+  * @param depth the number of datagrams to hold, in the range 1..MICROBIT_RADIO_MAXIMUM_QUEUE_DEPTH.
+  *        The default is MICROBIT_RADIO_MAXIMUM_RX_BUFFERS.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if depth is out of range.
+  *
+  * @note If the queue already holds more datagrams than the new depth, the excess are discarded according
+  *       to the overflow policy, and counted as dropped.
+  */
+int MicroBitRadioDatagram::setQueueDepth(int depth)
+{
+    if (depth < 1 || depth > MICROBIT_RADIO_MAXIMUM_QUEUE_DEPTH)
+        return MICROBIT_INVALID_PARAMETER;
+
+    rxQueueLimit = depth;
+
+    while (rxQueueDepth > rxQueueLimit)
+    {
+        DatagramEntry *p;
+
+        if (rxPolicy == MICROBIT_RADIO_DATAGRAM_DROP_OLDEST)
+        {
+            p = dequeue();
+        }
+        else
+        {
+            // Singly linked, so find the entry before the tail. This is only done when shrinking the queue.
+            DatagramEntry *last = rxQueue;
+
+            while (last->next != rxQueueTail)
+                last = last->next;
+
+            p = rxQueueTail;
+            last->next = NULL;
+            rxQueueTail = last;
+            rxQueueDepth--;
+        }
+
+        delete p;
+        rxDropped++;
+    }
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Selects which datagram is discarded when one is received whilst the queue is full.
+  *
+  * @param policy MICROBIT_RADIO_DATAGRAM_DROP_NEWEST (the default) to discard the datagram just received, or
+  *        MICROBIT_RADIO_DATAGRAM_DROP_OLDEST to discard the oldest queued datagram to make room for it.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if the policy is not recognised.
+  *
+  * @note Reliable datagrams are only acknowledged once queued, so under MICROBIT_RADIO_DATAGRAM_DROP_NEWEST
+  *       the sender will retransmit them, whereas under MICROBIT_RADIO_DATAGRAM_DROP_OLDEST they are always
+  *       accepted, but may be discarded before they are collected.
+  */
+int MicroBitRadioDatagram::setOverflowPolicy(int policy)
+{
+    if (policy != MICROBIT_RADIO_DATAGRAM_DROP_NEWEST && policy != MICROBIT_RADIO_DATAGRAM_DROP_OLDEST)
+        return MICROBIT_INVALID_PARAMETER;
+
+    rxPolicy = policy;
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Determines the number of datagrams awaiting collection by recv().
+  *
+  * @return the number of datagrams queued.
+  */
+int MicroBitRadioDatagram::dataReady()
+{
+    return rxQueueDepth;
+}
+
+/**
+  * Determines the number of received datagrams that have been discarded because the queue was full.
+  *
+  * @return the number of datagrams dropped since the last call to resetDroppedPackets().
+  */
+int MicroBitRadioDatagram::getDroppedPackets()
+{
+    return rxDropped;
+}
+
+/**
+  * Resets the count of dropped datagrams to zero.
+  *
+  * @return MICROBIT_OK.
+  */
+int MicroBitRadioDatagram::resetDroppedPackets()
+{
+    rxDropped = 0;
+
+    return MICROBIT_OK;
+}
+
 /**
   * Protocol handler callback. This is called when the radio receives a packet marked as a datagram.
   *
@@ -172,32 +572,254 @@ int MicroBitRadioDatagram::send(ManagedString data)
 void MicroBitRadioDatagram::packetReceived()
 {
     FrameBuffer *packet = radio.recv();
-    int queueDepth = 0;
 
-    // We add to the tail of the queue to preserve causal ordering.
-    packet->next = NULL;
+    if (packet == NULL)
+        return;
 
-    if (rxQueue == NULL)
+    queuePacket(PacketBuffer(packet->payload, packet->length - (MICROBIT_RADIO_HEADER_SIZE - 1), packet->rssi));
+
+    delete packet;
+}
+
+/**
+  * Protocol handler callback. This is called when the radio receives a packet marked as a reliable datagram.
+  *
+  * Datagrams addressed to this micro:bit are acknowledged, and queued for user reception unless they are
+  * duplicates. Acknowledgements of our own pending datagram complete its delivery.
+  */
+void MicroBitRadioDatagram::reliablePacketReceived()
+{
+    FrameBuffer *packet = radio.recv();
+    uint32_t destination, source;
+
+    if (packet == NULL)
+        return;
+
+    int len = packet->length - (MICROBIT_RADIO_HEADER_SIZE - 1) - MICROBIT_RADIO_RELIABLE_HEADER_SIZE;
+    uint8_t type = packet->payload[MICROBIT_RADIO_RELIABLE_TYPE];
+    uint8_t sequence = packet->payload[MICROBIT_RADIO_RELIABLE_SEQUENCE];
+
+    memcpy(&destination, &packet->payload[MICROBIT_RADIO_RELIABLE_DESTINATION], sizeof(uint32_t));
+    memcpy(&source, &packet->payload[MICROBIT_RADIO_RELIABLE_SOURCE], sizeof(uint32_t));
+
+    // Every well formed frame tells us about the link from its sender, wherever it is addressed.
+    // Each datagram sent carries the next sequence number, whereas acknowledgements carry the datagram's.
+    if (len >= 0)
     {
-        rxQueue = packet;
+        if (type == MICROBIT_RADIO_RELIABLE_DATA)
+            radio.neighbours().frameHeard(packet, source, sequence, 0xFF);
+        else
+            radio.neighbours().frameHeard(packet, source);
     }
-    else
+
+    // Ignore anything malformed, or not addressed to us.
+    if (len < 0 || destination != microbit_serial_number())
     {
-        FrameBuffer *p = rxQueue;
-        while (p->next != NULL)
+        delete packet;
+        return;
+    }
+
+    if (type == MICROBIT_RADIO_RELIABLE_ACK)
+    {
+        uint32_t pendingDestination;
+        bool acked = false;
+
+        // Complete our pending datagram, unless systemTick() has just given up on it.
+        __disable_irq();
+
+        if (status & MICROBIT_RADIO_DATAGRAM_STATUS_PENDING)
         {
-            p = p->next;
-            queueDepth++;
+            memcpy(&pendingDestination, &txFrame->payload[MICROBIT_RADIO_RELIABLE_DESTINATION], sizeof(uint32_t));
+
+            if (sequence == txSequence && source == pendingDestination)
+            {
+                status &= ~MICROBIT_RADIO_DATAGRAM_STATUS_PENDING;
+                acked = true;
+            }
         }
 
-        if (queueDepth >= MICROBIT_RADIO_MAXIMUM_RX_BUFFERS)
+        __enable_irq();
+
+        if (acked)
+            MicroBitEvent(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_DATAGRAM_ACKED);
+
+        delete packet;
+        return;
+    }
+
+    if (type != MICROBIT_RADIO_RELIABLE_DATA)
+    {
+        delete packet;
+        return;
+    }
+
+    ReliableHistory *h = historyFor(source);
+
+    // If we've already accepted this datagram, our acknowledgement must have been lost. Simply send it again.
+    if (h->source == source && h->sequence == sequence)
+    {
+        sendControl(MICROBIT_RADIO_RELIABLE_ACK, sequence, source, packet->group);
+        delete packet;
+        return;
+    }
+
+    // Strip the reliable header, so the datagram can be received just like any other.
+    // Only acknowledge the datagram if there was space to queue it. Otherwise, the sender will retry.
+    if (queuePacket(PacketBuffer(&packet->payload[MICROBIT_RADIO_RELIABLE_HEADER_SIZE], len, packet->rssi)) == MICROBIT_OK)
+    {
+        if (h->source != source)
         {
-            delete packet;
-            return;
+            h->source = source;
+            historyIndex = (historyIndex + 1) % MICROBIT_RADIO_RELIABLE_HISTORY;
         }
 
-        p->next = packet;
+        h->sequence = sequence;
+
+        sendControl(MICROBIT_RADIO_RELIABLE_ACK, sequence, source, packet->group);
     }
 
-    MicroBitEvent(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_DATAGRAM);
+    delete packet;
+}
+
+/**
+  * Finds the buffer in which the given datagram is being reassembled, or allocates one if it is new.
+  * Any incomplete datagrams that have timed out are discarded along the way.
+  *
+  * @param source the serial number of the sender.
+  *
+  * @param id the id of the datagram.
+  *
+  * @param count the number of fragments in the datagram.
+  *
+  * @return the buffer, or NULL if all buffers are in use, or memory could not be allocated.
+  */
+FragmentBuffer* MicroBitRadioDatagram::fragmentBufferFor(uint32_t source, uint8_t id, uint8_t count)
+{
+    uint32_t now = (uint32_t)system_timer_current_time();
+    FragmentBuffer *unused = NULL;
+
+    for (int i = 0; i < MICROBIT_RADIO_FRAGMENT_BUFFERS; i++)
+    {
+        FragmentBuffer *f = &fragments[i];
+
+        if (f->data != NULL)
+        {
+            if (f->source == source && f->id == id && f->count == count)
+                return f;
+
+            // A new datagram from the same source supersedes any it left incomplete.
+            if (f->source == source || (int32_t)(now - f->deadline) >= 0)
+            {
+                free(f->data);
+                f->data = NULL;
+            }
+        }
+
+        if (f->data == NULL && unused == NULL)
+            unused = f;
+    }
+
+    if (unused == NULL)
+        return NULL;
+
+    unused->data = (uint8_t *)malloc(count * MICROBIT_RADIO_FRAGMENT_PAYLOAD_SIZE);
+
+    if (unused->data == NULL)
+        return NULL;
+
+    unused->source = source;
+    unused->id = id;
+    unused->count = count;
+    unused->received = 0;
+    unused->length = 0;
+
+    return unused;
+}
+
+/**
+  * Protocol handler callback. This is called when the radio receives a fragment of a datagram.
+  *
+  * Fragments may arrive in any order. Once all the fragments of a datagram have arrived, it is
+  * queued for user reception.
+  */
+void MicroBitRadioDatagram::fragmentReceived()
+{
+    FrameBuffer *packet = radio.recv();
+    uint32_t source;
+
+    if (packet == NULL)
+        return;
+
+    int len = packet->length - (MICROBIT_RADIO_HEADER_SIZE - 1) - MICROBIT_RADIO_FRAGMENT_HEADER_SIZE;
+    uint8_t id = packet->payload[MICROBIT_RADIO_FRAGMENT_ID];
+    uint8_t index = packet->payload[MICROBIT_RADIO_FRAGMENT_INDEX];
+    uint8_t count = packet->payload[MICROBIT_RADIO_FRAGMENT_COUNT];
+
+    memcpy(&source, &packet->payload[MICROBIT_RADIO_FRAGMENT_SOURCE], sizeof(uint32_t));
+
+    // Ignore anything malformed. Every fragment but the last is always full.
+    if (len <= 0 || count < 2 || count > MICROBIT_RADIO_FRAGMENT_MAX_COUNT || index >= count ||
+        (index < count - 1 && len != MICROBIT_RADIO_FRAGMENT_PAYLOAD_SIZE))
+    {
+        delete packet;
+        return;
+    }
+
+    radio.neighbours().frameHeard(packet, source);
+
+    FragmentBuffer *f = fragmentBufferFor(source, id, count);
+
+    if (f == NULL)
+    {
+        delete packet;
+        return;
+    }
+
+    memcpy(&f->data[index * MICROBIT_RADIO_FRAGMENT_PAYLOAD_SIZE], &packet->payload[MICROBIT_RADIO_FRAGMENT_HEADER_SIZE], len);
+    f->received |= 1UL << index;
+    f->deadline = (uint32_t)system_timer_current_time() + MICROBIT_RADIO_FRAGMENT_TIMEOUT;
+
+    if (index == count - 1)
+        f->length = index * MICROBIT_RADIO_FRAGMENT_PAYLOAD_SIZE + len;
+
+    // Once every fragment has arrived, hand the datagram over to the application.
+    if (f->received == (1UL << count) - 1)
+    {
+        queuePacket(PacketBuffer(f->data, f->length, packet->rssi));
+
+        free(f->data);
+        f->data = NULL;
+    }
+
+    delete packet;
+}
+
+/**
+  * Periodic callback from MicroBit system timer.
+  *
+  * Retransmits any reliable datagram that has not been acknowledged in time.
+  */
+void MicroBitRadioDatagram::systemTick()
+{
+    if (!(status & MICROBIT_RADIO_DATAGRAM_STATUS_PENDING))
+        return;
+
+    uint32_t now = (uint32_t)system_timer_current_time();
+
+    if ((int32_t)(now - txDeadline) < 0)
+        return;
+
+    if (txRetries >= MICROBIT_RADIO_RELIABLE_RETRIES)
+    {
+        status &= ~MICROBIT_RADIO_DATAGRAM_STATUS_PENDING;
+        MicroBitEvent(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_DATAGRAM_FAILED);
+        return;
+    }
+
+    // Back off exponentially, to give the receiver (and the channel) a chance to recover.
+    txRetries++;
+    txTimeout <<= 1;
+    txDeadline = now + txTimeout;
+
+    radio.sendAsync(txFrame);
 }
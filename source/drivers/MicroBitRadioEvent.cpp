@@ -25,6 +25,7 @@ DEALINGS IN THE SOFTWARE.
 
 #include "MicroBitConfig.h"
 #include "MicroBitRadio.h"
+#include "MicroBitFiber.h"
 
 /**
  * Provides a simple broadcast radio abstraction, built upon the raw nrf51822 RADIO module.
@@ -51,6 +52,7 @@ DEALINGS IN THE SOFTWARE.
 MicroBitRadioEvent::MicroBitRadioEvent(MicroBitRadio &r) : radio(r)
 {
     this->suppressForwarding = false;
+    this->dropped = 0;
 }
 
 /**
@@ -144,6 +146,10 @@ int MicroBitRadioEvent::ignore(uint16_t id, uint16_t value, EventModel &eventBus
 void MicroBitRadioEvent::packetReceived()
 {
     FrameBuffer *p = radio.recv();
+
+    if (p == NULL)
+        return;
+
     MicroBitEvent *e = (MicroBitEvent *) p->payload;
 
     suppressForwarding = true;
@@ -171,5 +177,25 @@ void MicroBitRadioEvent::eventReceived(MicroBitEvent e)
     buf.protocol = MICROBIT_RADIO_PROTOCOL_EVENTBUS;
     memcpy(buf.payload, (const uint8_t *)&e, sizeof(MicroBitEvent));
 
-    radio.send(&buf);
+    // We're an immediate listener, so run in whatever context raised the event. On a user fiber, wait for the packet
+    // to be sent, so that bursts of events aren't lost. In interrupt context, or on the idle fiber (e.g. events raised
+    // by a radio protocol handler), we must not block, so can only queue the packet, and drop it if the queue is full.
+    int result;
+
+    if (inInterruptContext() || !fiber_scheduler_running() || fiber_is_idle())
+        result = radio.sendAsync(&buf);
+    else
+        result = radio.send(&buf);
+
+    if (result == MICROBIT_NO_RESOURCES)
+        dropped++;
+}
+
+/**
+  * @return the number of events that could not be forwarded, because they were raised in interrupt context,
+  *         or on the idle fiber, whilst the radio transmit queue was full.
+  */
+int MicroBitRadioEvent::getDroppedEvents()
+{
+    return dropped;
 }
@@ -0,0 +1,571 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 British Broadcasting Corporation.
+This software is provided by Lancaster University by arrangement with the BBC.
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "MicroBitConfig.h"
+#include "MicroBitRadio.h"
+#include "MicroBitRadioMesh.h"
+#include "MicroBitDevice.h"
+#include "MicroBitSystemTimer.h"
+
+/**
+  * Provides a simple multi-hop broadcast over the radio, so that packets reach micro:bits beyond the range of the sender.
+  *
+  * Every micro:bit that receives a mesh packet for the first time delivers it, and, if its time to live has not expired,
+  * rebroadcasts it after a short random delay. The delay decorrelates neighbouring rebroadcasts, and if enough neighbours
+  * are heard rebroadcasting the same packet first, ours is cancelled, bounding the airtime used in dense networks.
+  * Duplicates are recognised by the serial number of the origin and a per-origin sequence number.
+  *
+  * @note This API does not contain any form of encryption, authentication or authorisation. Its purpose is solely for use as a
+  * teaching aid to demonstrate how simple communications operates, and to provide a sandpit through which learning can take place.
+  * For serious applications, BLE should be considered a substantially more secure alternative.
+  */
+
+/**
+  * A packet awaiting rebroadcast.
+  */
+struct MeshForward
+{
+    FrameBuffer         frame;      // The packet, with its TTL and hop count already updated, and the group it was received on.
+    uint32_t            deadline;   // The system time at which the packet should be rebroadcast.
+    volatile uint8_t    state;      // MICROBIT_RADIO_MESH_SLOT_FREE or MICROBIT_RADIO_MESH_SLOT_PENDING.
+    uint8_t             duplicates; // The number of times the packet has been heard rebroadcast by neighbours whilst pending.
+};
+
+/**
+  * Reads the origin and sequence number from the header of a mesh packet.
+  */
+static void readHeader(FrameBuffer *packet, uint32_t *origin, uint16_t *sequence)
+{
+    memcpy(origin, &packet->payload[MICROBIT_RADIO_MESH_ORIGIN], sizeof(uint32_t));
+    memcpy(sequence, &packet->payload[MICROBIT_RADIO_MESH_SEQUENCE], sizeof(uint16_t));
+}
+
+/**
+  * Constructor.
+  *
+  * Creates an instance of a MicroBitRadioMesh which offers the ability to broadcast
+  * simple text or binary messages to micro:bits beyond the range of the radio.
+  *
+  * @param r The underlying radio module used to send and receive data.
+  *
+  * @note No memory is allocated, and packets are not rebroadcast, until this micro:bit first sends a mesh packet
+  *       or receives one.
+  */
+MicroBitRadioMesh::MicroBitRadioMesh(MicroBitRadio &r) : radio(r)
+{
+    this->rxQueue = NULL;
+    this->rxQueueTail = NULL;
+    this->rxQueueDepth = 0;
+    this->rxPolicy = MICROBIT_RADIO_MESH_DROP_NEWEST;
+    this->forward = NULL;
+    this->txSequence = 0;
+    this->originIndex = 0;
+
+    memset(origins, 0, sizeof(origins));
+    memset(&statistics, 0, sizeof(statistics));
+}
+
+/**
+  * Allocates the forwarding slots, and registers for periodic callbacks, if this has not already been done.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if memory or a system timer slot could not be allocated.
+  */
+int MicroBitRadioMesh::init()
+{
+    if (status & MICROBIT_COMPONENT_RUNNING)
+        return MICROBIT_OK;
+
+    if (forward == NULL)
+    {
+        forward = new MeshForward[MICROBIT_RADIO_MESH_FORWARD_SLOTS];
+
+        if (forward == NULL)
+            return MICROBIT_NO_RESOURCES;
+
+        for (int i = 0; i < MICROBIT_RADIO_MESH_FORWARD_SLOTS; i++)
+            forward[i].state = MICROBIT_RADIO_MESH_SLOT_FREE;
+
+        // Start from a random sequence number, so that our neighbours don't mistake us for our previous incarnation after a reset.
+        txSequence = microbit_random(65536);
+    }
+
+    if (system_timer_add_component(this) != MICROBIT_OK)
+        return MICROBIT_NO_RESOURCES;
+
+    status |= MICROBIT_COMPONENT_RUNNING;
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Determines if a packet has already been seen, and records it if not.
+  *
+  * @param origin the serial number of the micro:bit that first sent the packet.
+  *
+  * @param sequence the sequence number of the packet.
+  *
+  * @return true if the packet has been seen before (or is too old to tell), false otherwise.
+  */
+bool MicroBitRadioMesh::isDuplicate(uint32_t origin, uint16_t sequence)
+{
+    MeshOrigin *o = NULL;
+
+    for (int i = 0; i < MICROBIT_RADIO_MESH_ORIGINS; i++)
+    {
+        if (origins[i].origin == origin)
+        {
+            o = &origins[i];
+            break;
+        }
+    }
+
+    // If we've not heard from this origin recently, replace the oldest entry.
+    if (o == NULL)
+    {
+        o = &origins[originIndex];
+        originIndex = (originIndex + 1) % MICROBIT_RADIO_MESH_ORIGINS;
+
+        o->origin = origin;
+        o->sequence = sequence;
+        o->window = 1;
+
+        return false;
+    }
+
+    int16_t offset = (int16_t)(sequence - o->sequence);
+
+    // A newer packet than any seen so far. Slide the window forward.
+    if (offset > 0)
+    {
+        o->window = offset >= MICROBIT_RADIO_MESH_WINDOW ? 1 : (o->window << offset) | 1;
+        o->sequence = sequence;
+
+        return false;
+    }
+
+    // Too old to tell. Assume it's a duplicate, rather than risk flooding the network with it again.
+    if (-offset >= MICROBIT_RADIO_MESH_WINDOW)
+        return true;
+
+    uint16_t bit = 1 << -offset;
+
+    if (o->window & bit)
+        return true;
+
+    o->window |= bit;
+
+    return false;
+}
+
+/**
+  * Notes that a neighbour has rebroadcast a packet we are waiting to rebroadcast,
+  * and cancels our rebroadcast if enough neighbours have done so.
+  *
+  * @param origin the serial number of the micro:bit that first sent the packet.
+  *
+  * @param sequence the sequence number of the packet.
+  */
+void MicroBitRadioMesh::duplicateHeard(uint32_t origin, uint16_t sequence)
+{
+    if (forward == NULL)
+        return;
+
+    for (int i = 0; i < MICROBIT_RADIO_MESH_FORWARD_SLOTS; i++)
+    {
+        MeshForward *f = &forward[i];
+        uint32_t o;
+        uint16_t s;
+
+        if (f->state != MICROBIT_RADIO_MESH_SLOT_PENDING)
+            continue;
+
+        readHeader(&f->frame, &o, &s);
+
+        if (o == origin && s == sequence && ++f->duplicates >= MICROBIT_RADIO_MESH_SUPPRESSION)
+        {
+            // Our neighbours have this covered. systemTick() may be sending the packet right now, but if so, no harm done.
+            f->state = MICROBIT_RADIO_MESH_SLOT_FREE;
+            statistics.suppressed++;
+        }
+    }
+}
+
+/**
+  * Schedules a received packet for rebroadcast after a random delay.
+  *
+  * @param packet the packet, as received.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if all forwarding slots are in use.
+  */
+int MicroBitRadioMesh::scheduleForward(FrameBuffer *packet)
+{
+    if (init() != MICROBIT_OK)
+        return MICROBIT_NO_RESOURCES;
+
+    for (int i = 0; i < MICROBIT_RADIO_MESH_FORWARD_SLOTS; i++)
+    {
+        MeshForward *f = &forward[i];
+
+        if (f->state != MICROBIT_RADIO_MESH_SLOT_FREE)
+            continue;
+
+        memcpy(&f->frame, packet, sizeof(FrameBuffer));
+        f->frame.payload[MICROBIT_RADIO_MESH_TTL]--;
+        f->frame.payload[MICROBIT_RADIO_MESH_HOPS]++;
+        f->deadline = (uint32_t)system_timer_current_time() + microbit_random(MICROBIT_RADIO_MESH_JITTER + 1);
+        f->duplicates = 0;
+
+        // Only hand the slot to systemTick() once it's complete.
+        f->state = MICROBIT_RADIO_MESH_SLOT_PENDING;
+
+        return MICROBIT_OK;
+    }
+
+    return MICROBIT_NO_RESOURCES;
+}
+
+/**
+  * Adds the given packet to the queue awaiting user reception.
+  * If the queue is full, either this packet or the oldest queued is discarded, according to the overflow policy.
+  *
+  * @param packet The packet to queue.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if the packet was discarded.
+  */
+int MicroBitRadioMesh::queuePacket(FrameBuffer *packet)
+{
+    if (rxQueueDepth >= MICROBIT_RADIO_MAXIMUM_RX_BUFFERS)
+    {
+        statistics.dropped++;
+
+        if (rxPolicy == MICROBIT_RADIO_MESH_DROP_NEWEST)
+        {
+            delete packet;
+            return MICROBIT_NO_RESOURCES;
+        }
+
+        delete dequeue();
+    }
+
+    // We add to the tail of the queue to preserve causal ordering.
+    packet->next = NULL;
+
+    if (rxQueueTail == NULL)
+        rxQueue = packet;
+    else
+        rxQueueTail->next = packet;
+
+    rxQueueTail = packet;
+    rxQueueDepth++;
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Removes the oldest packet from the queue awaiting user reception.
+  *
+  * @return the packet, which the caller must delete, or NULL if the queue is empty.
+  */
+FrameBuffer* MicroBitRadioMesh::dequeue()
+{
+    FrameBuffer *p = rxQueue;
+
+    if (p == NULL)
+        return NULL;
+
+    rxQueue = p->next;
+    rxQueueDepth--;
+
+    if (rxQueue == NULL)
+        rxQueueTail = NULL;
+
+    return p;
+}
+
+/**
+  * Retrieves packet payload data into the given buffer.
+  *
+  * @param buf A pointer to a valid memory location where the received data is to be stored
+  *
+  * @param len The maximum amount of data that can safely be stored in 'buf'
+  *
+  * @param origin If not NULL, set to the serial number of the micro:bit that sent the packet.
+  *
+  * @return The length of the data stored, or MICROBIT_INVALID_PARAMETER if no data is available, or the memory regions provided are invalid.
+  */
+int MicroBitRadioMesh::recv(uint8_t *buf, int len, uint32_t *origin)
+{
+    if (buf == NULL || rxQueue == NULL || len < 0)
+        return MICROBIT_INVALID_PARAMETER;
+
+    // Take the first buffer from the queue.
+    FrameBuffer *p = dequeue();
+
+    int l = min(len, p->length - (MICROBIT_RADIO_HEADER_SIZE - 1) - MICROBIT_RADIO_MESH_HEADER_SIZE);
+
+    // Fill in the buffer provided, if possible.
+    memcpy(buf, &p->payload[MICROBIT_RADIO_MESH_HEADER_SIZE], l);
+
+    if (origin)
+        memcpy(origin, &p->payload[MICROBIT_RADIO_MESH_ORIGIN], sizeof(uint32_t));
+
+    delete p;
+    return l;
+}
+
+/**
+  * Retrieves packet payload data.
+  *
+  * @return the data received, or an empty PacketBuffer if no data is available.
+  */
+PacketBuffer MicroBitRadioMesh::recv()
+{
+    if (rxQueue == NULL)
+        return PacketBuffer::EmptyPacket;
+
+    FrameBuffer *p = dequeue();
+
+    PacketBuffer packet(&p->payload[MICROBIT_RADIO_MESH_HEADER_SIZE], p->length - (MICROBIT_RADIO_HEADER_SIZE - 1) - MICROBIT_RADIO_MESH_HEADER_SIZE, p->rssi);
+
+    delete p;
+    return packet;
+}
+
+/**
+  * Transmits the given buffer to all micro:bits within the given number of hops.
+  *
+  * This is a synchronous call that will wait until the first transmission of the packet
+  * has completed before returning.
+  *
+  * @param buffer The packet contents to transmit.
+  *
+  * @param len The number of bytes to transmit.
+  *
+  * @param ttl The number of hops the packet may travel, in the range 1..MICROBIT_RADIO_MESH_MAX_TTL.
+  *
+  * @return MICROBIT_OK on success, MICROBIT_NO_RESOURCES if memory could not be allocated, or MICROBIT_INVALID_PARAMETER
+  *         if the buffer or ttl is invalid, or the number of bytes to transmit is greater than `MICROBIT_RADIO_MESH_MAX_SIZE`.
+  */
+int MicroBitRadioMesh::send(uint8_t *buffer, int len, int ttl)
+{
+    if (buffer == NULL || len < 0 || len > MICROBIT_RADIO_MESH_MAX_SIZE || ttl < 1 || ttl > MICROBIT_RADIO_MESH_MAX_TTL)
+        return MICROBIT_INVALID_PARAMETER;
+
+    if (init() != MICROBIT_OK)
+        return MICROBIT_NO_RESOURCES;
+
+    FrameBuffer buf;
+    uint32_t origin = microbit_serial_number();
+    uint16_t sequence = ++txSequence;
+
+    buf.length = len + MICROBIT_RADIO_MESH_HEADER_SIZE + MICROBIT_RADIO_HEADER_SIZE - 1;
+    buf.version = 1;
+    buf.group = 0;
+    buf.protocol = MICROBIT_RADIO_PROTOCOL_MESH;
+    buf.payload[MICROBIT_RADIO_MESH_TTL] = ttl;
+    buf.payload[MICROBIT_RADIO_MESH_HOPS] = 0;
+    memcpy(&buf.payload[MICROBIT_RADIO_MESH_SEQUENCE], &sequence, sizeof(uint16_t));
+    memcpy(&buf.payload[MICROBIT_RADIO_MESH_ORIGIN], &origin, sizeof(uint32_t));
+    memcpy(&buf.payload[MICROBIT_RADIO_MESH_HEADER_SIZE], buffer, len);
+
+    // Remember our own packet, so that we don't rebroadcast it when our neighbours do.
+    isDuplicate(origin, sequence);
+
+    statistics.sent++;
+
+    return radio.send(&buf);
+}
+
+/**
+  * Transmits the given buffer to all micro:bits within the given number of hops.
+  *
+  * @param data The packet contents to transmit.
+  *
+  * @param ttl The number of hops the packet may travel, in the range 1..MICROBIT_RADIO_MESH_MAX_TTL.
+  *
+  * @return MICROBIT_OK on success, or an error code as described for send(uint8_t *, int, int).
+  */
+int MicroBitRadioMesh::send(PacketBuffer data, int ttl)
+{
+    return send((uint8_t *)data.getBytes(), data.length(), ttl);
+}
+
+/**
+  * Transmits the given string to all micro:bits within the given number of hops.
+  *
+  * @param data The packet contents to transmit.
+  *
+  * @param ttl The number of hops the packet may travel, in the range 1..MICROBIT_RADIO_MESH_MAX_TTL.
+  *
+  * @return MICROBIT_OK on success, or an error code as described for send(uint8_t *, int, int).
+  */
+int MicroBitRadioMesh::send(ManagedString data, int ttl)
+{
+    return send((uint8_t *)data.toCharArray(), data.length(), ttl);
+}
+
+/**
+  * Selects which packet is discarded when one is received whilst the queue is full.
+  *
+  * @param policy MICROBIT_RADIO_MESH_DROP_NEWEST (the default) to discard the packet just received, or
+  *        MICROBIT_RADIO_MESH_DROP_OLDEST to discard the oldest queued packet to make room for it.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if the policy is not recognised.
+  *
+  * @note Packets discarded from the queue are still rebroadcast, and are counted as dropped in the statistics.
+  */
+int MicroBitRadioMesh::setOverflowPolicy(int policy)
+{
+    if (policy != MICROBIT_RADIO_MESH_DROP_NEWEST && policy != MICROBIT_RADIO_MESH_DROP_OLDEST)
+        return MICROBIT_INVALID_PARAMETER;
+
+    rxPolicy = policy;
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Determines the number of packets awaiting collection by recv().
+  *
+  * @return the number of packets queued.
+  */
+int MicroBitRadioMesh::dataReady()
+{
+    return rxQueueDepth;
+}
+
+/**
+  * Copies the mesh traffic counters accumulated since the last call to resetStatistics().
+  *
+  * @param stats the structure to fill in.
+  *
+  * @return MICROBIT_OK.
+  */
+int MicroBitRadioMesh::getStatistics(MicroBitRadioMeshStatistics &stats)
+{
+    __disable_irq();
+    stats = statistics;
+    __enable_irq();
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Resets all mesh traffic counters to zero.
+  *
+  * @return MICROBIT_OK.
+  */
+int MicroBitRadioMesh::resetStatistics()
+{
+    __disable_irq();
+    memset(&statistics, 0, sizeof(statistics));
+    __enable_irq();
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Protocol handler callback. This is called when the radio receives a packet marked as a mesh packet.
+  *
+  * New packets are queued for user reception, and scheduled for rebroadcast.
+  */
+void MicroBitRadioMesh::packetReceived()
+{
+    FrameBuffer *packet = radio.recv();
+    uint32_t origin;
+    uint16_t sequence;
+
+    if (packet == NULL)
+        return;
+
+    // Ignore anything malformed.
+    if (packet->length < MICROBIT_RADIO_HEADER_SIZE - 1 + MICROBIT_RADIO_MESH_HEADER_SIZE)
+    {
+        delete packet;
+        return;
+    }
+
+    readHeader(packet, &origin, &sequence);
+
+    // A packet that has not yet been rebroadcast was heard directly from its origin.
+    if (packet->payload[MICROBIT_RADIO_MESH_HOPS] == 0)
+        radio.neighbours().frameHeard(packet, origin, sequence, 0xFFFF);
+
+    if (isDuplicate(origin, sequence))
+    {
+        statistics.duplicates++;
+        duplicateHeard(origin, sequence);
+
+        delete packet;
+        return;
+    }
+
+    int hops = packet->payload[MICROBIT_RADIO_MESH_HOPS];
+
+    statistics.received++;
+    statistics.hops[min(hops, MICROBIT_RADIO_MESH_STATS_HOPS - 1)]++;
+
+    // Pass the packet on, if it has further to go.
+    if (packet->payload[MICROBIT_RADIO_MESH_TTL] > 1 && scheduleForward(packet) != MICROBIT_OK)
+        statistics.dropped++;
+
+    // Queue the packet for the user.
+    if (queuePacket(packet) != MICROBIT_OK)
+        return;
+
+    MicroBitEvent(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_MESH);
+}
+
+/**
+  * Periodic callback from MicroBit system timer.
+  *
+  * Rebroadcasts any packets whose random delay has expired.
+  */
+void MicroBitRadioMesh::systemTick()
+{
+    uint32_t now = (uint32_t)system_timer_current_time();
+
+    for (int i = 0; i < MICROBIT_RADIO_MESH_FORWARD_SLOTS; i++)
+    {
+        MeshForward *f = &forward[i];
+
+        if (f->state != MICROBIT_RADIO_MESH_SLOT_PENDING || (int32_t)(now - f->deadline) < 0)
+            continue;
+
+        // Rebroadcast on the group the packet was received on, which scheduleForward() copied into the frame.
+        int result = radio.sendToGroup(&f->frame, f->frame.group);
+
+        // If the transmit queue is full, try again on the next tick.
+        if (result == MICROBIT_NO_RESOURCES)
+            continue;
+
+        f->state = MICROBIT_RADIO_MESH_SLOT_FREE;
+
+        if (result == MICROBIT_OK)
+            statistics.forwarded++;
+        else
+            statistics.dropped++;
+    }
+}
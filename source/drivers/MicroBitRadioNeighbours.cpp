@@ -0,0 +1,244 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 British Broadcasting Corporation.
+This software is provided by Lancaster University by arrangement with the BBC.
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "MicroBitConfig.h"
+#include "MicroBitRadio.h"
+#include "MicroBitRadioNeighbours.h"
+#include "MicroBitSystemTimer.h"
+#include "ErrorNo.h"
+
+/**
+  * Keeps statistics on the quality of the link from each micro:bit heard directly over the radio.
+  *
+  * Protocols whose frames carry the serial number of their sender report each frame heard. The signal strength of
+  * each neighbour is smoothed with an exponentially weighted moving average. Where frames also carry a sequence number,
+  * gaps in the sequence reveal lost packets, from which a smoothed packet reception ratio (PRR) is estimated, and from
+  * that, the expected transmission count (ETX) of the link. Links are assumed to be symmetric, as we cannot hear how well
+  * a neighbour receives us, so ETX is taken as 1 / PRR^2.
+  *
+  * The table is bounded in size, and the least recently heard neighbour is replaced when a new one appears.
+  *
+  * The table is only updated by protocol handlers, which MicroBitRadio::idleTick() calls in fiber context, never from
+  * the radio interrupt. As fibers are not preempted, entries can be read without disabling interrupts.
+  */
+
+/**
+  * Constructor.
+  *
+  * Creates an empty neighbour table.
+  */
+MicroBitRadioNeighbours::MicroBitRadioNeighbours()
+{
+    this->size = 0;
+}
+
+/**
+  * Looks up a neighbour in the table, adding it if necessary.
+  *
+  * @param id the serial number of the neighbour.
+  *
+  * @return the entry for the neighbour.
+  */
+MicroBitRadioNeighbour* MicroBitRadioNeighbours::entryFor(uint32_t id)
+{
+    uint32_t now = (uint32_t)system_timer_current_time();
+    MicroBitRadioNeighbour *n = NULL;
+
+    for (int i = 0; i < size; i++)
+    {
+        if (table[i].id == id)
+            return &table[i];
+
+        // Note the least recently heard neighbour, in case we need to replace it.
+        if (n == NULL || now - table[i].lastSeen > now - n->lastSeen)
+            n = &table[i];
+    }
+
+    if (size < MICROBIT_RADIO_NEIGHBOURS)
+        n = &table[size++];
+
+    // Until we know otherwise, assume the link is a good one.
+    memclr(n, sizeof(MicroBitRadioNeighbour));
+    n->id = id;
+    n->prr = MICROBIT_RADIO_NEIGHBOUR_PRR_SCALE;
+    n->etx = MICROBIT_RADIO_NEIGHBOUR_ETX_SCALE;
+
+    return n;
+}
+
+/**
+  * Updates the smoothed reception ratio, and ETX, of a neighbour.
+  *
+  * @param n the neighbour.
+  *
+  * @param lost the number of packets lost since the last one received.
+  */
+void MicroBitRadioNeighbours::updateReception(MicroBitRadioNeighbour *n, int lost)
+{
+    int prr = n->prr;
+    int round = (1 << MICROBIT_RADIO_NEIGHBOUR_PRR_SHIFT) - 1;
+
+    // Each packet lost moves the ratio towards zero, and the one received towards one.
+    // We round away from the current value, so that the ratio can reach either limit.
+    for (int i = 0; i < lost; i++)
+        prr -= (prr + round) >> MICROBIT_RADIO_NEIGHBOUR_PRR_SHIFT;
+
+    prr += (MICROBIT_RADIO_NEIGHBOUR_PRR_SCALE - prr + round) >> MICROBIT_RADIO_NEIGHBOUR_PRR_SHIFT;
+
+    n->prr = prr;
+
+    // ETX = 1 / PRR^2, on the assumption that the link is as good in both directions.
+    uint32_t etx = 0xFFFF;
+
+    if (prr > 0)
+        etx = (uint32_t)MICROBIT_RADIO_NEIGHBOUR_ETX_SCALE * MICROBIT_RADIO_NEIGHBOUR_PRR_SCALE * MICROBIT_RADIO_NEIGHBOUR_PRR_SCALE / (uint32_t)(prr * prr);
+
+    n->etx = min(etx, (uint32_t)0xFFFF);
+}
+
+/**
+  * Records a frame heard from a neighbour.
+  *
+  * @param packet the frame, as received.
+  *
+  * @param id the serial number of the micro:bit that sent the frame.
+  *
+  * @note This is called by protocols whose frames carry the serial number of their sender.
+  */
+void MicroBitRadioNeighbours::frameHeard(FrameBuffer *packet, uint32_t id)
+{
+    MicroBitRadioNeighbour *n = entryFor(id);
+
+    // Seed the average with the first frame heard, then smooth.
+    if (n->frames == 0)
+        n->rssiAverage = packet->rssi * (1 << MICROBIT_RADIO_NEIGHBOUR_RSSI_SHIFT);
+    else
+        n->rssiAverage += packet->rssi - (n->rssiAverage >> MICROBIT_RADIO_NEIGHBOUR_RSSI_SHIFT);
+
+    n->rssi = n->rssiAverage >> MICROBIT_RADIO_NEIGHBOUR_RSSI_SHIFT;
+    n->lastSeen = (uint32_t)system_timer_current_time();
+    n->frames++;
+}
+
+/**
+  * Records a frame heard from a neighbour, which carries a sequence number.
+  *
+  * @param packet the frame, as received.
+  *
+  * @param id the serial number of the micro:bit that sent the frame.
+  *
+  * @param sequence the sequence number of the frame. Retransmissions should repeat the sequence number.
+  *
+  * @param mask the range of sequence numbers, less one (e.g. 0xFF for an 8 bit sequence number).
+  *
+  * @note This is called by protocols whose frames carry the serial number of their sender. Sequence gaps are only
+  *       counted between frames of the same protocol, so a neighbour that alternates between protocols with sequence
+  *       numbers has its reception ratio estimated from whichever it uses for the longest runs.
+  */
+void MicroBitRadioNeighbours::frameHeard(FrameBuffer *packet, uint32_t id, uint16_t sequence, uint16_t mask)
+{
+    frameHeard(packet, id);
+
+    MicroBitRadioNeighbour *n = entryFor(id);
+    uint16_t gap = (sequence - n->sequence) & mask;
+
+    // The first sequence number heard from a protocol only gives us somewhere to count from.
+    if (n->protocol != packet->protocol)
+    {
+        n->protocol = packet->protocol;
+        n->sequence = sequence;
+        return;
+    }
+
+    // Ignore retransmissions, and frames that arrive out of order.
+    if (gap == 0 || gap > mask / 2)
+        return;
+
+    n->sequence = sequence;
+
+    // A large jump suggests the neighbour has restarted, so we can't tell how many packets were lost.
+    if (gap <= MICROBIT_RADIO_NEIGHBOUR_MAX_GAP)
+        updateReception(n, gap - 1);
+}
+
+/**
+  * Retrieves what we know about the given neighbour.
+  *
+  * @param id the serial number of the neighbour.
+  *
+  * @param neighbour set to the neighbour's entry in the table.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if the neighbour is not in the table.
+  */
+int MicroBitRadioNeighbours::get(uint32_t id, MicroBitRadioNeighbour &neighbour)
+{
+    for (int i = 0; i < size; i++)
+    {
+        if (table[i].id == id)
+        {
+            neighbour = table[i];
+            return MICROBIT_OK;
+        }
+    }
+
+    return MICROBIT_INVALID_PARAMETER;
+}
+
+/**
+  * Retrieves the whole neighbour table, in no particular order.
+  *
+  * @param neighbours the array into which to copy the table.
+  *
+  * @param len the number of entries that can be stored in neighbours.
+  *
+  * @return the number of entries copied, or MICROBIT_INVALID_PARAMETER if the array is invalid.
+  */
+int MicroBitRadioNeighbours::list(MicroBitRadioNeighbour *neighbours, int len)
+{
+    if (neighbours == NULL || len < 0)
+        return MICROBIT_INVALID_PARAMETER;
+
+    int n = min(len, (int)size);
+
+    memcpy(neighbours, table, n * sizeof(MicroBitRadioNeighbour));
+
+    return n;
+}
+
+/**
+  * @return the number of neighbours in the table.
+  */
+int MicroBitRadioNeighbours::count()
+{
+    return size;
+}
+
+/**
+  * Removes all neighbours from the table.
+  */
+void MicroBitRadioNeighbours::clear()
+{
+    size = 0;
+}
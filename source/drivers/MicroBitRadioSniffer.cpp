@@ -0,0 +1,220 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 British Broadcasting Corporation.
+This software is provided by Lancaster University by arrangement with the BBC.
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "MicroBitConfig.h"
+#include "MicroBitRadio.h"
+#include "MicroBitRadioSniffer.h"
+#include "MicroBitFiber.h"
+#include "MicroBitSystemTimer.h"
+#include "ErrorNo.h"
+
+/**
+  * Captures every frame received by the radio, including those that fail their CRC check, and streams them over serial.
+  *
+  * Frames are recorded in RADIO_IRQHandler, with their time of reception and signal strength, by a single copy into a
+  * ring buffer. They are sent from idleTick(), one record per frame, using the framing of MicroBitSerialFramer (SLIP,
+  * with a CRC-16-CCITT). A host tool need only decode each frame and write its record out as a pcap packet, unwrapping
+  * the 32 bit timestamp, for the capture to be inspected with standard tools (e.g. using a user DLT).
+  *
+  * Capture is passive; every frame received is still processed as normal. Only frames addressed to a group the radio
+  * is listening to can be heard, so MicroBitRadio::addGroup() should be used to widen the capture.
+  * Records are dropped if they are captured faster than they can be sent over serial.
+  */
+
+/**
+  * Constructor.
+  *
+  * Creates an instance of a MicroBitRadioSniffer, which captures frames received by the given radio.
+  *
+  * @param r The radio whose frames are captured.
+  *
+  * @param s The serial port to stream captured frames over.
+  *
+  * @code
+  * MicroBitRadioSniffer sniffer(uBit.radio, uBit.serial);
+  * @endcode
+  *
+  * @note No memory is allocated, and nothing is captured, until start() is called.
+  */
+MicroBitRadioSniffer::MicroBitRadioSniffer(MicroBitRadio &r, MicroBitSerial &s) : radio(r), framer(s), serial(s)
+{
+    this->captured = 0;
+    this->dropped = 0;
+}
+
+/**
+  * Destructor.
+  */
+MicroBitRadioSniffer::~MicroBitRadioSniffer()
+{
+    stop();
+}
+
+/**
+  * Begins capturing frames received by the radio, and streaming them over serial.
+  * The serial tx buffer is grown to hold MICROBIT_RADIO_SNIFFER_TX_BUFFER_SIZE bytes, if it is smaller.
+  *
+  * @return MICROBIT_OK on success, MICROBIT_NO_RESOURCES if a buffer could not be allocated,
+  *         MICROBIT_SERIAL_IN_USE if the serial tx buffer needs to grow but another fiber is transmitting, or
+  *         MICROBIT_NOT_SUPPORTED if another sniffer is attached to the radio.
+  */
+int MicroBitRadioSniffer::start()
+{
+    if (status & MICROBIT_COMPONENT_RUNNING)
+        return MICROBIT_OK;
+
+    // Records are only sent once there is room for the whole frame, so make sure the largest can fit.
+    if (serial.getTxBufferSize() - 1 < MICROBIT_RADIO_SNIFFER_TX_BUFFER_SIZE)
+    {
+        int result = serial.setTxBufferSize(MICROBIT_RADIO_SNIFFER_TX_BUFFER_SIZE);
+
+        if (result != MICROBIT_OK)
+            return result;
+    }
+
+    if (records.allocate(MICROBIT_RADIO_SNIFFER_BUFFER_SIZE) != MICROBIT_OK)
+        return MICROBIT_NO_RESOURCES;
+
+    if (radio.setSniffer(this) != MICROBIT_OK)
+    {
+        records.release();
+        return MICROBIT_NOT_SUPPORTED;
+    }
+
+    captured = 0;
+    dropped = 0;
+
+    fiber_add_idle_component(this);
+    status |= MICROBIT_COMPONENT_RUNNING;
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Stops capturing frames, and discards any that have not yet been sent.
+  *
+  * @return MICROBIT_OK.
+  */
+int MicroBitRadioSniffer::stop()
+{
+    if (!(status & MICROBIT_COMPONENT_RUNNING))
+        return MICROBIT_OK;
+
+    // Detach from the radio first, so that RADIO_IRQHandler no longer touches the buffer.
+    radio.setSniffer(NULL);
+
+    fiber_remove_idle_component(this);
+    status &= ~MICROBIT_COMPONENT_RUNNING;
+
+    records.release();
+
+    return MICROBIT_OK;
+}
+
+/**
+  * @return the number of frames captured since start() was called.
+  */
+int MicroBitRadioSniffer::getCapturedFrames()
+{
+    return captured;
+}
+
+/**
+  * @return the number of frames not captured since start() was called, due to lack of space.
+  */
+int MicroBitRadioSniffer::getDroppedFrames()
+{
+    return dropped;
+}
+
+/**
+  * Records a frame received by the radio.
+  *
+  * @param packet the frame, as received.
+  *
+  * @param group the group the frame was addressed to.
+  *
+  * @param valid true if the frame passed its CRC check.
+  *
+  * @note should only be called from RADIO_IRQHandler, whilst the frame is still in the receive buffer.
+  */
+void MicroBitRadioSniffer::frameCaptured(FrameBuffer *packet, uint8_t group, bool valid)
+{
+    uint8_t record[1 + MICROBIT_RADIO_SNIFFER_MAX_RECORD];
+    uint32_t timestamp = (uint32_t)system_timer_current_time_us();
+
+    // The length of a corrupt frame can't be trusted, so never copy more than the receive buffer holds.
+    int frameLength = min((int)packet->length + 1, MICROBIT_RADIO_SNIFFER_MAX_FRAME);
+    int length = MICROBIT_RADIO_SNIFFER_HEADER_SIZE + frameLength;
+
+    // Only whole records are buffered, so that the reader never sees part of one.
+    if (records.space() < length + 1)
+    {
+        dropped++;
+        return;
+    }
+
+    record[0] = length;
+    memcpy(&record[1 + MICROBIT_RADIO_SNIFFER_TIMESTAMP], &timestamp, sizeof(uint32_t));
+    record[1 + MICROBIT_RADIO_SNIFFER_RSSI] = (uint8_t)(-(int)NRF_RADIO->RSSISAMPLE);
+    record[1 + MICROBIT_RADIO_SNIFFER_FLAGS] = valid ? MICROBIT_RADIO_SNIFFER_FLAG_CRC_OK : 0;
+    record[1 + MICROBIT_RADIO_SNIFFER_FREQUENCY] = NRF_RADIO->FREQUENCY;
+    record[1 + MICROBIT_RADIO_SNIFFER_GROUP] = group;
+    memcpy(&record[1 + MICROBIT_RADIO_SNIFFER_HEADER_SIZE], packet, frameLength);
+
+    records.write(record, length + 1);
+    captured++;
+}
+
+/**
+  * A background, low priority callback that is triggered whenever the processor is idle.
+  * Here, we send as many records over serial as there is space for.
+  */
+void MicroBitRadioSniffer::idleTick()
+{
+    uint8_t record[MICROBIT_RADIO_SNIFFER_MAX_RECORD];
+
+    while (!records.isEmpty())
+    {
+        int length = records.peek();
+
+        // Leave the record buffered if another fiber is using the serial port. We can't wait for it here.
+        if (serial.txInUse())
+            return;
+
+        // Worst case, every byte of the record and its CRC is escaped, plus a delimiter at each end.
+        // Only send once there is room for all of it, so that the idle fiber never waits on the serial port.
+        int space = serial.getTxBufferSize() - 1 - serial.txBufferedSize();
+
+        if (space < 2 * (length + MICROBIT_SERIAL_FRAME_CRC_SIZE) + 2)
+            return;
+
+        records.skip(1);
+        records.read(record, length);
+
+        if (framer.send(record, length, ASYNC) != MICROBIT_OK)
+            dropped++;
+    }
+}
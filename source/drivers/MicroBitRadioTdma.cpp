@@ -0,0 +1,364 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 British Broadcasting Corporation.
+This software is provided by Lancaster University by arrangement with the BBC.
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "MicroBitConfig.h"
+#include "MicroBitRadio.h"
+#include "MicroBitRadioTdma.h"
+#include "MicroBitDevice.h"
+#include "MicroBitSystemTimer.h"
+
+/**
+  * Provides collision free transmission, by giving each micro:bit in a group its own time slot.
+  *
+  * Time is divided into frames of a fixed number of slots, using the network time provided by MicroBitRadio::timesync.
+  * One micro:bit is the coordinator; it is also the time reference, owns slot 0, and assigns the other slots on request.
+  * Other micro:bits join, and once synchronised, request a slot during slot 0. Thereafter, the transmit queue of the radio
+  * is only released during their own slot, so all packets sent (by any protocol) wait for it.
+  *
+  * Slot boundaries are checked by the system timer, so slots should be several timer periods long. All micro:bits in a
+  * group must use the same number and length of slots.
+  */
+
+/**
+  * Constructor.
+  *
+  * Creates an instance of a MicroBitRadioTdma, which offers collision free transmission by time division.
+  *
+  * @param r The underlying radio module used to send and receive data.
+  *
+  * @note Transmission is unaffected until start() or join() is called.
+  */
+MicroBitRadioTdma::MicroBitRadioTdma(MicroBitRadio &r) : radio(r)
+{
+    this->assigned = NULL;
+    this->requestDeadline = 0;
+    this->slotLength = MICROBIT_RADIO_TDMA_DEFAULT_SLOT_LENGTH;
+    this->slotCount = MICROBIT_RADIO_TDMA_DEFAULT_SLOTS;
+    this->slot = 0;
+}
+
+/**
+  * Registers for periodic callbacks, if this has not already been done.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if a system timer slot could not be allocated.
+  */
+int MicroBitRadioTdma::init()
+{
+    if (status & MICROBIT_COMPONENT_RUNNING)
+        return MICROBIT_OK;
+
+    if (system_timer_add_component(this) != MICROBIT_OK)
+        return MICROBIT_NO_RESOURCES;
+
+    status |= MICROBIT_COMPONENT_RUNNING;
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Determines if the given slot is open for transmission at the given network time.
+  *
+  * @param s the slot of interest.
+  *
+  * @param time the network time, in milliseconds.
+  *
+  * @return true if the slot has begun, and will not end before the next system timer period (plus a guard time).
+  */
+bool MicroBitRadioTdma::isOpen(int s, uint64_t time)
+{
+    uint32_t offset = time % ((uint32_t)slotCount * slotLength);
+    uint32_t start = s * slotLength;
+
+    return offset >= start && offset + system_timer_get_period() + MICROBIT_RADIO_TDMA_GUARD <= start + slotLength;
+}
+
+/**
+  * Sends a slot management packet.
+  *
+  * @param type MICROBIT_RADIO_TDMA_REQUEST or MICROBIT_RADIO_TDMA_ASSIGN.
+  *
+  * @param node the serial number of the micro:bit requesting, or being assigned, a slot.
+  *
+  * @param s the slot assigned, if any.
+  *
+  * @return MICROBIT_OK on success, or an error code as described for MicroBitRadio::sendAsync().
+  */
+int MicroBitRadioTdma::sendControl(uint8_t type, uint32_t node, uint8_t s)
+{
+    FrameBuffer buf;
+
+    buf.length = MICROBIT_RADIO_TDMA_SIZE + MICROBIT_RADIO_HEADER_SIZE - 1;
+    buf.version = 1;
+    buf.group = 0;
+    buf.protocol = MICROBIT_RADIO_PROTOCOL_TDMA;
+    buf.payload[MICROBIT_RADIO_TDMA_TYPE] = type;
+    memcpy(&buf.payload[MICROBIT_RADIO_TDMA_NODE], &node, sizeof(uint32_t));
+    buf.payload[MICROBIT_RADIO_TDMA_SLOT] = s;
+
+    return radio.sendAsync(&buf);
+}
+
+/**
+  * Makes this micro:bit the TDMA coordinator (and time reference) for its group.
+  *
+  * @param slots the number of slots in each frame, in the range 2..MICROBIT_RADIO_TDMA_MAX_SLOTS.
+  *
+  * @param length the length of each slot in milliseconds, in the range
+  *        MICROBIT_RADIO_TDMA_MIN_SLOT_LENGTH..MICROBIT_RADIO_TDMA_MAX_SLOT_LENGTH.
+  *
+  * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if the parameters are out of range, or
+  *         MICROBIT_NO_RESOURCES if memory or a system timer slot could not be allocated.
+  */
+int MicroBitRadioTdma::start(int slots, int length)
+{
+    if (slots < 2 || slots > MICROBIT_RADIO_TDMA_MAX_SLOTS || length < MICROBIT_RADIO_TDMA_MIN_SLOT_LENGTH || length > MICROBIT_RADIO_TDMA_MAX_SLOT_LENGTH)
+        return MICROBIT_INVALID_PARAMETER;
+
+    stop();
+
+    if (init() != MICROBIT_OK)
+        return MICROBIT_NO_RESOURCES;
+
+    assigned = (uint32_t *)malloc(slots * sizeof(uint32_t));
+
+    if (assigned == NULL)
+        return MICROBIT_NO_RESOURCES;
+
+    memset(assigned, 0, slots * sizeof(uint32_t));
+
+    if (radio.timesync().setReference(true) != MICROBIT_OK)
+    {
+        stop();
+        return MICROBIT_NO_RESOURCES;
+    }
+
+    slotCount = slots;
+    slotLength = length;
+    slot = 0;
+
+    // Hold all transmission until systemTick() sees our slot begin.
+    radio.setTransmitHold(true);
+
+    __disable_irq();
+    status |= MICROBIT_RADIO_TDMA_STATUS_COORDINATOR;
+    __enable_irq();
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Joins the TDMA schedule run by the coordinator of our group. A slot is requested once this micro:bit
+  * is synchronised, and a MICROBIT_RADIO_EVT_TDMA_SLOT event raised when it is assigned.
+  *
+  * @param slots the number of slots in each frame, as given to start() on the coordinator.
+  *
+  * @param length the length of each slot in milliseconds, as given to start() on the coordinator.
+  *
+  * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if the parameters are out of range, or
+  *         MICROBIT_NO_RESOURCES if a system timer slot could not be allocated.
+  *
+  * @note Until a slot is assigned, packets are only sent during the coordinator's slot, and not at all
+  *       until this micro:bit is synchronised.
+  */
+int MicroBitRadioTdma::join(int slots, int length)
+{
+    if (slots < 2 || slots > MICROBIT_RADIO_TDMA_MAX_SLOTS || length < MICROBIT_RADIO_TDMA_MIN_SLOT_LENGTH || length > MICROBIT_RADIO_TDMA_MAX_SLOT_LENGTH)
+        return MICROBIT_INVALID_PARAMETER;
+
+    stop();
+
+    if (init() != MICROBIT_OK)
+        return MICROBIT_NO_RESOURCES;
+
+    slotCount = slots;
+    slotLength = length;
+    slot = 0;
+    requestDeadline = (uint32_t)system_timer_current_time() + microbit_random(MICROBIT_RADIO_TDMA_REQUEST_INTERVAL);
+
+    // Hold all transmission until systemTick() sees a slot we can use begin.
+    radio.setTransmitHold(true);
+
+    __disable_irq();
+    status |= MICROBIT_RADIO_TDMA_STATUS_JOINED;
+    __enable_irq();
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Stops coordinating, or leaves the TDMA schedule, and returns to sending packets as soon as they are queued.
+  *
+  * @return MICROBIT_OK.
+  */
+int MicroBitRadioTdma::stop()
+{
+    if (!(status & (MICROBIT_RADIO_TDMA_STATUS_COORDINATOR | MICROBIT_RADIO_TDMA_STATUS_JOINED)) && assigned == NULL)
+        return MICROBIT_OK;
+
+    __disable_irq();
+    status &= ~(MICROBIT_RADIO_TDMA_STATUS_COORDINATOR | MICROBIT_RADIO_TDMA_STATUS_JOINED | MICROBIT_RADIO_TDMA_STATUS_ASSIGNED | MICROBIT_RADIO_TDMA_STATUS_OPEN);
+    __enable_irq();
+
+    if (assigned != NULL)
+    {
+        free(assigned);
+        assigned = NULL;
+
+        radio.timesync().setReference(false);
+    }
+
+    radio.setTransmitHold(false);
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Determines the slot in which this micro:bit transmits.
+  *
+  * @return the slot number, or MICROBIT_NO_DATA if no slot has been assigned.
+  */
+int MicroBitRadioTdma::getSlot()
+{
+    if (!(status & (MICROBIT_RADIO_TDMA_STATUS_COORDINATOR | MICROBIT_RADIO_TDMA_STATUS_ASSIGNED)))
+        return MICROBIT_NO_DATA;
+
+    return slot;
+}
+
+/**
+  * Protocol handler callback. This is called when the radio receives a slot management packet.
+  */
+void MicroBitRadioTdma::packetReceived()
+{
+    FrameBuffer *packet = radio.recv();
+    uint32_t node;
+
+    if (packet == NULL)
+        return;
+
+    if (packet->length != MICROBIT_RADIO_TDMA_SIZE + MICROBIT_RADIO_HEADER_SIZE - 1)
+    {
+        delete packet;
+        return;
+    }
+
+    uint8_t type = packet->payload[MICROBIT_RADIO_TDMA_TYPE];
+    uint8_t s = packet->payload[MICROBIT_RADIO_TDMA_SLOT];
+    memcpy(&node, &packet->payload[MICROBIT_RADIO_TDMA_NODE], sizeof(uint32_t));
+
+    // Requests are sent by the node itself.
+    if (type == MICROBIT_RADIO_TDMA_REQUEST)
+        radio.neighbours().frameHeard(packet, node);
+
+    delete packet;
+
+    if (type == MICROBIT_RADIO_TDMA_REQUEST && (status & MICROBIT_RADIO_TDMA_STATUS_COORDINATOR))
+    {
+        int chosen = 0;
+
+        // Give the node the slot it already has, if any (our reply may have been lost), otherwise the first unused one.
+        for (int i = 1; i < slotCount; i++)
+        {
+            if (assigned[i] == node)
+            {
+                chosen = i;
+                break;
+            }
+
+            if (assigned[i] == 0 && chosen == 0)
+                chosen = i;
+        }
+
+        // If every slot is taken, the node will simply keep asking.
+        if (chosen == 0)
+            return;
+
+        assigned[chosen] = node;
+        sendControl(MICROBIT_RADIO_TDMA_ASSIGN, node, chosen);
+    }
+
+    if (type == MICROBIT_RADIO_TDMA_ASSIGN && (status & MICROBIT_RADIO_TDMA_STATUS_JOINED) && node == microbit_serial_number())
+    {
+        if (s == 0 || s >= slotCount)
+            return;
+
+        bool changed = !(status & MICROBIT_RADIO_TDMA_STATUS_ASSIGNED) || slot != s;
+
+        __disable_irq();
+        slot = s;
+        status |= MICROBIT_RADIO_TDMA_STATUS_ASSIGNED;
+        __enable_irq();
+
+        if (changed)
+            MicroBitEvent(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_TDMA_SLOT);
+    }
+}
+
+/**
+  * Periodic callback from MicroBit system timer.
+  *
+  * Releases the transmit queue of the radio at the start of our slot, and holds it again at the end.
+  */
+void MicroBitRadioTdma::systemTick()
+{
+    if (!(status & (MICROBIT_RADIO_TDMA_STATUS_COORDINATOR | MICROBIT_RADIO_TDMA_STATUS_JOINED)))
+        return;
+
+    bool open = false;
+
+    // Without a shared time base, we can't know when any slot is, so we don't transmit at all.
+    if (radio.timesync().isSynchronised())
+    {
+        uint64_t time = radio.timesync().getTime() / 1000;
+
+        if (status & (MICROBIT_RADIO_TDMA_STATUS_COORDINATOR | MICROBIT_RADIO_TDMA_STATUS_ASSIGNED))
+        {
+            open = isOpen(slot, time);
+        }
+        else
+        {
+            // Until we have a slot of our own, we may only use the coordinator's, to ask for one.
+            open = isOpen(0, time);
+
+            uint32_t now = (uint32_t)system_timer_current_time();
+
+            if ((int32_t)(now - requestDeadline) >= 0)
+            {
+                sendControl(MICROBIT_RADIO_TDMA_REQUEST, microbit_serial_number(), 0);
+                requestDeadline = now + MICROBIT_RADIO_TDMA_REQUEST_INTERVAL + microbit_random(MICROBIT_RADIO_TDMA_REQUEST_INTERVAL);
+            }
+        }
+    }
+
+    if (open == ((status & MICROBIT_RADIO_TDMA_STATUS_OPEN) != 0))
+        return;
+
+    if (open)
+        status |= MICROBIT_RADIO_TDMA_STATUS_OPEN;
+    else
+        status &= ~MICROBIT_RADIO_TDMA_STATUS_OPEN;
+
+    radio.setTransmitHold(!open);
+}
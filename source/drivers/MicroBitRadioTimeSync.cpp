@@ -0,0 +1,454 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 British Broadcasting Corporation.
+This software is provided by Lancaster University by arrangement with the BBC.
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "MicroBitConfig.h"
+#include "MicroBitRadio.h"
+#include "MicroBitRadioTimeSync.h"
+#include "MicroBitDevice.h"
+#include "MicroBitSystemTimer.h"
+
+/**
+  * Provides a network wide time base, shared by all micro:bits in a group.
+  *
+  * One micro:bit is made the reference, and periodically broadcasts a beacon carrying its own time. Beacons are
+  * timestamped by the radio interrupt handler as they are sent and received, so their delivery is subject only to
+  * a constant delay, which is compensated for. Each receiver keeps a table of recent (local time, offset) samples,
+  * and fits a line through them to estimate both the offset and the relative drift of its clock.
+  *
+  * Once synchronised, receivers rebroadcast each new beacon, stamped with their own estimate of network time, so that
+  * micro:bits several hops from the reference are synchronised too. This is a simplified form of the Flooding Time
+  * Synchronisation Protocol (FTSP).
+  *
+  * @note This API does not contain any form of encryption, authentication or authorisation. Its purpose is solely for use as a
+  * teaching aid to demonstrate how simple communications operates, and to provide a sandpit through which learning can take place.
+  * For serious applications, BLE should be considered a substantially more secure alternative.
+  */
+
+MicroBitRadioTimeSync* MicroBitRadioTimeSync::instance = NULL;
+
+/**
+  * Constructor.
+  *
+  * Creates an instance of a MicroBitRadioTimeSync, which estimates a time base shared by all micro:bits in a group.
+  *
+  * @param r The underlying radio module used to send and receive data.
+  *
+  * @note No beacons are sent until setReference() is called, and none are rebroadcast until one is received.
+  */
+MicroBitRadioTimeSync::MicroBitRadioTimeSync(MicroBitRadio &r) : radio(r)
+{
+    this->hops = 0;
+    this->sequence = 0;
+    this->lastBeacon = 0;
+    this->txDeadline = 0;
+    this->txOffset = 0;
+    this->localAverage = 0;
+    this->offsetAverage = 0;
+
+    reset();
+
+    instance = this;
+}
+
+/**
+  * Registers for periodic callbacks, if this has not already been done.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if a system timer slot could not be allocated.
+  */
+int MicroBitRadioTimeSync::init()
+{
+    if (status & MICROBIT_COMPONENT_RUNNING)
+        return MICROBIT_OK;
+
+    if (system_timer_add_component(this) != MICROBIT_OK)
+        return MICROBIT_NO_RESOURCES;
+
+    status |= MICROBIT_COMPONENT_RUNNING;
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Discards all samples, and marks this micro:bit as unsynchronised.
+  */
+void MicroBitRadioTimeSync::reset()
+{
+    __disable_irq();
+    status &= ~(MICROBIT_RADIO_TIMESYNC_STATUS_SYNCHRONISED | MICROBIT_RADIO_TIMESYNC_STATUS_FORWARD);
+    __enable_irq();
+
+    root = 0;
+    sampleCount = 0;
+    sampleIndex = 0;
+    skew = 0;
+    residual = 0;
+}
+
+/**
+  * Adds a sample to the table, and refits the estimate of offset and drift.
+  *
+  * @param local the local time at which the beacon was received, in microseconds.
+  *
+  * @param offset the network time minus the local time at that point, in microseconds.
+  */
+void MicroBitRadioTimeSync::addSample(uint64_t local, int64_t offset)
+{
+    samples[sampleIndex].local = local;
+    samples[sampleIndex].offset = offset;
+
+    sampleIndex = (sampleIndex + 1) % MICROBIT_RADIO_TIMESYNC_SAMPLES;
+
+    if (sampleCount < MICROBIT_RADIO_TIMESYNC_SAMPLES)
+        sampleCount++;
+
+    // Find the centre of the samples. Sum their distance from the newest, to keep the arithmetic well within range.
+    int64_t localSum = 0;
+    int64_t offsetSum = 0;
+
+    for (int i = 0; i < sampleCount; i++)
+    {
+        localSum += (int64_t)(samples[i].local - local);
+        offsetSum += samples[i].offset - offset;
+    }
+
+    uint64_t newLocalAverage = local + localSum / sampleCount;
+    int64_t newOffsetAverage = offset + offsetSum / sampleCount;
+
+    // Least squares fit of offset against local time. The slope is the relative drift of the two clocks.
+    float sxy = 0;
+    float sxx = 0;
+
+    for (int i = 0; i < sampleCount; i++)
+    {
+        float dx = (float)(int64_t)(samples[i].local - newLocalAverage);
+        float dy = (float)(samples[i].offset - newOffsetAverage);
+
+        sxy += dx * dy;
+        sxx += dx * dx;
+    }
+
+    // Network time may be read from interrupt context (e.g. to schedule TDMA slots), so update the estimate atomically.
+    __disable_irq();
+    localAverage = newLocalAverage;
+    offsetAverage = newOffsetAverage;
+    skew = sxx > 0 ? sxy / sxx : 0;
+    __enable_irq();
+
+    // Note how well the samples agree with the fit, as the basis of our error bound.
+    residual = 0;
+
+    for (int i = 0; i < sampleCount; i++)
+    {
+        int64_t e = samples[i].offset - estimateOffset(samples[i].local);
+
+        if (e < 0)
+            e = -e;
+
+        if (e > residual)
+            residual = (uint32_t)e;
+    }
+}
+
+/**
+  * Estimates the offset between network time and local time.
+  *
+  * @param local the local time of interest, in microseconds.
+  *
+  * @return the network time minus the local time, in microseconds.
+  */
+int64_t MicroBitRadioTimeSync::estimateOffset(uint64_t local)
+{
+    return offsetAverage + (int64_t)(skew * (float)(int64_t)(local - localAverage));
+}
+
+/**
+  * Queues a beacon for transmission. It is stamped with the network time just before it is sent.
+  */
+void MicroBitRadioTimeSync::sendBeacon()
+{
+    FrameBuffer buf;
+
+    buf.length = MICROBIT_RADIO_TIMESYNC_SIZE + MICROBIT_RADIO_HEADER_SIZE - 1;
+    buf.version = 1;
+    buf.group = 0;
+    buf.protocol = MICROBIT_RADIO_PROTOCOL_TIMESYNC;
+
+    memcpy(&buf.payload[MICROBIT_RADIO_TIMESYNC_ROOT], &root, sizeof(uint32_t));
+    memcpy(&buf.payload[MICROBIT_RADIO_TIMESYNC_SEQUENCE], &sequence, sizeof(uint16_t));
+    buf.payload[MICROBIT_RADIO_TIMESYNC_HOPS] = hops;
+    memset(&buf.payload[MICROBIT_RADIO_TIMESYNC_TIME], 0, sizeof(uint64_t));
+
+    radio.sendAsync(&buf);
+}
+
+/**
+  * Makes this micro:bit the reference for network time, or stops it being one.
+  *
+  * The reference broadcasts a beacon every MICROBIT_RADIO_TIMESYNC_PERIOD milliseconds, and its local time is
+  * the network time. Only one micro:bit in a group should be the reference.
+  *
+  * @param reference true to become the reference, false to stop.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_NO_RESOURCES if a system timer slot could not be allocated.
+  */
+int MicroBitRadioTimeSync::setReference(bool reference)
+{
+    if (reference)
+    {
+        if (init() != MICROBIT_OK)
+            return MICROBIT_NO_RESOURCES;
+
+        reset();
+
+        root = microbit_serial_number();
+        hops = 0;
+
+        // Start from a random sequence number, so that receivers don't mistake us for our previous incarnation after a reset.
+        sequence = microbit_random(65536);
+
+        __disable_irq();
+        txOffset = 0;
+        txDeadline = (uint32_t)system_timer_current_time();
+        status |= MICROBIT_RADIO_TIMESYNC_STATUS_REFERENCE;
+        __enable_irq();
+    }
+    else if (status & MICROBIT_RADIO_TIMESYNC_STATUS_REFERENCE)
+    {
+        __disable_irq();
+        status &= ~MICROBIT_RADIO_TIMESYNC_STATUS_REFERENCE;
+        __enable_irq();
+
+        reset();
+    }
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Determines if this micro:bit is the reference for network time.
+  *
+  * @return true if this micro:bit is the reference, false otherwise.
+  */
+bool MicroBitRadioTimeSync::isReference()
+{
+    return status & MICROBIT_RADIO_TIMESYNC_STATUS_REFERENCE;
+}
+
+/**
+  * Determines if this micro:bit has a valid estimate of network time.
+  *
+  * @return true if this micro:bit is the reference, or has heard enough recent beacons, false otherwise.
+  */
+bool MicroBitRadioTimeSync::isSynchronised()
+{
+    if (status & MICROBIT_RADIO_TIMESYNC_STATUS_REFERENCE)
+        return true;
+
+    if (!(status & MICROBIT_RADIO_TIMESYNC_STATUS_SYNCHRONISED))
+        return false;
+
+    return (int32_t)((uint32_t)system_timer_current_time() - lastBeacon) < MICROBIT_RADIO_TIMESYNC_TIMEOUT * MICROBIT_RADIO_TIMESYNC_PERIOD;
+}
+
+/**
+  * Determines the current network time.
+  *
+  * @return the network time in microseconds, or the local time (as given by system_timer_current_time_us())
+  *         if this micro:bit is not synchronised.
+  */
+uint64_t MicroBitRadioTimeSync::getTime()
+{
+    uint64_t local = system_timer_current_time_us();
+
+    if ((status & MICROBIT_RADIO_TIMESYNC_STATUS_REFERENCE) || !isSynchronised())
+        return local;
+
+    return local + estimateOffset(local);
+}
+
+/**
+  * Determines how far the network time given by getTime() may be from that of the reference.
+  *
+  * The bound combines the disagreement between recent beacons and the estimated drift, a further allowance
+  * for drift since the last beacon, and the resolution of the timestamps at each hop from the reference.
+  *
+  * @return the error bound in microseconds, zero if this micro:bit is the reference, or MICROBIT_NO_DATA if it
+  *         is not synchronised.
+  */
+int MicroBitRadioTimeSync::getErrorBound()
+{
+    if (status & MICROBIT_RADIO_TIMESYNC_STATUS_REFERENCE)
+        return 0;
+
+    if (!isSynchronised())
+        return MICROBIT_NO_DATA;
+
+    TimeSyncSample *newest = &samples[(sampleIndex + MICROBIT_RADIO_TIMESYNC_SAMPLES - 1) % MICROBIT_RADIO_TIMESYNC_SAMPLES];
+    uint64_t elapsed = system_timer_current_time_us() - newest->local;
+
+    return residual + hops * MICROBIT_RADIO_TIMESYNC_RESOLUTION_US + (int)(elapsed * MICROBIT_RADIO_TIMESYNC_DRIFT_PPM / 1000000);
+}
+
+/**
+  * Stamps a beacon with the current network time, just before the RADIO hardware sends it.
+  *
+  * @param frame the beacon, in the transmit queue.
+  *
+  * @note should only be called from RADIO_IRQHandler...
+  */
+void MicroBitRadioTimeSync::transmitStarting(FrameBuffer *frame)
+{
+    uint64_t time = system_timer_current_time_us() + txOffset;
+
+    memcpy(&frame->payload[MICROBIT_RADIO_TIMESYNC_TIME], &time, sizeof(uint64_t));
+}
+
+/**
+  * Protocol handler callback. This is called when the radio receives a time synchronisation beacon.
+  */
+void MicroBitRadioTimeSync::packetReceived()
+{
+    FrameBuffer *packet = radio.recv();
+    uint32_t beaconRoot;
+    uint16_t beaconSequence;
+    uint64_t beaconTime;
+
+    if (packet == NULL)
+        return;
+
+    // The reference has no use for beacons, and we ignore anything malformed.
+    if ((status & MICROBIT_RADIO_TIMESYNC_STATUS_REFERENCE) || packet->length != MICROBIT_RADIO_TIMESYNC_SIZE + MICROBIT_RADIO_HEADER_SIZE - 1)
+    {
+        delete packet;
+        return;
+    }
+
+    memcpy(&beaconRoot, &packet->payload[MICROBIT_RADIO_TIMESYNC_ROOT], sizeof(uint32_t));
+    memcpy(&beaconSequence, &packet->payload[MICROBIT_RADIO_TIMESYNC_SEQUENCE], sizeof(uint16_t));
+    memcpy(&beaconTime, &packet->payload[MICROBIT_RADIO_TIMESYNC_TIME], sizeof(uint64_t));
+    uint8_t beaconHops = packet->payload[MICROBIT_RADIO_TIMESYNC_HOPS];
+
+    // A beacon that has not yet been rebroadcast was heard directly from the reference.
+    if (beaconHops == 0)
+        radio.neighbours().frameHeard(packet, beaconRoot, beaconSequence, 0xFFFF);
+
+    // Recover the full local time of reception from the low 32 bits captured by the interrupt handler.
+    uint64_t now = system_timer_current_time_us();
+    uint64_t local = now - (uint32_t)((uint32_t)now - packet->timestamp);
+
+    delete packet;
+
+    // If the reference has gone quiet, start afresh with whichever we hear next.
+    if (sampleCount > 0 && (int32_t)((uint32_t)system_timer_current_time() - lastBeacon) >= MICROBIT_RADIO_TIMESYNC_TIMEOUT * MICROBIT_RADIO_TIMESYNC_PERIOD)
+        reset();
+
+    // Ignore other references, and beacons we've already heard (directly, or rebroadcast by a neighbour).
+    if (sampleCount > 0 && (beaconRoot != root || (int16_t)(beaconSequence - sequence) <= 0))
+        return;
+
+    root = beaconRoot;
+    sequence = beaconSequence;
+    hops = beaconHops + 1;
+    lastBeacon = (uint32_t)system_timer_current_time();
+
+    addSample(local, (int64_t)(beaconTime + MICROBIT_RADIO_TIMESYNC_DELAY_US - local));
+
+    if (sampleCount < MICROBIT_RADIO_TIMESYNC_MIN_SAMPLES)
+        return;
+
+    if (!(status & MICROBIT_RADIO_TIMESYNC_STATUS_SYNCHRONISED))
+    {
+        __disable_irq();
+        status |= MICROBIT_RADIO_TIMESYNC_STATUS_SYNCHRONISED;
+        __enable_irq();
+
+        MicroBitEvent(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_TIMESYNC);
+    }
+
+    // Pass the beacon on, after a random delay to decorrelate our rebroadcast from those of our neighbours.
+    if (hops < MICROBIT_RADIO_TIMESYNC_MAX_HOPS && init() == MICROBIT_OK)
+    {
+        int delay = microbit_random(MICROBIT_RADIO_TIMESYNC_JITTER + 1);
+        int64_t offset = estimateOffset(now + delay * 1000);
+
+        __disable_irq();
+        txOffset = offset;
+        txDeadline = lastBeacon + delay;
+        status |= MICROBIT_RADIO_TIMESYNC_STATUS_FORWARD;
+        __enable_irq();
+    }
+}
+
+/**
+  * Periodic callback from MicroBit system timer.
+  *
+  * Sends the beacons due from the reference, and rebroadcasts those received once their random delay has expired.
+  */
+void MicroBitRadioTimeSync::systemTick()
+{
+    if (!(status & (MICROBIT_RADIO_TIMESYNC_STATUS_REFERENCE | MICROBIT_RADIO_TIMESYNC_STATUS_FORWARD)))
+        return;
+
+    uint32_t now = (uint32_t)system_timer_current_time();
+
+    if ((int32_t)(now - txDeadline) < 0)
+        return;
+
+    if (status & MICROBIT_RADIO_TIMESYNC_STATUS_REFERENCE)
+    {
+        sequence++;
+        txDeadline = now + MICROBIT_RADIO_TIMESYNC_PERIOD;
+    }
+
+    status &= ~MICROBIT_RADIO_TIMESYNC_STATUS_FORWARD;
+
+    sendBeacon();
+}
+
+/**
+  * Determines the current network time, as estimated by MicroBitRadio::timesync.
+  *
+  * @return the network time in microseconds, or the local time if the radio has not been synchronised.
+  */
+uint64_t network_time_us()
+{
+    if (MicroBitRadioTimeSync::instance == NULL)
+        return system_timer_current_time_us();
+
+    return MicroBitRadioTimeSync::instance->getTime();
+}
+
+/**
+  * Determines how far the network time given by network_time_us() may be from that of the reference.
+  *
+  * @return the error bound in microseconds, or MICROBIT_NO_DATA if the radio has not been synchronised.
+  */
+int network_time_error_us()
+{
+    if (MicroBitRadioTimeSync::instance == NULL)
+        return MICROBIT_NO_DATA;
+
+    return MicroBitRadioTimeSync::instance->getErrorBound();
+}
@@ -29,11 +29,85 @@ DEALINGS IN THE SOFTWARE.
 #include "MicroBitComponent.h"
 #include "MicroBitFiber.h"
 #include "NotifyEvents.h"
+#include "MicroBitSerialFramer.h"
 
 uint8_t MicroBitSerial::status = 0;
 
 int MicroBitSerial::baudrate = 0;
 
+/**
+  * Compiles a set of delimeter characters into a lookup table, with one bit per byte value.
+  *
+  * @param delimeters the characters to match against.
+  *
+  * @param map the MICROBIT_SERIAL_DELIMETER_MAP_SIZE word lookup table to fill.
+  */
+static void compileDelimeters(ManagedString delimeters, uint32_t *map)
+{
+    memclr(map, MICROBIT_SERIAL_DELIMETER_MAP_SIZE * sizeof(uint32_t));
+
+    for(int i = 0; i < delimeters.length(); i++)
+    {
+        uint8_t c = delimeters.charAt(i);
+        map[c >> 5] |= 1UL << (c & 0x1F);
+    }
+}
+
+/**
+  * Determines if the given character is present in a delimeter lookup table.
+  */
+static inline bool isDelimeter(uint32_t *map, uint8_t c)
+{
+    return (map[c >> 5] >> (c & 0x1F)) & 1;
+}
+
+/**
+  * Allocates the payload for a ManagedString of the given length, so that it can be filled
+  * directly rather than copied in from a temporary buffer.
+  *
+  * @return the new payload, or NULL if it could not be allocated.
+  */
+static StringData *allocateString(int len)
+{
+    StringData *data = (StringData *)malloc(4 + len + 1);
+
+    if(data == NULL)
+        return NULL;
+
+    data->init();
+    data->len = len;
+    data->data[len] = 0;
+
+    return data;
+}
+
+/**
+  * Wraps a payload created by allocateString() in a ManagedString, which takes ownership of it.
+  */
+static ManagedString adoptString(StringData *data)
+{
+    ManagedString s(data);
+
+    //the ManagedString now holds its own reference, so drop the one we were given.
+    data->decr();
+
+    return s;
+}
+
+/**
+  * Reads the time used to gather statistics, if they are enabled.
+  *
+  * @return the current value of the microsecond ticker, or zero if statistics are disabled.
+  */
+static inline uint32_t statisticsTime()
+{
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+    return us_ticker_read();
+#else
+    return 0;
+#endif
+}
+
 /**
   * Constructor.
   * Create an instance of MicroBitSerial
@@ -54,23 +128,30 @@ int MicroBitSerial::baudrate = 0;
   *       -https://github.com/mbedmicro/mbed/blob/master/libraries/mbed/api/RawSerial.h
   *
   *       Buffers aren't allocated until the first send or receive respectively.
+  *
+  *       Buffers are rounded up to a power of two in size, so at least the number
+  *       of bytes requested can be held.
   */
-MicroBitSerial::MicroBitSerial(PinName tx, PinName rx, uint8_t rxBufferSize, uint8_t txBufferSize) : RawSerial(tx,rx), delimeters()
+MicroBitSerial::MicroBitSerial(PinName tx, PinName rx, uint16_t rxBufferSize, uint16_t txBufferSize) : RawSerial(tx,rx), rxBuffScanDelimeters()
 {
-    // + 1 so there is a usable buffer size, of the size the user requested.
-    this->rxBuffSize = rxBufferSize + 1;
-    this->txBuffSize = txBufferSize + 1;
+    this->rxBuffSize = rxBufferSize;
+    this->txBuffSize = txBufferSize;
+
+    this->rxBuffHeadMatch = -1;
+    this->rxBuffScanIndex = -1;
 
-    this->rxBuff = NULL;
-    this->txBuff = NULL;
+    this->framer = NULL;
 
-    this->rxBuffHead = 0;
-    this->rxBuffTail = 0;
+    this->rtsPin = NULL;
+    this->ctsPin = NULL;
+    this->rxHighWater = 0;
+    this->rxLowWater = 0;
 
-    this->txBuffHead = 0;
-    this->txBuffTail = 0;
+    updateWaterMarks();
 
-    this->rxBuffHeadMatch = -1;
+    resetStatistics();
+
+    memclr(delimeterMap, sizeof(delimeterMap));
 
     this->baud(MICROBIT_SERIAL_DEFAULT_BAUD_RATE);
 
@@ -88,37 +169,59 @@ MicroBitSerial::MicroBitSerial(PinName tx, PinName rx, uint8_t rxBufferSize, uin
   */
 void MicroBitSerial::dataReceived()
 {
+    uint32_t start = statisticsTime();
+
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+    //the UART latches any overrun until the error is cleared.
+    uint32_t errors = NRF_UART0->ERRORSRC;
+
+    if(errors & UART_ERRORSRC_OVERRUN_Msk)
+        statistics.rxOverruns++;
+
+    NRF_UART0->ERRORSRC = errors;
+#endif
+
+    //if a framing layer is attached, it takes all received data.
+    if(framer != NULL)
+    {
+        framer->dataReceived(getc());
+
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+        statistics.bytesReceived++;
+#endif
+        interruptComplete(start);
+        return;
+    }
+
     if(!(status & MICROBIT_SERIAL_RX_BUFF_INIT))
         return;
 
     //get the received character
     char c = getc();
 
-    int delimeterOffset = 0;
-    int delimLength = this->delimeters.length();
+    //store the character, unless we are about to collide with the tail
+    bool stored = rxBuff.push(c);
 
-    //iterate through our delimeters (if any) to see if there is a match
-    while(delimeterOffset < delimLength)
-    {
-        //fire an event if there is to block any waiting fibers
-        if(this->delimeters.charAt(delimeterOffset) == c)
-            MicroBitEvent(MICROBIT_ID_SERIAL, MICROBIT_SERIAL_EVT_DELIM_MATCH);
+    //fire an event if it is one of our delimeters, to unblock any waiting fibers
+    if(isDelimeter(delimeterMap, c))
+        MicroBitEvent(MICROBIT_ID_SERIAL, MICROBIT_SERIAL_EVT_DELIM_MATCH);
 
-        delimeterOffset++;
-    }
-
-    uint16_t newHead = (rxBuffHead + 1) % rxBuffSize;
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+    if(stored)
+        statistics.bytesReceived++;
+    else
+        statistics.rxDropped++;
+#endif
 
-    //look ahead to our newHead value to see if we are about to collide with the tail
-    if(newHead != rxBuffTail)
+    if(stored)
     {
-        //if we are not, store the character, and update our actual head.
-        this->rxBuff[rxBuffHead] = c;
-        rxBuffHead = newHead;
+        //if we are nearly full, ask the sender to pause before we run out of space.
+        if(rtsPin != NULL && rxBuff.count() >= rxHighWaterMark)
+            rtsPin->write(1);
 
         //if we have any fibers waiting for a specific number of characters, unblock them
         if(rxBuffHeadMatch >= 0)
-            if(rxBuffHead == rxBuffHeadMatch)
+            if(rxBuff.getHead() == rxBuffHeadMatch)
             {
                 rxBuffHeadMatch = -1;
                 MicroBitEvent(MICROBIT_ID_SERIAL, MICROBIT_SERIAL_EVT_HEAD_MATCH);
@@ -127,6 +230,8 @@ void MicroBitSerial::dataReceived()
     else
         //otherwise, our buffer is full, send an event to the user...
         MicroBitEvent(MICROBIT_ID_SERIAL, MICROBIT_SERIAL_EVT_RX_FULL);
+
+    interruptComplete(start);
 }
 
 /**
@@ -137,23 +242,100 @@ void MicroBitSerial::dataReceived()
   */
 void MicroBitSerial::dataWritten()
 {
-    if(txBuffTail == txBuffHead || !(status & MICROBIT_SERIAL_TX_BUFF_INIT))
+    if(txBuff.isEmpty() || !(status & MICROBIT_SERIAL_TX_BUFF_INIT))
         return;
 
-    //send our current char
-    putc(txBuff[txBuffTail]);
+    //if the other device is not ready to receive, pause until it asserts CTS.
+    if(ctsPin != NULL && ctsPin->read())
+    {
+        detach(Serial::TxIrq);
+        return;
+    }
+
+    uint32_t start = statisticsTime();
 
-    uint16_t nextTail = (txBuffTail + 1) % txBuffSize;
+    //send our current char, and update our tail!
+    putc(txBuff.pop());
+
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+    statistics.bytesSent++;
+#endif
 
     //unblock any waiting fibers that are waiting for transmission to finish.
-    if(nextTail == txBuffHead)
+    if(txBuff.isEmpty())
     {
         MicroBitEvent(MICROBIT_ID_NOTIFY, MICROBIT_SERIAL_EVT_TX_EMPTY);
         detach(Serial::TxIrq);
     }
 
-    //update our tail!
-    txBuffTail = nextTail;
+    interruptComplete(start);
+}
+
+/**
+  * An internal interrupt callback for MicroBitSerial, configured when the CTS input
+  * is asserted. Resumes any transmission paused whilst CTS was deasserted.
+  */
+void MicroBitSerial::ctsAsserted()
+{
+    if((status & MICROBIT_SERIAL_TX_BUFF_INIT) && !txBuff.isEmpty())
+        attach(this, &MicroBitSerial::dataWritten, Serial::TxIrq);
+}
+
+/**
+  * Calculates the rx buffer levels at which flow control pauses and resumes the sender,
+  * for the current rx buffer.
+  */
+void MicroBitSerial::updateWaterMarks()
+{
+    int capacity = rxBuff.capacity();
+
+    rxHighWaterMark = rxHighWater ? min((int)rxHighWater, capacity) : capacity * MICROBIT_SERIAL_FLOW_HIGH_WATER / 100;
+    rxLowWaterMark = rxLowWater ? rxLowWater : capacity * MICROBIT_SERIAL_FLOW_LOW_WATER / 100;
+
+    //always leave a gap between the two, however small the buffer.
+    rxHighWaterMark = max(rxHighWaterMark, 1);
+    rxLowWaterMark = min(rxLowWaterMark, rxHighWaterMark - 1);
+}
+
+/**
+  * Reasserts RTS to resume the sender, if flow control is in use and the rx buffer
+  * has drained to its low water mark. Called whenever characters are removed from rxBuff.
+  */
+void MicroBitSerial::rxBufferDrained()
+{
+    if(rtsPin != NULL && rxBuff.count() <= rxLowWaterMark)
+        rtsPin->write(0);
+}
+
+/**
+  * Records the time spent handling an interrupt, if statistics are enabled.
+  *
+  * @param start the time at which handling began, as returned by us_ticker_read().
+  */
+void MicroBitSerial::interruptComplete(uint32_t start)
+{
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+    uint32_t duration = us_ticker_read() - start;
+
+    statistics.interruptTime += duration;
+    statistics.interruptTimeMax = max(statistics.interruptTimeMax, duration);
+#else
+    (void)start;
+#endif
+}
+
+/**
+  * Records the time spent spinning in a SYNC_SPINWAIT call, if statistics are enabled.
+  *
+  * @param start the time at which spinning began, as returned by us_ticker_read().
+  */
+void MicroBitSerial::spinWaitComplete(uint32_t start)
+{
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+    statistics.spinWaitTime += us_ticker_read() - start;
+#else
+    (void)start;
+#endif
 }
 
 /**
@@ -173,19 +355,7 @@ void MicroBitSerial::dataWritten()
   */
 int MicroBitSerial::setTxInterrupt(uint8_t *string, int len, MicroBitSerialMode mode)
 {
-    int copiedBytes = 0;
-
-    for(copiedBytes = 0; copiedBytes < len; copiedBytes++)
-    {
-        uint16_t nextHead = (txBuffHead + 1) % txBuffSize;
-        if(nextHead != txBuffTail)
-        {
-            this->txBuff[txBuffHead] = string[copiedBytes];
-            txBuffHead = nextHead;
-        }
-        else
-            break;
-    }
+    int copiedBytes = txBuff.write(string, len);
 
     if(mode != SYNC_SPINWAIT)
         fiber_wake_on_event(MICROBIT_ID_NOTIFY, MICROBIT_SERIAL_EVT_TX_EMPTY);
@@ -238,16 +408,20 @@ int MicroBitSerial::initialiseRx()
     {
         //ensure that we receive no interrupts after freeing our buffer
         detach(Serial::RxIrq);
-        free(this->rxBuff);
+        rxBuff.release();
     }
 
     status &= ~MICROBIT_SERIAL_RX_BUFF_INIT;
 
-    if((this->rxBuff = (uint8_t *)malloc(rxBuffSize)) == NULL)
-        return MICROBIT_NO_RESOURCES;
+    rxBuffScanIndex = -1;
 
-    this->rxBuffHead = 0;
-    this->rxBuffTail = 0;
+    int result = rxBuff.allocate(rxBuffSize);
+
+    if(result != MICROBIT_OK)
+        return result;
+
+    updateWaterMarks();
+    rxBufferDrained();
 
     //set the receive interrupt
     status |= MICROBIT_SERIAL_RX_BUFF_INIT;
@@ -266,16 +440,15 @@ int MicroBitSerial::initialiseTx()
     {
         //ensure that we receive no interrupts after freeing our buffer
         detach(Serial::TxIrq);
-        free(this->txBuff);
+        txBuff.release();
     }
 
     status &= ~MICROBIT_SERIAL_TX_BUFF_INIT;
 
-    if((this->txBuff = (uint8_t *)malloc(txBuffSize)) == NULL)
-        return MICROBIT_NO_RESOURCES;
+    int result = txBuff.allocate(txBuffSize);
 
-    this->txBuffHead = 0;
-    this->txBuffTail = 0;
+    if(result != MICROBIT_OK)
+        return result;
 
     status |= MICROBIT_SERIAL_TX_BUFF_INIT;
 
@@ -291,8 +464,14 @@ int MicroBitSerial::initialiseTx()
 void MicroBitSerial::send(MicroBitSerialMode mode)
 {
     if(mode == SYNC_SPINWAIT)
+    {
+        uint32_t start = statisticsTime();
+
         while(txBufferedSize() > 0);
 
+        spinWaitComplete(start);
+    }
+
     if(mode == SYNC_SLEEP)
         fiber_sleep(0);
 }
@@ -328,47 +507,149 @@ int MicroBitSerial::getChar(MicroBitSerialMode mode)
     }
 
     if(mode == SYNC_SPINWAIT)
+    {
+        uint32_t start = statisticsTime();
+
         while(!isReadable());
 
+        spinWaitComplete(start);
+    }
+
     if(mode == SYNC_SLEEP)
     {
         if(!isReadable())
             eventAfter(1, mode);
     }
 
-    char c = rxBuff[rxBuffTail];
+    rxBuffScanIndex = -1;
+
+    int c = rxBuff.pop();
 
-    rxBuffTail = (rxBuffTail + 1) % rxBuffSize;
+    rxBufferDrained();
 
     return c;
 }
 
 /**
-  * An internal method that copies values from a circular buffer to a linear buffer.
+  * Waits until the rxBuff holds at least the given number of characters.
   *
-  * @param circularBuff a pointer to the source circular buffer
+  * @param len the number of characters wanted. This is limited to the capacity of the rxBuff.
   *
-  * @param circularBuffSize the size of the circular buffer
+  * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. ASYNC returns
+  *        immediately, SYNC_SPINWAIT spins (locks up the processor) and SYNC_SLEEP puts the
+  *        calling fiber to sleep until the characters have been received.
+  */
+void MicroBitSerial::waitForData(int len, MicroBitSerialMode mode)
+{
+    //whilst flow control is in use, the sender is paused once the high water mark is reached.
+    len = min(len, rtsPin != NULL ? rxHighWaterMark : rxBuff.capacity());
+
+    if(mode == SYNC_SPINWAIT)
+    {
+        uint32_t start = statisticsTime();
+
+        while(rxBuff.count() < len);
+
+        spinWaitComplete(start);
+    }
+
+    if(mode == SYNC_SLEEP)
+    {
+        int buffered = rxBuff.count();
+
+        if(buffered < len)
+            eventAfter(len - buffered, mode);
+    }
+}
+
+/**
+  * Searches the rxBuff for a character that matches one of the delimeters.
   *
-  * @param linearBuff a pointer to the destination linear buffer
+  * @param delimeters a ManagedString containing a sequence of delimeter characters.
   *
-  * @param tailPosition the tail position in the circular buffer you want to copy from
+  * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP, which
+  *        determines how to wait for a match if none is buffered. See readUntil().
   *
-  * @param headPosition the head position in the circular buffer you want to copy to
+  * @return the index in the rxBuff of the matching character, or -1 if no match was found.
   *
-  * @note this method assumes that the linear buffer has the appropriate amount of
-  *       memory to contain the copy operation
+  * @note the caller must hold the lock for reception.
   */
-void MicroBitSerial::circularCopy(uint8_t *circularBuff, uint8_t circularBuffSize, uint8_t *linearBuff, uint16_t tailPosition, uint16_t headPosition)
+int MicroBitSerial::findDelimeter(ManagedString delimeters, MicroBitSerialMode mode)
 {
-    int toBuffIndex = 0;
+    uint32_t map[MICROBIT_SERIAL_DELIMETER_MAP_SIZE];
+
+    compileDelimeters(delimeters, map);
+
+    int localTail = rxBuff.getTail();
+
+    //if our last call gave up looking for the same delimeters, the characters it saw have
+    //not been consumed since and cannot match, so carry on from where it stopped.
+    if(rxBuffScanIndex >= 0 && delimeters == rxBuffScanDelimeters)
+        localTail = rxBuffScanIndex;
+
+    int foundIndex = -1;
+
+    //ASYNC mode just iterates through our stored characters checking for any matches.
+    while(localTail != rxBuff.getHead() && foundIndex  == -1)
+    {
+        //we use localTail to prevent modification of the actual tail.
+        if(isDelimeter(map, rxBuff.at(localTail)))
+            foundIndex = localTail;
+
+        localTail = rxBuff.wrap(localTail + 1);
+    }
+
+    //if our mode is SYNC_SPINWAIT and we didn't see any matching characters in our buffer
+    //spin until we find a match!
+    if(mode == SYNC_SPINWAIT)
+    {
+        uint32_t start = statisticsTime();
+
+        while(foundIndex == -1)
+        {
+            while(localTail == rxBuff.getHead());
 
-    while(tailPosition != headPosition)
+            if(isDelimeter(map, rxBuff.at(localTail)))
+                foundIndex = localTail;
+
+            localTail = rxBuff.wrap(localTail + 1);
+        }
+
+        spinWaitComplete(start);
+    }
+
+    //if our mode is SYNC_SLEEP, we set up an event to be fired when we see a
+    //matching character.
+    if(mode == SYNC_SLEEP && foundIndex == -1)
     {
-        linearBuff[toBuffIndex++] = circularBuff[tailPosition];
+        eventOn(delimeters, mode);
+
+        //only the newly received characters need to be checked.
+        while(localTail != rxBuff.getHead() && foundIndex == -1)
+        {
+            if(isDelimeter(map, rxBuff.at(localTail)))
+                foundIndex = localTail;
+
+            localTail = rxBuff.wrap(localTail + 1);
+        }
 
-        tailPosition = (tailPosition + 1) % circularBuffSize;
+        //if we were woken without a match being stored (e.g. the rxBuff was full),
+        //treat the last character received as the delimeter.
+        if(foundIndex == -1 && !rxBuff.isEmpty())
+            foundIndex = rxBuff.wrap(rxBuff.getHead() - 1);
+
+        memclr(delimeterMap, sizeof(delimeterMap));
+    }
+
+    if(foundIndex == -1)
+    {
+        rxBuffScanIndex = localTail;
+        rxBuffScanDelimeters = delimeters;
     }
+    else
+        rxBuffScanIndex = -1;
+
+    return foundIndex;
 }
 
 /**
@@ -584,18 +865,32 @@ int MicroBitSerial::read(MicroBitSerialMode mode)
   */
 ManagedString MicroBitSerial::read(int size, MicroBitSerialMode mode)
 {
-    uint8_t buff[size + 1];
+    if(size <= 0)
+        return ManagedString();
+
+    //an ASYNC read can return no more than is already buffered.
+    if(mode == ASYNC)
+        size = min(size, rxBufferedSize());
 
-    memclr(&buff, size + 1);
+    if(size <= 0)
+        return ManagedString();
 
-    int returnedSize = read((uint8_t *)buff, size, mode);
+    StringData *data = allocateString(size);
 
-    if(returnedSize <= 0)
+    if(data == NULL)
         return ManagedString();
 
-    return ManagedString((char *)buff, returnedSize);
-}
+    //read straight into the string, rather than via an intermediate buffer.
+    int returnedSize = read((uint8_t *)data->data, size, mode);
+
+    if(returnedSize != size)
+    {
+        free(data);
+        return ManagedString();
+    }
 
+    return adoptString(data);
+}
 /**
   * Reads multiple characters from the rxBuff and fills a user buffer.
   *
@@ -641,37 +936,19 @@ int MicroBitSerial::read(uint8_t *buffer, int bufferLen, MicroBitSerialMode mode
 
     int bufferIndex = 0;
 
-    int temp = 0;
-
-    if(mode == ASYNC)
-    {
-        while((temp = getChar(mode)) != MICROBIT_NO_DATA && bufferIndex < bufferLen)
-        {
-            buffer[bufferIndex] = (char)temp;
-            bufferIndex++;
-        }
-    }
+    rxBuffScanIndex = -1;
 
-    if(mode == SYNC_SPINWAIT)
+    //copy as much as we can directly from the rxBuff on each pass, waiting for more
+    //data between passes if our mode requires it.
+    do
     {
-        while(bufferIndex < bufferLen)
-        {
-            buffer[bufferIndex] = (char)getChar(mode);
-            bufferIndex++;
-        }
-    }
+        waitForData(bufferLen - bufferIndex, mode);
 
-    if(mode == SYNC_SLEEP)
-    {
-        if(bufferLen > rxBufferedSize())
-            eventAfter(bufferLen - rxBufferedSize(), mode);
+        bufferIndex += rxBuff.read(buffer + bufferIndex, bufferLen - bufferIndex);
 
-        while(bufferIndex < bufferLen)
-        {
-            buffer[bufferIndex] = (char)getChar(mode);
-            bufferIndex++;
-        }
+        rxBufferDrained();
     }
+    while(mode != ASYNC && bufferIndex < bufferLen);
 
     unlockRx();
 
@@ -725,75 +1002,203 @@ ManagedString MicroBitSerial::readUntil(ManagedString delimeters, MicroBitSerial
 
     lockRx();
 
-    int localTail = rxBuffTail;
-    int preservedTail = rxBuffTail;
+    int foundIndex = findDelimeter(delimeters, mode);
 
-    int foundIndex = -1;
-
-    //ASYNC mode just iterates through our stored characters checking for any matches.
-    while(localTail != rxBuffHead && foundIndex  == -1)
+    if(foundIndex < 0)
     {
-        //we use localTail to prevent modification of the actual tail.
-        char c = rxBuff[localTail];
-
-        for(int delimeterIterator = 0; delimeterIterator < delimeters.length(); delimeterIterator++)
-            if(delimeters.charAt(delimeterIterator) == c)
-                foundIndex = localTail;
+        unlockRx();
 
-        localTail = (localTail + 1) % rxBuffSize;
+        return ManagedString();
     }
 
-    //if our mode is SYNC_SPINWAIT and we didn't see any matching characters in our buffer
-    //spin until we find a match!
-    if(mode == SYNC_SPINWAIT)
+    int len = rxBuff.wrap(foundIndex - rxBuff.getTail());
+
+    ManagedString s;
+
+    if(len > 0)
     {
-        while(foundIndex == -1)
+        StringData *data = allocateString(len);
+
+        //copy straight from the rxBuff into the string.
+        if(data != NULL)
         {
-            while(localTail == rxBuffHead);
+            rxBuff.copy((uint8_t *)data->data, len);
+            s = adoptString(data);
+        }
+    }
+
+    //plus one for the character we listened for...
+    rxBuff.skip(len + 1);
+
+    rxBufferDrained();
 
-            char c = rxBuff[localTail];
+    unlockRx();
 
-            for(int delimeterIterator = 0; delimeterIterator < delimeters.length(); delimeterIterator++)
-                if(delimeters.charAt(delimeterIterator) == c)
-                    foundIndex = localTail;
+    return s;
+}
 
-            localTail = (localTail + 1) % rxBuffSize;
+/**
+  * Provides direct access to characters in the rxBuff, without copying or removing them.
+  *
+  * @param view set to describe the characters available. As the rxBuff is circular, these
+  *        may be split into two segments.
+  *
+  * @param size the number of characters wanted. This is limited to the capacity of the rxBuff.
+  *
+  * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. Each mode
+  *        gives a different behaviour:
+  *
+  *            ASYNC - The view covers however many characters are available, up to size.
+  *
+  *            SYNC_SPINWAIT - If the desired number of characters are not available, this method
+  *                            will spin (lock up the processor) until they have been received.
+  *
+  *            SYNC_SLEEP - If the desired number of characters are not available, the calling
+  *                         fiber sleeps until they have been received.
+  *
+  *         Defaults to SYNC_SLEEP.
+  *
+  * @return the number of characters in the view, MICROBIT_NO_DATA if there are no characters
+  *         available and the mode given is ASYNC, MICROBIT_INVALID_PARAMETER if size is not positive,
+  *         MICROBIT_SERIAL_IN_USE if another fiber is using the instance for reception, or
+  *         MICROBIT_NO_RESOURCES if buffer allocation did not complete successfully.
+  *
+  * @note When a view is returned, this instance remains locked for reception until consume() is
+  *       called, which also releases the characters in the view.
+  */
+int MicroBitSerial::peek(MicroBitSerialView &view, int size, MicroBitSerialMode mode)
+{
+    if(size <= 0)
+        return MICROBIT_INVALID_PARAMETER;
+
+    if(rxInUse())
+        return MICROBIT_SERIAL_IN_USE;
+
+    lockRx();
+
+    //lazy initialisation of our rx buffer
+    if(!(status & MICROBIT_SERIAL_RX_BUFF_INIT))
+    {
+        int result = initialiseRx();
+
+        if(result != MICROBIT_OK)
+        {
+            unlockRx();
+            return result;
         }
     }
 
-    //if our mode is SYNC_SLEEP, we set up an event to be fired when we see a
-    //matching character.
-    if(mode == SYNC_SLEEP && foundIndex == -1)
+    waitForData(size, mode);
+
+    if(rxBuff.segments(size, &view.first, &view.firstLength, &view.second, &view.secondLength) == 0)
     {
-        eventOn(delimeters, mode);
+        unlockRx();
+        return MICROBIT_NO_DATA;
+    }
+
+    status |= MICROBIT_SERIAL_RX_VIEW;
 
-        foundIndex = rxBuffHead - 1;
+    return view.length();
+}
 
-        this->delimeters = ManagedString();
+/**
+  * Provides direct access to the characters in the rxBuff up to and including the first
+  * that matches one of the delimeters, without copying or removing them.
+  *
+  * @param delimeters a ManagedString containing a sequence of delimeter characters e.g. ManagedString("\r\n")
+  *
+  * @param view set to describe the characters up to and including the delimeter. As the rxBuff
+  *        is circular, these may be split into two segments.
+  *
+  * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. Each mode
+  *        gives a different behaviour:
+  *
+  *            ASYNC - If none of the delimeters matches a character already in the rxBuff,
+  *                    MICROBIT_NO_DATA is returned.
+  *
+  *            SYNC_SPINWAIT - If none of the delimeters matches a character already in the rxBuff,
+  *                            this method will spin (lock up the processor) until a received
+  *                            character matches one of the delimeters.
+  *
+  *            SYNC_SLEEP - If none of the delimeters matches a character already in the rxBuff,
+  *                         the calling fiber sleeps until a character matching one of the
+  *                         delimeters is seen.
+  *
+  *         Defaults to SYNC_SLEEP.
+  *
+  * @return the number of characters in the view, including the delimeter, MICROBIT_NO_DATA if no
+  *         delimeter was found, MICROBIT_SERIAL_IN_USE if another fiber is using the instance for
+  *         reception, or MICROBIT_NO_RESOURCES if buffer allocation did not complete successfully.
+  *
+  * @note When a view is returned, this instance remains locked for reception until consume() is
+  *       called, which also releases the characters in the view. consume(view.length()) discards
+  *       the delimeter along with the characters before it.
+  */
+int MicroBitSerial::peekUntil(ManagedString delimeters, MicroBitSerialView &view, MicroBitSerialMode mode)
+{
+    if(rxInUse())
+        return MICROBIT_SERIAL_IN_USE;
+
+    lockRx();
+
+    //lazy initialisation of our rx buffer
+    if(!(status & MICROBIT_SERIAL_RX_BUFF_INIT))
+    {
+        int result = initialiseRx();
+
+        if(result != MICROBIT_OK)
+        {
+            unlockRx();
+            return result;
+        }
     }
 
-    if(foundIndex >= 0)
+    int foundIndex = findDelimeter(delimeters, mode);
+
+    if(foundIndex < 0)
     {
-        //calculate our local buffer size
-        int localBuffSize = (preservedTail > foundIndex) ? (rxBuffSize - preservedTail) + foundIndex : foundIndex - preservedTail;
+        unlockRx();
+        return MICROBIT_NO_DATA;
+    }
 
-        uint8_t localBuff[localBuffSize + 1];
+    int len = rxBuff.wrap(foundIndex - rxBuff.getTail()) + 1;
 
-        memclr(&localBuff, localBuffSize + 1);
+    rxBuff.segments(len, &view.first, &view.firstLength, &view.second, &view.secondLength);
 
-        circularCopy(rxBuff, rxBuffSize, localBuff, preservedTail, foundIndex);
+    status |= MICROBIT_SERIAL_RX_VIEW;
 
-        //plus one for the character we listened for...
-        rxBuffTail = (rxBuffTail + localBuffSize + 1) % rxBuffSize;
+    return view.length();
+}
 
-        unlockRx();
+/**
+  * Removes characters from the start of the view returned by the last call to peek() or
+  * peekUntil(), and releases the lock for reception held since that call. The view is no
+  * longer valid once this method has been called.
+  *
+  * @param len the number of characters to remove. Zero releases the lock without removing
+  *        any characters.
+  *
+  * @return MICROBIT_OK on success, or MICROBIT_INVALID_PARAMETER if there is no view outstanding
+  *         or len is greater than the number of characters buffered.
+  */
+int MicroBitSerial::consume(int len)
+{
+    if(!(status & MICROBIT_SERIAL_RX_VIEW) || len < 0 || len > rxBuff.count())
+        return MICROBIT_INVALID_PARAMETER;
 
-        return ManagedString((char *)localBuff, localBuffSize);
+    if(len > 0)
+    {
+        rxBuff.skip(len);
+        rxBuffScanIndex = -1;
+
+        rxBufferDrained();
     }
 
+    status &= ~MICROBIT_SERIAL_RX_VIEW;
+
     unlockRx();
 
-    return ManagedString();
+    return MICROBIT_OK;
 }
 
 /**
@@ -880,7 +1285,7 @@ int MicroBitSerial::eventAfter(int len, MicroBitSerialMode mode)
         return MICROBIT_INVALID_PARAMETER;
 
     //configure our head match...
-    this->rxBuffHeadMatch = (rxBuffHead + len) % rxBuffSize;
+    this->rxBuffHeadMatch = rxBuff.wrap(rxBuff.getHead() + len);
 
     //block!
     if(mode == SYNC_SLEEP)
@@ -915,8 +1320,8 @@ int MicroBitSerial::eventOn(ManagedString delimeters, MicroBitSerialMode mode)
     if(mode == SYNC_SPINWAIT)
         return MICROBIT_INVALID_PARAMETER;
 
-    //configure our head match...
-    this->delimeters = delimeters;
+    //configure our delimeter match...
+    compileDelimeters(delimeters, delimeterMap);
 
     //block!
     if(mode == SYNC_SLEEP)
@@ -935,7 +1340,7 @@ int MicroBitSerial::eventOn(ManagedString delimeters, MicroBitSerialMode mode)
   */
 int MicroBitSerial::isReadable()
 {
-    return (rxBuffTail != rxBuffHead) ? 1 : 0;
+    return rxBuff.isEmpty() ? 0 : 1;
 }
 
 /**
@@ -948,26 +1353,30 @@ int MicroBitSerial::isReadable()
   */
 int MicroBitSerial::isWriteable()
 {
-    return (txBuffHead != (txBuffTail - 1)) ? 1 : 0;
+    return txBuff.isFull() ? 0 : 1;
 }
 
 /**
   * Reconfigures the size of our rxBuff
   *
-  * @param size the new size for our rxBuff
+  * @param size the new size for our rxBuff. This is rounded up to a power of two, so
+  *        at least size bytes can be held. Must be no greater than MICROBIT_RING_BUFFER_MAXIMUM_SIZE.
   *
   * @return MICROBIT_SERIAL_IN_USE if another fiber is currently using this instance
-  *         for reception, otherwise MICROBIT_OK.
+  *         for reception, MICROBIT_INVALID_PARAMETER if size is out of range,
+  *         otherwise MICROBIT_OK.
   */
-int MicroBitSerial::setRxBufferSize(uint8_t size)
+int MicroBitSerial::setRxBufferSize(uint16_t size)
 {
     if(rxInUse())
         return MICROBIT_SERIAL_IN_USE;
 
+    if(size == 0 || size > MICROBIT_RING_BUFFER_MAXIMUM_SIZE)
+        return MICROBIT_INVALID_PARAMETER;
+
     lockRx();
 
-    // + 1 so there is a usable buffer size, of the size the user requested.
-    this->rxBuffSize = size + 1;
+    this->rxBuffSize = size;
 
     int result = initialiseRx();
 
@@ -979,20 +1388,24 @@ int MicroBitSerial::setRxBufferSize(uint8_t size)
 /**
   * Reconfigures the size of our txBuff
   *
-  * @param size the new size for our txBuff
+  * @param size the new size for our txBuff. This is rounded up to a power of two, so
+  *        at least size bytes can be held. Must be no greater than MICROBIT_RING_BUFFER_MAXIMUM_SIZE.
   *
   * @return MICROBIT_SERIAL_IN_USE if another fiber is currently using this instance
-  *         for transmission, otherwise MICROBIT_OK.
+  *         for transmission, MICROBIT_INVALID_PARAMETER if size is out of range,
+  *         otherwise MICROBIT_OK.
   */
-int MicroBitSerial::setTxBufferSize(uint8_t size)
+int MicroBitSerial::setTxBufferSize(uint16_t size)
 {
     if(txInUse())
         return MICROBIT_SERIAL_IN_USE;
 
+    if(size == 0 || size > MICROBIT_RING_BUFFER_MAXIMUM_SIZE)
+        return MICROBIT_INVALID_PARAMETER;
+
     lockTx();
 
-    // + 1 so there is a usable buffer size, of the size the user requested.
-    this->txBuffSize = size + 1;
+    this->txBuffSize = size;
 
     int result = initialiseTx();
 
@@ -1008,7 +1421,7 @@ int MicroBitSerial::setTxBufferSize(uint8_t size)
   */
 int MicroBitSerial::getRxBufferSize()
 {
-    return this->rxBuffSize;
+    return rxBuff.isAllocated() ? rxBuff.size() : this->rxBuffSize;
 }
 
 /**
@@ -1018,7 +1431,7 @@ int MicroBitSerial::getRxBufferSize()
   */
 int MicroBitSerial::getTxBufferSize()
 {
-    return this->txBuffSize;
+    return txBuff.isAllocated() ? txBuff.size() : this->txBuffSize;
 }
 
 /**
@@ -1035,7 +1448,11 @@ int MicroBitSerial::clearRxBuffer()
 
     lockRx();
 
-    rxBuffTail = rxBuffHead;
+    rxBuff.clear();
+
+    rxBuffScanIndex = -1;
+
+    rxBufferDrained();
 
     unlockRx();
 
@@ -1056,7 +1473,7 @@ int MicroBitSerial::clearTxBuffer()
 
     lockTx();
 
-    txBuffTail = txBuffHead;
+    txBuff.clear();
 
     unlockTx();
 
@@ -1071,10 +1488,7 @@ int MicroBitSerial::clearTxBuffer()
   */
 int MicroBitSerial::rxBufferedSize()
 {
-    if(rxBuffTail > rxBuffHead)
-        return (rxBuffSize - rxBuffTail) + rxBuffHead;
-
-    return rxBuffHead - rxBuffTail;
+    return rxBuff.count();
 }
 
 /**
@@ -1085,10 +1499,7 @@ int MicroBitSerial::rxBufferedSize()
   */
 int MicroBitSerial::txBufferedSize()
 {
-    if(txBuffTail > txBuffHead)
-        return (txBuffSize - txBuffTail) + txBuffHead;
-
-    return txBuffHead - txBuffTail;
+    return txBuff.count();
 }
 
 /**
@@ -1115,6 +1526,151 @@ int MicroBitSerial::txInUse()
     return (status & MICROBIT_SERIAL_TX_IN_USE);
 }
 
+/**
+  * Configures hardware flow control. RTS is deasserted to pause the sender when the rx buffer
+  * fills to its high water mark, and reasserted once it has drained to its low water mark.
+  * Transmission is paused whilst the other device deasserts CTS. Both signals are active low.
+  *
+  * @param rts the pin used to signal that we are ready to receive, or NC if not used.
+  *
+  * @param cts the pin on which the other device signals that it is ready to receive, or NC if not used.
+  *
+  * @param highWater the number of buffered characters at which RTS is deasserted. Zero selects
+  *        MICROBIT_SERIAL_FLOW_HIGH_WATER percent of the capacity of the rx buffer.
+  *
+  * @param lowWater the number of buffered characters at or below which RTS is reasserted. Zero selects
+  *        MICROBIT_SERIAL_FLOW_LOW_WATER percent of the capacity of the rx buffer.
+  *
+  * @return MICROBIT_SERIAL_IN_USE if another fiber is currently using this instance, MICROBIT_INVALID_PARAMETER
+  *         if lowWater is not less than highWater, otherwise MICROBIT_OK.
+  *
+  * @note Passing NC for both pins disables flow control. Whilst RTS is in use, blocking reads wait for
+  *       no more characters than the high water mark, so a readUntil() with no delimeter below the
+  *       high water mark cannot complete.
+  */
+int MicroBitSerial::setFlowControl(PinName rts, PinName cts, uint16_t highWater, uint16_t lowWater)
+{
+    if(rxInUse() || txInUse())
+        return MICROBIT_SERIAL_IN_USE;
+
+    if(highWater && lowWater && lowWater >= highWater)
+        return MICROBIT_INVALID_PARAMETER;
+
+    lockRx();
+    lockTx();
+
+    //release any pins we were using. Our interrupt handlers must never see a deleted pin.
+    DigitalOut *oldRts = rtsPin;
+    InterruptIn *oldCts = ctsPin;
+
+    rtsPin = NULL;
+    ctsPin = NULL;
+
+    delete oldRts;
+    delete oldCts;
+
+    this->rxHighWater = highWater;
+    this->rxLowWater = lowWater;
+
+    updateWaterMarks();
+
+    if(rts != NC)
+        rtsPin = new DigitalOut(rts, rxBuff.count() >= rxHighWaterMark ? 1 : 0);
+
+    if(cts != NC)
+    {
+        InterruptIn *pin = new InterruptIn(cts);
+        pin->fall(this, &MicroBitSerial::ctsAsserted);
+        ctsPin = pin;
+    }
+
+    //restart any transmission that was paused by the previous configuration.
+    ctsAsserted();
+
+    unlockTx();
+    unlockRx();
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Retrieves the traffic and timing statistics gathered by this instance.
+  *
+  * @param statistics the structure to fill.
+  *
+  * @return MICROBIT_OK, or MICROBIT_NOT_SUPPORTED if MICROBIT_SERIAL_STATISTICS is not enabled.
+  */
+int MicroBitSerial::getStatistics(MicroBitSerialStatistics &statistics)
+{
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+    statistics = this->statistics;
+
+    return MICROBIT_OK;
+#else
+    (void)statistics;
+
+    return MICROBIT_NOT_SUPPORTED;
+#endif
+}
+
+/**
+  * Resets all of the statistics gathered by this instance to zero.
+  *
+  * @return MICROBIT_OK, or MICROBIT_NOT_SUPPORTED if MICROBIT_SERIAL_STATISTICS is not enabled.
+  */
+int MicroBitSerial::resetStatistics()
+{
+#if CONFIG_ENABLED(MICROBIT_SERIAL_STATISTICS)
+    memclr(&statistics, sizeof(statistics));
+
+    return MICROBIT_OK;
+#else
+    return MICROBIT_NOT_SUPPORTED;
+#endif
+}
+
+/**
+  * Attaches a framing layer to this serial instance. Whilst attached, the framing layer is passed
+  * every received byte in place of the rx buffer, and holds this instance's lock for reception.
+  *
+  * @param framer the framing layer to attach, or NULL to detach the current one.
+  *
+  * @return MICROBIT_SERIAL_IN_USE if another fiber is currently using this instance
+  *         for reception, otherwise MICROBIT_OK.
+  */
+int MicroBitSerial::setFramer(MicroBitSerialFramer *framer)
+{
+    if(framer == NULL)
+    {
+        if(this->framer == NULL)
+            return MICROBIT_OK;
+
+        this->framer = NULL;
+
+        //hand reception back to our rx buffer, if we have one.
+        if(!(status & MICROBIT_SERIAL_RX_BUFF_INIT))
+            detach(Serial::RxIrq);
+
+        unlockRx();
+
+        return MICROBIT_OK;
+    }
+
+    if(this->framer == framer)
+        return MICROBIT_OK;
+
+    if(rxInUse())
+        return MICROBIT_SERIAL_IN_USE;
+
+    lockRx();
+
+    this->framer = framer;
+
+    attach(this, &MicroBitSerial::dataReceived, Serial::RxIrq);
+
+    return MICROBIT_OK;
+}
+
 /**
   * Detaches a previously configured interrupt
   *
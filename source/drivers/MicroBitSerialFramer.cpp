@@ -0,0 +1,412 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 British Broadcasting Corporation.
+This software is provided by Lancaster University by arrangement with the BBC.
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+#include "MicroBitConfig.h"
+#include "MicroBitSerialFramer.h"
+#include "ErrorNo.h"
+#include "MicroBitFiber.h"
+
+/**
+  * Updates a CRC-16-CCITT (polynomial 0x1021) with a single byte.
+  *
+  * Running the CRC over a payload followed by its own CRC (most significant byte first) yields zero,
+  * which allows received frames to be checked as they arrive.
+  */
+static inline uint16_t crc16_update(uint16_t crc, uint8_t c)
+{
+    crc = (uint8_t)(crc >> 8) | (crc << 8);
+    crc ^= c;
+    crc ^= (uint8_t)(crc & 0xFF) >> 4;
+    crc ^= (crc << 8) << 4;
+    crc ^= ((crc & 0xFF) << 4) << 1;
+
+    return crc;
+}
+
+/**
+  * Appends a single SLIP encoded byte to the given buffer.
+  *
+  * @return the number of bytes written.
+  */
+static inline int slip_encode(uint8_t *buffer, uint8_t c)
+{
+    if (c == MICROBIT_SERIAL_FRAME_END || c == MICROBIT_SERIAL_FRAME_ESC)
+    {
+        buffer[0] = MICROBIT_SERIAL_FRAME_ESC;
+        buffer[1] = (c == MICROBIT_SERIAL_FRAME_END) ? MICROBIT_SERIAL_FRAME_ESC_END : MICROBIT_SERIAL_FRAME_ESC_ESC;
+        return 2;
+    }
+
+    buffer[0] = c;
+    return 1;
+}
+
+/**
+  * Constructor.
+  * Create an instance of MicroBitSerialFramer.
+  *
+  * @param serial the serial port to send and receive frames over.
+  *
+  * @code
+  * MicroBitSerialFramer framer(uBit.serial);
+  * @endcode
+  *
+  * @note No memory is allocated, and received data is not intercepted, until enable() is called.
+  */
+MicroBitSerialFramer::MicroBitSerialFramer(MicroBitSerial &serial) : serial(serial)
+{
+    this->pool = NULL;
+    this->rxFrame = NULL;
+    this->rxLength = 0;
+    this->rxCrc = 0xFFFF;
+    this->rxStatus = 0;
+    this->crcErrors = 0;
+    this->droppedFrames = 0;
+}
+
+/**
+  * Destructor.
+  */
+MicroBitSerialFramer::~MicroBitSerialFramer()
+{
+    disable();
+}
+
+/**
+  * Takes a buffer from the free pool for the next incoming frame, and resets the decoder.
+  */
+void MicroBitSerialFramer::nextFrame()
+{
+    if (rxFrame == NULL && !freeFrames.isEmpty())
+        rxFrame = &pool[freeFrames.pop()];
+
+    rxLength = 0;
+    rxCrc = 0xFFFF;
+    rxStatus = 0;
+}
+
+/**
+  * Frees the receive pool, and any frames held in it.
+  */
+void MicroBitSerialFramer::freePool()
+{
+    freeFrames.release();
+    readyFrames.release();
+
+    free(pool);
+
+    pool = NULL;
+    rxFrame = NULL;
+}
+
+/**
+  * Allocates the receive pool, and attaches this framing layer to the serial port.
+  * From this point on, all data received by the serial port is decoded as frames, and is no
+  * longer available through the MicroBitSerial read methods.
+  *
+  * @param poolSize the number of frames that can be held awaiting collection by the application.
+  *
+  * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if poolSize is out of range,
+  *         MICROBIT_NO_RESOURCES if the pool could not be allocated, or MICROBIT_SERIAL_IN_USE if
+  *         the serial port is in use by another fiber for reception.
+  */
+int MicroBitSerialFramer::enable(int poolSize)
+{
+    if (pool != NULL)
+        return MICROBIT_OK;
+
+    if (poolSize < 1 || poolSize > 255)
+        return MICROBIT_INVALID_PARAMETER;
+
+    if (serial.rxInUse())
+        return MICROBIT_SERIAL_IN_USE;
+
+    pool = (SerialFrame *) malloc(poolSize * sizeof(SerialFrame));
+
+    if (pool == NULL || freeFrames.allocate(poolSize) != MICROBIT_OK || readyFrames.allocate(poolSize) != MICROBIT_OK)
+    {
+        freePool();
+        return MICROBIT_NO_RESOURCES;
+    }
+
+    for (int i = 0; i < poolSize; i++)
+        freeFrames.push(i);
+
+    rxFrame = NULL;
+    nextFrame();
+
+    int result = serial.setFramer(this);
+
+    if (result != MICROBIT_OK)
+        freePool();
+
+    return result;
+}
+
+/**
+  * Detaches this framing layer from the serial port, and frees the receive pool.
+  * Any frames awaiting collection are discarded.
+  *
+  * @return MICROBIT_OK.
+  */
+int MicroBitSerialFramer::disable()
+{
+    if (pool == NULL)
+        return MICROBIT_OK;
+
+    serial.setFramer(NULL);
+
+    freePool();
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Sends a frame over the serial port.
+  *
+  * @param buffer the payload of the frame.
+  *
+  * @param len the length of the payload, in the range 1..MICROBIT_SERIAL_FRAME_MAX_SIZE.
+  *
+  * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. See MicroBitSerial::send().
+  *
+  * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if the buffer is invalid, MICROBIT_SERIAL_IN_USE
+  *         if another fiber is using the serial port for transmission, or MICROBIT_NO_RESOURCES if, in ASYNC mode,
+  *         the frame did not fit in the serial tx buffer.
+  *
+  * @note A frame that is only partially queued in ASYNC mode will be discarded by the receiver.
+  */
+int MicroBitSerialFramer::send(uint8_t *buffer, int len, MicroBitSerialMode mode)
+{
+    if (buffer == NULL || len < 1 || len > MICROBIT_SERIAL_FRAME_MAX_SIZE)
+        return MICROBIT_INVALID_PARAMETER;
+
+    // Worst case, every byte is escaped, plus a delimiter at each end.
+    uint8_t frame[2 * (len + MICROBIT_SERIAL_FRAME_CRC_SIZE) + 2];
+    uint16_t crc = 0xFFFF;
+    int length = 0;
+
+    // A leading delimiter flushes any line noise received since the last frame.
+    frame[length++] = MICROBIT_SERIAL_FRAME_END;
+
+    for (int i = 0; i < len; i++)
+    {
+        crc = crc16_update(crc, buffer[i]);
+        length += slip_encode(&frame[length], buffer[i]);
+    }
+
+    length += slip_encode(&frame[length], crc >> 8);
+    length += slip_encode(&frame[length], crc & 0xFF);
+
+    frame[length++] = MICROBIT_SERIAL_FRAME_END;
+
+    int result = serial.send(frame, length, mode);
+
+    if (result < 0)
+        return result;
+
+    return result == length ? MICROBIT_OK : MICROBIT_NO_RESOURCES;
+}
+
+/**
+  * Sends a frame over the serial port.
+  *
+  * @param data the payload of the frame.
+  *
+  * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. See MicroBitSerial::send().
+  *
+  * @return MICROBIT_OK on success, or an error code as described for send(uint8_t *, int, MicroBitSerialMode).
+  */
+int MicroBitSerialFramer::send(PacketBuffer data, MicroBitSerialMode mode)
+{
+    return send(data.getBytes(), data.length(), mode);
+}
+
+/**
+  * Retrieves the payload of the oldest received frame into the given buffer.
+  *
+  * @param buf a pointer to a valid memory location where the payload is to be stored.
+  *
+  * @param len the maximum amount of data that can safely be stored in buf. Any remaining
+  *        payload is discarded.
+  *
+  * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. Each mode
+  *        gives a different behaviour:
+  *
+  *            ASYNC - If no frame is available, MICROBIT_NO_DATA is returned immediately.
+  *
+  *            SYNC_SPINWAIT - If no frame is available, this method will spin
+  *                            (lock up the processor) until a frame is received.
+  *
+  *            SYNC_SLEEP - If no frame is available, the calling fiber sleeps
+  *                         until a frame is received.
+  *
+  * @return The length of the data stored, MICROBIT_INVALID_PARAMETER if the buffer is invalid,
+  *         MICROBIT_NOT_SUPPORTED if the framer is not enabled, or MICROBIT_NO_DATA.
+  */
+int MicroBitSerialFramer::recv(uint8_t *buf, int len, MicroBitSerialMode mode)
+{
+    if (buf == NULL || len < 0)
+        return MICROBIT_INVALID_PARAMETER;
+
+    if (pool == NULL)
+        return MICROBIT_NOT_SUPPORTED;
+
+    if (mode == SYNC_SPINWAIT)
+        while(readyFrames.isEmpty());
+
+    if (mode == SYNC_SLEEP)
+        while(readyFrames.isEmpty())
+            fiber_wait_for_event(MICROBIT_ID_SERIAL, MICROBIT_SERIAL_EVT_FRAME_READY);
+
+    if (readyFrames.isEmpty())
+        return MICROBIT_NO_DATA;
+
+    uint8_t index = readyFrames.pop();
+    int l = min(len, pool[index].length);
+
+    memcpy(buf, pool[index].data, l);
+
+    // Return the buffer to the pool, for use by the receiver.
+    freeFrames.push(index);
+
+    return l;
+}
+
+/**
+  * Retrieves the payload of the oldest received frame.
+  *
+  * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. See recv(uint8_t *, int, MicroBitSerialMode).
+  *
+  * @return the payload received, or an empty PacketBuffer if no frame is available.
+  */
+PacketBuffer MicroBitSerialFramer::recv(MicroBitSerialMode mode)
+{
+    uint8_t buf[MICROBIT_SERIAL_FRAME_MAX_SIZE];
+
+    int length = recv(buf, MICROBIT_SERIAL_FRAME_MAX_SIZE, mode);
+
+    if (length < 0)
+        return PacketBuffer::EmptyPacket;
+
+    return PacketBuffer(buf, length);
+}
+
+/**
+  * Determines the number of complete frames awaiting collection.
+  *
+  * @return The number of frames ready to be read.
+  */
+int MicroBitSerialFramer::dataReady()
+{
+    return readyFrames.count();
+}
+
+/**
+  * @return the number of received frames discarded because they failed their CRC check, or were badly encoded.
+  */
+int MicroBitSerialFramer::getCrcErrors()
+{
+    return crcErrors;
+}
+
+/**
+  * @return the number of received frames discarded because they were too long, or no buffer was available to store them.
+  */
+int MicroBitSerialFramer::getDroppedFrames()
+{
+    return droppedFrames;
+}
+
+/**
+  * Decodes a single received byte. Called by MicroBitSerial in interrupt context.
+  *
+  * @param c the byte received.
+  */
+void MicroBitSerialFramer::dataReceived(uint8_t c)
+{
+    if (c == MICROBIT_SERIAL_FRAME_END)
+    {
+        // Empty frames are simply the delimiters of back to back frames.
+        if (rxLength > 0 || rxStatus)
+        {
+            if (rxStatus & MICROBIT_SERIAL_FRAME_STATUS_DROPPING)
+                droppedFrames++;
+
+            else if (rxStatus || rxLength <= MICROBIT_SERIAL_FRAME_CRC_SIZE || rxCrc != 0)
+                crcErrors++;
+
+            else
+            {
+                // A valid frame. Pass it on to the application.
+                rxFrame->length = rxLength - MICROBIT_SERIAL_FRAME_CRC_SIZE;
+                readyFrames.push(rxFrame - pool);
+                rxFrame = NULL;
+
+                MicroBitEvent(MICROBIT_ID_SERIAL, MICROBIT_SERIAL_EVT_FRAME_READY);
+            }
+        }
+
+        nextFrame();
+        return;
+    }
+
+    if (rxStatus & (MICROBIT_SERIAL_FRAME_STATUS_DROPPING | MICROBIT_SERIAL_FRAME_STATUS_ERROR))
+        return;
+
+    if (c == MICROBIT_SERIAL_FRAME_ESC)
+    {
+        rxStatus |= MICROBIT_SERIAL_FRAME_STATUS_ESCAPED;
+        return;
+    }
+
+    if (rxStatus & MICROBIT_SERIAL_FRAME_STATUS_ESCAPED)
+    {
+        rxStatus &= ~MICROBIT_SERIAL_FRAME_STATUS_ESCAPED;
+
+        if (c == MICROBIT_SERIAL_FRAME_ESC_END)
+            c = MICROBIT_SERIAL_FRAME_END;
+
+        else if (c == MICROBIT_SERIAL_FRAME_ESC_ESC)
+            c = MICROBIT_SERIAL_FRAME_ESC;
+
+        else
+        {
+            // Protocol violation. Discard the rest of the frame.
+            rxStatus |= MICROBIT_SERIAL_FRAME_STATUS_ERROR;
+            return;
+        }
+    }
+
+    // If there's nowhere to put this frame, discard it.
+    if (rxFrame == NULL || rxLength >= MICROBIT_SERIAL_FRAME_MAX_SIZE + MICROBIT_SERIAL_FRAME_CRC_SIZE)
+    {
+        rxStatus |= MICROBIT_SERIAL_FRAME_STATUS_DROPPING;
+        return;
+    }
+
+    rxFrame->data[rxLength++] = c;
+    rxCrc = crc16_update(rxCrc, c);
+}
@@ -0,0 +1,462 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 British Broadcasting Corporation.
+This software is provided by Lancaster University by arrangement with the BBC.
+
+Permission is hereby granted, free of charge, to any person obtaining a
+copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation
+the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.
+*/
+
+/**
+  * Class definition for MicroBitSerialMux.
+  *
+  * Carries several independent byte streams (e.g. logging, telemetry and commands) over a single serial port.
+  */
+#include "MicroBitConfig.h"
+#include "MicroBitSerialMux.h"
+#include "EventModel.h"
+#include "ErrorNo.h"
+#include "MicroBitFiber.h"
+
+/**
+  * Constructor.
+  * Create an instance of MicroBitSerialMux.
+  *
+  * @param framer the framing layer to carry channels over. It must be enabled before data can be received.
+  *
+  * @code
+  * MicroBitSerialFramer framer(uBit.serial);
+  * MicroBitSerialMux mux(framer);
+  *
+  * framer.enable();
+  * mux.openChannel(1, 0);  // commands, highest priority
+  * mux.openChannel(2, 1);  // telemetry
+  * mux.openChannel(3, 2);  // logging
+  * @endcode
+  *
+  * @note Once a channel is open, this instance collects all frames received by the framer.
+  */
+MicroBitSerialMux::MicroBitSerialMux(MicroBitSerialFramer &framer) : framer(framer)
+{
+    for (int i = 0; i < MICROBIT_SERIAL_MUX_CHANNELS; i++)
+    {
+        channels[i].id = 0;
+        channels[i].priority = 0;
+        channels[i].status = 0;
+        channels[i].rxDropped = 0;
+        channels[i].txDropped = 0;
+    }
+
+    this->lastChannel = 0;
+    this->status = 0;
+}
+
+/**
+  * Destructor. Closes all channels.
+  */
+MicroBitSerialMux::~MicroBitSerialMux()
+{
+    if (status & MICROBIT_SERIAL_MUX_LISTENING)
+        EventModel::defaultEventBus->ignore(MICROBIT_ID_SERIAL, MICROBIT_SERIAL_EVT_FRAME_READY, this, &MicroBitSerialMux::frameReceived);
+
+    for (int i = 0; i < MICROBIT_SERIAL_MUX_CHANNELS; i++)
+    {
+        channels[i].id = 0;
+        channels[i].rxBuffer.release();
+        channels[i].txBuffer.release();
+    }
+}
+
+/**
+  * Looks up an open channel.
+  *
+  * @param id the channel identifier.
+  *
+  * @return the channel, or NULL if it is not open.
+  */
+SerialChannel *MicroBitSerialMux::getChannel(uint8_t id)
+{
+    if (id == 0)
+        return NULL;
+
+    for (int i = 0; i < MICROBIT_SERIAL_MUX_CHANNELS; i++)
+        if (channels[i].id == id)
+            return &channels[i];
+
+    return NULL;
+}
+
+/**
+  * Chooses the channel to send the next frame from.
+  *
+  * @return the highest priority channel with data queued, or NULL if there is none.
+  */
+SerialChannel *MicroBitSerialMux::nextChannel()
+{
+    SerialChannel *next = NULL;
+    int start = lastChannel;
+
+    // Start searching just after the last channel sent, so that channels of equal priority take turns.
+    for (int i = 1; i <= MICROBIT_SERIAL_MUX_CHANNELS; i++)
+    {
+        int index = (start + i) % MICROBIT_SERIAL_MUX_CHANNELS;
+        SerialChannel *c = &channels[index];
+
+        if (c->id != 0 && !c->txBuffer.isEmpty() && (next == NULL || c->priority < next->priority))
+        {
+            next = c;
+            lastChannel = index;
+        }
+    }
+
+    return next;
+}
+
+/**
+  * Sends frames from the channel tx buffers until all are empty.
+  * Runs in its own fiber, started when data is queued.
+  */
+void MicroBitSerialMux::transmit()
+{
+    uint8_t frame[MICROBIT_SERIAL_FRAME_MAX_SIZE];
+    SerialChannel *c;
+
+    while ((c = nextChannel()) != NULL)
+    {
+        // Copy the frame out, leaving it queued until it has actually been sent.
+        frame[0] = c->id;
+        int len = c->txBuffer.copy(frame + 1, MICROBIT_SERIAL_FRAME_MAX_SIZE - 1);
+
+        // If another fiber is using the serial port, wait for it to finish and try again.
+        int result;
+        while ((result = framer.send(frame, len + 1, SYNC_SLEEP)) == MICROBIT_SERIAL_IN_USE)
+            fiber_sleep(MICROBIT_SERIAL_MUX_RETRY_PERIOD);
+
+        // The channel may have been closed whilst we were sending.
+        if (c->id != frame[0])
+            continue;
+
+        c->txBuffer.skip(len);
+
+        // Any other error won't go away by retrying, so discard the frame and stop. The next write starts us again.
+        if (result != MICROBIT_OK)
+        {
+            c->txDropped += len;
+            MicroBitEvent(MICROBIT_ID_SERIAL_MUX, MICROBIT_SERIAL_MUX_EVT_TX_SPACE);
+            break;
+        }
+
+        // Let any blocked senders refill the space we've just freed.
+        MicroBitEvent(MICROBIT_ID_SERIAL_MUX, MICROBIT_SERIAL_MUX_EVT_TX_SPACE);
+    }
+
+    status &= ~MICROBIT_SERIAL_MUX_TRANSMITTING;
+}
+
+/**
+  * Entry point for the fiber that runs transmit().
+  */
+void MicroBitSerialMux::transmitTask(void *mux)
+{
+    ((MicroBitSerialMux *)mux)->transmit();
+}
+
+/**
+  * Routes received frames to their channels. Invoked when the framer raises
+  * MICROBIT_SERIAL_EVT_FRAME_READY.
+  */
+void MicroBitSerialMux::frameReceived(MicroBitEvent)
+{
+    uint8_t frame[MICROBIT_SERIAL_FRAME_MAX_SIZE];
+    int len;
+
+    while ((len = framer.recv(frame, MICROBIT_SERIAL_FRAME_MAX_SIZE, ASYNC)) > 0)
+    {
+        SerialChannel *c = getChannel(frame[0]);
+
+        // Frames for channels we don't have open are discarded.
+        if (c == NULL || len == 1)
+            continue;
+
+        int stored = c->rxBuffer.write(frame + 1, len - 1);
+
+        c->rxDropped += len - 1 - stored;
+
+        if (stored > 0)
+            MicroBitEvent(MICROBIT_ID_SERIAL_MUX, c->id);
+    }
+}
+
+/**
+  * Opens a channel.
+  *
+  * @param id the channel identifier, in the range 1..255. Both ends of the link must use the same identifiers.
+  *
+  * @param priority the transmit priority of the channel. Lower values are sent first.
+  *
+  * @param rxBufferSize the number of received bytes the channel can hold awaiting collection.
+  *
+  * @param txBufferSize the number of bytes the channel can hold awaiting transmission.
+  *
+  * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if id is zero or already open, or
+  *         MICROBIT_NO_RESOURCES if MICROBIT_SERIAL_MUX_CHANNELS are already open or the buffers could not be allocated.
+  */
+int MicroBitSerialMux::openChannel(uint8_t id, uint8_t priority, uint16_t rxBufferSize, uint16_t txBufferSize)
+{
+    if (id == 0 || getChannel(id) != NULL)
+        return MICROBIT_INVALID_PARAMETER;
+
+    SerialChannel *c = NULL;
+
+    for (int i = 0; i < MICROBIT_SERIAL_MUX_CHANNELS && c == NULL; i++)
+        if (channels[i].id == 0)
+            c = &channels[i];
+
+    if (c == NULL)
+        return MICROBIT_NO_RESOURCES;
+
+    int result = c->rxBuffer.allocate(rxBufferSize);
+
+    if (result == MICROBIT_OK)
+        result = c->txBuffer.allocate(txBufferSize);
+
+    if (result != MICROBIT_OK)
+    {
+        c->rxBuffer.release();
+        c->txBuffer.release();
+
+        return result == MICROBIT_INVALID_PARAMETER ? result : MICROBIT_NO_RESOURCES;
+    }
+
+    c->id = id;
+    c->priority = priority;
+    c->status = 0;
+    c->rxDropped = 0;
+    c->txDropped = 0;
+
+    if (!(status & MICROBIT_SERIAL_MUX_LISTENING) && EventModel::defaultEventBus)
+    {
+        EventModel::defaultEventBus->listen(MICROBIT_ID_SERIAL, MICROBIT_SERIAL_EVT_FRAME_READY, this, &MicroBitSerialMux::frameReceived);
+        status |= MICROBIT_SERIAL_MUX_LISTENING;
+    }
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Closes a channel, discarding any data buffered on it.
+  *
+  * @param id the channel identifier.
+  *
+  * @return MICROBIT_OK on success, MICROBIT_INVALID_PARAMETER if the channel is not open, or
+  *         MICROBIT_SERIAL_IN_USE if a fiber is sending on the channel.
+  */
+int MicroBitSerialMux::closeChannel(uint8_t id)
+{
+    SerialChannel *c = getChannel(id);
+
+    if (c == NULL)
+        return MICROBIT_INVALID_PARAMETER;
+
+    if (c->status & MICROBIT_SERIAL_MUX_CHANNEL_TX_IN_USE)
+        return MICROBIT_SERIAL_IN_USE;
+
+    c->id = 0;
+    c->rxBuffer.release();
+    c->txBuffer.release();
+
+    // Wake any fibers waiting to receive on this channel, so they can see that it has closed.
+    MicroBitEvent(MICROBIT_ID_SERIAL_MUX, id);
+
+    return MICROBIT_OK;
+}
+
+/**
+  * Queues data for transmission on a channel.
+  *
+  * @param id the channel identifier.
+  *
+  * @param buffer the data to send.
+  *
+  * @param len the number of bytes to send.
+  *
+  * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. Each mode
+  *        gives a different behaviour:
+  *
+  *            ASYNC - Copies as many bytes as will fit into the channel's tx buffer, and returns immediately.
+  *
+  *            SYNC_SPINWAIT - Not supported, as data is sent by a background fiber.
+  *
+  *            SYNC_SLEEP - The calling fiber sleeps until all of the data has been queued.
+  *
+  *         Defaults to SYNC_SLEEP.
+  *
+  * @return the number of bytes queued, MICROBIT_INVALID_PARAMETER if the channel is not open, the buffer is invalid
+  *         or the mode is SYNC_SPINWAIT, or MICROBIT_SERIAL_IN_USE if another fiber is sending on the channel.
+  */
+int MicroBitSerialMux::send(uint8_t id, const uint8_t *buffer, int len, MicroBitSerialMode mode)
+{
+    SerialChannel *c = getChannel(id);
+
+    if (c == NULL || buffer == NULL || len < 0 || mode == SYNC_SPINWAIT)
+        return MICROBIT_INVALID_PARAMETER;
+
+    if (c->status & MICROBIT_SERIAL_MUX_CHANNEL_TX_IN_USE)
+        return MICROBIT_SERIAL_IN_USE;
+
+    c->status |= MICROBIT_SERIAL_MUX_CHANNEL_TX_IN_USE;
+
+    int bytesQueued = 0;
+
+    while (true)
+    {
+        bytesQueued += c->txBuffer.write(buffer + bytesQueued, len - bytesQueued);
+
+        // Start our transmitter if it isn't already running.
+        if (bytesQueued > 0 && !(status & MICROBIT_SERIAL_MUX_TRANSMITTING))
+        {
+            status |= MICROBIT_SERIAL_MUX_TRANSMITTING;
+            create_fiber(transmitTask, this);
+        }
+
+        if (mode == ASYNC || bytesQueued == len)
+            break;
+
+        fiber_wait_for_event(MICROBIT_ID_SERIAL_MUX, MICROBIT_SERIAL_MUX_EVT_TX_SPACE);
+    }
+
+    c->status &= ~MICROBIT_SERIAL_MUX_CHANNEL_TX_IN_USE;
+
+    return bytesQueued;
+}
+
+/**
+  * Queues a string for transmission on a channel.
+  *
+  * @param id the channel identifier.
+  *
+  * @param s the string to send.
+  *
+  * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. See send(uint8_t, const uint8_t *, int, MicroBitSerialMode).
+  *
+  * @return the number of bytes queued, or an error code as described for send(uint8_t, const uint8_t *, int, MicroBitSerialMode).
+  */
+int MicroBitSerialMux::send(uint8_t id, ManagedString s, MicroBitSerialMode mode)
+{
+    return send(id, (const uint8_t *)s.toCharArray(), s.length(), mode);
+}
+
+/**
+  * Reads data received on a channel.
+  *
+  * @param id the channel identifier.
+  *
+  * @param buffer a pointer to a user allocated buffer.
+  *
+  * @param len the maximum number of bytes to read.
+  *
+  * @param mode the selected mode, one of: ASYNC, SYNC_SPINWAIT, SYNC_SLEEP. Each mode
+  *        gives a different behaviour:
+  *
+  *            ASYNC - Reads whatever data is available, up to len bytes. Returns MICROBIT_NO_DATA if there is none.
+  *
+  *            SYNC_SPINWAIT - Not supported, as data is received by a background fiber.
+  *
+  *            SYNC_SLEEP - If no data is available, the calling fiber sleeps until some is received.
+  *                         Whatever data is then available is read, up to len bytes.
+  *
+  *         Defaults to SYNC_SLEEP.
+  *
+  * @return the number of bytes read, MICROBIT_NO_DATA, or MICROBIT_INVALID_PARAMETER if the channel is
+  *         not open, the buffer is invalid or the mode is SYNC_SPINWAIT.
+  */
+int MicroBitSerialMux::recv(uint8_t id, uint8_t *buffer, int len, MicroBitSerialMode mode)
+{
+    SerialChannel *c = getChannel(id);
+
+    if (c == NULL || buffer == NULL || len <= 0 || mode == SYNC_SPINWAIT)
+        return MICROBIT_INVALID_PARAMETER;
+
+    if (mode == SYNC_SLEEP)
+        while (c->id == id && c->rxBuffer.isEmpty())
+            fiber_wait_for_event(MICROBIT_ID_SERIAL_MUX, id);
+
+    if (c->id != id)
+        return MICROBIT_INVALID_PARAMETER;
+
+    int n = c->rxBuffer.read(buffer, len);
+
+    return n > 0 ? n : MICROBIT_NO_DATA;
+}
+
+/**
+  * Determines the number of bytes received on a channel and awaiting collection.
+  *
+  * @param id the channel identifier.
+  *
+  * @return the number of bytes buffered, or MICROBIT_INVALID_PARAMETER if the channel is not open.
+  */
+int MicroBitSerialMux::rxBufferedSize(uint8_t id)
+{
+    SerialChannel *c = getChannel(id);
+
+    return c ? c->rxBuffer.count() : MICROBIT_INVALID_PARAMETER;
+}
+
+/**
+  * Determines the number of bytes queued on a channel and awaiting transmission.
+  *
+  * @param id the channel identifier.
+  *
+  * @return the number of bytes buffered, or MICROBIT_INVALID_PARAMETER if the channel is not open.
+  */
+int MicroBitSerialMux::txBufferedSize(uint8_t id)
+{
+    SerialChannel *c = getChannel(id);
+
+    return c ? c->txBuffer.count() : MICROBIT_INVALID_PARAMETER;
+}
+
+/**
+  * Determines the number of bytes received on a channel that were discarded because its rx buffer was full.
+  *
+  * @param id the channel identifier.
+  *
+  * @return the number of bytes dropped, or MICROBIT_INVALID_PARAMETER if the channel is not open.
+  */
+int MicroBitSerialMux::getDroppedBytes(uint8_t id)
+{
+    SerialChannel *c = getChannel(id);
+
+    return c ? (int)c->rxDropped : MICROBIT_INVALID_PARAMETER;
+}
+
+/**
+  * Determines the number of bytes queued on a channel that were discarded because the serial port could not send them.
+  *
+  * @param id the channel identifier.
+  *
+  * @return the number of bytes dropped, or MICROBIT_INVALID_PARAMETER if the channel is not open.
+  */
+int MicroBitSerialMux::getDroppedTxBytes(uint8_t id)
+{
+    SerialChannel *c = getChannel(id);
+
+    return c ? (int)c->txDropped : MICROBIT_INVALID_PARAMETER;
+}